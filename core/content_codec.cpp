@@ -0,0 +1,257 @@
+#include "core/content_codec.h"
+
+#include <algorithm>
+
+#include "absl/strings/str_cat.h"
+
+#include "core/status_macros.h"
+
+#include <zdict.h>
+#include <zstd.h>
+
+namespace slop {
+
+namespace {
+
+constexpr char kMagic[] = {'\0', 'S', 'L', 'Z'};
+constexpr uint8_t kVersion = 1;
+// magic, version, dictionary id, content size, chunk size, chunk count.
+constexpr size_t kFixedHeaderSize = 4 + 1 + 4 + 8 + 4 + 4;
+// zstd's default level; higher levels cost far more CPU than they save on tool output.
+constexpr int kCompressionLevel = 3;
+
+void PutU32(std::string* out, uint32_t v) {
+  for (int i = 0; i < 4; ++i) out->push_back(static_cast<char>((v >> (8 * i)) & 0xff));
+}
+
+void PutU64(std::string* out, uint64_t v) {
+  for (int i = 0; i < 8; ++i) out->push_back(static_cast<char>((v >> (8 * i)) & 0xff));
+}
+
+void StoreU32(char* out, uint32_t v) {
+  for (int i = 0; i < 4; ++i) out[i] = static_cast<char>((v >> (8 * i)) & 0xff);
+}
+
+uint64_t LoadLittleEndian(const char* p, int bytes) {
+  uint64_t v = 0;
+  for (int i = 0; i < bytes; ++i) v |= static_cast<uint64_t>(static_cast<unsigned char>(p[i])) << (8 * i);
+  return v;
+}
+
+struct Header {
+  uint32_t dictionary_id;
+  size_t content_size;
+  size_t chunk_size;
+  std::vector<uint32_t> chunk_sizes;
+  // Offset of the first chunk.
+  size_t data_offset;
+};
+
+absl::StatusOr<Header> ParseHeader(absl::string_view data) {
+  if (!ContentCodec::IsEncoded(data) || data.size() < kFixedHeaderSize) {
+    return absl::InvalidArgumentError("Not compressed content");
+  }
+  if (static_cast<uint8_t>(data[4]) != kVersion) {
+    return absl::UnimplementedError(
+        absl::StrCat("Unsupported compressed content version ", static_cast<int>(data[4])));
+  }
+  Header header;
+  header.dictionary_id = LoadLittleEndian(data.data() + 5, 4);
+  header.content_size = LoadLittleEndian(data.data() + 9, 8);
+  header.chunk_size = LoadLittleEndian(data.data() + 17, 4);
+  size_t chunk_count = LoadLittleEndian(data.data() + 21, 4);
+  header.data_offset = kFixedHeaderSize + 4 * chunk_count;
+  if (header.chunk_size == 0 || chunk_count != (header.content_size + header.chunk_size - 1) / header.chunk_size ||
+      data.size() < header.data_offset) {
+    return absl::DataLossError("Corrupt compressed content header");
+  }
+  size_t total = 0;
+  header.chunk_sizes.reserve(chunk_count);
+  for (size_t i = 0; i < chunk_count; ++i) {
+    header.chunk_sizes.push_back(LoadLittleEndian(data.data() + kFixedHeaderSize + 4 * i, 4));
+    total += header.chunk_sizes.back();
+  }
+  if (header.data_offset + total != data.size()) return absl::DataLossError("Truncated compressed content");
+  return header;
+}
+
+struct CCtxDeleter {
+  void operator()(ZSTD_CCtx* ctx) const { ZSTD_freeCCtx(ctx); }
+};
+struct DCtxDeleter {
+  void operator()(ZSTD_DCtx* ctx) const { ZSTD_freeDCtx(ctx); }
+};
+
+// zstd contexts are expensive to set up and not thread-safe; keep one per thread.
+ZSTD_CCtx* CompressionContext() {
+  thread_local std::unique_ptr<ZSTD_CCtx, CCtxDeleter> ctx(ZSTD_createCCtx());
+  return ctx.get();
+}
+
+ZSTD_DCtx* DecompressionContext() {
+  thread_local std::unique_ptr<ZSTD_DCtx, DCtxDeleter> ctx(ZSTD_createDCtx());
+  return ctx.get();
+}
+
+}  // namespace
+
+struct ContentCodec::Dictionary {
+  ~Dictionary() {
+    ZSTD_freeCDict(cdict);
+    ZSTD_freeDDict(ddict);
+  }
+
+  ZSTD_CDict* cdict = nullptr;
+  ZSTD_DDict* ddict = nullptr;
+};
+
+ContentCodec::~ContentCodec() = default;
+
+bool ContentCodec::IsEncoded(absl::string_view data) {
+  return data.size() >= sizeof(kMagic) && data.substr(0, sizeof(kMagic)) == absl::string_view(kMagic, sizeof(kMagic));
+}
+
+absl::StatusOr<size_t> ContentCodec::DecodedSize(absl::string_view data) {
+  ASSIGN_OR_RETURN(Header header, ParseHeader(data));
+  return header.content_size;
+}
+
+absl::StatusOr<uint32_t> ContentCodec::DictionaryId(absl::string_view data) {
+  ASSIGN_OR_RETURN(Header header, ParseHeader(data));
+  return header.dictionary_id;
+}
+
+absl::StatusOr<std::string> ContentCodec::TrainDictionary(const std::vector<std::string>& samples) {
+  std::string buffer;
+  std::vector<size_t> sizes;
+  for (const auto& s : samples) {
+    buffer += s;
+    sizes.push_back(s.size());
+  }
+  std::string dictionary(kDictionaryCapacity, '\0');
+  size_t n = ZDICT_trainFromBuffer(dictionary.data(), dictionary.size(), buffer.data(), sizes.data(), sizes.size());
+  if (ZDICT_isError(n)) {
+    return absl::FailedPreconditionError(absl::StrCat("Dictionary training failed: ", ZDICT_getErrorName(n)));
+  }
+  dictionary.resize(n);
+  return dictionary;
+}
+
+absl::Status ContentCodec::AddDictionary(uint32_t id, absl::string_view dictionary, bool use_for_encoding) {
+  if (id == 0) return absl::InvalidArgumentError("Dictionary id 0 is reserved");
+  auto d = std::make_shared<Dictionary>();
+  d->cdict = ZSTD_createCDict(dictionary.data(), dictionary.size(), kCompressionLevel);
+  d->ddict = ZSTD_createDDict(dictionary.data(), dictionary.size());
+  if (d->cdict == nullptr || d->ddict == nullptr) {
+    return absl::InvalidArgumentError(absl::StrCat("Invalid compression dictionary ", id));
+  }
+  absl::MutexLock lock(&mu_);
+  dictionaries_[id] = std::move(d);
+  if (use_for_encoding) encoding_dictionary_ = id;
+  return absl::OkStatus();
+}
+
+bool ContentCodec::HasDictionary(uint32_t id) {
+  absl::MutexLock lock(&mu_);
+  return dictionaries_.contains(id);
+}
+
+uint32_t ContentCodec::encoding_dictionary() {
+  absl::MutexLock lock(&mu_);
+  return encoding_dictionary_;
+}
+
+absl::StatusOr<std::shared_ptr<const ContentCodec::Dictionary>> ContentCodec::FindDictionary(uint32_t id) {
+  absl::MutexLock lock(&mu_);
+  auto it = dictionaries_.find(id);
+  if (it == dictionaries_.end()) return absl::NotFoundError(absl::StrCat("Unknown compression dictionary ", id));
+  return it->second;
+}
+
+absl::StatusOr<std::string> ContentCodec::Encode(absl::string_view content) {
+  uint32_t dictionary_id = encoding_dictionary();
+  std::shared_ptr<const Dictionary> dictionary;
+  if (dictionary_id != 0) {
+    ASSIGN_OR_RETURN(dictionary, FindDictionary(dictionary_id));
+  }
+
+  size_t chunk_count = (content.size() + kChunkSize - 1) / kChunkSize;
+  std::string out(kMagic, sizeof(kMagic));
+  out.push_back(static_cast<char>(kVersion));
+  PutU32(&out, dictionary_id);
+  PutU64(&out, content.size());
+  PutU32(&out, kChunkSize);
+  PutU32(&out, chunk_count);
+  size_t sizes_offset = out.size();
+  out.resize(sizes_offset + 4 * chunk_count);
+
+  ZSTD_CCtx* ctx = CompressionContext();
+  for (size_t i = 0; i < chunk_count; ++i) {
+    absl::string_view chunk = content.substr(i * kChunkSize, kChunkSize);
+    size_t start = out.size();
+    out.resize(start + ZSTD_compressBound(chunk.size()));
+    size_t n = dictionary ? ZSTD_compress_usingCDict(ctx, out.data() + start, out.size() - start, chunk.data(),
+                                                     chunk.size(), dictionary->cdict)
+                          : ZSTD_compressCCtx(ctx, out.data() + start, out.size() - start, chunk.data(), chunk.size(),
+                                              kCompressionLevel);
+    if (ZSTD_isError(n)) return absl::InternalError(absl::StrCat("Compression failed: ", ZSTD_getErrorName(n)));
+    out.resize(start + n);
+    StoreU32(out.data() + sizes_offset + 4 * i, n);
+  }
+  return out;
+}
+
+absl::StatusOr<std::string> ContentCodec::Decode(absl::string_view data) {
+  return DecodeRange(data, 0, std::string::npos);
+}
+
+absl::StatusOr<std::string> ContentCodec::DecodeRange(absl::string_view data, size_t offset, size_t length) {
+  ASSIGN_OR_RETURN(Header header, ParseHeader(data));
+  std::shared_ptr<const Dictionary> dictionary;
+  if (header.dictionary_id != 0) {
+    ASSIGN_OR_RETURN(dictionary, FindDictionary(header.dictionary_id));
+  }
+
+  offset = std::min(offset, header.content_size);
+  length = std::min(length, header.content_size - offset);
+  std::string out;
+  if (length == 0) return out;
+  out.reserve(length);
+
+  ZSTD_DCtx* ctx = DecompressionContext();
+  auto inflate_chunk = [&](size_t index, size_t pos, char* dst, size_t size) -> absl::Status {
+    size_t n = dictionary ? ZSTD_decompress_usingDDict(ctx, dst, size, data.data() + pos, header.chunk_sizes[index],
+                                                       dictionary->ddict)
+                          : ZSTD_decompressDCtx(ctx, dst, size, data.data() + pos, header.chunk_sizes[index]);
+    if (ZSTD_isError(n)) return absl::DataLossError(absl::StrCat("Decompression failed: ", ZSTD_getErrorName(n)));
+    if (n != size) return absl::DataLossError("Compressed chunk has the wrong size");
+    return absl::OkStatus();
+  };
+
+  size_t first = offset / header.chunk_size;
+  size_t last = (offset + length - 1) / header.chunk_size;
+  size_t pos = header.data_offset;
+  for (size_t i = 0; i < first; ++i) pos += header.chunk_sizes[i];
+
+  std::string partial;
+  for (size_t i = first; i <= last; ++i) {
+    size_t chunk_begin = i * header.chunk_size;
+    size_t chunk_length = std::min(header.chunk_size, header.content_size - chunk_begin);
+    size_t from = std::max(offset, chunk_begin) - chunk_begin;
+    size_t to = std::min(offset + length, chunk_begin + chunk_length) - chunk_begin;
+    if (from == 0 && to == chunk_length) {
+      // Whole chunk wanted: inflate straight into the output.
+      size_t start = out.size();
+      out.resize(start + chunk_length);
+      RETURN_IF_ERROR(inflate_chunk(i, pos, out.data() + start, chunk_length));
+    } else {
+      partial.resize(chunk_length);
+      RETURN_IF_ERROR(inflate_chunk(i, pos, partial.data(), chunk_length));
+      out.append(partial, from, to - from);
+    }
+    pos += header.chunk_sizes[i];
+  }
+  return out;
+}
+
+}  // namespace slop
@@ -0,0 +1,75 @@
+#ifndef SLOP_CORE_CONTENT_CODEC_H_
+#define SLOP_CORE_CONTENT_CODEC_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+
+namespace slop {
+
+// Compresses message content with zstd, optionally against a dictionary trained on
+// earlier content. Content is cut into fixed-size chunks that are compressed
+// independently, so that a byte range (e.g. the head and tail of a tool result) can
+// be read by inflating only the chunks it overlaps.
+//
+// Encoded layout, integers little-endian:
+//   "\0SLZ" | u8 version | u32 dictionary id (0: none) | u64 content size |
+//   u32 chunk size | u32 chunk count | u32 compressed size per chunk | chunks
+//
+// Thread-safe.
+class ContentCodec {
+ public:
+  static constexpr size_t kChunkSize = 64 * 1024;
+  static constexpr size_t kDictionaryCapacity = 16 * 1024;
+
+  ContentCodec() = default;
+  ~ContentCodec();
+
+  ContentCodec(const ContentCodec&) = delete;
+  ContentCodec& operator=(const ContentCodec&) = delete;
+
+  // Whether `data` is in the encoded format. Text never starts with a NUL byte.
+  static bool IsEncoded(absl::string_view data);
+  // Size of the content `data` decodes to, read from the header.
+  static absl::StatusOr<size_t> DecodedSize(absl::string_view data);
+  // Dictionary `data` was encoded with, or 0.
+  static absl::StatusOr<uint32_t> DictionaryId(absl::string_view data);
+
+  // Trains a dictionary of at most kDictionaryCapacity bytes. Fails when the
+  // samples are too few or too small to learn from.
+  static absl::StatusOr<std::string> TrainDictionary(const std::vector<std::string>& samples);
+
+  // Makes dictionary `id` (non-zero) available for decoding; with
+  // `use_for_encoding`, Encode() uses it from now on.
+  absl::Status AddDictionary(uint32_t id, absl::string_view dictionary, bool use_for_encoding);
+  bool HasDictionary(uint32_t id);
+  // Dictionary used by Encode(), or 0.
+  uint32_t encoding_dictionary();
+
+  absl::StatusOr<std::string> Encode(absl::string_view content);
+  absl::StatusOr<std::string> Decode(absl::string_view data);
+  // Decodes `length` bytes of content starting at `offset`, clamped to the content size.
+  absl::StatusOr<std::string> DecodeRange(absl::string_view data, size_t offset, size_t length);
+
+ private:
+  struct Dictionary;
+
+  // Returns dictionary `id`, or an error if it has not been added.
+  absl::StatusOr<std::shared_ptr<const Dictionary>> FindDictionary(uint32_t id);
+
+  absl::Mutex mu_;
+  absl::flat_hash_map<uint32_t, std::shared_ptr<const Dictionary>> dictionaries_ ABSL_GUARDED_BY(mu_);
+  uint32_t encoding_dictionary_ ABSL_GUARDED_BY(mu_) = 0;
+};
+
+}  // namespace slop
+
+#endif  // SLOP_CORE_CONTENT_CODEC_H_
@@ -0,0 +1,116 @@
+#include "core/content_codec.h"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "absl/strings/str_cat.h"
+
+#include <gtest/gtest.h>
+
+namespace slop {
+namespace {
+
+// Looks like a tool result: numbered source lines, compressible but not uniform.
+std::string ToolOutput(size_t size, int seed = 0) {
+  std::string out;
+  for (int line = 0; out.size() < size; ++line) {
+    absl::StrAppend(&out, line + seed, ": absl::Status Database::Method", line % 17, "(const std::string& arg) {\n");
+  }
+  out.resize(size);
+  return out;
+}
+
+TEST(ContentCodecTest, RoundTripsAcrossChunks) {
+  ContentCodec codec;
+  for (size_t size : {size_t{0}, size_t{1}, size_t{5000}, ContentCodec::kChunkSize, 3 * ContentCodec::kChunkSize + 7}) {
+    std::string content = ToolOutput(size);
+    auto encoded = codec.Encode(content);
+    ASSERT_TRUE(encoded.ok()) << encoded.status();
+    EXPECT_TRUE(ContentCodec::IsEncoded(*encoded));
+    EXPECT_EQ(*ContentCodec::DecodedSize(*encoded), size);
+    auto decoded = codec.Decode(*encoded);
+    ASSERT_TRUE(decoded.ok()) << decoded.status();
+    EXPECT_EQ(*decoded, content) << size;
+  }
+}
+
+TEST(ContentCodecTest, CompressesToolOutput) {
+  ContentCodec codec;
+  std::string content = ToolOutput(200000);
+  auto encoded = codec.Encode(content);
+  ASSERT_TRUE(encoded.ok());
+  EXPECT_LT(encoded->size(), content.size() / 4);
+}
+
+TEST(ContentCodecTest, DecodesRanges) {
+  ContentCodec codec;
+  std::string content = ToolOutput(3 * ContentCodec::kChunkSize + 100);
+  auto encoded = codec.Encode(content);
+  ASSERT_TRUE(encoded.ok());
+
+  struct Range {
+    size_t offset;
+    size_t length;
+  };
+  const size_t chunk = ContentCodec::kChunkSize;
+  for (Range r : {Range{0, 10}, Range{chunk - 5, 10}, Range{chunk, chunk}, Range{10, 2 * chunk},
+                  Range{content.size() - 50, 50}, Range{content.size() - 50, 1000}, Range{content.size() + 1, 10}}) {
+    auto range = codec.DecodeRange(*encoded, r.offset, r.length);
+    ASSERT_TRUE(range.ok()) << range.status();
+    EXPECT_EQ(*range, content.substr(std::min(r.offset, content.size()), r.length)) << r.offset << "+" << r.length;
+  }
+}
+
+TEST(ContentCodecTest, TextIsNotEncoded) {
+  EXPECT_FALSE(ContentCodec::IsEncoded(""));
+  EXPECT_FALSE(ContentCodec::IsEncoded("SLZ plain text"));
+  EXPECT_FALSE(ContentCodec::DecodedSize("plain text").ok());
+}
+
+TEST(ContentCodecTest, RejectsCorruptData) {
+  ContentCodec codec;
+  auto encoded = codec.Encode(ToolOutput(10000));
+  ASSERT_TRUE(encoded.ok());
+
+  std::string truncated = encoded->substr(0, encoded->size() - 1);
+  EXPECT_FALSE(codec.Decode(truncated).ok());
+
+  std::string flipped = *encoded;
+  flipped[flipped.size() / 2] ^= 0x5a;
+  auto decoded = codec.Decode(flipped);
+  EXPECT_TRUE(!decoded.ok() || *decoded != ToolOutput(10000));
+}
+
+TEST(ContentCodecTest, DictionaryRoundTrip) {
+  std::vector<std::string> samples;
+  for (int i = 0; i < 200; ++i) samples.push_back(ToolOutput(2000, i * 100));
+  auto dictionary = ContentCodec::TrainDictionary(samples);
+  ASSERT_TRUE(dictionary.ok()) << dictionary.status();
+  EXPECT_LE(dictionary->size(), ContentCodec::kDictionaryCapacity);
+
+  ContentCodec codec;
+  ASSERT_TRUE(codec.AddDictionary(7, *dictionary, /*use_for_encoding=*/true).ok());
+  EXPECT_EQ(codec.encoding_dictionary(), 7u);
+
+  std::string content = ToolOutput(6000, 12345);
+  auto encoded = codec.Encode(content);
+  ASSERT_TRUE(encoded.ok());
+  EXPECT_EQ(*ContentCodec::DictionaryId(*encoded), 7u);
+  EXPECT_EQ(*codec.Decode(*encoded), content);
+
+  // A codec without the dictionary cannot decode it.
+  ContentCodec other;
+  auto decoded = other.Decode(*encoded);
+  EXPECT_EQ(decoded.status().code(), absl::StatusCode::kNotFound);
+  ASSERT_TRUE(other.AddDictionary(7, *dictionary, /*use_for_encoding=*/false).ok());
+  EXPECT_EQ(other.encoding_dictionary(), 0u);
+  EXPECT_EQ(*other.Decode(*encoded), content);
+}
+
+TEST(ContentCodecTest, TrainingNeedsSamples) {
+  EXPECT_FALSE(ContentCodec::TrainDictionary({"too", "few"}).ok());
+}
+
+}  // namespace
+}  // namespace slop
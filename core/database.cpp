@@ -1,23 +1,42 @@
 #include "core/database.h"
 
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
 #include <iostream>
+#include <limits>
+#include <optional>
 
 #include "absl/container/flat_hash_set.h"
 #include "absl/log/check.h"
 #include "absl/log/log.h"
+#include "absl/strings/ascii.h"
+#include "absl/strings/match.h"
 #include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_join.h"
+#include "absl/strings/str_replace.h"
 #include "absl/strings/str_split.h"
 #include "absl/strings/substitute.h"
+#include "absl/time/clock.h"
 
+#include "core/json_writer.h"
 #include "core/status_macros.h"
+#include "core/token_counter.h"
 
 #include <nlohmann/json.hpp>
 #include <sqlite3.h>
 namespace slop {
 
+Database::Statement::~Statement() {
+  if (release_) release_(sql_, std::move(stmt_));
+}
+
 absl::Status Database::Statement::Prepare() {
   sqlite3_stmt* raw_stmt = nullptr;
-  int rc = sqlite3_prepare_v2(db_, sql_.c_str(), -1, &raw_stmt, nullptr);
+  // Statements that go back into the cache are long-lived; let SQLite know.
+  unsigned int flags = release_ ? SQLITE_PREPARE_PERSISTENT : 0;
+  int rc = sqlite3_prepare_v3(db_, sql_.c_str(), -1, flags, &raw_stmt, nullptr);
   if (rc != SQLITE_OK) {
     std::string err = sqlite3_errmsg(db_);
     LOG(ERROR) << "Prepare error: " << err << " (SQL: " << sql_ << ")";
@@ -55,6 +74,13 @@ absl::Status Database::Statement::BindText(int index, const std::string& value)
   return absl::OkStatus();
 }
 
+absl::Status Database::Statement::BindBlob(int index, absl::string_view value) {
+  if (sqlite3_bind_blob64(stmt_.get(), index, value.data(), value.size(), SQLITE_TRANSIENT) != SQLITE_OK) {
+    return absl::InternalError("BindBlob error: " + std::string(sqlite3_errmsg(db_)));
+  }
+  return absl::OkStatus();
+}
+
 absl::Status Database::Statement::BindNull(int index) {
   if (sqlite3_bind_null(stmt_.get(), index) != SQLITE_OK) {
     return absl::InternalError("BindNull error: " + std::string(sqlite3_errmsg(db_)));
@@ -88,12 +114,57 @@ std::string Database::Statement::ColumnText(int index) {
   return text ? std::string(text) : "";
 }
 
+absl::string_view Database::Statement::ColumnTextView(int index) {
+  const char* text = reinterpret_cast<const char*>(sqlite3_column_text(stmt_.get(), index));
+  if (text == nullptr) return absl::string_view();
+  return absl::string_view(text, sqlite3_column_bytes(stmt_.get(), index));
+}
+
 int Database::Statement::ColumnType(int index) { return sqlite3_column_type(stmt_.get(), index); }
 
 const char* Database::Statement::ColumnName(int index) { return sqlite3_column_name(stmt_.get(), index); }
 
 int Database::Statement::ColumnCount() { return sqlite3_column_count(stmt_.get()); }
 
+absl::Status Database::Statement::ForEachRow(absl::FunctionRef<void(Statement&)> visitor) {
+  while (true) {
+    ASSIGN_OR_RETURN(bool has_row, Step());
+    if (!has_row) return absl::OkStatus();
+    visitor(*this);
+  }
+}
+
+Database::Message Database::MessageView::ToMessage() const {
+  Message m;
+  m.id = id;
+  m.session_id = std::string(session_id);
+  m.role = std::string(role);
+  m.content = std::string(content);
+  m.tool_call_id = std::string(tool_call_id);
+  m.status = std::string(status);
+  m.created_at = std::string(created_at);
+  m.group_id = std::string(group_id);
+  m.parsing_strategy = std::string(parsing_strategy);
+  m.tokens = tokens;
+  return m;
+}
+
+absl::string_view Database::MessageArena::Copy(absl::string_view text) {
+  if (text.empty()) return absl::string_view();
+  if (text.size() > remaining_) {
+    size_t size = std::max(kBlockSize, text.size());
+    blocks_.push_back(std::make_unique<char[]>(size));
+    next_ = blocks_.back().get();
+    remaining_ = size;
+  }
+  char* out = next_;
+  memcpy(out, text.data(), text.size());
+  next_ += text.size();
+  remaining_ -= text.size();
+  bytes_used_ += text.size();
+  return absl::string_view(out, text.size());
+}
+
 bool Database::IsStopWord(const std::string& word) {
   static const absl::flat_hash_set<std::string> kStopWords = {
       "about", "above", "after",   "again", "against", "all",   "and",    "any",   "because",  "been",      "before",
@@ -123,29 +194,221 @@ std::vector<std::string> Database::ExtractTags(const std::string& text) {
   return tags;
 }
 
-absl::StatusOr<std::unique_ptr<Database::Statement>> Database::Prepare(const std::string& sql) {
-  absl::MutexLock lock(&mu_);
-  auto stmt = std::make_unique<Statement>(db_.get(), sql);
-  auto status = stmt->Prepare();
-  if (!status.ok()) return status;
-  return stmt;
+namespace {
+
+// How long a connection waits on a lock held by another connection before giving up.
+constexpr int kBusyTimeoutMs = 5000;
+
+// WAL frames after which a commit checkpoints, as SQLite's default auto-checkpoint.
+constexpr int kAutoCheckpointFrames = 1000;
+
+// Rows PRAGMA optimize samples per index, so that maintenance stays in milliseconds.
+constexpr int kOptimizeAnalysisLimit = 400;
+
+// Window size, in groups, of sessions that have not set one.
+constexpr int kDefaultContextSize = 5;
+
+// usage_daily plus the usage rows CloneSession() gave clones to carry over their
+// source's totals, as rows of no day; see MigrateToVersion2(). Per-session totals
+// read this, reports over every session or per day usage_daily alone.
+constexpr char kSessionUsage[] =
+    "(SELECT session_id, model, day, requests, prompt_tokens, completion_tokens, total_tokens, cached_tokens "
+    "FROM usage_daily UNION ALL "
+    "SELECT IFNULL(session_id, ''), IFNULL(model, ''), NULL, inherited_requests, IFNULL(prompt_tokens, 0), "
+    "IFNULL(completion_tokens, 0), IFNULL(total_tokens, 0), IFNULL(cached_tokens, 0) "
+    "FROM usage WHERE inherited_requests > 0)";
+
+// Transaction control and connection-scoped statements report themselves as
+// read-only but have to run on the writer.
+bool IsReadOnlyStatement(sqlite3_stmt* stmt) {
+  if (!sqlite3_stmt_readonly(stmt)) return false;
+  absl::string_view sql = absl::StripLeadingAsciiWhitespace(sqlite3_sql(stmt));
+  for (absl::string_view keyword : {"BEGIN", "COMMIT", "END", "ROLLBACK", "SAVEPOINT", "RELEASE", "PRAGMA", "ATTACH",
+                                    "DETACH"}) {
+    if (absl::StartsWithIgnoreCase(sql, keyword)) return false;
+  }
+  return true;
 }
 
-absl::Status Database::Init(const std::string& db_path) {
-  LOG(INFO) << "Initializing database at " << db_path;
-  sqlite3* raw_db = nullptr;
-  int rc = sqlite3_open(db_path.c_str(), &raw_db);
-  if (rc != SQLITE_OK) {
-    std::string err = sqlite3_errmsg(raw_db);
-    sqlite3_close(raw_db);
-    LOG(ERROR) << "Failed to open database: " << err;
-    return absl::InternalError("Failed to open database: " + err);
+// Column list shared by every query that reads whole messages; see ReadMessageView().
+// Content stored in `blobs` is resolved through stored_messages.content_hash.
+constexpr char kMessageColumns[] =
+    "id, session_id, role, IFNULL(content, (SELECT content FROM blobs WHERE hash = stored_messages.content_hash)), "
+    "tool_call_id, status, created_at, group_id, parsing_strategy, tokens";
+
+// Sessions whose messages session ?1 sees, with the highest message id it sees of each:
+// the session itself, then each ancestor up to the point its fork was taken. Columns
+// are named so as not to clash with those of `messages`.
+constexpr char kLineage[] =
+    "lineage(lineage_session_id, lineage_last_id) AS ("
+    "SELECT ?1, 9223372036854775807 "
+    "UNION ALL SELECT s.parent_id, MIN(l.lineage_last_id, s.branch_message_id) FROM lineage l "
+    "JOIN sessions s ON s.id = l.lineage_session_id WHERE s.parent_id IS NOT NULL)";
+
+// The stored messages of kLineage, each with session ?1's entry in message_overrides
+// if it has one. Select kLineageVisible rows and read their status as kLineageStatus.
+constexpr char kLineageMessages[] =
+    "lineage CROSS JOIN stored_messages ON session_id = lineage_session_id AND id <= lineage_last_id "
+    "LEFT JOIN message_overrides ON override_session_id = ?1 AND override_message_id = id";
+constexpr char kLineageVisible[] = "(override_message_id IS NULL OR override_status IS NOT NULL)";
+constexpr char kLineageStatus[] = "IFNULL(override_status, status)";
+// kMessageColumns of kLineageMessages.
+constexpr char kLineageMessageColumns[] =
+    "id, session_id, role, IFNULL(content, (SELECT content FROM blobs WHERE hash = stored_messages.content_hash)), "
+    "tool_call_id, IFNULL(override_status, status), created_at, group_id, parsing_strategy, tokens";
+
+// Highest id of the messages of session ?1 that its forks see, 0 without forks. Those
+// messages stay as they are: the session overrides them instead of changing them.
+constexpr char kLastForkedId[] = "IFNULL((SELECT MAX(branch_message_id) FROM sessions WHERE parent_id = ?1), 0)";
+
+// Views the row the statement is positioned on, selected with kMessageColumns.
+Database::MessageView ReadMessageView(Database::Statement& stmt) {
+  Database::MessageView m;
+  m.id = stmt.ColumnInt(0);
+  m.session_id = stmt.ColumnTextView(1);
+  m.role = stmt.ColumnTextView(2);
+  m.content = stmt.ColumnTextView(3);
+  m.tool_call_id = stmt.ColumnTextView(4);
+  m.status = stmt.ColumnTextView(5);
+  m.created_at = stmt.ColumnTextView(6);
+  m.group_id = stmt.ColumnTextView(7);
+  m.parsing_strategy = stmt.ColumnTextView(8);
+  m.tokens = stmt.ColumnInt(9);
+  return m;
+}
+
+Database::MessageView ViewOf(const Database::Message& message) {
+  Database::MessageView m;
+  m.id = message.id;
+  m.session_id = message.session_id;
+  m.role = message.role;
+  m.content = message.content;
+  m.tool_call_id = message.tool_call_id;
+  m.status = message.status;
+  m.created_at = message.created_at;
+  m.group_id = message.group_id;
+  m.parsing_strategy = message.parsing_strategy;
+  m.tokens = message.tokens;
+  return m;
+}
+
+// Key of `content` in the blobs table: 64-bit FNV-1a and the length. Not
+// collision-resistant, so a hit is compared with the stored content before use.
+std::string ContentHash(absl::string_view content) {
+  uint64_t hash = 14695981039346656037ull;
+  for (unsigned char c : content) {
+    hash ^= c;
+    hash *= 1099511628211ull;
+  }
+  return absl::StrCat(absl::Hex(hash, absl::kZeroPad16), "-", content.size());
+}
+
+// SQL inflate(x): the text of message content stored compressed, x unchanged otherwise.
+void InflateFunction(sqlite3_context* ctx, int /*argc*/, sqlite3_value** argv) {
+  sqlite3_value* value = argv[0];
+  if (sqlite3_value_type(value) != SQLITE_BLOB) {
+    sqlite3_result_value(ctx, value);
+    return;
+  }
+  absl::string_view data(static_cast<const char*>(sqlite3_value_blob(value)), sqlite3_value_bytes(value));
+  if (!Database::IsCompressedContent(data)) {
+    sqlite3_result_value(ctx, value);
+    return;
+  }
+  auto content = static_cast<Database*>(sqlite3_user_data(ctx))->InflateContent(data);
+  if (!content.ok()) {
+    sqlite3_result_error(ctx, std::string(content.status().message()).c_str(), -1);
+    return;
   }
+  sqlite3_result_text64(ctx, content->data(), content->size(), SQLITE_TRANSIENT, SQLITE_UTF8);
+}
 
-  sqlite3_exec(raw_db, "DROP TABLE IF EXISTS code_search;", nullptr, nullptr, nullptr);
+// SQL archived_content(id): content of archived message `id` as stored, or NULL when
+// it is not in the archive or no archive is attached. The user data is the
+// connection's Database::UniqueStmt slot for the lookup, kept prepared between calls.
+void ArchivedContentFunction(sqlite3_context* ctx, int /*argc*/, sqlite3_value** argv) {
+  static constexpr char kSql[] = "SELECT content FROM archive.messages WHERE id = ?";
+  sqlite3* db = sqlite3_context_db_handle(ctx);
+  auto* cached = static_cast<Database::UniqueStmt*>(sqlite3_user_data(ctx));
+  Database::UniqueStmt one_off;
+  sqlite3_stmt* stmt = cached->get();
+  // A lookup already under way further up the stack gets a statement of its own.
+  if (stmt == nullptr || sqlite3_stmt_busy(stmt)) {
+    sqlite3_stmt* raw_stmt = nullptr;
+    if (sqlite3_prepare_v3(db, kSql, -1, SQLITE_PREPARE_PERSISTENT, &raw_stmt, nullptr) != SQLITE_OK) {
+      // Without the archive attached there is nothing to cache.
+      sqlite3_finalize(raw_stmt);
+      sqlite3_result_null(ctx);
+      return;
+    }
+    if (stmt == nullptr) {
+      cached->reset(raw_stmt);
+    } else {
+      one_off.reset(raw_stmt);
+    }
+    stmt = raw_stmt;
+  }
+  if (sqlite3_bind_value(stmt, 1, argv[0]) == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) {
+    sqlite3_result_value(ctx, sqlite3_column_value(stmt, 0));
+  } else {
+    sqlite3_result_null(ctx);
+  }
+  sqlite3_reset(stmt);
+}
 
-  const char* schema = R"(
-    CREATE TABLE IF NOT EXISTS messages (
+// SQL estimate_tokens(text): Database::EstimateTokens() of `text`, 0 for NULL.
+void EstimateTokensFunction(sqlite3_context* ctx, int /*argc*/, sqlite3_value** argv) {
+  if (sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+    sqlite3_result_int(ctx, 0);
+    return;
+  }
+  // Text is read as its UTF-8 bytes, the way AppendMessage() sees it.
+  const char* data = static_cast<const char*>(sqlite3_value_blob(argv[0]));
+  sqlite3_result_int(ctx, Database::EstimateTokens(absl::string_view(data, sqlite3_value_bytes(argv[0]))));
+}
+
+absl::Status ExecSchema(sqlite3* db, const char* sql) {
+  if (sqlite3_exec(db, sql, nullptr, nullptr, nullptr) != SQLITE_OK) {
+    return absl::InternalError(absl::StrCat("Schema error: ", sqlite3_errmsg(db)));
+  }
+  return absl::OkStatus();
+}
+
+bool SchemaObjectExists(sqlite3* db, const char* name) {
+  sqlite3_stmt* raw_stmt = nullptr;
+  bool found = false;
+  if (sqlite3_prepare_v2(db, "SELECT 1 FROM sqlite_master WHERE name = ?", -1, &raw_stmt, nullptr) == SQLITE_OK) {
+    sqlite3_bind_text(raw_stmt, 1, name, -1, SQLITE_STATIC);
+    found = sqlite3_step(raw_stmt) == SQLITE_ROW;
+  }
+  sqlite3_finalize(raw_stmt);
+  return found;
+}
+
+// Schema version 1: the schema as of the introduction of versioning. Brings a new
+// database, or one from before versioning (user_version 0), up to it, so every
+// statement tolerates tables and columns that already exist. The search and tag
+// indexes it creates are marked stale in `metadata`, for Init() to fill them from the
+// existing rows (see RunPendingBackfills()). Messages are stored in `stored_messages`; `messages` is a view of
+// every message, live or archived, with its content resolved and inflated, so that
+// query_db reads them as text. A `messages` table from before versioning is renamed.
+absl::Status MigrateToVersion1(sqlite3* db) {
+  RETURN_IF_ERROR(ExecSchema(db, "DROP TABLE IF EXISTS code_search;"));
+  if (SchemaObjectExists(db, "messages")) {
+    // The views and triggers are created again below.
+    RETURN_IF_ERROR(ExecSchema(db, R"(
+      DROP VIEW IF EXISTS messages_resolved;
+      DROP TRIGGER IF EXISTS messages_release_blob;
+      DROP TRIGGER IF EXISTS messages_fts_insert;
+      DROP TRIGGER IF EXISTS messages_fts_delete;
+      DROP TRIGGER IF EXISTS messages_fts_update;
+      DROP TRIGGER IF EXISTS archived_messages_fts_delete;
+      DROP TRIGGER IF EXISTS archived_messages_fts_stale;
+      ALTER TABLE messages RENAME TO stored_messages;
+    )"));
+  }
+  RETURN_IF_ERROR(ExecSchema(db, R"(
+    CREATE TABLE IF NOT EXISTS stored_messages (
         id INTEGER PRIMARY KEY AUTOINCREMENT,
         session_id TEXT,
         role TEXT CHECK(role IN ('system', 'user', 'assistant', 'tool')),
@@ -158,6 +421,12 @@ absl::Status Database::Init(const std::string& db_path) {
         tokens INTEGER DEFAULT 0
     );
 
+    -- Serves the per-session window (DISTINCT group_id ... ORDER BY created_at), GetLastGroupId
+    -- and /message list without touching other sessions' rows.
+    CREATE INDEX IF NOT EXISTS idx_messages_session_group ON stored_messages(session_id, group_id, created_at, id);
+    -- Serves GetMessagesByGroups, /message view|remove and /undo.
+    CREATE INDEX IF NOT EXISTS idx_messages_group ON stored_messages(group_id);
+
     CREATE TABLE IF NOT EXISTS tools (
         name TEXT PRIMARY KEY,
         description TEXT,
@@ -178,7 +447,10 @@ absl::Status Database::Init(const std::string& db_path) {
         id TEXT PRIMARY KEY,
         context_size INTEGER DEFAULT 5,
         scratchpad TEXT,
-        active_skills TEXT
+        active_skills TEXT,
+        parent_id TEXT,
+        branch_message_id INTEGER,
+        deleted_at DATETIME
     );
 
     CREATE TABLE IF NOT EXISTS usage (
@@ -202,33 +474,852 @@ absl::Status Database::Init(const std::string& db_path) {
         semantic_tags TEXT NOT NULL,
         created_at DATETIME DEFAULT CURRENT_TIMESTAMP
     );
-  )";
 
-  rc = sqlite3_exec(raw_db, schema, nullptr, nullptr, nullptr);
+    -- Message content shared by hash; see Database::kDefaultDedupThreshold.
+    CREATE TABLE IF NOT EXISTS blobs (
+        hash TEXT PRIMARY KEY,
+        content BLOB NOT NULL,
+        size INTEGER NOT NULL
+    );
+
+    -- Messages moved to the archive database, without their content; see ArchiveGroups().
+    CREATE TABLE IF NOT EXISTS archived_messages (
+        id INTEGER PRIMARY KEY,
+        session_id TEXT,
+        role TEXT,
+        tool_call_id TEXT,
+        status TEXT,
+        created_at DATETIME,
+        group_id TEXT,
+        parsing_strategy TEXT,
+        tokens INTEGER
+    );
+    CREATE INDEX IF NOT EXISTS idx_archived_messages_session_group ON archived_messages(session_id, group_id);
+    CREATE INDEX IF NOT EXISTS idx_archived_messages_group ON archived_messages(group_id);
+
+    -- zstd dictionaries for compressed message content; see ContentCodec.
+    CREATE TABLE IF NOT EXISTS content_dictionaries (
+        id INTEGER PRIMARY KEY AUTOINCREMENT,
+        dictionary BLOB NOT NULL,
+        created_at DATETIME DEFAULT CURRENT_TIMESTAMP
+    );
+
+    -- Settings of the database itself; see RegisterDefaults() and
+    -- RebuildStaleMessageIndex().
+    CREATE TABLE IF NOT EXISTS metadata (
+        key TEXT PRIMARY KEY,
+        value TEXT
+    );
+
+    -- The status a session gives a message it shares with its parent or its forks, or
+    -- NULL where it removed it; see CloneSession(). A rowid table, so that the update
+    -- hook sees its changes.
+    CREATE TABLE IF NOT EXISTS message_overrides (
+        override_session_id TEXT NOT NULL,
+        override_message_id INTEGER NOT NULL,
+        override_status TEXT,
+        PRIMARY KEY (override_session_id, override_message_id)
+    );
+  )"));
+
+  // Columns added to tables before versioning; the ones a database already has fail.
+  for (const char* sql : {
+           "ALTER TABLE stored_messages ADD COLUMN tokens INTEGER DEFAULT 0;",
+           "ALTER TABLE skills ADD COLUMN activation_count INTEGER DEFAULT 0;",
+           "ALTER TABLE sessions ADD COLUMN active_skills TEXT;",
+           "ALTER TABLE tools ADD COLUMN call_count INTEGER DEFAULT 0;",
+           "ALTER TABLE stored_messages ADD COLUMN content_hash TEXT;",
+           "ALTER TABLE sessions ADD COLUMN parent_id TEXT;",
+           "ALTER TABLE sessions ADD COLUMN branch_message_id INTEGER;",
+           "ALTER TABLE sessions ADD COLUMN deleted_at DATETIME;",
+       }) {
+    (void)sqlite3_exec(db, sql, nullptr, nullptr, nullptr);
+  }
+
+  // Objects that depend on those columns.
+  for (const char* index : {"messages_fts", "memos_fts", "memo_tags"}) {
+    if (SchemaObjectExists(db, index)) continue;
+    RETURN_IF_ERROR(ExecSchema(
+        db, absl::Substitute("INSERT OR REPLACE INTO metadata (key, value) VALUES ('$0_stale', '1');", index).c_str()));
+  }
+  return ExecSchema(db, R"(
+    CREATE INDEX IF NOT EXISTS idx_messages_content_hash ON stored_messages(content_hash) WHERE content_hash IS NOT NULL;
+
+    -- A blob lives as long as some message refers to it.
+    CREATE TRIGGER IF NOT EXISTS messages_release_blob AFTER DELETE ON stored_messages
+    WHEN old.content_hash IS NOT NULL
+    BEGIN
+        DELETE FROM blobs WHERE hash = old.content_hash
+            AND NOT EXISTS (SELECT 1 FROM stored_messages WHERE content_hash = old.content_hash);
+    END;
+
+    -- Stored messages with content resolved from blobs and inflated, then the archived
+    -- messages with content read from the archive. messages_resolved, the external
+    -- content of messages_fts, is the same view.
+    CREATE VIEW IF NOT EXISTS messages AS
+    SELECT id, session_id, role,
+           inflate(IFNULL(content, (SELECT content FROM blobs WHERE hash = stored_messages.content_hash))) AS content,
+           tool_call_id, status, created_at, group_id, parsing_strategy, tokens
+    FROM stored_messages
+    UNION ALL
+    SELECT id, session_id, role, inflate(archived_content(id)) AS content,
+           tool_call_id, status, created_at, group_id, parsing_strategy, tokens
+    FROM archived_messages;
+
+    CREATE VIEW IF NOT EXISTS messages_resolved AS SELECT * FROM messages;
+
+    -- Full-text indexes; see SearchMessages() and SearchMemos(). messages_fts indexes the
+    -- resolved text, so its triggers resolve content the way messages_resolved does. The
+    -- delete trigger runs BEFORE so that the blob has not been released yet.
+    CREATE VIRTUAL TABLE IF NOT EXISTS messages_fts USING fts5(
+        content, content='messages_resolved', content_rowid='id', tokenize='porter unicode61');
+
+    CREATE TRIGGER IF NOT EXISTS messages_fts_insert AFTER INSERT ON stored_messages
+    BEGIN
+        INSERT INTO messages_fts (rowid, content)
+        VALUES (new.id, inflate(IFNULL(new.content, (SELECT content FROM blobs WHERE hash = new.content_hash))));
+    END;
+
+    -- Archived messages keep their entry: archiving deletes the row once its stub is in
+    -- archived_messages.
+    CREATE TRIGGER IF NOT EXISTS messages_fts_delete BEFORE DELETE ON stored_messages
+    WHEN NOT EXISTS (SELECT 1 FROM archived_messages WHERE id = old.id)
+    BEGIN
+        INSERT INTO messages_fts (messages_fts, rowid, content)
+        VALUES ('delete', old.id, inflate(IFNULL(old.content, (SELECT content FROM blobs WHERE hash = old.content_hash))));
+    END;
+
+    CREATE TRIGGER IF NOT EXISTS messages_fts_update AFTER UPDATE OF content, content_hash ON stored_messages
+    BEGIN
+        INSERT INTO messages_fts (messages_fts, rowid, content)
+        VALUES ('delete', old.id, inflate(IFNULL(old.content, (SELECT content FROM blobs WHERE hash = old.content_hash))));
+        INSERT INTO messages_fts (rowid, content)
+        VALUES (new.id, inflate(IFNULL(new.content, (SELECT content FROM blobs WHERE hash = new.content_hash))));
+    END;
+
+    -- Deleting a stub removes the entry with the content read back from the archive.
+    -- Without the archive the stub is deleted anyway and its entry is left behind;
+    -- messages_fts_stale has RebuildStaleMessageIndex() rebuild the index.
+    CREATE TRIGGER IF NOT EXISTS archived_messages_fts_delete BEFORE DELETE ON archived_messages
+    WHEN archived_content(old.id) IS NOT NULL
+    BEGIN
+        INSERT INTO messages_fts (messages_fts, rowid, content)
+        VALUES ('delete', old.id, inflate(archived_content(old.id)));
+    END;
+
+    CREATE TRIGGER IF NOT EXISTS archived_messages_fts_stale BEFORE DELETE ON archived_messages
+    WHEN archived_content(old.id) IS NULL
+    BEGIN
+        INSERT OR REPLACE INTO metadata (key, value) VALUES ('messages_fts_stale', '1');
+    END;
+
+    CREATE VIRTUAL TABLE IF NOT EXISTS memos_fts USING fts5(
+        content, semantic_tags, content='llm_memos', content_rowid='id', tokenize='porter unicode61');
+
+    CREATE TRIGGER IF NOT EXISTS memos_fts_insert AFTER INSERT ON llm_memos
+    BEGIN
+        INSERT INTO memos_fts (rowid, content, semantic_tags) VALUES (new.id, new.content, new.semantic_tags);
+    END;
+
+    CREATE TRIGGER IF NOT EXISTS memos_fts_delete AFTER DELETE ON llm_memos
+    BEGIN
+        INSERT INTO memos_fts (memos_fts, rowid, content, semantic_tags)
+        VALUES ('delete', old.id, old.content, old.semantic_tags);
+    END;
+
+    CREATE TRIGGER IF NOT EXISTS memos_fts_update AFTER UPDATE ON llm_memos
+    BEGIN
+        INSERT INTO memos_fts (memos_fts, rowid, content, semantic_tags)
+        VALUES ('delete', old.id, old.content, old.semantic_tags);
+        INSERT INTO memos_fts (rowid, content, semantic_tags) VALUES (new.id, new.content, new.semantic_tags);
+    END;
+
+    -- Tag lookup keys of each memo; see GetMemosByTags(). Written by AddMemo() and
+    -- UpdateMemo(), which parse the tags.
+    CREATE TABLE IF NOT EXISTS memo_tags (
+        tag TEXT NOT NULL,
+        memo_id INTEGER NOT NULL,
+        PRIMARY KEY (tag, memo_id)
+    ) WITHOUT ROWID;
+    CREATE INDEX IF NOT EXISTS idx_memo_tags_memo ON memo_tags(memo_id);
+
+    CREATE TRIGGER IF NOT EXISTS memo_tags_delete AFTER DELETE ON llm_memos
+    BEGIN
+        DELETE FROM memo_tags WHERE memo_id = old.id;
+    END;
+  )");
+}
+
+// Schema version 2: usage rolled up per session, model and UTC day, kept current by
+// triggers on `usage` so that reports read one row per group instead of every usage
+// row, and the prices reports apply to them. `usage.inherited_requests` is set on the
+// rows CloneSession() gives a clone to carry over the source's totals, to the number
+// of requests each stands for. The triggers skip those rows, so that reports over
+// every session and per day count each request once; GetTotalUsage() and
+// GetUsageByModel() of a session add them.
+absl::Status MigrateToVersion2(sqlite3* db) {
+  // Fails on a database that already has it, like the columns of version 1.
+  (void)sqlite3_exec(db, "ALTER TABLE usage ADD COLUMN inherited_requests INTEGER NOT NULL DEFAULT 0;", nullptr,
+                     nullptr, nullptr);
+  return ExecSchema(db, R"(
+    CREATE INDEX IF NOT EXISTS idx_usage_inherited ON usage(session_id) WHERE inherited_requests > 0;
+
+    CREATE TABLE IF NOT EXISTS usage_daily (
+        session_id TEXT NOT NULL,
+        model TEXT NOT NULL,
+        day TEXT NOT NULL,
+        requests INTEGER NOT NULL,
+        prompt_tokens INTEGER NOT NULL,
+        completion_tokens INTEGER NOT NULL,
+        total_tokens INTEGER NOT NULL,
+        PRIMARY KEY (session_id, model, day)
+    ) WITHOUT ROWID;
+    CREATE INDEX IF NOT EXISTS idx_usage_daily_day ON usage_daily(day);
+
+    CREATE TRIGGER IF NOT EXISTS usage_rollup_insert AFTER INSERT ON usage
+    WHEN new.inherited_requests = 0
+    BEGIN
+        INSERT INTO usage_daily (session_id, model, day, requests, prompt_tokens, completion_tokens, total_tokens)
+        VALUES (IFNULL(new.session_id, ''), IFNULL(new.model, ''), IFNULL(date(new.created_at), date('now')), 1,
+                IFNULL(new.prompt_tokens, 0), IFNULL(new.completion_tokens, 0), IFNULL(new.total_tokens, 0))
+        ON CONFLICT (session_id, model, day) DO UPDATE SET
+            requests = requests + 1,
+            prompt_tokens = prompt_tokens + excluded.prompt_tokens,
+            completion_tokens = completion_tokens + excluded.completion_tokens,
+            total_tokens = total_tokens + excluded.total_tokens;
+    END;
+
+    CREATE TRIGGER IF NOT EXISTS usage_rollup_delete AFTER DELETE ON usage
+    WHEN old.inherited_requests = 0
+    BEGIN
+        UPDATE usage_daily SET
+            requests = requests - 1,
+            prompt_tokens = prompt_tokens - IFNULL(old.prompt_tokens, 0),
+            completion_tokens = completion_tokens - IFNULL(old.completion_tokens, 0),
+            total_tokens = total_tokens - IFNULL(old.total_tokens, 0)
+        WHERE session_id = IFNULL(old.session_id, '') AND model = IFNULL(old.model, '')
+            AND day = IFNULL(date(old.created_at), date('now'));
+        DELETE FROM usage_daily
+        WHERE session_id = IFNULL(old.session_id, '') AND model = IFNULL(old.model, '')
+            AND day = IFNULL(date(old.created_at), date('now')) AND requests <= 0;
+    END;
+
+    CREATE TRIGGER IF NOT EXISTS usage_rollup_update AFTER UPDATE ON usage
+    BEGIN
+        UPDATE usage_daily SET
+            requests = requests - 1,
+            prompt_tokens = prompt_tokens - IFNULL(old.prompt_tokens, 0),
+            completion_tokens = completion_tokens - IFNULL(old.completion_tokens, 0),
+            total_tokens = total_tokens - IFNULL(old.total_tokens, 0)
+        WHERE old.inherited_requests = 0 AND session_id = IFNULL(old.session_id, '')
+            AND model = IFNULL(old.model, '') AND day = IFNULL(date(old.created_at), date('now'));
+        DELETE FROM usage_daily
+        WHERE old.inherited_requests = 0 AND session_id = IFNULL(old.session_id, '')
+            AND model = IFNULL(old.model, '') AND day = IFNULL(date(old.created_at), date('now'))
+            AND requests <= 0;
+        INSERT INTO usage_daily (session_id, model, day, requests, prompt_tokens, completion_tokens, total_tokens)
+        SELECT IFNULL(new.session_id, ''), IFNULL(new.model, ''), IFNULL(date(new.created_at), date('now')), 1,
+               IFNULL(new.prompt_tokens, 0), IFNULL(new.completion_tokens, 0), IFNULL(new.total_tokens, 0)
+        WHERE new.inherited_requests = 0
+        ON CONFLICT (session_id, model, day) DO UPDATE SET
+            requests = requests + 1,
+            prompt_tokens = prompt_tokens + excluded.prompt_tokens,
+            completion_tokens = completion_tokens + excluded.completion_tokens,
+            total_tokens = total_tokens + excluded.total_tokens;
+    END;
+
+    DELETE FROM usage_daily;
+    INSERT INTO usage_daily (session_id, model, day, requests, prompt_tokens, completion_tokens, total_tokens)
+    SELECT IFNULL(session_id, ''), IFNULL(model, ''), IFNULL(date(created_at), date('now')), COUNT(*),
+           SUM(IFNULL(prompt_tokens, 0)), SUM(IFNULL(completion_tokens, 0)), SUM(IFNULL(total_tokens, 0))
+    FROM usage WHERE inherited_requests = 0 GROUP BY 1, 2, 3;
+
+    -- USD per million tokens. A model is priced by the longest pattern it matches.
+    CREATE TABLE IF NOT EXISTS model_prices (
+        model_pattern TEXT PRIMARY KEY,
+        prompt_per_million REAL NOT NULL,
+        completion_per_million REAL NOT NULL
+    );
+  )");
+}
+
+// Schema version 3: a session's window may be a token budget, which
+// GetBudgetWindowSize() fills from `messages.tokens`. The window index covers the
+// columns that selection reads, and `message_tokens_stale` has Init() estimate every
+// message's tokens once content can be inflated.
+absl::Status MigrateToVersion3(sqlite3* db) {
+  // Fails on a database that already has it, like the columns of version 1.
+  (void)sqlite3_exec(db, "ALTER TABLE sessions ADD COLUMN context_budget INTEGER DEFAULT 0;", nullptr, nullptr,
+                     nullptr);
+  RETURN_IF_ERROR(ExecSchema(db, R"(
+    DROP INDEX IF EXISTS idx_messages_session_group;
+    CREATE INDEX idx_messages_session_group ON stored_messages(session_id, group_id, created_at, id, status, role, tokens);
+    INSERT OR REPLACE INTO metadata (key, value) VALUES ('message_tokens_stale', '1');
+  )"));
+  return absl::OkStatus();
+}
+
+// Schema version 4: tokens are counted by TokenCounter instead of one per four
+// bytes, so `message_tokens_stale` has every message estimated again.
+absl::Status MigrateToVersion4(sqlite3* db) {
+  return ExecSchema(db, "INSERT OR REPLACE INTO metadata (key, value) VALUES ('message_tokens_stale', '1');");
+}
+
+// Schema version 5: `cached_tokens`, the part of a request's prompt the provider
+// served from its prompt cache, in `usage` and rolled up in `usage_daily`. The
+// rollup triggers are replaced to carry it; rows from before count none.
+absl::Status MigrateToVersion5(sqlite3* db) {
+  // Fail on a database that already has them, like the columns of version 1.
+  (void)sqlite3_exec(db, "ALTER TABLE usage ADD COLUMN cached_tokens INTEGER DEFAULT 0;", nullptr, nullptr, nullptr);
+  (void)sqlite3_exec(db, "ALTER TABLE usage_daily ADD COLUMN cached_tokens INTEGER NOT NULL DEFAULT 0;", nullptr,
+                     nullptr, nullptr);
+  return ExecSchema(db, R"(
+    DROP TRIGGER IF EXISTS usage_rollup_insert;
+    DROP TRIGGER IF EXISTS usage_rollup_delete;
+    DROP TRIGGER IF EXISTS usage_rollup_update;
+
+    CREATE TRIGGER usage_rollup_insert AFTER INSERT ON usage
+    WHEN new.inherited_requests = 0
+    BEGIN
+        INSERT INTO usage_daily (session_id, model, day, requests, prompt_tokens, completion_tokens, total_tokens,
+                                 cached_tokens)
+        VALUES (IFNULL(new.session_id, ''), IFNULL(new.model, ''), IFNULL(date(new.created_at), date('now')), 1,
+                IFNULL(new.prompt_tokens, 0), IFNULL(new.completion_tokens, 0), IFNULL(new.total_tokens, 0),
+                IFNULL(new.cached_tokens, 0))
+        ON CONFLICT (session_id, model, day) DO UPDATE SET
+            requests = requests + 1,
+            prompt_tokens = prompt_tokens + excluded.prompt_tokens,
+            completion_tokens = completion_tokens + excluded.completion_tokens,
+            total_tokens = total_tokens + excluded.total_tokens,
+            cached_tokens = cached_tokens + excluded.cached_tokens;
+    END;
+
+    CREATE TRIGGER usage_rollup_delete AFTER DELETE ON usage
+    WHEN old.inherited_requests = 0
+    BEGIN
+        UPDATE usage_daily SET
+            requests = requests - 1,
+            prompt_tokens = prompt_tokens - IFNULL(old.prompt_tokens, 0),
+            completion_tokens = completion_tokens - IFNULL(old.completion_tokens, 0),
+            total_tokens = total_tokens - IFNULL(old.total_tokens, 0),
+            cached_tokens = cached_tokens - IFNULL(old.cached_tokens, 0)
+        WHERE session_id = IFNULL(old.session_id, '') AND model = IFNULL(old.model, '')
+            AND day = IFNULL(date(old.created_at), date('now'));
+        DELETE FROM usage_daily
+        WHERE session_id = IFNULL(old.session_id, '') AND model = IFNULL(old.model, '')
+            AND day = IFNULL(date(old.created_at), date('now')) AND requests <= 0;
+    END;
+
+    CREATE TRIGGER usage_rollup_update AFTER UPDATE ON usage
+    BEGIN
+        UPDATE usage_daily SET
+            requests = requests - 1,
+            prompt_tokens = prompt_tokens - IFNULL(old.prompt_tokens, 0),
+            completion_tokens = completion_tokens - IFNULL(old.completion_tokens, 0),
+            total_tokens = total_tokens - IFNULL(old.total_tokens, 0),
+            cached_tokens = cached_tokens - IFNULL(old.cached_tokens, 0)
+        WHERE old.inherited_requests = 0 AND session_id = IFNULL(old.session_id, '')
+            AND model = IFNULL(old.model, '') AND day = IFNULL(date(old.created_at), date('now'));
+        DELETE FROM usage_daily
+        WHERE old.inherited_requests = 0 AND session_id = IFNULL(old.session_id, '')
+            AND model = IFNULL(old.model, '') AND day = IFNULL(date(old.created_at), date('now'))
+            AND requests <= 0;
+        INSERT INTO usage_daily (session_id, model, day, requests, prompt_tokens, completion_tokens, total_tokens,
+                                 cached_tokens)
+        SELECT IFNULL(new.session_id, ''), IFNULL(new.model, ''), IFNULL(date(new.created_at), date('now')), 1,
+               IFNULL(new.prompt_tokens, 0), IFNULL(new.completion_tokens, 0), IFNULL(new.total_tokens, 0),
+               IFNULL(new.cached_tokens, 0)
+        WHERE new.inherited_requests = 0
+        ON CONFLICT (session_id, model, day) DO UPDATE SET
+            requests = requests + 1,
+            prompt_tokens = prompt_tokens + excluded.prompt_tokens,
+            completion_tokens = completion_tokens + excluded.completion_tokens,
+            total_tokens = total_tokens + excluded.total_tokens,
+            cached_tokens = cached_tokens + excluded.cached_tokens;
+    END;
+  )");
+}
+
+int GetSchemaVersion(sqlite3* db) {
+  sqlite3_stmt* raw_stmt = nullptr;
+  int version = 0;
+  if (sqlite3_prepare_v2(db, "PRAGMA user_version;", -1, &raw_stmt, nullptr) == SQLITE_OK &&
+      sqlite3_step(raw_stmt) == SQLITE_ROW) {
+    version = sqlite3_column_int(raw_stmt, 0);
+  }
+  sqlite3_finalize(raw_stmt);
+  return version;
+}
+
+// Applies, in one transaction, the migrations of every version above the database's
+// `PRAGMA user_version`. A database that is up to date is only read. To change the
+// schema, bump Database::kSchemaVersion and add a step; never edit a released one.
+absl::Status Migrate(sqlite3* db) {
+  if (GetSchemaVersion(db) == Database::kSchemaVersion) return absl::OkStatus();
+  RETURN_IF_ERROR(ExecSchema(db, "BEGIN IMMEDIATE;"));
+  // Read again under the lock: another process may have migrated it meanwhile.
+  int version = GetSchemaVersion(db);
+  absl::Status status;
+  if (version > Database::kSchemaVersion) {
+    LOG(WARNING) << "Database schema version " << version << " is newer than this binary's ("
+                 << Database::kSchemaVersion << ").";
+  }
+  if (version < 1) status = MigrateToVersion1(db);
+  if (status.ok() && version < 2) status = MigrateToVersion2(db);
+  if (status.ok() && version < 3) status = MigrateToVersion3(db);
+  if (status.ok() && version < 4) status = MigrateToVersion4(db);
+  if (status.ok() && version < 5) status = MigrateToVersion5(db);
+  if (status.ok() && version < Database::kSchemaVersion) {
+    status = ExecSchema(db, absl::StrCat("PRAGMA user_version = ", Database::kSchemaVersion, ";").c_str());
+  }
+  if (!status.ok()) {
+    (void)sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
+    return status;
+  }
+  return ExecSchema(db, "COMMIT;");
+}
+
+// The calling thread's innermost open read snapshot, of any database; each links to
+// the one that was innermost before it.
+thread_local const Database::ReadSnapshot* innermost_read_snapshot = nullptr;
+
+}  // namespace
+
+Database::~Database() {
+  StopWriteBehind();
+  StopArchiver();
+  bool open;
+  {
+    absl::MutexLock lock(&mu_);
+    open = writer_.db != nullptr;
+  }
+  // Cheap unless the connection's queries showed that statistics are stale.
+  if (open) {
+    absl::Status status = Execute(absl::StrCat("PRAGMA analysis_limit = ", kOptimizeAnalysisLimit));
+    if (status.ok()) status = Execute("PRAGMA optimize");
+    if (!status.ok()) LOG(WARNING) << "PRAGMA optimize failed: " << status;
+  }
+  absl::MutexLock lock(&mu_);
+  // Cached statements must be finalized before their connections are closed.
+  ClearStatementCachesLocked();
+}
+
+void Database::AcquireWriter() {
+  if (HoldsWriter()) {
+    ++writer_depth_;
+    return;
+  }
+  writer_mu_.Lock();
+  writer_thread_.store(std::this_thread::get_id());
+  writer_depth_ = 1;
+}
+
+void Database::ReleaseWriter() {
+  if (--writer_depth_ > 0) return;
+  sqlite3* db;
+  {
+    absl::MutexLock lock(&mu_);
+    db = writer_.db.get();
+  }
+  writer_in_transaction_.store(db != nullptr && sqlite3_get_autocommit(db) == 0);
+  if (history_dirty_.exchange(false)) history_generation_++;
+  if (manifest_dirty_.exchange(false)) manifest_generation_++;
+  writer_thread_.store(std::thread::id());
+  writer_mu_.Unlock();
+}
+
+Database::Connection* Database::AcquireReader() {
+  std::string path;
+  {
+    absl::MutexLock lock(&mu_);
+    if (reader_path_.empty()) return nullptr;
+    if (!idle_readers_.empty()) {
+      Connection* reader = idle_readers_.back();
+      idle_readers_.pop_back();
+      return reader;
+    }
+    if (readers_.size() >= kMaxReadConnections) return nullptr;
+    // Reserve the slot so that the pool never grows past its limit.
+    readers_.push_back(std::make_unique<Connection>());
+    path = reader_path_;
+  }
+
+  sqlite3* raw_db = nullptr;
+  int rc = sqlite3_open_v2(path.c_str(), &raw_db, SQLITE_OPEN_READONLY, nullptr);
+  absl::MutexLock lock(&mu_);
+  auto slot = std::find_if(readers_.begin(), readers_.end(), [](const auto& r) { return r->db == nullptr; });
+  if (rc != SQLITE_OK) {
+    LOG(WARNING) << "Failed to open read connection: " << sqlite3_errmsg(raw_db);
+    sqlite3_close(raw_db);
+    readers_.erase(slot);
+    return nullptr;
+  }
+  sqlite3_busy_timeout(raw_db, kBusyTimeoutMs);
+  ApplyTuning(raw_db);
+  RegisterFunctions(raw_db, slot->get());
+  (*slot)->db.reset(raw_db);
+  return slot->get();
+}
+
+void Database::ReleaseReader(Connection* reader) {
+  absl::MutexLock lock(&mu_);
+  idle_readers_.push_back(reader);
+}
+
+size_t Database::GetReadConnectionCount() {
+  absl::MutexLock lock(&mu_);
+  return readers_.size();
+}
+
+std::unique_ptr<Database::Statement> Database::CheckoutStatement(Connection* conn, const std::string& sql,
+                                                                 std::function<void()> on_release) {
+  auto stmt = std::make_unique<Statement>(conn->db.get(), sql);
+  stmt->release_ = [this, conn, on_release = std::move(on_release)](const std::string& sql, UniqueStmt handle) {
+    if (handle) ReleaseStatement(conn, sql, std::move(handle));
+    on_release();
+  };
+
+  absl::MutexLock lock(&mu_);
+  if (stmt_cache_capacity_ == 0) return stmt;
+  auto it = conn->stmt_index.find(sql);
+  if (it != conn->stmt_index.end()) {
+    // Check the handle out of the cache so concurrent callers never share it.
+    stmt->stmt_ = std::move(it->second->stmt);
+    conn->stmt_lru.erase(it->second);
+    conn->stmt_index.erase(it);
+    stmt_cache_stats_.hits++;
+  } else {
+    stmt_cache_stats_.misses++;
+  }
+  return stmt;
+}
+
+absl::StatusOr<std::unique_ptr<Database::Statement>> Database::Prepare(const std::string& sql) {
+  AcquireWriter();
+  auto stmt = CheckoutStatement(&writer_, sql, [this] { ReleaseWriter(); });
+  if (!stmt->stmt_) RETURN_IF_ERROR(stmt->Prepare());
+  return stmt;
+}
+
+absl::StatusOr<std::unique_ptr<Database::Statement>> Database::PrepareRead(const std::string& sql) {
+  if (HoldsWriter()) return Prepare(sql);
+  const ReadSnapshot* snapshot = ActiveReadSnapshot();
+  Connection* reader;
+  std::function<void()> on_release;
+  if (snapshot != nullptr && snapshot->conn_ != nullptr) {
+    // The snapshot's reader stays checked out until the snapshot ends.
+    reader = snapshot->conn_;
+    on_release = [] {};
+  } else {
+    if (writer_in_transaction_.load()) return Prepare(sql);
+    reader = AcquireReader();
+    if (reader == nullptr) return Prepare(sql);
+    if (!reader->archive_attached && archive_exists_.load()) {
+      absl::Status attached = AttachArchive(reader, /*create=*/false);
+      if (!attached.ok()) LOG(WARNING) << "Archive unavailable on a read connection: " << attached;
+    }
+    on_release = [this, reader] { ReleaseReader(reader); };
+  }
+
+  auto stmt = CheckoutStatement(reader, sql, std::move(on_release));
+  if (!stmt->stmt_ && !stmt->Prepare().ok()) {
+    // Objects that only exist on the writer connection (TEMP tables, attached
+    // databases) do not resolve here.
+    stmt.reset();
+    return Prepare(sql);
+  }
+  if (!IsReadOnlyStatement(stmt->stmt_.get())) {
+    // Keeps the handle cached on the reader, so the next attempt costs a lookup, not a prepare.
+    stmt.reset();
+    return Prepare(sql);
+  }
+  return stmt;
+}
+
+void Database::ReleaseStatement(Connection* conn, const std::string& sql, UniqueStmt stmt) {
+  sqlite3_reset(stmt.get());
+  sqlite3_clear_bindings(stmt.get());
+
+  absl::MutexLock lock(&mu_);
+  if (stmt_cache_capacity_ == 0 || conn->stmt_index.contains(sql)) return;
+  conn->stmt_lru.push_front({sql, std::move(stmt)});
+  conn->stmt_index[sql] = conn->stmt_lru.begin();
+  EvictStatementsLocked(conn, stmt_cache_capacity_);
+}
+
+void Database::EvictStatementsLocked(Connection* conn, size_t capacity) {
+  while (conn->stmt_lru.size() > capacity) {
+    conn->stmt_index.erase(conn->stmt_lru.back().sql);
+    conn->stmt_lru.pop_back();
+    stmt_cache_stats_.evictions++;
+  }
+}
+
+void Database::ClearStatementCachesLocked() {
+  writer_.stmt_index.clear();
+  writer_.stmt_lru.clear();
+  writer_.archived_content_stmt.reset();
+  for (auto& reader : readers_) {
+    reader->stmt_index.clear();
+    reader->stmt_lru.clear();
+    reader->archived_content_stmt.reset();
+  }
+}
+
+Database::StatementCacheStats Database::GetStatementCacheStats() {
+  absl::MutexLock lock(&mu_);
+  StatementCacheStats stats = stmt_cache_stats_;
+  stats.size = writer_.stmt_lru.size();
+  for (const auto& reader : readers_) stats.size += reader->stmt_lru.size();
+  stats.capacity = stmt_cache_capacity_;
+  return stats;
+}
+
+void Database::SetStatementCacheCapacity(size_t capacity) {
+  absl::MutexLock lock(&mu_);
+  stmt_cache_capacity_ = capacity;
+  EvictStatementsLocked(&writer_, capacity);
+  for (auto& reader : readers_) EvictStatementsLocked(reader.get(), capacity);
+}
+
+absl::StatusOr<std::unique_ptr<Database::WriteBatch>> Database::BeginWriteBatch() {
+  AcquireWriter();
+  bool in_transaction;
+  {
+    absl::MutexLock lock(&mu_);
+    in_transaction = sqlite3_get_autocommit(writer_.db.get()) == 0;
+  }
+  std::string savepoint;
+  absl::Status status;
+  if (in_transaction) {
+    savepoint = absl::StrCat("write_batch_", write_batch_depth_);
+    status = Execute("SAVEPOINT " + savepoint + ";");
+  } else {
+    // IMMEDIATE takes the write lock up front, so the commit cannot fail with
+    // SQLITE_BUSY because another process wrote in between.
+    status = Execute("BEGIN IMMEDIATE;");
+  }
+  if (!status.ok()) {
+    ReleaseWriter();
+    return status;
+  }
+  write_batch_depth_++;
+  return std::unique_ptr<WriteBatch>(new WriteBatch(this, std::move(savepoint)));
+}
+
+absl::StatusOr<std::unique_ptr<Database::ReadSnapshot>> Database::BeginReadSnapshot() {
+  std::unique_ptr<ReadSnapshot> snapshot(new ReadSnapshot(this));
+  if (ActiveReadSnapshot() != nullptr) return snapshot;
+
+  // A thread holding the writer reads through it, and so do all threads while the
+  // writer is left inside a transaction.
+  Connection* reader = HoldsWriter() || writer_in_transaction_.load() ? nullptr : AcquireReader();
+  if (reader == nullptr) {
+    AcquireWriter();
+    snapshot->holds_writer_ = true;
+    // Nothing is committed while the writer is held, so no cached entry is newer.
+    snapshot->last_message_id_ = std::numeric_limits<int>::max();
+  } else {
+    snapshot->conn_ = reader;
+    // ATTACH is refused inside a transaction.
+    if (!reader->archive_attached && archive_exists_.load()) {
+      absl::Status attached = AttachArchive(reader, /*create=*/false);
+      if (!attached.ok()) LOG(WARNING) << "Archive unavailable on a read connection: " << attached;
+    }
+  }
+  // Read before the transaction starts, like the caches do, so that a change
+  // committed meanwhile marks what the snapshot reads as stale.
+  snapshot->history_generation_ = history_generation_.load();
+  snapshot->manifest_generation_ = manifest_generation_.load();
+  snapshot->outer_ = innermost_read_snapshot;
+  snapshot->active_ = true;
+  innermost_read_snapshot = snapshot.get();
+  if (reader == nullptr) return snapshot;
+
+  if (sqlite3_exec(reader->db.get(), "BEGIN;", nullptr, nullptr, nullptr) != SQLITE_OK) {
+    return absl::InternalError(absl::StrCat("Failed to begin read snapshot: ", sqlite3_errmsg(reader->db.get())));
+  }
+  // BEGIN defers the read transaction to the first read.
+  ASSIGN_OR_RETURN(snapshot->last_message_id_, GetLastMessageId());
+  return snapshot;
+}
+
+Database::ReadSnapshot::~ReadSnapshot() {
+  if (!active_) return;
+  innermost_read_snapshot = outer_;
+  if (conn_ != nullptr) {
+    sqlite3* db = conn_->db.get();
+    if (sqlite3_get_autocommit(db) == 0) (void)sqlite3_exec(db, "COMMIT;", nullptr, nullptr, nullptr);
+    db_->ReleaseReader(conn_);
+  }
+  if (holds_writer_) db_->ReleaseWriter();
+}
+
+const Database::ReadSnapshot* Database::ActiveReadSnapshot() const {
+  for (const ReadSnapshot* snapshot = innermost_read_snapshot; snapshot != nullptr; snapshot = snapshot->outer_) {
+    if (snapshot->db_ == this) return snapshot;
+  }
+  return nullptr;
+}
+
+Database::WriteBatch::~WriteBatch() {
+  if (!finished_) (void)Finish(/*commit=*/false);
+}
+
+absl::Status Database::WriteBatch::Commit() { return Finish(/*commit=*/true); }
+
+absl::Status Database::WriteBatch::Rollback() { return Finish(/*commit=*/false); }
+
+absl::Status Database::WriteBatch::Finish(bool commit) {
+  if (finished_) return absl::FailedPreconditionError("Write batch already finished");
+  finished_ = true;
+
+  absl::Status status;
+  if (savepoint_.empty()) {
+    status = db_->Execute(commit ? "COMMIT;" : "ROLLBACK;");
+    if (!status.ok() && commit) (void)db_->Execute("ROLLBACK;");
+  } else {
+    if (!commit) {
+      // Unlike ROLLBACK, this does not run the rollback hook.
+      db_->InvalidateHistory();
+      status = db_->Execute("ROLLBACK TO " + savepoint_ + ";");
+    }
+    absl::Status release = db_->Execute("RELEASE " + savepoint_ + ";");
+    if (status.ok()) status = release;
+  }
+  db_->write_batch_depth_--;
+  db_->ReleaseWriter();
+  return status;
+}
+
+absl::Status Database::Init(const std::string& db_path) { return Init(db_path, Tuning()); }
+
+absl::Status Database::Init(const std::string& db_path, const Tuning& tuning) {
+  LOG(INFO) << "Initializing database at " << db_path;
+  // Queued writes belong to the database being replaced.
+  StopWriteBehind();
+  tuning_ = tuning;
+  sqlite3* raw_db = nullptr;
+  int rc = sqlite3_open(db_path.c_str(), &raw_db);
   if (rc != SQLITE_OK) {
     std::string err = sqlite3_errmsg(raw_db);
     sqlite3_close(raw_db);
-    return absl::InternalError("Schema error: " + err);
+    LOG(ERROR) << "Failed to open database: " << err;
+    return absl::InternalError("Failed to open database: " + err);
   }
 
-  // Migration: Add tokens column to messages table if it doesn't exist
-  (void)sqlite3_exec(raw_db, "ALTER TABLE messages ADD COLUMN tokens INTEGER DEFAULT 0;", nullptr, nullptr, nullptr);
-  (void)sqlite3_exec(raw_db, "ALTER TABLE skills ADD COLUMN activation_count INTEGER DEFAULT 0;", nullptr, nullptr,
-                     nullptr);
-  (void)sqlite3_exec(raw_db, "ALTER TABLE sessions ADD COLUMN active_skills TEXT;", nullptr, nullptr, nullptr);
-  (void)sqlite3_exec(raw_db, "ALTER TABLE tools ADD COLUMN call_count INTEGER DEFAULT 0;", nullptr, nullptr, nullptr);
+  sqlite3_busy_timeout(raw_db, kBusyTimeoutMs);
+  ApplyTuning(raw_db);
+  // Only takes effect on a database that has no tables yet.
+  if (tuning_.incremental_vacuum_pages > 0) (void)ExecSchema(raw_db, "PRAGMA auto_vacuum = INCREMENTAL;");
+  absl::Status migrated = Migrate(raw_db);
+  if (!migrated.ok()) {
+    sqlite3_close(raw_db);
+    return migrated;
+  }
+
+  // File-backed databases switch to WAL so that the read-only connections never
+  // block on (or block) the writer. In-memory databases cannot be shared between
+  // connections and keep using the writer for everything.
+  std::string reader_path;
+  std::string archive_path;
+  const char* filename = sqlite3_db_filename(raw_db, "main");
+  if (filename != nullptr && filename[0] != '\0') {
+    archive_path = absl::StrCat(filename, ".archive");
+    sqlite3_stmt* raw_stmt = nullptr;
+    if (sqlite3_prepare_v2(raw_db, "PRAGMA journal_mode=WAL;", -1, &raw_stmt, nullptr) == SQLITE_OK &&
+        sqlite3_step(raw_stmt) == SQLITE_ROW &&
+        absl::EqualsIgnoreCase(reinterpret_cast<const char*>(sqlite3_column_text(raw_stmt, 0)), "wal")) {
+      reader_path = filename;
+      // Durable up to the last checkpoint, and consistent after a power loss.
+      if (tuning_.synchronous_normal) (void)ExecSchema(raw_db, "PRAGMA synchronous = NORMAL;");
+    } else {
+      LOG(WARNING) << "WAL journaling unavailable for " << db_path << "; reads will use the writer connection.";
+    }
+    sqlite3_finalize(raw_stmt);
+  }
+
+  wal_frames_ = 0;
+  wal_checkpointed_frames_ = 0;
+  checkpoints_ = 0;
+  if (!reader_path.empty()) sqlite3_wal_hook(raw_db, &Database::OnWalCommit, this);
+  sqlite3_commit_hook(
+      raw_db,
+      [](void* self) {
+        static_cast<Database*>(self)->commit_count_++;
+        return 0;
+      },
+      this);
+  commit_count_ = 0;
+  // Appended messages are picked up by the history cache on its next read; anything
+  // else that changes `stored_messages`, or any change to `message_overrides`,
+  // invalidates it. Any change to `tools` or `skills` but their counters invalidates
+  // the tool manifest.
+  sqlite3_update_hook(
+      raw_db,
+      [](void* self, int op, const char*, const char* table, sqlite3_int64) {
+        auto* database = static_cast<Database*>(self);
+        if ((op != SQLITE_INSERT && std::strcmp(table, "stored_messages") == 0) ||
+            std::strcmp(table, "message_overrides") == 0) {
+          database->InvalidateHistory();
+        }
+        if (!database->writing_counters_ && (std::strcmp(table, "tools") == 0 || std::strcmp(table, "skills") == 0)) {
+          database->InvalidateManifest();
+        }
+      },
+      this);
+  sqlite3_rollback_hook(
+      raw_db,
+      [](void* self) {
+        static_cast<Database*>(self)->InvalidateHistory();
+        static_cast<Database*>(self)->InvalidateManifest();
+      },
+      this);
+  RegisterFunctions(raw_db, &writer_);
 
   {
+    ScopedWriter writer(this);
     absl::MutexLock lock(&mu_);
-    db_.reset(raw_db);
+    ClearStatementCachesLocked();
+    idle_readers_.clear();
+    readers_.clear();
+    reader_path_ = reader_path;
+    archive_path_ = archive_path;
+    writer_.db.reset(raw_db);
+    writer_.archive_attached = false;
+  }
+  std::error_code ec;
+  archive_exists_ = !archive_path.empty() && std::filesystem::exists(archive_path, ec);
+  if (archive_exists_.load()) {
+    ScopedWriter writer(this);
+    absl::Status attached = AttachArchive(&writer_, /*create=*/true);
+    if (!attached.ok()) LOG(WARNING) << "Archive unavailable: " << attached;
+  }
+  {
+    absl::MutexLock lock(&history_mu_);
+    history_cache_.clear();
   }
+  history_generation_++;
+
+  codec_ = std::make_unique<ContentCodec>();
+  compressed_without_dictionary_ = 0;
+  absl::Status s = LoadCompressionDictionaries();
+  if (!s.ok()) return s;
+
+  // After the dictionaries: rebuilding messages_fts and estimating tokens inflate
+  // every message.
+  s = RunPendingBackfills();
+  if (!s.ok()) return s;
+  s = RebuildStaleMessageIndex();
+  if (!s.ok()) return s;
 
-  absl::Status s = RegisterDefaultTools();
+  s = RegisterDefaultTools();
   if (!s.ok()) return s;
 
   s = RegisterDefaultSkills();
   if (!s.ok()) return s;
 
+  StartWriteBehind();
   return absl::OkStatus();
 }
 
@@ -253,8 +1344,11 @@ absl::Status Database::RegisterDefaultTools() {
        "history.",
        R"({"type":"object","properties":{"pattern":{"type":"string"},"path":{"type":"string"},"case_insensitive":{"type":"boolean"},"word_regexp":{"type":"boolean"},"line_number":{"type":"boolean","default":true},"count":{"type":"boolean"},"before":{"type":"integer"},"after":{"type":"integer"},"context":{"type":"integer"},"files_with_matches":{"type":"boolean"},"all_match":{"type":"boolean"},"pcre":{"type":"boolean"},"show_function":{"type":"boolean"},"function_context":{"type":"boolean"},"cached":{"type":"boolean"},"branch":{"type":"string"}},"required":["pattern"]})",
        true},
-      {"query_db", "Query the local SQLite database using SQL.",
-       R"({"type":"object","properties":{"sql":{"type":"string"}},"required":["sql"]})", true},
+      {"query_db",
+       "Query the local SQLite database using SQL. Rows come back as JSON objects or, with format=tsv, as a more "
+       "compact table; long results are cut short with a count of the rows left out.",
+       R"({"type":"object","properties":{"sql":{"type":"string"},"format":{"type":"string","enum":["json","tsv"]}},"required":["sql"]})",
+       true},
       {"apply_patch", "Applies partial changes to a file by matching a specific block of text and replacing it.",
        R"({"type":"object","properties":{"path":{"type":"string"},"patches":{"type":"array","items":{"type":"object","properties":{"find":{"type":"string"},"replace":{"type":"string"}},"required":["find","replace"]}}},"required":["path","patches"]})",
        true},
@@ -264,6 +1358,12 @@ absl::Status Database::RegisterDefaultTools() {
       {"retrieve_memos", "Retrieve memos based on semantic tags.",
        R"({"type":"object","properties":{"tags":{"type":"array","items":{"type":"string"}}},"required":["tags"]})",
        true},
+      {"search_history",
+       "Full-text search of the conversation history for any of the words in query. Returns the best matching "
+       "messages first, with their id, group_id and a snippet; read a whole message with query_db on "
+       "messages.",
+       R"({"type":"object","properties":{"query":{"type":"string"},"limit":{"type":"integer","default":10},"all_sessions":{"type":"boolean","default":false}},"required":["query"]})",
+       true},
       {"list_directory", "List files and directories with optional depth and git awareness.",
        R"({"type":"object","properties":{"path":{"type":"string"},"depth":{"type":"integer"},"git_only":{"type":"boolean"}},"required":[]})",
        true},
@@ -299,11 +1399,16 @@ absl::Status Database::RegisterDefaultTools() {
   // Automatically register all core tools defined in the default_tools list.
   // This ensures the agent always has access to the fundamental building blocks
   // for code manipulation and system interaction.
+  std::string definitions;
   for (const auto& t : default_tools) {
-    absl::Status s = RegisterTool(t);
-    if (!s.ok()) return s;
+    absl::StrAppend(&definitions, t.name, "\x1f", t.description, "\x1f", t.json_schema, "\x1f", t.is_enabled, "\x1e");
   }
-  return absl::OkStatus();
+  return RegisterDefaults("default_tools_hash", definitions, [&]() -> absl::Status {
+    for (const auto& t : default_tools) {
+      RETURN_IF_ERROR(RegisterTool(t));
+    }
+    return absl::OkStatus();
+  });
 }
 
 absl::Status Database::RegisterDefaultSkills() {
@@ -400,11 +1505,32 @@ absl::Status Database::RegisterDefaultSkills() {
        "Stay focused on the commit history. Be precise, technical, and proactive in fixing your own bugs before the "
        "user sees them."});
 
+  std::string definitions;
   for (const auto& s : default_skills) {
-    absl::Status status = RegisterSkill(s);
-    if (!status.ok()) return status;
+    absl::StrAppend(&definitions, s.name, "\x1f", s.description, "\x1f", s.system_prompt_patch, "\x1e");
   }
-  return absl::OkStatus();
+  return RegisterDefaults("default_skills_hash", definitions, [&]() -> absl::Status {
+    for (const auto& s : default_skills) {
+      RETURN_IF_ERROR(RegisterSkill(s));
+    }
+    return absl::OkStatus();
+  });
+}
+
+absl::Status Database::RegisterDefaults(const std::string& key, absl::string_view definitions,
+                                        absl::FunctionRef<absl::Status()> register_defaults) {
+  std::string hash = ContentHash(definitions);
+  {
+    ASSIGN_OR_RETURN(auto stmt, Prepare("SELECT 1 FROM metadata WHERE key = ? AND value = ?;"));
+    RETURN_IF_ERROR(stmt->BindText(1, key));
+    RETURN_IF_ERROR(stmt->BindText(2, hash));
+    ASSIGN_OR_RETURN(bool registered, stmt->Step());
+    if (registered) return absl::OkStatus();
+  }
+  ASSIGN_OR_RETURN(auto batch, BeginWriteBatch());
+  RETURN_IF_ERROR(register_defaults());
+  RETURN_IF_ERROR(Execute("INSERT OR REPLACE INTO metadata (key, value) VALUES (?, ?);", key, hash));
+  return batch->Commit();
 }
 
 absl::Status Database::Execute(const std::string& sql) { return Execute(sql, {}); }
@@ -418,20 +1544,37 @@ absl::Status Database::Execute(const std::string& sql, const std::vector<std::st
   return (*stmt_or)->Run();
 }
 
+int Database::EstimateTokens(absl::string_view text) { return TokenCounter::Default().Count(text); }
+
 absl::Status Database::AppendMessage(const std::string& session_id, const std::string& role, const std::string& content,
                                      const std::string& tool_call_id, const std::string& status,
                                      const std::string& group_id, const std::string& parsing_strategy, int tokens) {
+  // Held throughout so that a blob cannot be released between StoreBlob() and the insert.
+  ScopedWriter writer(this);
   // Ensure session exists
   RETURN_IF_ERROR(Execute("INSERT OR IGNORE INTO sessions (id) VALUES (?)", session_id));
 
+  std::string hash;
+  size_t dedup_threshold = dedup_threshold_.load();
+  if (dedup_threshold > 0 && content.size() >= dedup_threshold) {
+    ASSIGN_OR_RETURN(hash, StoreBlob(content));
+  }
+
   std::string sql =
-      "INSERT INTO messages (session_id, role, content, tool_call_id, status, group_id, parsing_strategy, tokens) "
-      "VALUES (?, ?, ?, ?, ?, ?, ?, ?)";
+      "INSERT INTO stored_messages (session_id, role, content, tool_call_id, status, group_id, parsing_strategy, "
+      "tokens, content_hash) VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?)";
   ASSIGN_OR_RETURN(auto stmt, Prepare(sql));
 
   RETURN_IF_ERROR(stmt->BindText(1, session_id));
   RETURN_IF_ERROR(stmt->BindText(2, role));
-  RETURN_IF_ERROR(stmt->BindText(3, content));
+  bool compressed = false;
+  if (hash.empty()) {
+    RETURN_IF_ERROR(BindContent(stmt.get(), 3, content, &compressed));
+    RETURN_IF_ERROR(stmt->BindNull(9));
+  } else {
+    RETURN_IF_ERROR(stmt->BindNull(3));
+    RETURN_IF_ERROR(stmt->BindText(9, hash));
+  }
   if (tool_call_id.empty()) {
     RETURN_IF_ERROR(stmt->BindNull(4));
   } else {
@@ -448,83 +1591,351 @@ absl::Status Database::AppendMessage(const std::string& session_id, const std::s
   } else {
     RETURN_IF_ERROR(stmt->BindText(7, parsing_strategy));
   }
-  RETURN_IF_ERROR(stmt->BindInt(8, tokens));
+  RETURN_IF_ERROR(stmt->BindInt(8, tokens > 0 ? tokens : EstimateTokens(content)));
+  RETURN_IF_ERROR(stmt->Run());
 
-  return stmt->Run();
+  if (compressed) NoteCompressedContent();
+  return absl::OkStatus();
 }
 
-absl::Status Database::UpdateMessageStatus(int id, const std::string& status) {
-  return Execute("UPDATE messages SET status = ? WHERE id = ?;", status, id);
+absl::StatusOr<std::string> Database::StoreBlob(const std::string& content) {
+  std::string hash = ContentHash(content);
+  {
+    ASSIGN_OR_RETURN(auto stmt, Prepare("SELECT content FROM blobs WHERE hash = ?"));
+    RETURN_IF_ERROR(stmt->BindText(1, hash));
+    ASSIGN_OR_RETURN(bool found, stmt->Step());
+    if (found) {
+      absl::string_view stored = stmt->ColumnTextView(0);
+      if (IsCompressedContent(stored)) {
+        ASSIGN_OR_RETURN(std::string text, InflateContent(stored));
+        return text == content ? hash : "";
+      }
+      return stored == content ? hash : "";
+    }
+  }
+  ASSIGN_OR_RETURN(auto stmt, Prepare("INSERT INTO blobs (hash, content, size) VALUES (?, ?, ?)"));
+  RETURN_IF_ERROR(stmt->BindText(1, hash));
+  bool compressed = false;
+  RETURN_IF_ERROR(BindContent(stmt.get(), 2, content, &compressed));
+  RETURN_IF_ERROR(stmt->BindInt64(3, content.size()));
+  RETURN_IF_ERROR(stmt->Run());
+  if (compressed) NoteCompressedContent();
+  return hash;
 }
 
-/**
- * @brief Retrieves messages for a specific session, optionally windowed.
- *
- * If window_size > 0, it retrieves messages from the most recent 'window_size' groups.
- * A 'group' typically corresponds to one full interaction (user prompt + assistant response).
- *
- * @param session_id The session to query.
- * @param include_dropped If true, includes messages marked as 'dropped'.
- * @param window_size Number of recent groups to include. 0 for all history.
- * @return absl::StatusOr<std::vector<Message>> A list of messages ordered by time.
+absl::Status Database::BindContent(Statement* stmt, int index, const std::string& content, bool* compressed) {
+  *compressed = false;
+  size_t threshold = compression_threshold_.load();
+  if (threshold > 0 && content.size() >= threshold) {
+    ASSIGN_OR_RETURN(std::string encoded, codec_->Encode(content));
+    // Incompressible content (e.g. already compressed output) stays text.
+    *compressed = encoded.size() < content.size();
+    if (*compressed) return stmt->BindBlob(index, encoded);
+  }
+  return stmt->BindText(index, content);
+}
+
+void Database::NoteCompressedContent() {
+  if (codec_->encoding_dictionary() == 0 && ++compressed_without_dictionary_ == kDictionaryTrainingThreshold) {
+    absl::Status trained = TrainCompressionDictionary();
+    if (!trained.ok()) LOG(WARNING) << "Compression dictionary not trained: " << trained.message();
+  }
+}
+
+absl::Status Database::UpdateMessageStatus(const std::string& session_id, int id, const std::string& status) {
+  ASSIGN_OR_RETURN(auto batch, BeginWriteBatch());
+  bool shared;
+  {
+    ASSIGN_OR_RETURN(auto stmt, Prepare(absl::StrCat("WITH RECURSIVE ", kLineage, " SELECT session_id != ?1 OR id <= ",
+                                                     kLastForkedId, " FROM ", kLineageMessages,
+                                                     " WHERE id = ?2 AND ", kLineageVisible, ";")));
+    RETURN_IF_ERROR(stmt->BindText(1, session_id));
+    RETURN_IF_ERROR(stmt->BindInt(2, id));
+    ASSIGN_OR_RETURN(bool row, stmt->Step());
+    if (!row) return absl::NotFoundError(absl::StrCat("Message ", id, " not found in session '", session_id, "'."));
+    shared = stmt->ColumnInt(0) != 0;
+  }
+  // Other sessions see the message as it is, so the session overrides it instead.
+  if (shared) {
+    RETURN_IF_ERROR(Execute("INSERT OR REPLACE INTO message_overrides (override_session_id, override_message_id, "
+                            "override_status) VALUES (?, ?, ?);",
+                            session_id, id, status));
+  } else {
+    RETURN_IF_ERROR(Execute("UPDATE stored_messages SET status = ? WHERE id = ?;", status, id));
+    RETURN_IF_ERROR(Execute(
+        "DELETE FROM message_overrides WHERE override_session_id = ? AND override_message_id = ?;", session_id, id));
+  }
+  return batch->Commit();
+}
+absl::Status Database::RemoveGroup(const std::string& session_id, const std::string& group_id) {
+  ASSIGN_OR_RETURN(auto batch, BeginWriteBatch());
+  // Messages other sessions see are hidden from this one; the rest are deleted.
+  RETURN_IF_ERROR(Execute(absl::StrCat("WITH RECURSIVE ", kLineage,
+                                       " INSERT OR REPLACE INTO message_overrides (override_session_id, "
+                                       "override_message_id, override_status) SELECT ?1, id, NULL FROM ",
+                                       kLineageMessages, " WHERE group_id = ?2 AND (session_id != ?1 OR id <= ",
+                                       kLastForkedId, ");"),
+                          session_id, group_id));
+  RETURN_IF_ERROR(Execute(absl::StrCat("DELETE FROM message_overrides WHERE override_session_id = ?1 AND "
+                                       "override_message_id IN (SELECT id FROM stored_messages "
+                                       "WHERE session_id = ?1 AND group_id = ?2 AND id > ",
+                                       kLastForkedId, ");"),
+                          session_id, group_id));
+  for (const char* table : {"stored_messages", "archived_messages"}) {
+    RETURN_IF_ERROR(Execute(
+        absl::StrCat("DELETE FROM ", table, " WHERE session_id = ?1 AND group_id = ?2 AND id > ", kLastForkedId, ";"),
+        session_id, group_id));
+  }
+  return batch->Commit();
+}
+
+/**
+ * @brief Retrieves messages for a specific session, optionally windowed.
+ *
+ * If window_size > 0, it retrieves messages from the most recent 'window_size' groups.
+ * A 'group' typically corresponds to one full interaction (user prompt + assistant response).
+ *
+ * @param session_id The session to query.
+ * @param include_dropped If true, includes messages marked as 'dropped'.
+ * @param window_size Number of recent groups to include. 0 for all history.
+ * @return absl::StatusOr<std::vector<Message>> A list of messages ordered by time.
  */
 absl::StatusOr<std::vector<Database::Message>> Database::GetConversationHistory(const std::string& session_id,
                                                                                 bool include_dropped, int window_size) {
+  std::vector<Message> history;
+  absl::Status status;
+  std::string scratch;
+  RETURN_IF_ERROR(VisitConversationHistory(session_id, include_dropped, window_size, [&](const MessageView& row) {
+    MessageView m = row;
+    if (status.ok()) status = InflateView(&m, &scratch);
+    if (status.ok()) history.push_back(m.ToMessage());
+  }));
+  if (!status.ok()) return status;
+  return history;
+}
+
+absl::StatusOr<std::vector<Database::MessageView>> Database::GetConversationHistoryViews(
+    const std::string& session_id, MessageArena* arena, bool include_dropped, int window_size) {
+  std::vector<MessageView> history;
+  absl::Status status;
+  std::string scratch;
+  RETURN_IF_ERROR(VisitConversationHistory(session_id, include_dropped, window_size, [&](const MessageView& row) {
+    MessageView m = row;
+    if (status.ok()) status = InflateView(&m, &scratch);
+    if (!status.ok()) return;
+    m.session_id = arena->Copy(row.session_id);
+    m.role = arena->Copy(row.role);
+    m.content = arena->Copy(m.content);
+    m.tool_call_id = arena->Copy(row.tool_call_id);
+    m.status = arena->Copy(row.status);
+    m.created_at = arena->Copy(row.created_at);
+    m.group_id = arena->Copy(row.group_id);
+    m.parsing_strategy = arena->Copy(row.parsing_strategy);
+    history.push_back(m);
+  }));
+  if (!status.ok()) return status;
+  return history;
+}
+
+absl::Status Database::VisitConversationHistory(const std::string& session_id, bool include_dropped, int window_size,
+                                                absl::FunctionRef<void(const MessageView&)> visitor) {
+  if (include_dropped) return VisitStoredHistory(session_id, include_dropped, window_size, visitor);
+  ASSIGN_OR_RETURN(std::shared_ptr<const HistoryWindow> window, GetHistoryWindow(session_id, window_size));
+  for (const auto& row : window->rows) visitor(ViewOf(*row));
+  return absl::OkStatus();
+}
+
+absl::StatusOr<std::shared_ptr<const Database::HistoryWindow>> Database::GetHistoryWindow(
+    const std::string& session_id, int window_size) {
+  // Read before the messages so that a change made meanwhile marks the result stale.
+  const ReadSnapshot* snapshot = ActiveReadSnapshot();
+  int64_t generation = snapshot != nullptr ? snapshot->history_generation_ : history_generation_.load();
+  std::pair<std::string, int> key(session_id, std::max(window_size, 0));
+  std::shared_ptr<const HistoryWindow> cached;
+  {
+    absl::MutexLock lock(&history_mu_);
+    if (history_cache_capacity_ > 0) {
+      auto it = history_cache_.find(key);
+      if (it != history_cache_.end() && it->second.window->generation == generation &&
+          (snapshot == nullptr || it->second.window->last_id <= snapshot->last_message_id_)) {
+        cached = it->second.window;
+      }
+    }
+  }
+
+  std::shared_ptr<const HistoryWindow> window;
+  if (cached) {
+    ASSIGN_OR_RETURN(window, ExtendHistoryWindow(session_id, window_size, cached));
+  }
+  bool hit = window != nullptr;
+  if (!hit) {
+    auto loaded = std::make_shared<HistoryWindow>();
+    RETURN_IF_ERROR(VisitStoredHistory(session_id, false, window_size, [&](const MessageView& m) {
+      loaded->rows.push_back(std::make_shared<const Message>(m.ToMessage()));
+      loaded->last_id = std::max(loaded->last_id, m.id);
+    }));
+    loaded->generation = generation;
+    window = std::move(loaded);
+  }
+
+  absl::MutexLock lock(&history_mu_);
+  (hit ? history_cache_stats_.hits : history_cache_stats_.misses)++;
+  if (history_cache_capacity_ == 0) return window;
+  auto it = history_cache_.find(key);
+  if (it == history_cache_.end() && history_cache_.size() >= history_cache_capacity_) {
+    auto oldest = std::min_element(history_cache_.begin(), history_cache_.end(), [](const auto& a, const auto& b) {
+      return a.second.last_used < b.second.last_used;
+    });
+    history_cache_.erase(oldest);
+  }
+  CachedHistoryWindow& entry = history_cache_[key];
+  // Another reader may have stored a newer window meanwhile; keep the newest.
+  if (entry.window == nullptr || entry.window->generation < generation ||
+      (entry.window->generation == generation && entry.window->last_id <= window->last_id)) {
+    entry.window = window;
+  }
+  entry.last_used = ++history_cache_clock_;
+  return window;
+}
+
+absl::StatusOr<std::shared_ptr<const Database::HistoryWindow>> Database::ExtendHistoryWindow(
+    const std::string& session_id, int window_size, const std::shared_ptr<const HistoryWindow>& cached) {
+  // Walks the rowid range above the watermark rather than the session's index
+  // entries (hence +session_id). Messages a fork inherits are all below it. `preceded`
+  // tells whether a message's group has earlier messages, which a window missing that
+  // group would have to load; those may belong to an ancestor, so any session's count.
+  std::string sql = absl::StrCat(
+      "SELECT ", kMessageColumns,
+      ", group_id IS NOT NULL AND EXISTS (SELECT 1 FROM stored_messages o WHERE o.group_id = stored_messages.group_id "
+      "AND o.id <= ?1 AND o.status != 'dropped') AS preceded "
+      "FROM stored_messages WHERE id > ?1 AND +session_id = ?2 ORDER BY created_at ASC, id ASC");
+  ASSIGN_OR_RETURN(auto stmt, PrepareRead(sql));
+  RETURN_IF_ERROR(stmt->BindInt(1, cached->last_id));
+  RETURN_IF_ERROR(stmt->BindText(2, session_id));
+
+  auto window = std::make_shared<HistoryWindow>();
+  window->last_id = cached->last_id;
+  window->generation = cached->generation;
+  bool stale = false;
+  bool appended = false;
+  absl::flat_hash_set<std::string> groups;
+  if (window_size > 0) {
+    for (const auto& row : cached->rows) {
+      if (!row->group_id.empty()) groups.insert(row->group_id);
+    }
+  }
+  RETURN_IF_ERROR(stmt->ForEachRow([&](Statement& row) {
+    if (stale) return;
+    MessageView m = ReadMessageView(row);
+    window->last_id = std::max(window->last_id, m.id);
+    if (m.status == "dropped") return;
+    const Message* last = !window->rows.empty()  ? window->rows.back().get()
+                          : !cached->rows.empty() ? cached->rows.back().get()
+                                                  : nullptr;
+    // A clock step back would sort the message before ones already in the window, and
+    // a group outside the window that gains a message moves into it.
+    if ((last != nullptr && m.created_at < last->created_at) ||
+        (window_size > 0 && !m.group_id.empty() && !groups.contains(m.group_id) && row.ColumnInt(10) != 0)) {
+      stale = true;
+      return;
+    }
+    if (!appended) {
+      window->rows = cached->rows;
+      appended = true;
+    }
+    if (window_size > 0 && !m.group_id.empty()) groups.insert(std::string(m.group_id));
+    window->rows.push_back(std::make_shared<const Message>(m.ToMessage()));
+  }));
+  if (stale) return nullptr;
+  if (!appended) {
+    if (window->last_id == cached->last_id) return cached;
+    // Only dropped messages were appended.
+    window->rows = cached->rows;
+    return window;
+  }
+
+  // Keep the window_size groups whose latest message is newest, like the windowed query.
+  if (window_size > 0 && groups.size() > static_cast<size_t>(window_size)) {
+    absl::flat_hash_set<absl::string_view> kept;
+    for (auto it = window->rows.rbegin(); it != window->rows.rend() && kept.size() < static_cast<size_t>(window_size);
+         ++it) {
+      if (!(*it)->group_id.empty()) kept.insert((*it)->group_id);
+    }
+    std::vector<std::shared_ptr<const Message>> rows;
+    rows.reserve(window->rows.size());
+    for (auto& row : window->rows) {
+      if (row->group_id.empty() || kept.contains(row->group_id)) rows.push_back(row);
+    }
+    window->rows = std::move(rows);
+  }
+  return window;
+}
+
+void Database::InvalidateHistory() {
+  history_dirty_ = true;
+  history_generation_++;
+}
+
+void Database::InvalidateManifest() {
+  manifest_dirty_ = true;
+  manifest_generation_++;
+}
+
+Database::HistoryCacheStats Database::GetHistoryCacheStats() {
+  absl::MutexLock lock(&history_mu_);
+  HistoryCacheStats stats = history_cache_stats_;
+  stats.size = history_cache_.size();
+  stats.capacity = history_cache_capacity_;
+  return stats;
+}
+
+void Database::SetHistoryCacheCapacity(size_t capacity) {
+  absl::MutexLock lock(&history_mu_);
+  history_cache_capacity_ = capacity;
+  history_cache_.clear();
+}
+
+absl::Status Database::VisitStoredHistory(const std::string& session_id, bool include_dropped, int window_size,
+                                          absl::FunctionRef<void(const MessageView&)> visitor) {
   std::string sql;
-  std::string drop_filter = include_dropped ? "" : "AND status != 'dropped'";
+  std::string drop_filter = include_dropped ? "" : absl::StrCat("AND ", kLineageStatus, " != 'dropped'");
 
+  // A fork's history is its ancestors' messages up to each branch point, then its own.
   if (window_size > 0) {
     // This query retrieves the history with a turn-based windowing logic.
     // Instead of limiting by raw message count, it limits by 'group_id' count.
     // Each 'group_id' represents a full turn (user prompt + multiple tool calls/responses).
     // This ensures that we don't truncate a conversation in the middle of a tool-calling sequence.
     sql = absl::Substitute(
-        "SELECT id, session_id, role, content, tool_call_id, status, created_at, group_id, parsing_strategy, tokens "
-        "FROM messages WHERE session_id = ? $0 "
-        "AND (group_id IS NULL OR group_id IN (SELECT DISTINCT group_id FROM messages WHERE session_id = ? AND "
-        "group_id IS NOT NULL $0 ORDER BY created_at DESC, id DESC LIMIT ?)) "
+        "WITH RECURSIVE $2 "
+        "SELECT $1 "
+        "FROM $3 "
+        "WHERE $4 $0 AND (group_id IS NULL OR group_id IN (SELECT DISTINCT group_id FROM $3 "
+        "WHERE group_id IS NOT NULL AND $4 $0 "
+        "ORDER BY created_at DESC, id DESC LIMIT ?2)) "
         "ORDER BY created_at ASC, id ASC",
-        drop_filter);
+        drop_filter, kLineageMessageColumns, kLineage, kLineageMessages, kLineageVisible);
   } else {
     sql = absl::Substitute(
-        "SELECT id, session_id, role, content, tool_call_id, status, created_at, group_id, parsing_strategy, tokens "
-        "FROM messages WHERE session_id = ? $0 "
-        "ORDER BY created_at ASC, id ASC",
-        drop_filter);
+        "WITH RECURSIVE $2 "
+        "SELECT $1 "
+        "FROM $3 "
+        "WHERE $4 $0 ORDER BY created_at ASC, id ASC",
+        drop_filter, kLineageMessageColumns, kLineage, kLineageMessages, kLineageVisible);
   }
 
-  ASSIGN_OR_RETURN(auto stmt, Prepare(sql));
+  ASSIGN_OR_RETURN(auto stmt, PrepareRead(sql));
 
   RETURN_IF_ERROR(stmt->BindText(1, session_id));
   if (window_size > 0) {
-    RETURN_IF_ERROR(stmt->BindText(2, session_id));
-    RETURN_IF_ERROR(stmt->BindInt(3, window_size));
+    RETURN_IF_ERROR(stmt->BindInt(2, window_size));
   }
 
-  std::vector<Message> history;
-  while (true) {
-    auto row_or = stmt->Step();
-    if (!row_or.ok()) return row_or.status();
-    if (!*row_or) break;
-
-    Message m;
-    m.id = stmt->ColumnInt(0);
-    m.session_id = stmt->ColumnText(1);
-    m.role = stmt->ColumnText(2);
-    m.content = stmt->ColumnText(3);
-    m.tool_call_id = stmt->ColumnText(4);
-    m.status = stmt->ColumnText(5);
-    m.created_at = stmt->ColumnText(6);
-    m.group_id = stmt->ColumnText(7);
-    m.parsing_strategy = stmt->ColumnText(8);
-    m.tokens = stmt->ColumnInt(9);
-    history.push_back(m);
-  }
-  return history;
+  return stmt->ForEachRow([&](Statement& row) { visitor(ReadMessageView(row)); });
 }
 
 absl::StatusOr<std::vector<Database::Message>> Database::GetMessagesByGroups(
-    const std::vector<std::string>& group_ids) {
+    const std::vector<std::string>& group_ids, int after_id) {
   if (group_ids.empty()) return std::vector<Message>();
 
   std::string placeholders;
@@ -532,44 +1943,134 @@ absl::StatusOr<std::vector<Database::Message>> Database::GetMessagesByGroups(
     placeholders += (i == 0 ? "?" : ", ?");
   }
 
-  std::string sql =
-      "SELECT id, session_id, role, content, tool_call_id, status, created_at, group_id, parsing_strategy, tokens "
-      "FROM messages WHERE group_id IN (" +
-      placeholders + ") ORDER BY created_at ASC, id ASC";
+  std::string sql = absl::StrCat("SELECT ", kMessageColumns, " FROM stored_messages WHERE group_id IN (", placeholders,
+                                 ") AND id > ? ORDER BY created_at ASC, id ASC");
 
-  ASSIGN_OR_RETURN(auto stmt, Prepare(sql));
+  ASSIGN_OR_RETURN(auto stmt, PrepareRead(sql));
 
   for (size_t i = 0; i < group_ids.size(); ++i) {
     RETURN_IF_ERROR(stmt->BindText(i + 1, group_ids[i]));
   }
+  RETURN_IF_ERROR(stmt->BindInt(group_ids.size() + 1, after_id));
 
   std::vector<Message> messages;
-  while (true) {
-    auto row_or = stmt->Step();
-    if (!row_or.ok()) return row_or.status();
-    if (!*row_or) break;
-
-    Message m;
-    m.id = stmt->ColumnInt(0);
-    m.session_id = stmt->ColumnText(1);
-    m.role = stmt->ColumnText(2);
-    m.content = stmt->ColumnText(3);
-    m.tool_call_id = stmt->ColumnText(4);
-    m.status = stmt->ColumnText(5);
-    m.created_at = stmt->ColumnText(6);
-    m.group_id = stmt->ColumnText(7);
-    m.parsing_strategy = stmt->ColumnText(8);
-    m.tokens = stmt->ColumnInt(9);
-    messages.push_back(m);
-  }
+  absl::Status status;
+  std::string scratch;
+  RETURN_IF_ERROR(stmt->ForEachRow([&](Statement& row) {
+    MessageView m = ReadMessageView(row);
+    if (status.ok()) status = InflateView(&m, &scratch);
+    if (status.ok()) messages.push_back(m.ToMessage());
+  }));
+  if (!status.ok()) return status;
   return messages;
 }
 
+absl::Status Database::InflateView(MessageView* m, std::string* scratch) {
+  if (!IsCompressedContent(m->content)) return absl::OkStatus();
+  ASSIGN_OR_RETURN(*scratch, InflateContent(m->content));
+  m->content = *scratch;
+  return absl::OkStatus();
+}
+
+absl::StatusOr<size_t> Database::GetContentSize(absl::string_view content) {
+  if (!IsCompressedContent(content)) return content.size();
+  return ContentCodec::DecodedSize(content);
+}
+
+absl::StatusOr<std::string> Database::InflateContent(absl::string_view content) {
+  if (!IsCompressedContent(content)) return std::string(content);
+  RETURN_IF_ERROR(LoadCompressionDictionary(content));
+  return codec_->Decode(content);
+}
+
+absl::StatusOr<std::string> Database::InflateContentRange(absl::string_view content, size_t offset, size_t length) {
+  if (!IsCompressedContent(content)) return std::string(content.substr(std::min(offset, content.size()), length));
+  RETURN_IF_ERROR(LoadCompressionDictionary(content));
+  return codec_->DecodeRange(content, offset, length);
+}
+
+absl::Status Database::LoadCompressionDictionary(absl::string_view content) {
+  ASSIGN_OR_RETURN(uint32_t id, ContentCodec::DictionaryId(content));
+  if (id == 0 || codec_->HasDictionary(id)) return absl::OkStatus();
+  // Trained by another process since Init().
+  ASSIGN_OR_RETURN(auto stmt, PrepareRead("SELECT dictionary FROM content_dictionaries WHERE id = ?"));
+  RETURN_IF_ERROR(stmt->BindInt64(1, id));
+  ASSIGN_OR_RETURN(bool found, stmt->Step());
+  if (!found) return absl::DataLossError(absl::StrCat("Compression dictionary ", id, " is missing"));
+  return codec_->AddDictionary(id, stmt->ColumnTextView(0), /*use_for_encoding=*/false);
+}
+
+absl::Status Database::LoadCompressionDictionaries() {
+  ASSIGN_OR_RETURN(auto stmt, PrepareRead("SELECT id, dictionary FROM content_dictionaries ORDER BY id"));
+  std::vector<std::pair<uint32_t, std::string>> dictionaries;
+  RETURN_IF_ERROR(stmt->ForEachRow([&](Statement& row) {
+    dictionaries.emplace_back(row.ColumnInt64(0), std::string(row.ColumnTextView(1)));
+  }));
+  // The newest dictionary is the one new content is compressed with.
+  for (size_t i = 0; i < dictionaries.size(); ++i) {
+    RETURN_IF_ERROR(codec_->AddDictionary(dictionaries[i].first, dictionaries[i].second,
+                                          /*use_for_encoding=*/i + 1 == dictionaries.size()));
+  }
+  return absl::OkStatus();
+}
+
+absl::Status Database::TrainCompressionDictionary() {
+  // zstd wants many small samples, about 100x the dictionary size in total.
+  constexpr size_t kSampleSize = 4096;
+  constexpr size_t kMaxSampleBytes = 100 * ContentCodec::kDictionaryCapacity;
+
+  std::vector<std::string> samples;
+  {
+    ASSIGN_OR_RETURN(auto stmt,
+                     PrepareRead("SELECT content FROM (SELECT content FROM blobs ORDER BY rowid DESC LIMIT 1000) "
+                                 "UNION ALL SELECT content FROM (SELECT content FROM stored_messages WHERE "
+                                 "typeof(content) = 'blob' OR length(content) >= ? ORDER BY id DESC LIMIT 1000)"));
+    RETURN_IF_ERROR(stmt->BindInt(1, kSampleSize / 4));
+    size_t total = 0;
+    absl::Status status;
+    RETURN_IF_ERROR(stmt->ForEachRow([&](Statement& row) {
+      if (!status.ok() || total >= kMaxSampleBytes) return;
+      auto content = InflateContent(row.ColumnTextView(0));
+      if (!content.ok()) {
+        status = content.status();
+        return;
+      }
+      for (size_t pos = 0; pos < content->size() && total < kMaxSampleBytes; pos += kSampleSize) {
+        samples.push_back(content->substr(pos, kSampleSize));
+        total += samples.back().size();
+      }
+    }));
+    RETURN_IF_ERROR(status);
+  }
+  ASSIGN_OR_RETURN(std::string dictionary, ContentCodec::TrainDictionary(samples));
+
+  ScopedWriter writer(this);
+  {
+    ASSIGN_OR_RETURN(auto stmt, Prepare("INSERT INTO content_dictionaries (dictionary) VALUES (?)"));
+    RETURN_IF_ERROR(stmt->BindBlob(1, dictionary));
+    RETURN_IF_ERROR(stmt->Run());
+  }
+  ASSIGN_OR_RETURN(auto stmt, Prepare("SELECT last_insert_rowid()"));
+  ASSIGN_OR_RETURN(bool has_row, stmt->Step());
+  if (!has_row) return absl::InternalError("last_insert_rowid() returned no row");
+  return codec_->AddDictionary(stmt->ColumnInt64(0), dictionary, /*use_for_encoding=*/true);
+}
+
+void Database::RegisterFunctions(sqlite3* db, Connection* conn) {
+  sqlite3_create_function(db, "inflate", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, this, InflateFunction, nullptr,
+                          nullptr);
+  sqlite3_create_function(db, "archived_content", 1, SQLITE_UTF8, &conn->archived_content_stmt,
+                          ArchivedContentFunction, nullptr, nullptr);
+  sqlite3_create_function(db, "estimate_tokens", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, nullptr,
+                          EstimateTokensFunction, nullptr, nullptr);
+}
+
 absl::StatusOr<std::string> Database::GetLastGroupId(const std::string& session_id) {
-  std::string sql =
-      "SELECT group_id FROM messages WHERE session_id = ? AND group_id IS NOT NULL ORDER BY created_at DESC, id DESC "
-      "LIMIT 1";
-  ASSIGN_OR_RETURN(auto stmt, Prepare(sql));
+  std::string sql = absl::StrCat(
+      "WITH RECURSIVE ", kLineage,
+      " SELECT group_id FROM ", kLineageMessages, " WHERE group_id IS NOT NULL AND ", kLineageVisible,
+      " ORDER BY created_at DESC, id DESC LIMIT 1");
+  ASSIGN_OR_RETURN(auto stmt, PrepareRead(sql));
   RETURN_IF_ERROR(stmt->BindText(1, session_id));
   auto row_or = stmt->Step();
   if (!row_or.ok()) return row_or.status();
@@ -579,66 +2080,249 @@ absl::StatusOr<std::string> Database::GetLastGroupId(const std::string& session_
   return absl::NotFoundError("No group found");
 }
 
-absl::Status Database::RecordUsage(const std::string& session_id, const std::string& model, int prompt_tokens,
-                                   int completion_tokens) {
-  // Ensure session exists
-  RETURN_IF_ERROR(Execute("INSERT OR IGNORE INTO sessions (id) VALUES (?)", session_id));
+absl::StatusOr<std::vector<Database::GroupSummary>> Database::ListGroups(const std::string& session_id, int limit) {
+  // Content is read for the prompts alone, from the table or the archive.
+  std::string sql = absl::StrCat(
+      "WITH RECURSIVE ", kLineage,
+      ", session_messages AS (SELECT id, role, created_at, group_id, tokens FROM ", kLineageMessages,
+      " WHERE group_id IS NOT NULL AND ", kLineageVisible,
+      " UNION ALL SELECT id, role, created_at, group_id, tokens FROM archived_messages "
+      "WHERE session_id = ?1 AND group_id IS NOT NULL), "
+      "groups AS (SELECT group_id, MIN(CASE WHEN role = 'user' THEN id END) AS prompt_id, "
+      "MIN(CASE WHEN role = 'user' THEN created_at END) AS prompt_at, "
+      "MAX(CASE WHEN role = 'assistant' THEN tokens END) AS assistant_tokens "
+      "FROM session_messages GROUP BY group_id) "
+      "SELECT group_id, IFNULL((SELECT IFNULL(content, (SELECT content FROM blobs WHERE hash = m.content_hash)) "
+      "FROM stored_messages m WHERE m.id = prompt_id), archived_content(prompt_id)), assistant_tokens "
+      "FROM groups WHERE prompt_id IS NOT NULL ORDER BY prompt_at DESC, prompt_id DESC LIMIT ?2");
+  ASSIGN_OR_RETURN(auto stmt, PrepareRead(sql));
+  RETURN_IF_ERROR(stmt->BindText(1, session_id));
+  RETURN_IF_ERROR(stmt->BindInt(2, limit));
+  std::vector<GroupSummary> groups;
+  absl::Status status;
+  RETURN_IF_ERROR(stmt->ForEachRow([&](Statement& row) {
+    if (!status.ok()) return;
+    auto prompt = InflateContent(row.ColumnTextView(1));
+    if (!prompt.ok()) {
+      status = prompt.status();
+      return;
+    }
+    GroupSummary group{row.ColumnText(0), *std::move(prompt), std::nullopt};
+    if (row.ColumnType(2) != SQLITE_NULL) group.assistant_tokens = row.ColumnInt(2);
+    groups.push_back(std::move(group));
+  }));
+  if (!status.ok()) return status;
+  return groups;
+}
 
-  return Execute(
-      "INSERT INTO usage (session_id, model, prompt_tokens, completion_tokens, total_tokens) VALUES (?, ?, ?, ?, ?);",
-      session_id, model, prompt_tokens, completion_tokens, prompt_tokens + completion_tokens);
+absl::StatusOr<std::vector<Database::Message>> Database::GetGroupMessages(const std::string& session_id,
+                                                                        const std::string& group_id) {
+  std::string sql = absl::StrCat(
+      "WITH RECURSIVE ", kLineage, " SELECT ", kLineageMessageColumns, " FROM ", kLineageMessages,
+      " WHERE group_id = ?2 AND ", kLineageVisible,
+      " UNION ALL SELECT id, session_id, role, archived_content(id), tool_call_id, status, created_at, group_id, "
+      "parsing_strategy, tokens FROM archived_messages WHERE session_id = ?1 AND group_id = ?2 "
+      "ORDER BY 7, 1");
+  ASSIGN_OR_RETURN(auto stmt, PrepareRead(sql));
+  RETURN_IF_ERROR(stmt->BindText(1, session_id));
+  RETURN_IF_ERROR(stmt->BindText(2, group_id));
+  std::vector<Message> messages;
+  absl::Status status;
+  std::string scratch;
+  RETURN_IF_ERROR(stmt->ForEachRow([&](Statement& row) {
+    MessageView m = ReadMessageView(row);
+    if (status.ok()) status = InflateView(&m, &scratch);
+    if (status.ok()) messages.push_back(m.ToMessage());
+  }));
+  if (!status.ok()) return status;
+  return messages;
+}
+
+absl::StatusOr<int> Database::GetLastMessageId() {
+  ASSIGN_OR_RETURN(auto stmt, PrepareRead("SELECT IFNULL(MAX(id), 0) FROM stored_messages"));
+  ASSIGN_OR_RETURN(bool found, stmt->Step());
+  return found ? stmt->ColumnInt(0) : 0;
+}
+
+absl::Status Database::RecordUsage(const std::string& session_id, const std::string& model, int prompt_tokens,
+                                   int completion_tokens, int cached_tokens) {
+  absl::MutexLock lock(&pending_mu_);
+  pending_writes_.usage.push_back(
+      {session_id, model, prompt_tokens, completion_tokens, cached_tokens, absl::ToUnixSeconds(absl::Now())});
+  pending_writes_.updates++;
+  pending_write_count_++;
+  return absl::OkStatus();
 }
 
 absl::StatusOr<Database::TotalUsage> Database::GetTotalUsage(const std::string& session_id) {
-  std::string sql = "SELECT SUM(prompt_tokens), SUM(completion_tokens), SUM(total_tokens) FROM usage";
+  std::string sql = absl::StrCat("SELECT SUM(prompt_tokens), SUM(completion_tokens), SUM(total_tokens), "
+                                 "SUM(cached_tokens) FROM ",
+                                 session_id.empty() ? "usage_daily" : kSessionUsage);
   if (!session_id.empty()) {
     sql += " WHERE session_id = ?";
   }
 
-  ASSIGN_OR_RETURN(auto stmt, Prepare(sql));
+  TotalUsage usage = {0, 0, 0};
+  RETURN_IF_ERROR(ReadWithPendingWrites(
+      [&]() -> absl::Status {
+        ASSIGN_OR_RETURN(auto stmt, PrepareRead(sql));
+
+        if (!session_id.empty()) {
+          RETURN_IF_ERROR(stmt->BindText(1, session_id));
+        }
+
+        auto row_or = stmt->Step();
+        if (!row_or.ok()) return row_or.status();
+
+        usage = {0, 0, 0};
+        if (*row_or) {
+          usage.prompt_tokens = stmt->ColumnInt(0);
+          usage.completion_tokens = stmt->ColumnInt(1);
+          usage.total_tokens = stmt->ColumnInt(2);
+          usage.cached_tokens = stmt->ColumnInt(3);
+        }
+        return absl::OkStatus();
+      },
+      [&](const PendingWrites& pending) {
+        for (const PendingUsage& u : pending.usage) {
+          if (!session_id.empty() && u.session_id != session_id) continue;
+          usage.prompt_tokens += u.prompt_tokens;
+          usage.completion_tokens += u.completion_tokens;
+          usage.total_tokens += u.prompt_tokens + u.completion_tokens;
+          usage.cached_tokens += u.cached_tokens;
+        }
+      }));
+  return usage;
+}
 
-  if (!session_id.empty()) {
-    RETURN_IF_ERROR(stmt->BindText(1, session_id));
-  }
+namespace {
+
+// Groups rows of `from` (usage_daily or kSessionUsage) matching `where` by model (and
+// day, if `by_day`) and prices each group with the longest matching model_prices
+// pattern. Pricing runs once per group, not per request.
+std::string UsageRollupQuery(absl::string_view from, absl::string_view where, bool by_day,
+                             absl::string_view order_by) {
+  return absl::StrCat(
+      "WITH g AS (SELECT model, ", by_day ? "day" : "'' AS day",
+      ", SUM(requests) AS requests, SUM(prompt_tokens) AS prompt_tokens, "
+      "SUM(completion_tokens) AS completion_tokens, SUM(total_tokens) AS total_tokens, "
+      "SUM(cached_tokens) AS cached_tokens FROM ",
+      from, " WHERE ", where, by_day ? " GROUP BY model, day) " : " GROUP BY model) ",
+      "SELECT model, day, requests, prompt_tokens, completion_tokens, total_tokens, cached_tokens, "
+      "(SELECT (g.prompt_tokens * p.prompt_per_million + g.completion_tokens * p.completion_per_million) / 1e6 "
+      "FROM model_prices p WHERE g.model GLOB p.model_pattern "
+      "ORDER BY length(p.model_pattern) DESC LIMIT 1) "
+      "FROM g ORDER BY ",
+      order_by);
+}
 
-  auto row_or = stmt->Step();
-  if (!row_or.ok()) return row_or.status();
+}  // namespace
+
+absl::StatusOr<std::vector<Database::UsageRollup>> Database::ReadUsageRollups(const std::string& sql,
+                                                                              const std::string& session_id,
+                                                                              const std::string& since) {
+  RETURN_IF_ERROR(FlushPendingWrites());
+  ASSIGN_OR_RETURN(auto stmt, PrepareRead(sql));
+  int index = 1;
+  if (!session_id.empty()) RETURN_IF_ERROR(stmt->BindText(index++, session_id));
+  if (!since.empty()) RETURN_IF_ERROR(stmt->BindText(index++, since));
+
+  std::vector<UsageRollup> rollups;
+  RETURN_IF_ERROR(stmt->ForEachRow([&](Statement& row) {
+    UsageRollup rollup;
+    rollup.model = row.ColumnText(0);
+    rollup.day = row.ColumnText(1);
+    rollup.requests = row.ColumnInt64(2);
+    rollup.prompt_tokens = row.ColumnInt64(3);
+    rollup.completion_tokens = row.ColumnInt64(4);
+    rollup.total_tokens = row.ColumnInt64(5);
+    rollup.cached_tokens = row.ColumnInt64(6);
+    if (row.ColumnType(7) != SQLITE_NULL) rollup.cost = row.ColumnDouble(7);
+    rollups.push_back(std::move(rollup));
+  }));
+  return rollups;
+}
 
-  TotalUsage usage = {0, 0, 0};
-  if (*row_or) {
-    usage.prompt_tokens = stmt->ColumnInt(0);
-    usage.completion_tokens = stmt->ColumnInt(1);
-    usage.total_tokens = stmt->ColumnInt(2);
+absl::StatusOr<std::vector<Database::UsageRollup>> Database::GetUsageByModel(const std::string& session_id) {
+  // A clone's totals include what it inherited; all sessions count each request once.
+  std::string sql = session_id.empty()
+                        ? UsageRollupQuery("usage_daily", "1", false, "total_tokens DESC, model")
+                        : UsageRollupQuery(kSessionUsage, "session_id = ?", false, "total_tokens DESC, model");
+  return ReadUsageRollups(sql, session_id, "");
+}
+
+absl::StatusOr<std::vector<Database::UsageRollup>> Database::GetUsageByDay(const std::string& session_id,
+                                                                           int days) {
+  if (days < 1) return absl::InvalidArgumentError("days must be at least 1");
+  std::string since = absl::FormatTime("%Y-%m-%d", absl::Now() - absl::Hours(24) * (days - 1), absl::UTCTimeZone());
+  std::string sql = UsageRollupQuery("usage_daily", session_id.empty() ? "day >= ?" : "session_id = ? AND day >= ?",
+                                     true, "day DESC, total_tokens DESC, model");
+  return ReadUsageRollups(sql, session_id, since);
+}
+
+absl::Status Database::SetModelPrice(const ModelPrice& price) {
+  if (price.model_pattern.empty()) return absl::InvalidArgumentError("Model pattern must not be empty");
+  if (price.prompt_per_million < 0 || price.completion_per_million < 0) {
+    return absl::InvalidArgumentError("Prices must not be negative");
   }
-  return usage;
+  return Execute(
+      "INSERT INTO model_prices (model_pattern, prompt_per_million, completion_per_million) VALUES (?, ?, ?) "
+      "ON CONFLICT(model_pattern) DO UPDATE SET prompt_per_million = excluded.prompt_per_million, "
+      "completion_per_million = excluded.completion_per_million",
+      price.model_pattern, price.prompt_per_million, price.completion_per_million);
+}
+
+absl::StatusOr<std::vector<Database::ModelPrice>> Database::GetModelPrices() {
+  ASSIGN_OR_RETURN(auto stmt,
+                   PrepareRead("SELECT model_pattern, prompt_per_million, completion_per_million FROM model_prices "
+                               "ORDER BY model_pattern"));
+  std::vector<ModelPrice> prices;
+  RETURN_IF_ERROR(stmt->ForEachRow([&](Statement& row) {
+    prices.push_back({row.ColumnText(0), row.ColumnDouble(1), row.ColumnDouble(2)});
+  }));
+  return prices;
 }
 
 absl::Status Database::RegisterTool(const Tool& tool) {
   std::string sql =
       "INSERT INTO tools (name, description, json_schema, is_enabled, call_count) VALUES (?, ?, ?, ?, ?) "
       "ON CONFLICT(name) DO UPDATE SET description=excluded.description, json_schema=excluded.json_schema, "
-      "is_enabled=excluded.is_enabled;";
+      "is_enabled=excluded.is_enabled "
+      "WHERE (description, json_schema, is_enabled) IS NOT (excluded.description, excluded.json_schema, "
+      "excluded.is_enabled);";
   return Execute(sql, tool.name, tool.description, tool.json_schema, tool.is_enabled ? 1 : 0, tool.call_count);
 }
 
 absl::StatusOr<std::vector<Database::Tool>> Database::GetEnabledTools() {
   std::string sql = "SELECT name, description, json_schema, is_enabled, call_count FROM tools WHERE is_enabled = 1";
-  ASSIGN_OR_RETURN(auto stmt, Prepare(sql));
-
   std::vector<Tool> tools;
-  while (true) {
-    auto row_or = stmt->Step();
-    if (!row_or.ok()) return row_or.status();
-    if (!*row_or) break;
-
-    Tool t;
-    t.name = stmt->ColumnText(0);
-    t.description = stmt->ColumnText(1);
-    t.json_schema = stmt->ColumnText(2);
-    t.is_enabled = stmt->ColumnInt(3) != 0;
-    t.call_count = stmt->ColumnInt(4);
-    tools.push_back(t);
-  }
+  RETURN_IF_ERROR(ReadWithPendingWrites(
+      [&]() -> absl::Status {
+        ASSIGN_OR_RETURN(auto stmt, PrepareRead(sql));
+
+        tools.clear();
+        while (true) {
+          auto row_or = stmt->Step();
+          if (!row_or.ok()) return row_or.status();
+          if (!*row_or) break;
+
+          Tool t;
+          t.name = stmt->ColumnText(0);
+          t.description = stmt->ColumnText(1);
+          t.json_schema = stmt->ColumnText(2);
+          t.is_enabled = stmt->ColumnInt(3) != 0;
+          t.call_count = stmt->ColumnInt(4);
+          tools.push_back(t);
+        }
+        return absl::OkStatus();
+      },
+      [&](const PendingWrites& pending) {
+        if (pending.tool_calls.empty()) return;
+        for (Tool& t : tools) {
+          auto it = pending.tool_calls.find(t.name);
+          if (it != pending.tool_calls.end()) t.call_count += it->second;
+        }
+      }));
   return tools;
 }
 
@@ -649,8 +2333,10 @@ absl::Status Database::RegisterSkill(const Skill& skill) {
 }
 
 absl::Status Database::UpdateSkill(const Skill& skill) {
-  return Execute("UPDATE skills SET description = ?, system_prompt_patch = ?, activation_count = ? WHERE name = ?;",
-                 skill.description, skill.system_prompt_patch, skill.activation_count, skill.name);
+  return Execute(
+      "UPDATE skills SET description = ?1, system_prompt_patch = ?2, activation_count = ?3 "
+      "WHERE name = ?4 AND (description, system_prompt_patch, activation_count) IS NOT (?1, ?2, ?3);",
+      skill.description, skill.system_prompt_patch, skill.activation_count, skill.name);
 }
 
 absl::Status Database::DeleteSkill(const std::string& name_or_id) {
@@ -664,37 +2350,330 @@ absl::Status Database::DeleteSkill(const std::string& name_or_id) {
 
 absl::StatusOr<std::vector<Database::Skill>> Database::GetSkills() {
   std::string sql = "SELECT id, name, description, system_prompt_patch, activation_count FROM skills";
-  ASSIGN_OR_RETURN(auto stmt, Prepare(sql));
-
   std::vector<Skill> skills;
-  while (true) {
-    auto row_or = stmt->Step();
-    if (!row_or.ok()) return row_or.status();
-    if (!*row_or) break;
-
-    Skill s;
-    s.id = stmt->ColumnInt(0);
-    s.name = stmt->ColumnText(1);
-    s.description = stmt->ColumnText(2);
-    s.system_prompt_patch = stmt->ColumnText(3);
-    s.activation_count = stmt->ColumnInt(4);
-    skills.push_back(s);
-  }
+  RETURN_IF_ERROR(ReadWithPendingWrites(
+      [&]() -> absl::Status {
+        ASSIGN_OR_RETURN(auto stmt, PrepareRead(sql));
+
+        skills.clear();
+        while (true) {
+          auto row_or = stmt->Step();
+          if (!row_or.ok()) return row_or.status();
+          if (!*row_or) break;
+
+          Skill s;
+          s.id = stmt->ColumnInt(0);
+          s.name = stmt->ColumnText(1);
+          s.description = stmt->ColumnText(2);
+          s.system_prompt_patch = stmt->ColumnText(3);
+          s.activation_count = stmt->ColumnInt(4);
+          skills.push_back(s);
+        }
+        return absl::OkStatus();
+      },
+      [&](const PendingWrites& pending) {
+        // Matched as WritePendingWrites() matches them: by name, or by id.
+        for (const auto& [name_or_id, count] : pending.skill_activations) {
+          int id = 0;
+          bool is_id = absl::SimpleAtoi(name_or_id, &id);
+          for (Skill& s : skills) {
+            if (s.name == name_or_id || (is_id && s.id == id)) s.activation_count += count;
+          }
+        }
+      }));
   return skills;
 }
 
-absl::Status Database::IncrementSkillActivationCount(const std::string& name_or_id) {
-  std::string sql = "UPDATE skills SET activation_count = activation_count + 1 WHERE name = ? OR id = ?;";
-  int id = 0;
-  if (absl::SimpleAtoi(name_or_id, &id)) {
-    return Execute(sql, name_or_id, id);
+absl::Status Database::SetToolEnabled(const std::string& name, bool enabled) {
+  ASSIGN_OR_RETURN(auto stmt, PrepareRead("SELECT is_enabled FROM tools WHERE name = ?"));
+  RETURN_IF_ERROR(stmt->BindAll(name));
+  ASSIGN_OR_RETURN(bool found, stmt->Step());
+  if (!found) return absl::NotFoundError(absl::StrCat("Tool not found: ", name));
+  if ((stmt->ColumnInt(0) != 0) == enabled) return absl::OkStatus();
+  stmt.reset();
+  return Execute("UPDATE tools SET is_enabled = ? WHERE name = ?;", enabled ? 1 : 0, name);
+}
+
+absl::StatusOr<std::shared_ptr<const Database::ToolManifest>> Database::GetToolManifest() {
+  // Read before the tables so that a change made meanwhile marks the result stale.
+  const ReadSnapshot* snapshot = ActiveReadSnapshot();
+  int64_t generation = snapshot != nullptr ? snapshot->manifest_generation_ : manifest_generation_.load();
+  {
+    absl::MutexLock lock(&manifest_mu_);
+    if (manifest_ && manifest_->generation == generation) return manifest_;
   }
-  return Execute(sql, name_or_id, nullptr);
+  auto manifest = std::make_shared<ToolManifest>();
+  ASSIGN_OR_RETURN(manifest->tools, GetEnabledTools());
+  for (const Tool& t : manifest->tools) manifest->tool_names.insert(t.name);
+  ASSIGN_OR_RETURN(manifest->skills, GetSkills());
+  manifest->generation = generation;
+  absl::MutexLock lock(&manifest_mu_);
+  if (!manifest_ || manifest_->generation < generation) manifest_ = manifest;
+  return manifest;
+}
+
+absl::Status Database::IncrementSkillActivationCount(const std::string& name_or_id) {
+  absl::MutexLock lock(&pending_mu_);
+  pending_writes_.skill_activations[name_or_id]++;
+  pending_writes_.updates++;
+  pending_write_count_++;
+  return absl::OkStatus();
 }
 
 absl::Status Database::IncrementToolCallCount(const std::string& name) {
-  std::string sql = "UPDATE tools SET call_count = call_count + 1 WHERE name = ?;";
-  return Execute(sql, name);
+  absl::MutexLock lock(&pending_mu_);
+  pending_writes_.tool_calls[name]++;
+  pending_writes_.updates++;
+  pending_write_count_++;
+  return absl::OkStatus();
+}
+
+absl::Status Database::FlushPendingWrites() { return WritePendingWrites(/*if_idle=*/false); }
+
+bool Database::ReadsQueuedWrites(const std::string& sql) {
+  ScopedWriter writer(this);
+  sqlite3* db;
+  {
+    absl::MutexLock lock(&mu_);
+    db = writer_.db.get();
+  }
+  // The authorizer sees every table the statement reads, through views and triggers
+  // included, while it is prepared.
+  bool reads = false;
+  sqlite3_set_authorizer(
+      db,
+      [](void* reads, int action, const char* table, const char*, const char* database, const char*) {
+        if (action == SQLITE_READ && table != nullptr && database != nullptr && std::strcmp(database, "main") == 0) {
+          for (const char* queued : {"tools", "skills", "usage", "usage_daily"}) {
+            if (std::strcmp(table, queued) == 0) *static_cast<bool*>(reads) = true;
+          }
+        }
+        return SQLITE_OK;
+      },
+      &reads);
+  sqlite3_stmt* raw_stmt = nullptr;
+  // A statement that does not prepare fails in the caller's own prepare.
+  (void)sqlite3_prepare_v2(db, sql.c_str(), -1, &raw_stmt, nullptr);
+  sqlite3_finalize(raw_stmt);
+  sqlite3_set_authorizer(db, nullptr, nullptr);
+  return reads;
+}
+
+absl::Status Database::WritePendingWrites(bool if_idle) {
+  if (pending_write_count_.load() == 0) return absl::OkStatus();
+  // Held from taking the queue until it is committed, so that a flush waits for one
+  // already under way and reads after it see its writes.
+  ScopedWriter writer(this);
+  if (if_idle) {
+    absl::MutexLock lock(&mu_);
+    if (sqlite3_get_autocommit(writer_.db.get()) == 0) return absl::OkStatus();
+  }
+  PendingWrites pending;
+  {
+    absl::MutexLock lock(&pending_mu_);
+    std::swap(pending, pending_writes_);
+  }
+  if (pending.updates == 0) return absl::OkStatus();
+
+  writing_counters_ = true;
+  absl::Status status = [&]() -> absl::Status {
+    ASSIGN_OR_RETURN(auto batch, BeginWriteBatch());
+    for (const auto& [name, count] : pending.tool_calls) {
+      RETURN_IF_ERROR(Execute("UPDATE tools SET call_count = call_count + ? WHERE name = ?;", count, name));
+    }
+    for (const auto& [name_or_id, count] : pending.skill_activations) {
+      std::string sql = "UPDATE skills SET activation_count = activation_count + ? WHERE name = ? OR id = ?;";
+      int id = 0;
+      if (absl::SimpleAtoi(name_or_id, &id)) {
+        RETURN_IF_ERROR(Execute(sql, count, name_or_id, id));
+      } else {
+        RETURN_IF_ERROR(Execute(sql, count, name_or_id, nullptr));
+      }
+    }
+    for (const PendingUsage& u : pending.usage) {
+      RETURN_IF_ERROR(Execute("INSERT OR IGNORE INTO sessions (id) VALUES (?)", u.session_id));
+      RETURN_IF_ERROR(Execute(
+          "INSERT INTO usage (session_id, model, prompt_tokens, completion_tokens, total_tokens, cached_tokens, "
+          "created_at) VALUES (?, ?, ?, ?, ?, ?, datetime(?, 'unixepoch'));",
+          u.session_id, u.model, u.prompt_tokens, u.completion_tokens, u.prompt_tokens + u.completion_tokens,
+          u.cached_tokens, u.created_at));
+    }
+    return batch->Commit();
+  }();
+  writing_counters_ = false;
+  if (!status.ok()) {
+    // Queued again, ahead of anything queued meanwhile, for the next flush.
+    absl::MutexLock lock(&pending_mu_);
+    for (const auto& [name, count] : pending.tool_calls) pending_writes_.tool_calls[name] += count;
+    for (const auto& [name, count] : pending.skill_activations) pending_writes_.skill_activations[name] += count;
+    pending.usage.insert(pending.usage.end(), pending_writes_.usage.begin(), pending_writes_.usage.end());
+    pending_writes_.usage = std::move(pending.usage);
+    pending_writes_.updates += pending.updates;
+    return status;
+  }
+  absl::MutexLock lock(&pending_mu_);
+  pending_write_count_ -= pending.updates;
+  flushes_++;
+  return absl::OkStatus();
+}
+
+absl::Status Database::ReadWithPendingWrites(absl::FunctionRef<absl::Status()> read,
+                                             absl::FunctionRef<void(const PendingWrites&)> merge) {
+  int64_t flushes;
+  {
+    absl::MutexLock lock(&pending_mu_);
+    flushes = flushes_;
+  }
+  RETURN_IF_ERROR(read());
+  {
+    absl::MutexLock lock(&pending_mu_);
+    // Every update not in the queue has been committed before `read` began.
+    if (flushes_ == flushes && pending_write_count_.load() == pending_writes_.updates) {
+      merge(pending_writes_);
+      return absl::OkStatus();
+    }
+  }
+  RETURN_IF_ERROR(FlushPendingWrites());
+  return read();
+}
+
+void Database::StartWriteBehind() {
+  StopWriteBehind();
+  stop_write_behind_ = std::make_unique<absl::Notification>();
+  write_behind_ = std::thread([this, stop = stop_write_behind_.get(), interval = tuning_.maintenance_interval] {
+    absl::Time next_maintenance = absl::Now() + interval;
+    while (!stop->WaitForNotificationWithTimeout(kWriteBehindInterval)) {
+      absl::Status status = WritePendingWrites(/*if_idle=*/true);
+      if (!status.ok()) LOG(WARNING) << "Writing queued usage and counters failed: " << status;
+      if (interval <= absl::ZeroDuration() || absl::Now() < next_maintenance) continue;
+      // As for the queue, never inside a transaction some caller has open.
+      ScopedWriter writer(this);
+      bool idle;
+      {
+        absl::MutexLock lock(&mu_);
+        idle = sqlite3_get_autocommit(writer_.db.get()) != 0;
+      }
+      if (!idle) continue;
+      status = RunMaintenance();
+      if (!status.ok()) LOG(WARNING) << "Database maintenance failed: " << status;
+      next_maintenance = absl::Now() + interval;
+    }
+  });
+}
+
+void Database::StopWriteBehind() {
+  if (write_behind_.joinable()) {
+    stop_write_behind_->Notify();
+    write_behind_.join();
+  }
+  absl::Status status = FlushPendingWrites();
+  if (!status.ok()) LOG(WARNING) << "Writing queued usage and counters failed: " << status;
+}
+
+void Database::ApplyTuning(sqlite3* db) {
+  std::string pragmas;
+  if (tuning_.mmap_bytes > 0) absl::StrAppend(&pragmas, "PRAGMA mmap_size = ", tuning_.mmap_bytes, ";");
+  // A negative cache_size is in KiB.
+  if (tuning_.cache_bytes > 0) absl::StrAppend(&pragmas, "PRAGMA cache_size = -", tuning_.cache_bytes / 1024, ";");
+  if (tuning_.temp_store_memory) pragmas += "PRAGMA temp_store = MEMORY;";
+  if (pragmas.empty()) return;
+  absl::Status status = ExecSchema(db, pragmas.c_str());
+  if (!status.ok()) LOG(WARNING) << "Tuning the connection failed: " << status;
+}
+
+int Database::OnWalCommit(void* self, sqlite3* db, const char* db_name, int frames) {
+  auto* database = static_cast<Database*>(self);
+  bool main = std::strcmp(db_name, "main") == 0;
+  if (main) {
+    // Fewer frames than last time: the WAL was restarted from the beginning.
+    if (frames < database->wal_frames_.load()) database->wal_checkpointed_frames_ = 0;
+    database->wal_frames_ = frames;
+  }
+  if (frames < kAutoCheckpointFrames) return SQLITE_OK;
+  int log_frames = 0;
+  int checkpointed = 0;
+  if (sqlite3_wal_checkpoint_v2(db, db_name, SQLITE_CHECKPOINT_PASSIVE, &log_frames, &checkpointed) == SQLITE_OK &&
+      main) {
+    database->wal_checkpointed_frames_ = checkpointed;
+    database->checkpoints_++;
+  }
+  return SQLITE_OK;
+}
+
+absl::Status Database::RunMaintenance() {
+  ScopedWriter writer(this);
+  RETURN_IF_ERROR(Execute(absl::StrCat("PRAGMA analysis_limit = ", kOptimizeAnalysisLimit)));
+  RETURN_IF_ERROR(Execute("PRAGMA optimize"));
+  RETURN_IF_ERROR(RebuildStaleMessageIndex());
+  if (tuning_.incremental_vacuum_pages <= 0) return absl::OkStatus();
+  {
+    ASSIGN_OR_RETURN(auto stmt, Prepare("PRAGMA auto_vacuum"));
+    ASSIGN_OR_RETURN(bool has_row, stmt->Step());
+    // 2: INCREMENTAL.
+    if (!has_row || stmt->ColumnInt(0) != 2) return absl::OkStatus();
+  }
+  // Frees one page per step.
+  ASSIGN_OR_RETURN(auto stmt, Prepare(absl::StrCat("PRAGMA incremental_vacuum(", tuning_.incremental_vacuum_pages, ")")));
+  while (true) {
+    ASSIGN_OR_RETURN(bool has_row, stmt->Step());
+    if (!has_row) break;
+  }
+  return absl::OkStatus();
+}
+
+absl::StatusOr<Database::StorageStats> Database::GetStorageStats() {
+  StorageStats stats;
+  std::vector<sqlite3*> connections;
+  std::string archive_path;
+  {
+    absl::MutexLock lock(&mu_);
+    if (writer_.db == nullptr) return absl::FailedPreconditionError("Database is not open");
+    connections.push_back(writer_.db.get());
+    for (const auto& reader : readers_) {
+      if (reader->db != nullptr) connections.push_back(reader->db.get());
+    }
+    archive_path = archive_path_;
+  }
+  for (sqlite3* db : connections) {
+    int current = 0;
+    int highwater = 0;
+    if (sqlite3_db_status(db, SQLITE_DBSTATUS_CACHE_HIT, &current, &highwater, 0) == SQLITE_OK) {
+      stats.cache_hits += current;
+    }
+    if (sqlite3_db_status(db, SQLITE_DBSTATUS_CACHE_MISS, &current, &highwater, 0) == SQLITE_OK) {
+      stats.cache_misses += current;
+    }
+    if (sqlite3_db_status(db, SQLITE_DBSTATUS_CACHE_USED, &current, &highwater, 0) == SQLITE_OK) {
+      stats.cache_bytes_used += current;
+    }
+  }
+  stats.connections = static_cast<int>(connections.size());
+
+  ASSIGN_OR_RETURN(auto stmt, PrepareRead("SELECT * FROM pragma_page_size, pragma_page_count, "
+                                          "pragma_freelist_count, pragma_journal_mode"));
+  ASSIGN_OR_RETURN(bool has_row, stmt->Step());
+  if (has_row) {
+    stats.page_size = stmt->ColumnInt64(0);
+    stats.page_count = stmt->ColumnInt64(1);
+    stats.freelist_pages = stmt->ColumnInt64(2);
+    stats.journal_mode = stmt->ColumnText(3);
+  }
+
+  const char* filename = sqlite3_db_filename(connections[0], "main");
+  auto file_size = [](const std::string& path) -> int64_t {
+    std::error_code ec;
+    auto size = std::filesystem::file_size(path, ec);
+    return ec ? 0 : static_cast<int64_t>(size);
+  };
+  if (filename != nullptr && filename[0] != '\0') {
+    stats.db_file_bytes = file_size(filename);
+    stats.wal_file_bytes = file_size(absl::StrCat(filename, "-wal"));
+  }
+  if (!archive_path.empty()) stats.archive_file_bytes = file_size(archive_path);
+  stats.wal_frames = wal_frames_.load();
+  stats.wal_checkpointed_frames = wal_checkpointed_frames_.load();
+  stats.checkpoints = checkpoints_.load();
+  return stats;
 }
 
 absl::Status Database::SetActiveSkills(const std::string& session_id, const std::vector<std::string>& skills) {
@@ -706,7 +2685,7 @@ absl::Status Database::SetActiveSkills(const std::string& session_id, const std:
 }
 
 absl::StatusOr<std::vector<std::string>> Database::GetActiveSkills(const std::string& session_id) {
-  ASSIGN_OR_RETURN(auto stmt, Prepare("SELECT active_skills FROM sessions WHERE id = ?;"));
+  ASSIGN_OR_RETURN(auto stmt, PrepareRead("SELECT active_skills FROM sessions WHERE id = ?;"));
   RETURN_IF_ERROR(stmt->BindText(1, session_id));
   auto row_or = stmt->Step();
   if (!row_or.ok()) return row_or.status();
@@ -723,25 +2702,84 @@ absl::StatusOr<std::vector<std::string>> Database::GetActiveSkills(const std::st
 
 absl::Status Database::SetContextWindow(const std::string& session_id, int size) {
   RETURN_IF_ERROR(Execute("INSERT OR IGNORE INTO sessions (id) VALUES (?)", session_id));
-  return Execute("UPDATE sessions SET context_size = ? WHERE id = ?;", size, session_id);
+  return Execute("UPDATE sessions SET context_size = ?, context_budget = 0 WHERE id = ?;", size, session_id);
+}
+
+absl::Status Database::SetContextBudget(const std::string& session_id, int tokens) {
+  if (tokens < 0) return absl::InvalidArgumentError("Context budget must not be negative");
+  RETURN_IF_ERROR(Execute("INSERT OR IGNORE INTO sessions (id) VALUES (?)", session_id));
+  return Execute("UPDATE sessions SET context_budget = ? WHERE id = ?;", tokens, session_id);
 }
 
 absl::StatusOr<Database::ContextSettings> Database::GetContextSettings(const std::string& session_id) {
-  std::string sql = "SELECT context_size FROM sessions WHERE id = ?";
-  ASSIGN_OR_RETURN(auto stmt, Prepare(sql));
+  std::string sql = "SELECT context_size, IFNULL(context_budget, 0) FROM sessions WHERE id = ?";
+  ASSIGN_OR_RETURN(auto stmt, PrepareRead(sql));
 
   RETURN_IF_ERROR(stmt->BindText(1, session_id));
 
   auto row_or = stmt->Step();
   if (!row_or.ok()) return row_or.status();
 
-  ContextSettings settings = {5};  // Default
+  ContextSettings settings = {kDefaultContextSize};
   if (*row_or) {
     settings.size = stmt->ColumnInt(0);
+    settings.budget = stmt->ColumnInt(1);
   }
   return settings;
 }
 
+absl::StatusOr<Database::SessionPromptState> Database::GetSessionPromptState(const std::string& session_id) {
+  std::string sql =
+      "SELECT s.id IS NOT NULL, s.context_size, IFNULL(s.context_budget, 0), st.state_blob, s.scratchpad "
+      "FROM (SELECT ? AS id) AS q LEFT JOIN sessions s ON s.id = q.id "
+      "LEFT JOIN session_state st ON st.session_id = q.id";
+  ASSIGN_OR_RETURN(auto stmt, PrepareRead(sql));
+  RETURN_IF_ERROR(stmt->BindText(1, session_id));
+  ASSIGN_OR_RETURN(bool has_row, stmt->Step());
+
+  SessionPromptState result = {{kDefaultContextSize}};
+  if (!has_row) return result;
+  if (stmt->ColumnInt(0) != 0) {
+    result.settings.size = stmt->ColumnInt(1);
+    result.settings.budget = stmt->ColumnInt(2);
+  }
+  result.state = stmt->ColumnText(3);
+  result.scratchpad = stmt->ColumnText(4);
+  return result;
+}
+
+absl::StatusOr<int> Database::GetBudgetWindowSize(const std::string& session_id, int budget,
+                                                  const TokenTiers& tiers) {
+  // Groups are ranked the way the windowed history query picks them, by their newest
+  // message, and cost their tokens with tool results at the inactive tier. Only the
+  // newest group is costed again message by message, numbering its tool results from
+  // the newest to find their tier; windowing every group that way took 3x as long.
+  const std::string sql = absl::StrCat(
+      "WITH RECURSIVE ", kLineage,
+      ", ranked AS (SELECT group_id, ROW_NUMBER() OVER (ORDER BY MAX(created_at) DESC, MAX(id) DESC) AS rank, "
+      "SUM(CASE WHEN role != 'tool' THEN IFNULL(tokens, 0) ELSE MIN(IFNULL(tokens, 0), ?4) END) AS cost "
+      "FROM ", kLineageMessages, " WHERE group_id IS NOT NULL AND ", kLineageVisible, " AND ", kLineageStatus,
+      " != 'dropped' GROUP BY group_id), "
+      "active AS (SELECT SUM(CASE WHEN role != 'tool' THEN tokens WHEN recency <= ?5 THEN MIN(tokens, ?2) "
+      "ELSE MIN(tokens, ?3) END) AS cost FROM (SELECT role, IFNULL(tokens, 0) AS tokens, "
+      "ROW_NUMBER() OVER (PARTITION BY role = 'tool' ORDER BY created_at DESC, id DESC) AS recency "
+      "FROM ", kLineageMessages, " WHERE group_id = (SELECT group_id FROM ranked WHERE rank = 1) AND ",
+      kLineageVisible, " AND ", kLineageStatus, " != 'dropped')), "
+      "running AS (SELECT rank, SUM(CASE WHEN rank = 1 THEN (SELECT cost FROM active) ELSE cost END) "
+      "OVER (ORDER BY rank ROWS UNBOUNDED PRECEDING) AS total FROM ranked) "
+      "SELECT COUNT(*) FROM running WHERE rank = 1 OR total <= ?6");
+  ASSIGN_OR_RETURN(auto stmt, PrepareRead(sql));
+  RETURN_IF_ERROR(stmt->BindText(1, session_id));
+  RETURN_IF_ERROR(stmt->BindInt(2, tiers.active_full_fidelity));
+  RETURN_IF_ERROR(stmt->BindInt(3, tiers.active_degraded));
+  RETURN_IF_ERROR(stmt->BindInt(4, tiers.inactive));
+  RETURN_IF_ERROR(stmt->BindInt(5, tiers.full_fidelity_count));
+  RETURN_IF_ERROR(stmt->BindInt(6, budget));
+  ASSIGN_OR_RETURN(bool has_row, stmt->Step());
+  // A window of 0 groups would be the whole history.
+  return has_row ? std::max(stmt->ColumnInt(0), 1) : 1;
+}
+
 absl::Status Database::SetSessionState(const std::string& session_id, const std::string& state_blob) {
   // Ensure session exists
   RETURN_IF_ERROR(Execute("INSERT OR IGNORE INTO sessions (id) VALUES (?)", session_id));
@@ -761,7 +2799,7 @@ absl::Status Database::SetSessionState(const std::string& session_id, const std:
  */
 absl::StatusOr<std::string> Database::GetSessionState(const std::string& session_id) {
   std::string sql = "SELECT state_blob FROM session_state WHERE session_id = ?";
-  ASSIGN_OR_RETURN(auto stmt, Prepare(sql));
+  ASSIGN_OR_RETURN(auto stmt, PrepareRead(sql));
 
   RETURN_IF_ERROR(stmt->BindText(1, session_id));
 
@@ -775,17 +2813,107 @@ absl::StatusOr<std::string> Database::GetSessionState(const std::string& session
 }
 
 absl::Status Database::DeleteSession(const std::string& session_id) {
-  RETURN_IF_ERROR(Execute("DELETE FROM messages WHERE session_id = ?;", session_id));
+  RETURN_IF_ERROR(FlushPendingWrites());
+  ASSIGN_OR_RETURN(auto batch, BeginWriteBatch());
+  bool has_forks;
+  {
+    ASSIGN_OR_RETURN(auto stmt, Prepare("SELECT 1 FROM sessions WHERE parent_id = ? LIMIT 1;"));
+    RETURN_IF_ERROR(stmt->BindText(1, session_id));
+    ASSIGN_OR_RETURN(has_forks, stmt->Step());
+  }
+  if (has_forks) {
+    // Forks still inherit from the session, so it stays, renamed and hidden, with the
+    // messages they see, until its last fork is deleted.
+    std::string tombstone;
+    {
+      ASSIGN_OR_RETURN(auto stmt, Prepare("SELECT ? || '@deleted-' || lower(hex(randomblob(8)));"));
+      RETURN_IF_ERROR(stmt->BindText(1, session_id));
+      ASSIGN_OR_RETURN(bool row, stmt->Step());
+      if (!row) return absl::InternalError("Failed to name deleted session");
+      tombstone = stmt->ColumnText(0);
+    }
+    for (const char* table : {"stored_messages", "archived_messages"}) {
+      RETURN_IF_ERROR(Execute(absl::StrCat("DELETE FROM ", table, " WHERE session_id = ?1 AND id > "
+                                           "(SELECT MAX(branch_message_id) FROM sessions WHERE parent_id = ?1);"),
+                              session_id));
+      RETURN_IF_ERROR(
+          Execute(absl::StrCat("UPDATE ", table, " SET session_id = ?2 WHERE session_id = ?1;"), session_id, tombstone));
+    }
+    RETURN_IF_ERROR(Execute("UPDATE sessions SET parent_id = ?2 WHERE parent_id = ?1;", session_id, tombstone));
+    // Forks read the messages as they are, never through the session's overrides.
+    RETURN_IF_ERROR(Execute("DELETE FROM message_overrides WHERE override_session_id = ?;", session_id));
+    RETURN_IF_ERROR(Execute(
+        "UPDATE sessions SET id = ?2, deleted_at = CURRENT_TIMESTAMP, scratchpad = NULL, active_skills = NULL "
+        "WHERE id = ?1;",
+        session_id, tombstone));
+  } else {
+    std::optional<std::string> parent_id;
+    {
+      ASSIGN_OR_RETURN(auto stmt, Prepare("SELECT parent_id FROM sessions WHERE id = ? AND parent_id IS NOT NULL;"));
+      RETURN_IF_ERROR(stmt->BindText(1, session_id));
+      ASSIGN_OR_RETURN(bool row, stmt->Step());
+      if (row) parent_id = stmt->ColumnText(0);
+    }
+    RETURN_IF_ERROR(Execute("DELETE FROM stored_messages WHERE session_id = ?;", session_id));
+    // The archived content goes with the next ArchiveGroups() pass.
+    RETURN_IF_ERROR(Execute("DELETE FROM archived_messages WHERE session_id = ?;", session_id));
+    RETURN_IF_ERROR(Execute("DELETE FROM message_overrides WHERE override_session_id = ?;", session_id));
+    RETURN_IF_ERROR(Execute("DELETE FROM sessions WHERE id = ?;", session_id));
+    // Deleted ancestors go with their last fork.
+    RETURN_IF_ERROR(PruneDeletedSessions(std::move(parent_id)));
+  }
   RETURN_IF_ERROR(Execute("DELETE FROM usage WHERE session_id = ?;", session_id));
-  RETURN_IF_ERROR(Execute("DELETE FROM sessions WHERE id = ?;", session_id));
   RETURN_IF_ERROR(Execute("DELETE FROM session_state WHERE session_id = ?;", session_id));
+  return batch->Commit();
+}
+
+absl::Status Database::PruneDeletedSessions(std::optional<std::string> session_id) {
+  while (session_id) {
+    ASSIGN_OR_RETURN(auto stmt, Prepare("SELECT parent_id FROM sessions WHERE id = ?1 AND deleted_at IS NOT NULL "
+                                        "AND NOT EXISTS (SELECT 1 FROM sessions WHERE parent_id = ?1);"));
+    RETURN_IF_ERROR(stmt->BindText(1, *session_id));
+    ASSIGN_OR_RETURN(bool row, stmt->Step());
+    // The first session kept may have overrides that no fork needs any more.
+    if (!row) return ReleaseForkedMessages(*session_id);
+    std::string tombstone = *session_id;
+    session_id.reset();
+    if (stmt->ColumnType(0) != SQLITE_NULL) session_id = stmt->ColumnText(0);
+    RETURN_IF_ERROR(Execute("DELETE FROM stored_messages WHERE session_id = ?;", tombstone));
+    RETURN_IF_ERROR(Execute("DELETE FROM archived_messages WHERE session_id = ?;", tombstone));
+    RETURN_IF_ERROR(Execute("DELETE FROM sessions WHERE id = ?;", tombstone));
+  }
   return absl::OkStatus();
 }
 
+absl::Status Database::ReleaseForkedMessages(const std::string& session_id) {
+  // Overrides of the session's own messages that no fork sees any more are applied to
+  // the messages themselves; those of inherited messages stay.
+  RETURN_IF_ERROR(Execute(absl::StrCat(
+      "UPDATE stored_messages SET status = (SELECT override_status FROM message_overrides "
+      "WHERE override_session_id = ?1 AND override_message_id = stored_messages.id) "
+      "WHERE session_id = ?1 AND id > ", kLastForkedId, " AND id IN (SELECT override_message_id FROM message_overrides "
+      "WHERE override_session_id = ?1 AND override_status IS NOT NULL);"),
+      session_id));
+  for (const char* table : {"stored_messages", "archived_messages"}) {
+    RETURN_IF_ERROR(Execute(absl::StrCat("DELETE FROM ", table, " WHERE session_id = ?1 AND id > ", kLastForkedId,
+                                         " AND id IN (SELECT override_message_id FROM message_overrides "
+                                         "WHERE override_session_id = ?1 AND override_status IS NULL);"),
+                            session_id));
+  }
+  return Execute(absl::StrCat("DELETE FROM message_overrides WHERE override_session_id = ?1 AND override_message_id > ",
+                              kLastForkedId,
+                              " AND NOT EXISTS (SELECT 1 FROM stored_messages WHERE id = override_message_id "
+                              "AND session_id != ?1);"),
+                 session_id);
+}
+
 absl::Status Database::CloneSession(const std::string& source_id, const std::string& target_id) {
+  RETURN_IF_ERROR(FlushPendingWrites());
+  ASSIGN_OR_RETURN(auto batch, BeginWriteBatch());
+
   // Check source exists
   {
-    auto stmt_or = Prepare("SELECT 1 FROM sessions WHERE id = ?");
+    auto stmt_or = Prepare("SELECT 1 FROM sessions WHERE id = ? AND deleted_at IS NULL");
     if (!stmt_or.ok()) return stmt_or.status();
     RETURN_IF_ERROR((*stmt_or)->BindText(1, source_id));
     auto res_or = (*stmt_or)->Step();
@@ -807,64 +2935,291 @@ absl::Status Database::CloneSession(const std::string& source_id, const std::str
     }
   }
 
-  RETURN_IF_ERROR(Execute("BEGIN TRANSACTION;"));
-
-  auto rollback_on_failure = [&](absl::Status s) {
-    if (!s.ok()) {
-      (void)Execute("ROLLBACK;");
-    }
-    return s;
-  };
-
+  // Messages are not copied: the target inherits every message there is now from the
+  // source's lineage (see kLineage), and the source's overrides of them.
   absl::Status status = Execute(
-      "INSERT INTO sessions (id, context_size, scratchpad, active_skills) "
-      "SELECT ?, context_size, scratchpad, active_skills FROM sessions "
-      "WHERE id = ?;",
+      "INSERT INTO sessions (id, context_size, context_budget, scratchpad, active_skills, parent_id, "
+      "branch_message_id) "
+      "SELECT ?, context_size, context_budget, scratchpad, active_skills, id, "
+      "(SELECT IFNULL(MAX(id), 0) FROM stored_messages) FROM sessions WHERE id = ?;",
       {target_id, source_id});
-  if (!status.ok()) return rollback_on_failure(status);
+  if (!status.ok()) return status;
 
   status = Execute(
-      "INSERT INTO messages (session_id, role, content, tool_call_id, status, "
-      "created_at, group_id, parsing_strategy, tokens) "
-      "SELECT ?, role, content, tool_call_id, status, created_at, group_id, "
-      "parsing_strategy, tokens FROM messages WHERE session_id = ?;",
+      "INSERT INTO message_overrides (override_session_id, override_message_id, override_status) "
+      "SELECT ?, override_message_id, override_status FROM message_overrides WHERE override_session_id = ?;",
       {target_id, source_id});
-  if (!status.ok()) return rollback_on_failure(status);
+  if (!status.ok()) return status;
 
+  // One row per model carries the source's totals over. It is marked inherited, so
+  // that the requests are not counted again in usage_daily.
   status = Execute(
       "INSERT INTO usage (session_id, model, prompt_tokens, "
-      "completion_tokens, total_tokens, created_at) "
-      "SELECT ?, model, prompt_tokens, completion_tokens, total_tokens, "
-      "created_at FROM usage WHERE session_id = ?;",
+      "completion_tokens, total_tokens, cached_tokens, created_at, inherited_requests) "
+      "SELECT ?, model, SUM(prompt_tokens), SUM(completion_tokens), SUM(total_tokens), SUM(IFNULL(cached_tokens, 0)), "
+      "MAX(created_at), SUM(MAX(inherited_requests, 1)) FROM usage WHERE session_id = ? GROUP BY model;",
       {target_id, source_id});
-  if (!status.ok()) return rollback_on_failure(status);
+  if (!status.ok()) return status;
 
   status = Execute(
       "INSERT INTO session_state (session_id, state_blob) "
       "SELECT ?, state_blob FROM session_state WHERE session_id = ?;",
       {target_id, source_id});
-  if (!status.ok()) return rollback_on_failure(status);
+  if (!status.ok()) return status;
+
+  return batch->Commit();
+}
+
+absl::Status Database::AttachArchive(Connection* conn, bool create) {
+  std::string path;
+  sqlite3* db;
+  {
+    absl::MutexLock lock(&mu_);
+    path = archive_path_;
+    db = conn->db.get();
+  }
+  if (path.empty()) return absl::FailedPreconditionError("Archiving needs a file-backed database");
+  if (!conn->archive_attached) {
+    if (!create && !archive_exists_.load()) return absl::OkStatus();
+    char* sql = sqlite3_mprintf("ATTACH DATABASE %Q AS archive;", path.c_str());
+    int rc = sqlite3_exec(db, sql, nullptr, nullptr, nullptr);
+    sqlite3_free(sql);
+    if (rc != SQLITE_OK) return absl::InternalError(absl::StrCat("Failed to attach archive: ", sqlite3_errmsg(db)));
+    conn->archive_attached = true;
+  }
+  if (!create) return absl::OkStatus();
 
-  return Execute("COMMIT;");
+  // The archive keeps whole rows, so that it can be read on its own. Content is as
+  // stored in the main database: compressed against its dictionaries, but not
+  // shared through `blobs`.
+  const char* schema = R"(
+    PRAGMA archive.journal_mode=WAL;
+    CREATE TABLE IF NOT EXISTS archive.messages (
+        id INTEGER PRIMARY KEY,
+        session_id TEXT,
+        role TEXT,
+        content,
+        tool_call_id TEXT,
+        status TEXT,
+        created_at DATETIME,
+        group_id TEXT,
+        parsing_strategy TEXT,
+        tokens INTEGER
+    );
+  )";
+  if (sqlite3_exec(db, schema, nullptr, nullptr, nullptr) != SQLITE_OK) {
+    return absl::InternalError(absl::StrCat("Archive schema error: ", sqlite3_errmsg(db)));
+  }
+  archive_exists_ = true;
+  return absl::OkStatus();
+}
+
+absl::StatusOr<Database::ArchiveStats> Database::ArchiveGroups(const ArchivePolicy& policy) {
+  {
+    ScopedWriter writer(this);
+    RETURN_IF_ERROR(AttachArchive(&writer_, /*create=*/true));
+  }
+  // Groups are ranked within their session the way the history window picks them:
+  // by their newest message that is not dropped. A group outside the window is
+  // archived once it is old enough or far enough down. The tiers of a token budget
+  // are the orchestrator's, so a budgeted window is bounded from below: tool results
+  // count for nothing, and a group is out once the messages of the groups up to it
+  // exceed the budget.
+  const std::string sql = absl::Substitute(
+      "WITH ranked AS ("
+      "SELECT session_id, group_id, MAX(created_at) AS last_at, COUNT(*) AS message_count, "
+      "ROW_NUMBER() OVER w AS rank, "
+      "SUM(SUM(CASE WHEN role != 'tool' AND status != 'dropped' THEN IFNULL(tokens, 0) ELSE 0 END)) "
+      "OVER (w ROWS UNBOUNDED PRECEDING) AS min_tokens "
+      "FROM stored_messages WHERE group_id IS NOT NULL GROUP BY session_id, group_id "
+      "WINDOW w AS (PARTITION BY session_id "
+      "ORDER BY MAX(CASE WHEN status != 'dropped' THEN created_at END) DESC, MAX(id) DESC)) "
+      "SELECT r.session_id, r.group_id, r.message_count FROM ranked r LEFT JOIN sessions s ON s.id = r.session_id "
+      "WHERE (CASE WHEN IFNULL(s.context_budget, 0) > 0 THEN r.rank > 1 AND r.min_tokens > s.context_budget "
+      "ELSE IFNULL(s.context_size, $0) > 0 AND r.rank > IFNULL(s.context_size, $0) END) "
+      "AND r.session_id NOT IN (SELECT parent_id FROM sessions WHERE parent_id IS NOT NULL) "
+      "AND ((?1 > 0 AND r.last_at < datetime('now', printf('-%d seconds', ?1))) OR (?2 > 0 AND r.rank > ?2)) "
+      "LIMIT ?3",
+      kDefaultContextSize);
+  ArchiveStats stats;
+  while (true) {
+    std::vector<std::pair<std::string, std::string>> groups;
+    {
+      ASSIGN_OR_RETURN(auto stmt, PrepareRead(sql));
+      RETURN_IF_ERROR(stmt->BindInt64(1, absl::ToInt64Seconds(policy.max_age)));
+      RETURN_IF_ERROR(stmt->BindInt(2, policy.max_groups_per_session));
+      RETURN_IF_ERROR(stmt->BindInt(3, kArchiveBatchGroups));
+      RETURN_IF_ERROR(stmt->ForEachRow([&](Statement& row) {
+        groups.emplace_back(row.ColumnText(0), row.ColumnText(1));
+        stats.messages += row.ColumnInt(2);
+      }));
+    }
+    if (groups.empty()) break;
+    RETURN_IF_ERROR(ArchiveBatch(groups));
+    stats.groups += groups.size();
+    if (groups.size() < static_cast<size_t>(kArchiveBatchGroups)) break;
+  }
+  // Content left behind by DeleteSession() and /message remove.
+  RETURN_IF_ERROR(Execute("DELETE FROM archive.messages WHERE id NOT IN (SELECT id FROM archived_messages);"));
+  return stats;
+}
+
+absl::Status Database::ArchiveBatch(const std::vector<std::pair<std::string, std::string>>& groups) {
+  // The rows are copied and committed before they are replaced by stubs. With WAL, a
+  // transaction over attached databases is atomic per file only; this order means a
+  // crash in between leaves a copy in the archive, never a message in neither file.
+  {
+    ASSIGN_OR_RETURN(auto batch, BeginWriteBatch());
+    for (const auto& [session_id, group_id] : groups) {
+      RETURN_IF_ERROR(Execute(absl::StrCat("INSERT OR REPLACE INTO archive.messages (id, session_id, role, content, "
+                                           "tool_call_id, status, created_at, group_id, parsing_strategy, tokens) "
+                                           "SELECT ",
+                                           kMessageColumns,
+                                           " FROM stored_messages WHERE session_id = ? AND group_id = ?;"),
+                              session_id, group_id));
+    }
+    RETURN_IF_ERROR(batch->Commit());
+  }
+  ASSIGN_OR_RETURN(auto batch, BeginWriteBatch());
+  for (const auto& [session_id, group_id] : groups) {
+    RETURN_IF_ERROR(Execute(
+        "INSERT OR REPLACE INTO archived_messages (id, session_id, role, tool_call_id, status, created_at, group_id, "
+        "parsing_strategy, tokens) "
+        "SELECT id, session_id, role, tool_call_id, status, created_at, group_id, parsing_strategy, tokens "
+        "FROM stored_messages WHERE session_id = ? AND group_id = ? AND id IN (SELECT id FROM archive.messages);",
+        session_id, group_id));
+    RETURN_IF_ERROR(Execute(
+        "DELETE FROM stored_messages WHERE session_id = ? AND group_id = ? "
+        "AND id IN (SELECT id FROM archive.messages);",
+        session_id, group_id));
+  }
+  return batch->Commit();
+}
+
+void Database::StartArchiver(const ArchivePolicy& policy, absl::Duration interval) {
+  StopArchiver();
+  stop_archiver_ = std::make_unique<absl::Notification>();
+  archiver_ = std::thread([this, policy, interval, stop = stop_archiver_.get()] {
+    do {
+      auto stats = ArchiveGroups(policy);
+      if (!stats.ok()) {
+        LOG(WARNING) << "Archiving failed: " << stats.status();
+      } else if (stats->groups > 0) {
+        LOG(INFO) << "Archived " << stats->groups << " groups (" << stats->messages << " messages).";
+      }
+    } while (!stop->WaitForNotificationWithTimeout(interval));
+  });
+}
+
+void Database::StopArchiver() {
+  if (!archiver_.joinable()) return;
+  stop_archiver_->Notify();
+  archiver_.join();
+}
+
+absl::Status Database::RebuildStaleMessageIndex() {
+  ScopedWriter writer(this);
+  {
+    // A rebuild without the archive would drop the entries of every archived message.
+    ASSIGN_OR_RETURN(auto stmt, Prepare("SELECT 1 FROM metadata WHERE key = 'messages_fts_stale' "
+                                        "AND (NOT EXISTS (SELECT 1 FROM archived_messages) "
+                                        "OR EXISTS (SELECT 1 FROM pragma_database_list WHERE name = 'archive'));"));
+    ASSIGN_OR_RETURN(bool stale, stmt->Step());
+    if (!stale) return absl::OkStatus();
+  }
+  ASSIGN_OR_RETURN(auto batch, BeginWriteBatch());
+  RETURN_IF_ERROR(Execute("INSERT INTO messages_fts (messages_fts) VALUES ('rebuild');"));
+  RETURN_IF_ERROR(Execute("DELETE FROM metadata WHERE key = 'messages_fts_stale';"));
+  return batch->Commit();
+}
+
+absl::Status Database::RunPendingBackfills() {
+  ScopedWriter writer(this);
+  std::vector<std::string> pending;
+  {
+    ASSIGN_OR_RETURN(auto stmt, Prepare("SELECT key FROM metadata WHERE key IN "
+                                        "('memos_fts_stale', 'memo_tags_stale', 'message_tokens_stale');"));
+    RETURN_IF_ERROR(stmt->ForEachRow([&](Statement& row) { pending.emplace_back(row.ColumnTextView(0)); }));
+  }
+  for (const std::string& key : pending) {
+    ASSIGN_OR_RETURN(auto batch, BeginWriteBatch());
+    if (key == "message_tokens_stale") {
+      RETURN_IF_ERROR(
+          Execute("UPDATE stored_messages SET tokens = estimate_tokens(inflate(IFNULL(content, "
+                  "(SELECT content FROM blobs WHERE hash = stored_messages.content_hash))));"));
+    } else if (key == "memo_tags_stale") {
+      RETURN_IF_ERROR(IndexAllMemoTags());
+    } else {
+      RETURN_IF_ERROR(Execute("INSERT INTO memos_fts (memos_fts) VALUES ('rebuild');"));
+    }
+    RETURN_IF_ERROR(Execute("DELETE FROM metadata WHERE key = ?;", {key}));
+    RETURN_IF_ERROR(batch->Commit());
+  }
+  return absl::OkStatus();
 }
 
 absl::Status Database::AddMemo(const std::string& content, const std::string& semantic_tags) {
-  auto stmt_or = Prepare("INSERT INTO llm_memos (content, semantic_tags) VALUES (?, ?)");
-  if (!stmt_or.ok()) return stmt_or.status();
-  auto& stmt = *stmt_or;
-  (void)stmt->BindText(1, content);
-  (void)stmt->BindText(2, semantic_tags);
-  return stmt->Run();
+  ASSIGN_OR_RETURN(auto batch, BeginWriteBatch());
+  {
+    ASSIGN_OR_RETURN(auto stmt, Prepare("INSERT INTO llm_memos (content, semantic_tags) VALUES (?, ?)"));
+    RETURN_IF_ERROR(stmt->BindText(1, content));
+    RETURN_IF_ERROR(stmt->BindText(2, semantic_tags));
+    RETURN_IF_ERROR(stmt->Run());
+  }
+  ASSIGN_OR_RETURN(auto stmt, Prepare("SELECT last_insert_rowid()"));
+  ASSIGN_OR_RETURN(bool has_row, stmt->Step());
+  if (!has_row) return absl::InternalError("last_insert_rowid() returned no row");
+  RETURN_IF_ERROR(IndexMemoTags(stmt->ColumnInt64(0), semantic_tags));
+  return batch->Commit();
 }
 
 absl::Status Database::UpdateMemo(int id, const std::string& content, const std::string& semantic_tags) {
-  auto stmt_or = Prepare("UPDATE llm_memos SET content = ?, semantic_tags = ? WHERE id = ?");
-  if (!stmt_or.ok()) return stmt_or.status();
-  auto& stmt = *stmt_or;
-  (void)stmt->BindText(1, content);
-  (void)stmt->BindText(2, semantic_tags);
-  (void)stmt->BindInt(3, id);
-  return stmt->Run();
+  ASSIGN_OR_RETURN(auto batch, BeginWriteBatch());
+  ASSIGN_OR_RETURN(auto stmt, Prepare("UPDATE llm_memos SET content = ?, semantic_tags = ? WHERE id = ?"));
+  RETURN_IF_ERROR(stmt->BindText(1, content));
+  RETURN_IF_ERROR(stmt->BindText(2, semantic_tags));
+  RETURN_IF_ERROR(stmt->BindInt(3, id));
+  RETURN_IF_ERROR(stmt->Run());
+  RETURN_IF_ERROR(IndexMemoTags(id, semantic_tags));
+  return batch->Commit();
+}
+
+std::vector<std::string> Database::TagKeys(const std::string& tag) {
+  std::vector<std::string> parts = absl::StrSplit(absl::AsciiStrToLower(tag), '-', absl::SkipWhitespace());
+  std::vector<std::string> keys;
+  for (size_t begin = 0; begin < parts.size(); ++begin) {
+    for (size_t end = begin + 1; end <= parts.size(); ++end) {
+      keys.push_back(absl::StrJoin(parts.begin() + begin, parts.begin() + end, "-"));
+    }
+  }
+  return keys;
+}
+
+absl::Status Database::IndexMemoTags(int64_t memo_id, const std::string& semantic_tags) {
+  RETURN_IF_ERROR(Execute("DELETE FROM memo_tags WHERE memo_id = ?", memo_id));
+  auto tags = nlohmann::json::parse(semantic_tags, nullptr, false);
+  if (!tags.is_array()) return absl::OkStatus();
+  for (const auto& tag : tags) {
+    if (!tag.is_string()) continue;
+    for (const auto& key : TagKeys(tag.get<std::string>())) {
+      RETURN_IF_ERROR(Execute("INSERT OR IGNORE INTO memo_tags (tag, memo_id) VALUES (?, ?)", key, memo_id));
+    }
+  }
+  return absl::OkStatus();
+}
+
+absl::Status Database::IndexAllMemoTags() {
+  std::vector<std::pair<int64_t, std::string>> memos;
+  {
+    ASSIGN_OR_RETURN(auto stmt, PrepareRead("SELECT id, semantic_tags FROM llm_memos"));
+    RETURN_IF_ERROR(stmt->ForEachRow(
+        [&](Statement& row) { memos.emplace_back(row.ColumnInt64(0), std::string(row.ColumnTextView(1))); }));
+  }
+  ASSIGN_OR_RETURN(auto batch, BeginWriteBatch());
+  for (const auto& [id, semantic_tags] : memos) {
+    RETURN_IF_ERROR(IndexMemoTags(id, semantic_tags));
+  }
+  return batch->Commit();
 }
 
 absl::Status Database::DeleteMemo(int id) {
@@ -876,7 +3231,7 @@ absl::Status Database::DeleteMemo(int id) {
 }
 
 absl::StatusOr<Database::Memo> Database::GetMemo(int id) {
-  auto stmt_or = Prepare("SELECT id, content, semantic_tags, created_at FROM llm_memos WHERE id = ?");
+  auto stmt_or = PrepareRead("SELECT id, content, semantic_tags, created_at FROM llm_memos WHERE id = ?");
   if (!stmt_or.ok()) return stmt_or.status();
   auto& stmt = *stmt_or;
   (void)stmt->BindInt(1, id);
@@ -893,7 +3248,8 @@ absl::StatusOr<Database::Memo> Database::GetMemo(int id) {
   };
 }
 
-absl::StatusOr<std::vector<Database::Memo>> Database::GetMemosByTags(const std::vector<std::string>& tags_input) {
+absl::StatusOr<std::vector<Database::Memo>> Database::GetMemosByTags(const std::vector<std::string>& tags_input,
+                                                                      int limit) {
   if (tags_input.empty()) return std::vector<Memo>();
 
   std::set<std::string> unique_tags;
@@ -910,44 +3266,36 @@ absl::StatusOr<std::vector<Database::Memo>> Database::GetMemosByTags(const std::
   if (unique_tags.empty()) return std::vector<Memo>();
   std::vector<std::string> tags(unique_tags.begin(), unique_tags.end());
 
-  std::string sql =
-      "SELECT DISTINCT m.id, m.content, m.semantic_tags, m.created_at "
-      "FROM llm_memos m, json_each(m.semantic_tags) j "
-      "WHERE ";
+  // A memo tag matches a query tag that is one of its runs of hyphen-separated parts
+  // ("arch", "decision" or "arch-decision" for "arch-decision"); memo_tags holds
+  // every run, so that this is a lookup on its primary key.
+  std::string placeholders;
   for (size_t i = 0; i < tags.size(); ++i) {
-    sql += "(j.value = ? OR j.value LIKE ? OR j.value LIKE ? OR j.value LIKE ?)";
-    if (i < tags.size() - 1) sql += " OR ";
+    placeholders += (i == 0 ? "?" : ", ?");
   }
-
-  auto stmt_or = Prepare(sql);
-  if (!stmt_or.ok()) return stmt_or.status();
-  auto& stmt = *stmt_or;
+  std::string sql = absl::StrCat(
+      "SELECT m.id, m.content, m.semantic_tags, m.created_at "
+      "FROM (SELECT memo_id, COUNT(*) AS matches FROM memo_tags WHERE tag IN (",
+      placeholders,
+      ") GROUP BY memo_id) t "
+      "JOIN llm_memos m ON m.id = t.memo_id "
+      "ORDER BY t.matches DESC, m.id DESC LIMIT ?");
+
+  ASSIGN_OR_RETURN(auto stmt, PrepareRead(sql));
   for (size_t i = 0; i < tags.size(); ++i) {
-    int base = i * 4 + 1;
-    (void)stmt->BindText(base, tags[i]);                    // Exact
-    (void)stmt->BindText(base + 1, tags[i] + "-%");         // Prefix: arch-
-    (void)stmt->BindText(base + 2, "%-" + tags[i]);         // Suffix: -arch
-    (void)stmt->BindText(base + 3, "%-" + tags[i] + "-%");  // Middle: -arch-
+    RETURN_IF_ERROR(stmt->BindText(i + 1, tags[i]));
   }
+  RETURN_IF_ERROR(stmt->BindInt(tags.size() + 1, limit));
 
   std::vector<Memo> results;
-  while (true) {
-    auto res = stmt->Step();
-    if (!res.ok()) return res.status();
-    if (!*res) break;
-
-    results.push_back({
-        stmt->ColumnInt(0),
-        stmt->ColumnText(1),
-        stmt->ColumnText(2),
-        stmt->ColumnText(3),
-    });
-  }
+  RETURN_IF_ERROR(stmt->ForEachRow([&](Statement& row) {
+    results.push_back({row.ColumnInt(0), row.ColumnText(1), row.ColumnText(2), row.ColumnText(3)});
+  }));
   return results;
 }
 
 absl::StatusOr<std::vector<Database::Memo>> Database::GetAllMemos() {
-  auto stmt_or = Prepare("SELECT id, content, semantic_tags, created_at FROM llm_memos");
+  auto stmt_or = PrepareRead("SELECT id, content, semantic_tags, created_at FROM llm_memos");
   if (!stmt_or.ok()) return stmt_or.status();
   auto& stmt = *stmt_or;
 
@@ -967,41 +3315,204 @@ absl::StatusOr<std::vector<Database::Memo>> Database::GetAllMemos() {
   return results;
 }
 
+std::string Database::FtsMatchAny(const std::vector<std::string>& terms) {
+  std::vector<std::string> quoted;
+  for (const auto& term : terms) {
+    absl::string_view t = absl::StripAsciiWhitespace(term);
+    if (t.empty()) continue;
+    quoted.push_back(absl::StrCat("\"", absl::StrReplaceAll(t, {{"\"", "\"\""}}), "\""));
+  }
+  return absl::StrJoin(quoted, " OR ");
+}
+
+absl::StatusOr<std::vector<Database::SearchHit>> Database::SearchMessages(const std::vector<std::string>& terms,
+                                                                          const std::string& session_id, int limit) {
+  std::string match = FtsMatchAny(terms);
+  if (match.empty()) return std::vector<SearchHit>();
+
+  // Within a session, messages it inherits from its ancestors count as its own. Hits are
+  // live or archived messages; an entry left behind by a stub deleted without its archive
+  // matches neither and is skipped.
+  ASSIGN_OR_RETURN(auto stmt,
+                   PrepareRead(absl::StrCat(
+                       "WITH RECURSIVE ", kLineage,
+                       " SELECT messages_fts.rowid, IFNULL(m.session_id, a.session_id), IFNULL(m.role, a.role), "
+                       "IFNULL(m.group_id, a.group_id), IFNULL(m.created_at, a.created_at), "
+                       "snippet(messages_fts, 0, '**', '**', '...', 24) "
+                       "FROM messages_fts LEFT JOIN stored_messages m ON m.id = messages_fts.rowid "
+                       "LEFT JOIN archived_messages a ON m.id IS NULL AND a.id = messages_fts.rowid "
+                       "LEFT JOIN message_overrides ON override_session_id = ?1 "
+                       "AND override_message_id = messages_fts.rowid "
+                       "WHERE messages_fts MATCH ?2 AND ", kLineageVisible,
+                       " AND IFNULL(override_status, IFNULL(m.status, a.status)) != 'dropped' AND (?1 = '' OR "
+                       "EXISTS (SELECT 1 FROM lineage WHERE lineage_session_id = IFNULL(m.session_id, a.session_id) "
+                       "AND lineage_last_id >= messages_fts.rowid)) "
+                       "ORDER BY messages_fts.rank LIMIT ?3")));
+  RETURN_IF_ERROR(stmt->BindText(1, session_id));
+  RETURN_IF_ERROR(stmt->BindText(2, match));
+  RETURN_IF_ERROR(stmt->BindInt(3, limit));
+
+  std::vector<SearchHit> hits;
+  RETURN_IF_ERROR(stmt->ForEachRow([&](Statement& row) {
+    hits.push_back({row.ColumnInt(0), row.ColumnText(1), row.ColumnText(2), row.ColumnText(3), row.ColumnText(4),
+                    row.ColumnText(5)});
+  }));
+  return hits;
+}
+
+absl::StatusOr<std::vector<Database::Memo>> Database::SearchMemos(const std::vector<std::string>& terms, int limit) {
+  std::string match = FtsMatchAny(terms);
+  if (match.empty()) return std::vector<Memo>();
+
+  ASSIGN_OR_RETURN(auto stmt, PrepareRead("SELECT m.id, m.content, m.semantic_tags, m.created_at "
+                                          "FROM memos_fts JOIN llm_memos m ON m.id = memos_fts.rowid "
+                                          "WHERE memos_fts MATCH ? ORDER BY bm25(memos_fts, 1.0, 2.0) LIMIT ?"));
+  RETURN_IF_ERROR(stmt->BindText(1, match));
+  RETURN_IF_ERROR(stmt->BindInt(2, limit));
+
+  std::vector<Memo> memos;
+  RETURN_IF_ERROR(stmt->ForEachRow([&](Statement& row) {
+    memos.push_back({row.ColumnInt(0), row.ColumnText(1), row.ColumnText(2), row.ColumnText(3)});
+  }));
+  return memos;
+}
+
 absl::StatusOr<std::string> Database::Query(const std::string& sql) { return Query(sql, {}); }
 
 absl::StatusOr<std::string> Database::Query(const std::string& sql, const std::vector<std::string>& params) {
-  auto stmt_or = Prepare(sql);
-  if (!stmt_or.ok()) {
-    return stmt_or.status();
+  ASSIGN_OR_RETURN(QueryResult result, Query(sql, params, QueryOptions()));
+  return std::move(result.output);
+}
+
+namespace {
+
+void AppendTsvField(std::string* out, absl::string_view value) {
+  for (char c : value) {
+    switch (c) {
+      case '\t':
+        out->append("\\t");
+        break;
+      case '\n':
+        out->append("\\n");
+        break;
+      case '\r':
+        out->append("\\r");
+        break;
+      case '\\':
+        out->append("\\\\");
+        break;
+      default:
+        out->push_back(c);
+    }
   }
-  auto& stmt = *stmt_or;
+}
 
+}  // namespace
+
+absl::StatusOr<Database::QueryResult> Database::Query(const std::string& sql, const std::vector<std::string>& params,
+                                                      const QueryOptions& options) {
+  if (pending_write_count_.load() > 0 && ReadsQueuedWrites(sql)) RETURN_IF_ERROR(FlushPendingWrites());
+  ASSIGN_OR_RETURN(auto stmt, PrepareRead(sql));
   for (size_t i = 0; i < params.size(); ++i) {
     RETURN_IF_ERROR(stmt->BindText(i + 1, params[i]));
   }
 
-  nlohmann::json results = nlohmann::json::array();
-  while (true) {
-    auto row_or = stmt->Step();
-    if (!row_or.ok()) return row_or.status();
-    if (!*row_or) break;
+  const bool json = options.format == QueryFormat::kJson;
+  std::vector<std::string> names;
+  for (int i = 0; i < stmt->ColumnCount(); ++i) names.push_back(stmt->ColumnName(i));
+
+  QueryResult result;
+  std::string& out = result.output;
+  if (json) {
+    out.push_back('[');
+  } else {
+    for (size_t i = 0; i < names.size(); ++i) {
+      if (i > 0) out.push_back('\t');
+      AppendTsvField(&out, names[i]);
+    }
+    out.push_back('\n');
+  }
 
-    nlohmann::json row = nlohmann::json::object();
-    for (int i = 0; i < stmt->ColumnCount(); ++i) {
-      std::string name = stmt->ColumnName(i);
+  JsonWriter writer(&out);
+  std::string inflated;
+  bool limited = false;
+  while (true) {
+    ASSIGN_OR_RETURN(bool has_row, stmt->Step());
+    if (!has_row) break;
+    if (options.max_rows > 0 && result.rows == options.max_rows) {
+      limited = true;
+      break;
+    }
+    size_t row_start = out.size();
+    if (json) {
+      if (result.rows > 0) out.push_back(',');
+      writer.BeginObject();
+    }
+    for (size_t i = 0; i < names.size(); ++i) {
       int type = stmt->ColumnType(i);
-      if (type == SQLITE_INTEGER)
-        row[name] = stmt->ColumnInt64(i);
-      else if (type == SQLITE_FLOAT)
-        row[name] = stmt->ColumnDouble(i);
-      else if (type == SQLITE_NULL)
-        row[name] = nullptr;
-      else
-        row[name] = stmt->ColumnText(i);
+      if (json) {
+        writer.Key(names[i]);
+        if (type == SQLITE_INTEGER) {
+          writer.Int(stmt->ColumnInt64(i));
+          continue;
+        } else if (type == SQLITE_FLOAT) {
+          writer.Double(stmt->ColumnDouble(i));
+          continue;
+        } else if (type == SQLITE_NULL) {
+          writer.Null();
+          continue;
+        }
+      } else {
+        if (i > 0) out.push_back('\t');
+        if (type == SQLITE_NULL) continue;
+      }
+      absl::string_view text = stmt->ColumnTextView(i);
+      if (type == SQLITE_BLOB && IsCompressedContent(text)) {
+        // Only the columns a query actually selects are inflated.
+        ASSIGN_OR_RETURN(inflated, InflateContent(text));
+        text = inflated;
+      }
+      if (json) {
+        writer.String(text);
+      } else {
+        AppendTsvField(&out, text);
+      }
+    }
+    if (json) {
+      writer.EndObject();
+    } else {
+      out.push_back('\n');
+    }
+    // One byte is left for the closing bracket.
+    if (options.max_bytes > 0 && result.rows > 0 && out.size() + (json ? 1 : 0) > options.max_bytes) {
+      out.resize(row_start);
+      limited = true;
+      break;
+    }
+    result.rows++;
+  }
+  if (json) out.push_back(']');
+
+  if (limited) {
+    // The rest is stepped without being read, up to kOmittedRowsCountFactor times what
+    // was written: a careless query reports "at least" instead of running to its end.
+    result.omitted_rows = 1;
+    const int64_t cap = kOmittedRowsCountFactor * static_cast<int64_t>(std::max<size_t>(result.rows, 1));
+    while (true) {
+      auto has_row = stmt->Step();
+      if (!has_row.ok()) {
+        result.omitted_rows = -1;
+        break;
+      }
+      if (!*has_row) break;
+      if (result.omitted_rows == cap) {
+        result.omitted_rows_at_least = true;
+        break;
+      }
+      result.omitted_rows++;
     }
-    results.push_back(row);
   }
-  return results.dump(-1, ' ', false, nlohmann::json::error_handler_t::replace);
+  return result;
 }
 
 absl::Status Database::UpdateScratchpad(const std::string& session_id, const std::string& scratchpad) {
@@ -1016,7 +3527,7 @@ absl::Status Database::UpdateScratchpad(const std::string& session_id, const std
 }
 
 absl::StatusOr<std::string> Database::GetScratchpad(const std::string& session_id) {
-  auto stmt_or = Prepare("SELECT scratchpad FROM sessions WHERE id = ?");
+  auto stmt_or = PrepareRead("SELECT scratchpad FROM sessions WHERE id = ?");
   if (!stmt_or.ok()) return stmt_or.status();
   auto stmt = std::move(*stmt_or);
   (void)stmt->BindText(1, session_id);
@@ -1,14 +1,27 @@
 #ifndef SLOP_SQL_DATABASE_H_
 #define SLOP_SQL_DATABASE_H_
 
+#include <atomic>
+#include <functional>
+#include <list>
 #include <memory>
+#include <optional>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "absl/base/thread_annotations.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/container/flat_hash_set.h"
+#include "absl/functional/function_ref.h"
 #include "absl/status/status.h"
 #include "absl/status/statusor.h"
+#include "absl/strings/string_view.h"
 #include "absl/synchronization/mutex.h"
+#include "absl/synchronization/notification.h"
+#include "absl/time/time.h"
+
+#include "core/content_codec.h"
 
 #include <sqlite3.h>
 
@@ -16,14 +29,63 @@ namespace slop {
 
 class Database {
  public:
-  Database() : db_(nullptr) {}
-  ~Database() = default;
+  Database() = default;
+  ~Database();
 
   // Non-copyable
   Database(const Database&) = delete;
   Database& operator=(const Database&) = delete;
 
+  // Version of the schema Init() migrates databases to, kept in `PRAGMA user_version`.
+  static constexpr int kSchemaVersion = 5;
+
+  // Connection settings applied by Init(). Sizes of 0 keep SQLite's defaults.
+  struct Tuning {
+    // Bytes of the database file each connection memory-maps for reads.
+    int64_t mmap_bytes = int64_t{256} << 20;
+    // Page cache of each connection, in bytes.
+    int64_t cache_bytes = int64_t{16} << 20;
+    // synchronous=NORMAL rather than FULL under WAL: a power loss can lose the last
+    // commits but cannot corrupt the database.
+    bool synchronous_normal = true;
+    // Keeps temporary tables and indices (e.g. for ORDER BY) in memory.
+    bool temp_store_memory = true;
+    // How often the background thread runs RunMaintenance(); zero disables it.
+    absl::Duration maintenance_interval = absl::Hours(1);
+    // Free pages returned to the file system per maintenance pass. New databases
+    // are created with auto_vacuum=INCREMENTAL; existing ones keep their mode.
+    int incremental_vacuum_pages = 1024;
+  };
+
+  // Opens the database, migrating its schema if it is older than kSchemaVersion and
+  // registering the built-in tools and skills if they changed since the last run.
   absl::Status Init(const std::string& db_path = ":memory:");
+  absl::Status Init(const std::string& db_path, const Tuning& tuning);
+  // PRAGMA optimize (with a bounded analysis), a pending search index rebuild (see
+  // RebuildStaleMessageIndex()) and an incremental vacuum step. Also run
+  // periodically, see Tuning::maintenance_interval, and when the database closes.
+  absl::Status RunMaintenance();
+
+  struct StorageStats {
+    // Page cache lookups over all connections since they were opened.
+    int64_t cache_hits = 0;
+    int64_t cache_misses = 0;
+    int64_t cache_bytes_used = 0;
+    int connections = 0;
+    int64_t page_size = 0;
+    int64_t page_count = 0;
+    int64_t freelist_pages = 0;
+    int64_t db_file_bytes = 0;
+    int64_t wal_file_bytes = 0;
+    int64_t archive_file_bytes = 0;
+    // Frames in the WAL after the last commit, and how many of them the last
+    // checkpoint copied into the database; their difference is the checkpoint lag.
+    int64_t wal_frames = 0;
+    int64_t wal_checkpointed_frames = 0;
+    int64_t checkpoints = 0;
+    std::string journal_mode;
+  };
+  absl::StatusOr<StorageStats> GetStorageStats();
   absl::Status Execute(const std::string& sql);
   absl::Status Execute(const std::string& sql, const std::vector<std::string>& params);
 
@@ -46,12 +108,14 @@ class Database {
   class Statement {
    public:
     Statement(sqlite3* db, const std::string& sql) : db_(db), sql_(sql) {}
+    ~Statement();
 
     absl::Status Prepare();
     absl::Status BindInt(int index, int value);
     absl::Status BindInt64(int index, int64_t value);
     absl::Status BindDouble(int index, double value);
     absl::Status BindText(int index, const std::string& value);
+    absl::Status BindBlob(int index, absl::string_view value);
     absl::Status BindNull(int index);
 
     // Overloads for easier binding
@@ -74,11 +138,20 @@ class Database {
     int64_t ColumnInt64(int index);
     double ColumnDouble(int index);
     std::string ColumnText(int index);
+    // Returns the text (or BLOB bytes) of column `index` without copying it. The view
+    // is valid until the next Step() or the destruction of the statement.
+    absl::string_view ColumnTextView(int index);
     int ColumnType(int index);
     const char* ColumnName(int index);
     int ColumnCount();
 
+    // Steps through the remaining rows, calling `visitor` with the statement
+    // positioned on each one. Column views are valid only during the call.
+    absl::Status ForEachRow(absl::FunctionRef<void(Statement&)> visitor);
+
    private:
+    friend class Database;
+
     absl::Status BindRecursive(int /*index*/) { return absl::OkStatus(); }
 
     template <typename T, typename... Rest>
@@ -91,10 +164,97 @@ class Database {
     sqlite3* db_;
     std::string sql_;
     UniqueStmt stmt_;
+    // When set, called on destruction with the (possibly null) handle. Returns the
+    // handle to its connection's statement cache and releases the connection.
+    std::function<void(const std::string& sql, UniqueStmt stmt)> release_;
   };
 
+  // Returns a prepared statement for `sql` on the writer connection. The writer is
+  // held by the calling thread for as long as the statement is alive, so writes from
+  // different threads are serialized. Handles are served from an LRU cache keyed by
+  // SQL text when possible; a cached handle is reset and its bindings cleared before
+  // it is handed out again.
   absl::StatusOr<std::unique_ptr<Statement>> Prepare(const std::string& sql);
 
+  // Like Prepare(), but for statements that only read. For file-backed databases the
+  // statement runs on one of a small pool of read-only WAL connections and never waits
+  // for the writer. Falls back to the writer for in-memory databases, when the calling
+  // thread holds the writer or a transaction is open on it, when the pool is
+  // exhausted, or when `sql` turns out to write.
+  absl::StatusOr<std::unique_ptr<Statement>> PrepareRead(const std::string& sql);
+
+  // Groups writes into a single transaction, so that e.g. everything persisted for
+  // one LLM turn is committed (and fsync'd) once. The calling thread holds the writer
+  // from BeginWriteBatch() until the batch is committed or rolled back; do not wait
+  // on other threads that write while a batch is open.
+  //
+  // Batches nest: a batch begun while another is open (or while the writer is
+  // inside a transaction) is a savepoint, and rolling it back discards only its own
+  // writes. A batch destroyed without Commit() is rolled back.
+  class WriteBatch {
+   public:
+    ~WriteBatch();
+
+    WriteBatch(const WriteBatch&) = delete;
+    WriteBatch& operator=(const WriteBatch&) = delete;
+
+    absl::Status Commit();
+    absl::Status Rollback();
+
+   private:
+    friend class Database;
+    WriteBatch(Database* db, std::string savepoint) : db_(db), savepoint_(std::move(savepoint)) {}
+
+    absl::Status Finish(bool commit);
+
+    Database* db_;
+    // Empty when this batch owns the transaction.
+    std::string savepoint_;
+    bool finished_ = false;
+  };
+
+  absl::StatusOr<std::unique_ptr<WriteBatch>> BeginWriteBatch();
+
+  // Runs every PrepareRead() of the calling thread in one read transaction until the
+  // snapshot is destroyed, so that reads spread over several queries (the settings,
+  // history, tools and memos a prompt is assembled from) see the same database.
+  // Writes committed by other threads meanwhile are not seen. Cached history windows
+  // and the tool manifest are only used when they are not newer than the snapshot.
+  //
+  // The snapshot keeps one pooled reader checked out. Without one (in-memory
+  // databases, an exhausted pool, a writer left inside a transaction) it holds the
+  // writer instead, which keeps other threads from writing until it ends.
+  //
+  // Snapshots nest: one begun while another is open on the same thread reads from
+  // the outer one. Statements must not outlive the snapshot they were prepared in,
+  // and snapshots end in the reverse order they began, on the thread that began them.
+  // Defined after Database, which it needs the connections of.
+  class ReadSnapshot;
+
+  absl::StatusOr<std::unique_ptr<ReadSnapshot>> BeginReadSnapshot();
+
+  // Number of transactions committed on the writer connection since Init().
+  int64_t GetCommitCount() const { return commit_count_.load(); }
+
+  // Maximum number of pooled read-only connections.
+  static constexpr size_t kMaxReadConnections = 8;
+  // Number of read-only connections opened so far; 0 when WAL is not in use.
+  size_t GetReadConnectionCount();
+
+  struct StatementCacheStats {
+    int64_t hits = 0;
+    int64_t misses = 0;
+    int64_t evictions = 0;
+    size_t size = 0;
+    size_t capacity = 0;
+  };
+
+  static constexpr size_t kDefaultStatementCacheCapacity = 64;
+
+  StatementCacheStats GetStatementCacheStats();
+  // Sets the maximum number of idle statements kept in the cache. 0 disables caching.
+  void SetStatementCacheCapacity(size_t capacity);
+
   struct Message {
     int id;
     std::string session_id;
@@ -108,6 +268,45 @@ class Database {
     int tokens;
   };
 
+  // A Message whose text fields are views. Views passed to a visitor are valid for
+  // that call only; views returned by GetConversationHistoryViews() live as long as
+  // the MessageArena they were copied into.
+  struct MessageView {
+    int id;
+    absl::string_view session_id;
+    absl::string_view role;
+    absl::string_view content;
+    absl::string_view tool_call_id;
+    absl::string_view status;
+    absl::string_view created_at;
+    absl::string_view group_id;
+    absl::string_view parsing_strategy;
+    int tokens;
+
+    Message ToMessage() const;
+  };
+
+  // Bump allocator backing MessageViews: a history is copied into a few large
+  // blocks instead of one heap allocation per field. Moving the arena keeps
+  // existing views valid.
+  class MessageArena {
+   public:
+    MessageArena() = default;
+    MessageArena(MessageArena&&) = default;
+    MessageArena& operator=(MessageArena&&) = default;
+
+    absl::string_view Copy(absl::string_view text);
+    size_t bytes_used() const { return bytes_used_; }
+
+   private:
+    static constexpr size_t kBlockSize = 64 * 1024;
+
+    std::vector<std::unique_ptr<char[]>> blocks_;
+    char* next_ = nullptr;
+    size_t remaining_ = 0;
+    size_t bytes_used_ = 0;
+  };
+
   /**
    * @brief Appends a new message to the conversation history.
    *
@@ -118,19 +317,103 @@ class Database {
    * @param status The status of the message (e.g., "completed", "dropped").
    * @param group_id Optional ID to group related messages together.
    * @param parsing_strategy Optional strategy used to parse the message.
-   * @param tokens The number of tokens used by this message.
+   * @param tokens The number of tokens the message takes in a prompt; 0 stores
+   *        EstimateTokens(content).
    * @return absl::Status OK if successful, otherwise an error.
    */
   absl::Status AppendMessage(const std::string& session_id, const std::string& role, const std::string& content,
                              const std::string& tool_call_id = "", const std::string& status = "completed",
                              const std::string& group_id = "", const std::string& parsing_strategy = "",
                              int tokens = 0);
-  absl::Status UpdateMessageStatus(int id, const std::string& status);
+  // Sets the status of message `id` as session `session_id` sees it. A message the
+  // session shares with its parent or its forks changes for it alone; see CloneSession().
+  absl::Status UpdateMessageStatus(const std::string& session_id, int id, const std::string& status);
+  // Removes group `group_id` from the history of `session_id`, archived messages
+  // included. As with UpdateMessageStatus(), its parent and forks keep the group.
+  absl::Status RemoveGroup(const std::string& session_id, const std::string& group_id);
+
+  // Token count of `text` by TokenCounter::Default(). Stored in `stored_messages.tokens` and
+  // available to SQL as estimate_tokens(text).
+  static int EstimateTokens(absl::string_view text);
+  // Bytes per token on average, for converting limits given in bytes.
+  static constexpr int kBytesPerToken = 4;
 
   absl::StatusOr<std::vector<Message>> GetConversationHistory(const std::string& session_id,
                                                               bool include_dropped = false, int window_size = 0);
-  absl::StatusOr<std::vector<Message>> GetMessagesByGroups(const std::vector<std::string>& group_ids);
+  // Streams the same rows as GetConversationHistory() without materializing them.
+  // Content stored compressed is passed as-is; see InflateContent().
+  absl::Status VisitConversationHistory(const std::string& session_id, bool include_dropped, int window_size,
+                                        absl::FunctionRef<void(const MessageView&)> visitor);
+  // Like GetConversationHistory(), with all text copied into `arena`.
+  absl::StatusOr<std::vector<MessageView>> GetConversationHistoryViews(const std::string& session_id,
+                                                                        MessageArena* arena,
+                                                                        bool include_dropped = false,
+                                                                        int window_size = 0);
+  // Messages of `group_ids` with an id above `after_id`.
+  absl::StatusOr<std::vector<Message>> GetMessagesByGroups(const std::vector<std::string>& group_ids,
+                                                           int after_id = 0);
+  // Last group of the session's history, inherited messages included.
   absl::StatusOr<std::string> GetLastGroupId(const std::string& session_id);
+  struct GroupSummary {
+    std::string group_id;
+    std::string prompt;                   // The group's first user message.
+    std::optional<int> assistant_tokens;  // Most tokens of its assistant messages.
+  };
+  // The newest `limit` groups of the session's history that have a user message,
+  // newest first: its own, archived ones included, and those it inherits, less the
+  // ones it removed. /message list.
+  absl::StatusOr<std::vector<GroupSummary>> ListGroups(const std::string& session_id, int limit);
+  // Messages of group `group_id` as the session sees them, in the same history as
+  // ListGroups(), oldest first, with content inflated. /message view.
+  absl::StatusOr<std::vector<Message>> GetGroupMessages(const std::string& session_id, const std::string& group_id);
+  // Id of the most recently appended message, or 0.
+  absl::StatusOr<int> GetLastMessageId();
+
+  // History without dropped messages is served from a cache of materialized windows,
+  // one per session and window size. A cached window is brought up to date by reading
+  // only the messages appended since it was filled; any other change to
+  // `stored_messages` made through this Database (status updates, deletes, rollbacks)
+  // discards the cache. Changes other than appends made by other processes are not seen.
+  struct HistoryCacheStats {
+    // Reads served from a cached window, with any appended messages merged in.
+    int64_t hits = 0;
+    // Reads that loaded the whole window.
+    int64_t misses = 0;
+    size_t size = 0;
+    size_t capacity = 0;
+  };
+
+  static constexpr size_t kDefaultHistoryCacheCapacity = 8;
+
+  HistoryCacheStats GetHistoryCacheStats();
+  // Sets the maximum number of cached windows. 0 disables the cache.
+  void SetHistoryCacheCapacity(size_t capacity);
+
+  // Message content of at least this many bytes is stored as a compressed BLOB
+  // (see ContentCodec). Every read path except VisitConversationHistory() inflates
+  // it, Query() included; in SQL, inflate(content) yields the text.
+  static constexpr size_t kDefaultCompressionThreshold = 4096;
+  // Number of messages compressed without a dictionary before one is trained.
+  static constexpr int kDictionaryTrainingThreshold = 64;
+  // 0 stores new content uncompressed. Existing rows are left as they are.
+  void SetCompressionThreshold(size_t bytes) { compression_threshold_.store(bytes); }
+  // Trains a dictionary on recent message content and compresses new content with it.
+  absl::Status TrainCompressionDictionary();
+
+  static bool IsCompressedContent(absl::string_view content) { return ContentCodec::IsEncoded(content); }
+  // Size, full text and a byte range of message content as stored; only the
+  // compressed chunks overlapping the range are inflated.
+  static absl::StatusOr<size_t> GetContentSize(absl::string_view content);
+  absl::StatusOr<std::string> InflateContent(absl::string_view content);
+  absl::StatusOr<std::string> InflateContentRange(absl::string_view content, size_t offset, size_t length);
+
+  // Message content of at least this many bytes is stored once in the `blobs` table,
+  // keyed by its hash, and stored_messages.content_hash refers to it instead; repeated
+  // tool results then cost one row. The read paths resolve the reference, and in SQL
+  // the `messages` view does.
+  static constexpr size_t kDefaultDedupThreshold = 1024;
+  // 0 stores all new content inline. Existing rows are left as they are.
+  void SetDedupThreshold(size_t bytes) { dedup_threshold_.store(bytes); }
 
   struct Usage {
     std::string session_id;
@@ -141,15 +424,48 @@ class Database {
     std::string created_at;
   };
 
+  // Queued: see FlushPendingWrites(). `cached_tokens` is the part of
+  // `prompt_tokens` the provider served from its prompt cache.
   absl::Status RecordUsage(const std::string& session_id, const std::string& model, int prompt_tokens,
-                           int completion_tokens);
+                           int completion_tokens, int cached_tokens = 0);
   struct TotalUsage {
     int prompt_tokens;
     int completion_tokens;
     int total_tokens;
+    int cached_tokens = 0;
   };
   absl::StatusOr<TotalUsage> GetTotalUsage(const std::string& session_id = "");
 
+  // Usage summed from the `usage_daily` rollup, which triggers on `usage` keep
+  // current; these read one row per session, model and day rather than every
+  // request. `cost` is in USD and is unset when no price pattern matches `model`.
+  struct UsageRollup {
+    std::string model;
+    std::string day;  // YYYY-MM-DD (UTC); empty when grouped by model only.
+    int64_t requests = 0;
+    int64_t prompt_tokens = 0;
+    int64_t completion_tokens = 0;
+    int64_t total_tokens = 0;
+    int64_t cached_tokens = 0;  // Of prompt_tokens.
+    std::optional<double> cost;
+  };
+  // Per model, for `session_id` or for all sessions when it is empty. A clone's
+  // totals include those it inherited; all sessions count each request once.
+  absl::StatusOr<std::vector<UsageRollup>> GetUsageByModel(const std::string& session_id = "");
+  // Per day and model over the last `days` days (including today), newest first.
+  // Only requests made in the session count, not those a clone inherited.
+  absl::StatusOr<std::vector<UsageRollup>> GetUsageByDay(const std::string& session_id, int days);
+
+  // USD per million tokens for models matching `model_pattern` (a GLOB, e.g.
+  // "gemini-2.5-pro*"). When several patterns match, the longest wins.
+  struct ModelPrice {
+    std::string model_pattern;
+    double prompt_per_million = 0;
+    double completion_per_million = 0;
+  };
+  absl::Status SetModelPrice(const ModelPrice& price);
+  absl::StatusOr<std::vector<ModelPrice>> GetModelPrices();
+
   struct Tool {
     std::string name;
     std::string description;
@@ -173,29 +489,126 @@ class Database {
   absl::Status UpdateSkill(const Skill& skill);
   absl::Status DeleteSkill(const std::string& name_or_id);
   absl::StatusOr<std::vector<Skill>> GetSkills();
+
+  // Enables or disables tool `name`; NotFound if there is none.
+  absl::Status SetToolEnabled(const std::string& name, bool enabled);
+
+  // What a prompt declares: the enabled tools and every skill. Built on first use and
+  // shared until a row of `tools` or `skills` changes through this Database, whether
+  // by RegisterTool(), SetToolEnabled(), RegisterSkill(), UpdateSkill(), DeleteSkill()
+  // or SQL; calls that change nothing keep it, and so do the queued counters, which
+  // are as of when it was built. Changes made by other processes are not seen.
+  struct ToolManifest {
+    std::vector<Tool> tools;
+    absl::flat_hash_set<std::string> tool_names;
+    std::vector<Skill> skills;
+    int64_t generation = 0;
+  };
+  absl::StatusOr<std::shared_ptr<const ToolManifest>> GetToolManifest();
+  // Queued: see FlushPendingWrites().
   absl::Status IncrementSkillActivationCount(const std::string& name_or_id);
   absl::Status IncrementToolCallCount(const std::string& name);
 
+  // Usage rows and tool and skill counters are not written on the caller's thread
+  // (often a dispatcher thread running a tool): they are queued, increments to the
+  // same counter coalesced, and written in one transaction by a background thread
+  // every kWriteBehindInterval. Reads through this object never see counts go
+  // missing: GetEnabledTools(), GetSkills() and GetTotalUsage() add the queued updates
+  // to what they read, and Query() and the usage rollups flush the queue first when
+  // their statement reads these tables. Destruction flushes it too.
+  static constexpr absl::Duration kWriteBehindInterval = absl::Milliseconds(200);
+  // Writes the queued ledger updates now.
+  absl::Status FlushPendingWrites();
+
   absl::Status SetActiveSkills(const std::string& session_id, const std::vector<std::string>& skills);
   absl::StatusOr<std::vector<std::string>> GetActiveSkills(const std::string& session_id);
 
   // Context Settings
+  // Sets the window to the last `size` groups and turns off the token budget.
   absl::Status SetContextWindow(const std::string& session_id, int size);
+  // Sets the window to as many groups as fit in `tokens`; see GetBudgetWindowSize().
+  // 0 returns to the group-count window.
+  absl::Status SetContextBudget(const std::string& session_id, int tokens);
   struct ContextSettings {
     int size;
+    // Token budget of the window. When positive, it replaces `size`.
+    int budget = 0;
   };
   absl::StatusOr<ContextSettings> GetContextSettings(const std::string& session_id);
+  // GetContextSettings(), GetSessionState() and GetScratchpad() in one query. A
+  // missing state or scratchpad is empty.
+  struct SessionPromptState {
+    ContextSettings settings;
+    std::string state;
+    std::string scratchpad;
+  };
+  absl::StatusOr<SessionPromptState> GetSessionPromptState(const std::string& session_id);
+
+  // Tokens a tool result can take in a prompt once truncated, by tier: the newest
+  // `full_fidelity_count` tool results of the active (newest) group, its older ones,
+  // and those of every other group. Mirrors Orchestrator::TruncationSettings.
+  struct TokenTiers {
+    int active_full_fidelity = 0;
+    int active_degraded = 0;
+    int inactive = 0;
+    int full_fidelity_count = 0;
+  };
+  // The window size, in groups, that a `budget` of tokens buys. Groups are walked
+  // newest first, each costing the `tokens` of its messages with tool results capped
+  // at their tier, and the walk stops before the first group that does not fit. The
+  // newest group is always kept, so the result is at least 1.
+  absl::StatusOr<int> GetBudgetWindowSize(const std::string& session_id, int budget, const TokenTiers& tiers);
 
   // Session State Management
   absl::Status SetSessionState(const std::string& session_id, const std::string& state_blob);
   absl::StatusOr<std::string> GetSessionState(const std::string& session_id);
 
-  // Session Deletion
+  // Session Deletion. A session with forks is renamed and hidden instead, keeping
+  // the messages they inherit from it until the last of them is deleted.
   absl::Status DeleteSession(const std::string& session_id);
 
-  // Session Cloning
+  // Session Cloning. The target is a fork: it records the source as its parent and
+  // the newest message id as its branch point, and inherits the source's history up
+  // to there instead of copying it. History reads and SearchMessages() follow the
+  // lineage. Messages stay shared when one session changes them: UpdateMessageStatus()
+  // and RemoveGroup() of a message another session sees record the change in
+  // `message_overrides` for the session alone, and history reads apply it. Only the
+  // changed messages cost a row. Overrides are copied with the source's other
+  // settings: scratchpad, state and context window. Usage is copied as one row per model,
+  // marked inherited so that reports over all sessions count it once.
   absl::Status CloneSession(const std::string& source_id, const std::string& target_id);
 
+  // Cold storage. Groups that can no longer enter their session's rolling window are
+  // moved into an archive database next to the main file (`<db_path>.archive`,
+  // ATTACHed as `archive`), so that the main file and its page cache hold the live
+  // history only. Each archived message leaves a row without content in
+  // `archived_messages`, and the `messages` view reads the content back from
+  // the archive, so lookups by id or group (query_db, /message view, truncation
+  // hints) keep working. Archived messages stay in the search index, so
+  // SearchMessages() finds them; history reads see live messages only.
+  //
+  // The newest `context_size` groups of a session are never archived, and neither is
+  // anything in a session whose window is unlimited (context_size 0) or that has forks.
+  // A session with a token budget keeps every group its window could still hold.
+  struct ArchivePolicy {
+    // Archive groups whose last message is older than this. Zero: no age limit.
+    absl::Duration max_age = absl::ZeroDuration();
+    // Archive groups beyond the newest this many of their session. 0: no cap.
+    int max_groups_per_session = 0;
+  };
+  struct ArchiveStats {
+    int groups = 0;
+    int messages = 0;
+  };
+  // Groups moved per transaction; the writer is released between batches.
+  static constexpr int kArchiveBatchGroups = 64;
+  // Runs one archiving pass. Fails with FailedPreconditionError for in-memory databases.
+  absl::StatusOr<ArchiveStats> ArchiveGroups(const ArchivePolicy& policy);
+  // Runs ArchiveGroups() on a background thread now and every `interval` after that,
+  // until StopArchiver() or destruction. Replaces a running archiver.
+  void StartArchiver(const ArchivePolicy& policy, absl::Duration interval);
+  void StopArchiver();
+
   absl::Status UpdateScratchpad(const std::string& session_id, const std::string& scratchpad);
   absl::StatusOr<std::string> GetScratchpad(const std::string& session_id);
 
@@ -213,23 +626,330 @@ class Database {
   absl::Status UpdateMemo(int id, const std::string& content, const std::string& semantic_tags);
   absl::Status DeleteMemo(int id);
   absl::StatusOr<Memo> GetMemo(int id);
-  absl::StatusOr<std::vector<Memo>> GetMemosByTags(const std::vector<std::string>& tags);
+  // Memos with a tag matching any of `tags`, those matching the most first. A tag
+  // matches when it is one of the memo tag's runs of hyphen-separated parts, e.g.
+  // "arch", "decision" or "arch-decision" for "arch-decision". -1: no limit.
+  absl::StatusOr<std::vector<Memo>> GetMemosByTags(const std::vector<std::string>& tags, int limit = -1);
   absl::StatusOr<std::vector<Memo>> GetAllMemos();
-  // Full Text Search
+
+  // Full-text search over the FTS5 indexes messages_fts and memos_fts, which triggers
+  // keep in sync. Rows matching any of `terms` are returned best first by BM25, so
+  // rows matching more and rarer terms rank higher. Terms are matched as words
+  // (stemmed), not as FTS5 query syntax.
+  struct SearchHit {
+    int id;  // Message id.
+    std::string session_id;
+    std::string role;
+    std::string group_id;
+    std::string created_at;
+    // Matching excerpt of the content, matches in **bold**.
+    std::string snippet;
+  };
+  // Messages not dropped, archived ones included; limited to `session_id` unless it
+  // is empty.
+  absl::StatusOr<std::vector<SearchHit>> SearchMessages(const std::vector<std::string>& terms,
+                                                        const std::string& session_id, int limit);
+  // Matches in semantic_tags weigh twice as much as matches in content.
+  absl::StatusOr<std::vector<Memo>> SearchMemos(const std::vector<std::string>& terms, int limit);
+  // FTS5 MATCH expression for any of `terms`, each quoted; empty if there are none.
+  static std::string FtsMatchAny(const std::vector<std::string>& terms);
+
+  // Runs a read-only statement and returns its rows as a JSON array of objects.
   absl::StatusOr<std::string> Query(const std::string& sql);
   absl::StatusOr<std::string> Query(const std::string& sql, const std::vector<std::string>& params);
 
+  enum class QueryFormat {
+    // An array of objects, one per row, keyed by column name in column order.
+    kJson,
+    // A line of column names, then a line per row; fields are tab-separated, NULL
+    // is empty, and tabs, newlines and backslashes in values are escaped as \t,
+    // \n, \r and \\.
+    kTsv,
+  };
+  struct QueryOptions {
+    QueryFormat format = QueryFormat::kJson;
+    // No more rows are written once the next row would take the output past
+    // `max_bytes`, or `max_rows` rows are written; the rest are only stepped, to
+    // count them (see QueryResult). The first row is always written whole. 0: no limit.
+    size_t max_bytes = 0;
+    size_t max_rows = 0;
+  };
+  struct QueryResult {
+    std::string output;
+    size_t rows = 0;
+    // Rows left out because of a limit; -1 when there were some but counting them
+    // failed. Counting stops at kOmittedRowsCountFactor times `rows`, and
+    // `omitted_rows_at_least` is set if there are more.
+    int64_t omitted_rows = 0;
+    bool omitted_rows_at_least = false;
+  };
+  static constexpr int64_t kOmittedRowsCountFactor = 10;
+  // Serializes rows straight into the output as they are stepped.
+  absl::StatusOr<QueryResult> Query(const std::string& sql, const std::vector<std::string>& params,
+                                    const QueryOptions& options);
+
  private:
   absl::Status RegisterDefaultTools();
   absl::Status RegisterDefaultSkills();
+  // Runs `register_defaults` in one transaction, unless it already ran for these
+  // `definitions` of the built-in tools or skills: metadata `key` holds their hash.
+  absl::Status RegisterDefaults(const std::string& key, absl::string_view definitions,
+                                absl::FunctionRef<absl::Status()> register_defaults);
+  // Runs a rollup `sql` with `session_id` and then `since` bound, each if not empty.
+  absl::StatusOr<std::vector<UsageRollup>> ReadUsageRollups(const std::string& sql, const std::string& session_id,
+                                                            const std::string& since);
 
   struct DbDeleter {
     void operator()(sqlite3* db) const {
       if (db) sqlite3_close(db);
     }
   };
+  struct CachedStatement {
+    std::string sql;
+    UniqueStmt stmt;
+  };
+  // A SQLite connection and its statement cache. The cache is guarded by mu_; the
+  // connection itself is used only by whoever has checked it out.
+  struct Connection {
+    std::unique_ptr<sqlite3, DbDeleter> db;
+    // Idle statements, most recently used first. Checked-out statements are not in the cache.
+    std::list<CachedStatement> stmt_lru;
+    absl::flat_hash_map<std::string, std::list<CachedStatement>::iterator> stmt_index;
+    // Whether the archive database is attached; see ArchiveGroups().
+    bool archive_attached = false;
+    // archived_content()'s lookup, prepared on first use and finalized with the statement cache.
+    UniqueStmt archived_content_stmt;
+  };
+
+  // Holds the writer for the current thread for the lifetime of the scope.
+  class ScopedWriter {
+   public:
+    explicit ScopedWriter(Database* db) : db_(db) { db_->AcquireWriter(); }
+    ~ScopedWriter() { db_->ReleaseWriter(); }
+
+   private:
+    Database* db_;
+  };
+
+  // The writer lock is re-entrant so that a thread holding it (e.g. inside
+  // CloneSession) can keep preparing statements.
+  void AcquireWriter() ABSL_NO_THREAD_SAFETY_ANALYSIS;
+  void ReleaseWriter() ABSL_NO_THREAD_SAFETY_ANALYSIS;
+  bool HoldsWriter() const { return writer_thread_.load() == std::this_thread::get_id(); }
+  // The calling thread's innermost open snapshot of this database, or nullptr.
+  const ReadSnapshot* ActiveReadSnapshot() const;
+
+  // Returns an idle pooled reader, opening one if the pool has room, or nullptr.
+  Connection* AcquireReader();
+  void ReleaseReader(Connection* reader);
+
+  // Wraps `conn` in a Statement for `sql`, checking a cached handle out of the
+  // connection's cache when there is one. `on_release` runs when the statement dies.
+  std::unique_ptr<Statement> CheckoutStatement(Connection* conn, const std::string& sql,
+                                               std::function<void()> on_release);
+  // Returns a checked-out statement handle to the cache, or finalizes it if the
+  // cache is full, disabled, or already holds an idle handle for the same SQL.
+  void ReleaseStatement(Connection* conn, const std::string& sql, UniqueStmt stmt);
+  void EvictStatementsLocked(Connection* conn, size_t capacity) ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+  void ClearStatementCachesLocked() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  // A materialized history window, shared by readers and never modified once cached.
+  struct HistoryWindow {
+    // As stored: compressed content is not inflated.
+    std::vector<std::shared_ptr<const Message>> rows;
+    // Highest id of the session's messages when the window was read, dropped or not.
+    int last_id = 0;
+    // Value of history_generation_ before the window was read.
+    int64_t generation = 0;
+  };
+  struct CachedHistoryWindow {
+    std::shared_ptr<const HistoryWindow> window;
+    int64_t last_used = 0;
+  };
+
+  // Reads the history straight from `stored_messages`.
+  absl::Status VisitStoredHistory(const std::string& session_id, bool include_dropped, int window_size,
+                                  absl::FunctionRef<void(const MessageView&)> visitor);
+  // Returns the up-to-date window of `session_id`, from the cache when possible.
+  absl::StatusOr<std::shared_ptr<const HistoryWindow>> GetHistoryWindow(const std::string& session_id,
+                                                                       int window_size);
+  // Reads the messages of `session_id` appended after `cached` was filled and returns
+  // the window with them merged in, or nullptr when it must be reloaded.
+  absl::StatusOr<std::shared_ptr<const HistoryWindow>> ExtendHistoryWindow(
+      const std::string& session_id, int window_size, const std::shared_ptr<const HistoryWindow>& cached);
+  // Discards the cached history windows; see history_dirty_.
+  void InvalidateHistory();
+  // Discards the tool manifest; see manifest_dirty_.
+  void InvalidateManifest();
+
+  // ATTACHes the archive to `conn` if it exists and is not attached yet. With
+  // `create`, the archive is created first. Requires exclusive use of `conn`.
+  absl::Status AttachArchive(Connection* conn, bool create);
+  // Applies the overrides `session_id` has of its own messages that none of its forks
+  // sees any more to the messages, deleting the ones it removed; see CloneSession().
+  absl::Status ReleaseForkedMessages(const std::string& session_id);
+  // Deletes `session_id` if it is a deleted session without forks left, then its parent
+  // likewise. The first session kept gets ReleaseForkedMessages().
+  absl::Status PruneDeletedSessions(std::optional<std::string> session_id);
+  // Moves the messages of `groups`, (session_id, group_id) pairs, into the archive.
+  absl::Status ArchiveBatch(const std::vector<std::pair<std::string, std::string>>& groups);
+  // Rebuilds messages_fts if deleting archived messages without their archive left
+  // entries behind (`messages_fts_stale` in `metadata`), once the archive is readable
+  // again or no archived message is left.
+  absl::Status RebuildStaleMessageIndex();
+  // Runs the backfills a migration left pending in `metadata` (`memos_fts_stale`,
+  // `memo_tags_stale`, `message_tokens_stale`), each in the transaction that clears
+  // its key, so that one interrupted or failed runs again on the next Init().
+  absl::Status RunPendingBackfills();
+
+  // Installs the SQL functions every connection provides (inflate(), archived_content())
+  // on `db`, the connection `conn` is about to own.
+  void RegisterFunctions(sqlite3* db, Connection* conn);
+  // Loads the dictionary compressed `content` needs into codec_ if it is not there yet.
+  absl::Status LoadCompressionDictionary(absl::string_view content);
+  absl::Status LoadCompressionDictionaries();
+  // Replaces compressed content in `m` with its text, kept alive by `scratch`.
+  absl::Status InflateView(MessageView* m, std::string* scratch);
+  // Binds `content` to parameter `index` of `stmt`, compressed if it is large enough.
+  // Sets `compressed` to whether it was.
+  absl::Status BindContent(Statement* stmt, int index, const std::string& content, bool* compressed);
+  // Lookup keys of a memo tag: every run of its hyphen-separated parts, lowercased.
+  static std::vector<std::string> TagKeys(const std::string& tag);
+  // Replaces the memo_tags rows of memo `memo_id`. Requires the writer.
+  absl::Status IndexMemoTags(int64_t memo_id, const std::string& semantic_tags);
+  // Fills memo_tags from every memo; run when the table is created.
+  absl::Status IndexAllMemoTags();
+  // Counts content compressed without a dictionary and trains one once there is enough.
+  void NoteCompressedContent();
+  // Returns the hash of `content` in `blobs`, inserting it if needed, or "" when a
+  // different blob already has that hash. Requires the writer.
+  absl::StatusOr<std::string> StoreBlob(const std::string& content);
+
   absl::Mutex mu_;
-  std::unique_ptr<sqlite3, DbDeleter> db_ ABSL_GUARDED_BY(mu_);
+  Connection writer_ ABSL_GUARDED_BY(mu_);
+  std::vector<std::unique_ptr<Connection>> readers_ ABSL_GUARDED_BY(mu_);
+  std::vector<Connection*> idle_readers_ ABSL_GUARDED_BY(mu_);
+  // Path of a file-backed database in WAL mode; empty when readers are disabled.
+  std::string reader_path_ ABSL_GUARDED_BY(mu_);
+  size_t stmt_cache_capacity_ ABSL_GUARDED_BY(mu_) = kDefaultStatementCacheCapacity;
+  StatementCacheStats stmt_cache_stats_ ABSL_GUARDED_BY(mu_);
+
+  absl::Mutex writer_mu_;
+  std::atomic<std::thread::id> writer_thread_{};
+  int writer_depth_ = 0;  // Only touched by the thread holding writer_mu_.
+  int write_batch_depth_ = 0;  // Only touched by the thread holding writer_mu_.
+  std::atomic<int64_t> commit_count_{0};
+  // Whether the writer was left inside an explicit transaction by its last holder.
+  // Reads then go through the writer so that they observe the transaction's writes.
+  std::atomic<bool> writer_in_transaction_{false};
+
+  absl::Mutex history_mu_;
+  absl::flat_hash_map<std::pair<std::string, int>, CachedHistoryWindow> history_cache_ ABSL_GUARDED_BY(history_mu_);
+  size_t history_cache_capacity_ ABSL_GUARDED_BY(history_mu_) = kDefaultHistoryCacheCapacity;
+  HistoryCacheStats history_cache_stats_ ABSL_GUARDED_BY(history_mu_);
+  int64_t history_cache_clock_ ABSL_GUARDED_BY(history_mu_) = 0;
+  // Bumped whenever cached windows may no longer match `stored_messages`; windows
+  // read under an older generation are reloaded.
+  std::atomic<int64_t> history_generation_{0};
+  // Set when `stored_messages` rows are updated or deleted, or writes are rolled
+  // back; the generation is bumped again when the writer is released, after the
+  // commit, so that a window read by another connection before the commit is not kept.
+  std::atomic<bool> history_dirty_{false};
+
+  absl::Mutex manifest_mu_;
+  std::shared_ptr<const ToolManifest> manifest_ ABSL_GUARDED_BY(manifest_mu_);
+  // As history_generation_ and history_dirty_, for changes to `tools` and `skills`.
+  std::atomic<int64_t> manifest_generation_{0};
+  std::atomic<bool> manifest_dirty_{false};
+  // Set while the queued counters are written, whose updates keep the manifest.
+  // Only touched by the thread holding writer_mu_.
+  bool writing_counters_ = false;
+
+  // Replaced by Init(); dictionary ids are only meaningful within one database.
+  std::unique_ptr<ContentCodec> codec_ = std::make_unique<ContentCodec>();
+  std::atomic<size_t> compression_threshold_{kDefaultCompressionThreshold};
+  std::atomic<int> compressed_without_dictionary_{0};
+  std::atomic<size_t> dedup_threshold_{kDefaultDedupThreshold};
+
+  // Path of the archive database; empty for in-memory databases.
+  std::string archive_path_ ABSL_GUARDED_BY(mu_);
+  // Set once the archive file exists, so that read connections attach it too.
+  std::atomic<bool> archive_exists_{false};
+  std::thread archiver_;
+  std::unique_ptr<absl::Notification> stop_archiver_;
+
+  // Ledger updates waiting for FlushPendingWrites().
+  struct PendingUsage {
+    std::string session_id;
+    std::string model;
+    int prompt_tokens;
+    int completion_tokens;
+    int cached_tokens;
+    int64_t created_at;  // Unix seconds.
+  };
+  struct PendingWrites {
+    absl::flat_hash_map<std::string, int64_t> tool_calls;
+    absl::flat_hash_map<std::string, int64_t> skill_activations;
+    std::vector<PendingUsage> usage;
+    int64_t updates = 0;  // Calls queued, counting coalesced ones.
+  };
+  // With `if_idle`, leaves the queue alone while a transaction is open on the
+  // writer instead of joining it: the background thread must not write into a
+  // transaction some caller may roll back.
+  absl::Status WritePendingWrites(bool if_idle);
+  // Whether `sql` reads a table FlushPendingWrites() writes: `tools` and `skills` for
+  // their counters, `usage` and its rollup `usage_daily`. Prepares it on the writer.
+  bool ReadsQueuedWrites(const std::string& sql);
+  // Runs `read`, then `merge` with the queue. If a flush committed or was under way
+  // meanwhile, `read` may or may not have seen its updates: the queue is flushed and
+  // `read` runs again instead. `read` must replace what it read before.
+  absl::Status ReadWithPendingWrites(absl::FunctionRef<absl::Status()> read,
+                                     absl::FunctionRef<void(const PendingWrites&)> merge);
+  void StartWriteBehind();
+  void StopWriteBehind();
+  absl::Mutex pending_mu_;
+  PendingWrites pending_writes_ ABSL_GUARDED_BY(pending_mu_);
+  // Updates queued or being written; reads skip flushing when there are none.
+  std::atomic<int64_t> pending_write_count_{0};
+  // Flushes committed; see ReadWithPendingWrites().
+  int64_t flushes_ ABSL_GUARDED_BY(pending_mu_) = 0;
+  std::thread write_behind_;
+  std::unique_ptr<absl::Notification> stop_write_behind_;
+
+  // Applies the per-connection settings of `tuning_` to a newly opened connection.
+  void ApplyTuning(sqlite3* db);
+  Tuning tuning_;
+  // Replaces SQLite's auto-checkpoint to track WAL size and checkpoint progress.
+  static int OnWalCommit(void* self, sqlite3* db, const char* db_name, int frames);
+  std::atomic<int64_t> wal_frames_{0};
+  std::atomic<int64_t> wal_checkpointed_frames_{0};
+  std::atomic<int64_t> checkpoints_{0};
+};
+
+class Database::ReadSnapshot {
+ public:
+  ~ReadSnapshot();
+
+  ReadSnapshot(const ReadSnapshot&) = delete;
+  ReadSnapshot& operator=(const ReadSnapshot&) = delete;
+
+ private:
+  friend class Database;
+  explicit ReadSnapshot(Database* db) : db_(db) {}
+
+  Database* db_;
+  // Whether this snapshot started the transaction; a nested one reads from its outer.
+  bool active_ = false;
+  // The thread's innermost snapshot, of any database, when this one began.
+  const ReadSnapshot* outer_ = nullptr;
+  // The reader inside the transaction, or null when the writer is held.
+  Connection* conn_ = nullptr;
+  bool holds_writer_ = false;
+  // Generations and newest message id as of the transaction's start: cached
+  // entries past them hold writes the snapshot does not see.
+  int64_t history_generation_ = 0;
+  int64_t manifest_generation_ = 0;
+  int last_message_id_ = 0;
 };
 
 }  // namespace slop
@@ -0,0 +1,907 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <new>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_split.h"
+#include "absl/time/time.h"
+
+#include "core/database.h"
+#include "core/http_client.h"
+#include "core/ledger_generator.h"
+#include "core/orchestrator.h"
+#include "core/orchestrator_gemini.h"
+#include "core/status_macros.h"
+#include "core/tool_executor.h"
+
+#include <benchmark/benchmark.h>
+
+// Counts heap allocations made through operator new so that benchmarks can report
+// allocations per iteration.
+static std::atomic<int64_t> g_allocations{0};
+
+void* operator new(size_t size) {
+  g_allocations.fetch_add(1, std::memory_order_relaxed);
+  void* p = std::malloc(size == 0 ? 1 : size);
+  if (p == nullptr) std::abort();
+  return p;
+}
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+
+namespace {
+
+constexpr int kLedgerMessages = 50000;
+constexpr int kLedgerSessions = 10;
+constexpr int kMessagesPerGroup = 4;
+constexpr char kHotSession[] = "session_0";
+
+// Builds a ledger of kLedgerMessages messages spread across kLedgerSessions sessions.
+// Shared by all benchmarks; built once.
+slop::Database* GetLedger() {
+  static slop::Database* db = [] {
+    auto* db = new slop::Database();
+    if (!db->Init(":memory:").ok()) return db;
+    (void)db->Execute("BEGIN TRANSACTION;");
+    for (int i = 0; i < kLedgerMessages; ++i) {
+      std::string session_id = absl::StrCat("session_", i % kLedgerSessions);
+      std::string group_id = absl::StrCat("g", (i / kLedgerSessions) / kMessagesPerGroup);
+      const char* role = (i % kMessagesPerGroup == 0) ? "user" : (i % 2 == 0 ? "tool" : "assistant");
+      (void)db->AppendMessage(session_id, role, absl::StrCat("message body ", i, std::string(200, 'x')), "",
+                              "completed", group_id);
+    }
+    (void)db->Execute("COMMIT;");
+    (void)db->AddMemo("Prefer prepared statements for hot queries.", R"(["database","cache"])");
+    (void)db->UpdateScratchpad(kHotSession, "- [ ] measure");
+    (void)db->SetSessionState(kHotSession, "### STATE\nGoal: bench");
+    return db;
+  }();
+  return db;
+}
+
+// Issues the same sequence of Database calls as one agent turn with a single tool call:
+// prompt assembly, response processing and tool result persistence.
+void RunTurn(slop::Database* db, int turn) {
+  std::string group_id = absl::StrCat("bench_", turn);
+  (void)db->AppendMessage(kHotSession, "user", "continue", "", "completed", group_id);
+  (void)db->GetContextSettings(kHotSession);
+  benchmark::DoNotOptimize(db->GetConversationHistory(kHotSession, false, 5));
+  for (int i = 0; i < 3; ++i) benchmark::DoNotOptimize(db->GetEnabledTools());
+  benchmark::DoNotOptimize(db->GetSkills());
+  benchmark::DoNotOptimize(db->GetSessionState(kHotSession));
+  benchmark::DoNotOptimize(db->GetScratchpad(kHotSession));
+  benchmark::DoNotOptimize(db->SearchMemos({"database", "cache"}, 5));
+  auto last_id = db->GetLastMessageId();
+  (void)db->RecordUsage(kHotSession, "bench-model", 100, 20);
+  (void)db->AppendMessage(kHotSession, "assistant", R"({"functionCall":{"name":"read_file"}})", "read_file",
+                          "tool_call", group_id, "gemini", 120);
+  benchmark::DoNotOptimize(db->GetMessagesByGroups({group_id}, last_id.value_or(0)));
+  (void)db->IncrementToolCallCount("read_file");
+  (void)db->AppendMessage(kHotSession, "tool", "file contents", "read_file|read_file", "completed", group_id,
+                          "gemini");
+}
+
+void ReportCacheCounters(benchmark::State& state, const slop::Database::StatementCacheStats& before,
+                         const slop::Database::StatementCacheStats& after) {
+  double hits = static_cast<double>(after.hits - before.hits);
+  double misses = static_cast<double>(after.misses - before.misses);
+  state.counters["hits"] = benchmark::Counter(hits, benchmark::Counter::kAvgIterations);
+  state.counters["misses"] = benchmark::Counter(misses, benchmark::Counter::kAvgIterations);
+  state.counters["hit_rate"] = (hits + misses) > 0 ? hits / (hits + misses) : 0.0;
+}
+
+// Arg: statement cache capacity. 0 reproduces the uncached behaviour (prepare on every call).
+void BM_AgentTurnDbOverhead(benchmark::State& state) {
+  slop::Database* db = GetLedger();
+  db->SetStatementCacheCapacity(static_cast<size_t>(state.range(0)));
+  auto before = db->GetStatementCacheStats();
+  // Across repetitions too: a turn reusing an old group would reload the history window.
+  static int turn = 0;
+  for (auto _ : state) {
+    RunTurn(db, turn++);
+  }
+  ReportCacheCounters(state, before, db->GetStatementCacheStats());
+  db->SetStatementCacheCapacity(slop::Database::kDefaultStatementCacheCapacity);
+}
+BENCHMARK(BM_AgentTurnDbOverhead)->Arg(0)->Arg(slop::Database::kDefaultStatementCacheCapacity);
+
+// Isolates the prepare cost of a typical hot query.
+void BM_PrepareHistoryQuery(benchmark::State& state) {
+  slop::Database* db = GetLedger();
+  db->SetStatementCacheCapacity(static_cast<size_t>(state.range(0)));
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(db->Prepare(
+        "SELECT id, session_id, role, content, tool_call_id, status, created_at, group_id, parsing_strategy, tokens "
+        "FROM stored_messages WHERE group_id IN (?) ORDER BY created_at ASC, id ASC"));
+  }
+  db->SetStatementCacheCapacity(slop::Database::kDefaultStatementCacheCapacity);
+}
+BENCHMARK(BM_PrepareHistoryQuery)->Arg(0)->Arg(slop::Database::kDefaultStatementCacheCapacity);
+
+// The ledger stores four messages per group for each session, so a window of 250
+// groups loads 1k messages.
+constexpr int kHistoryWindowGroups = 250;
+
+void ReportAllocations(benchmark::State& state, int64_t allocations_before, size_t messages) {
+  state.counters["allocs"] = benchmark::Counter(static_cast<double>(g_allocations.load() - allocations_before),
+                                                benchmark::Counter::kAvgIterations);
+  state.counters["messages"] = static_cast<double>(messages);
+}
+
+// Loads a 1k-message history as std::string-backed Messages.
+void BM_LoadHistoryMessages(benchmark::State& state) {
+  slop::Database* db = GetLedger();
+  size_t messages = 0;
+  int64_t before = g_allocations.load();
+  for (auto _ : state) {
+    auto history = db->GetConversationHistory(kHotSession, false, kHistoryWindowGroups);
+    messages = history->size();
+    benchmark::DoNotOptimize(history);
+  }
+  ReportAllocations(state, before, messages);
+}
+BENCHMARK(BM_LoadHistoryMessages);
+
+// Loads the same history into a MessageArena.
+void BM_LoadHistoryArena(benchmark::State& state) {
+  slop::Database* db = GetLedger();
+  size_t messages = 0;
+  int64_t before = g_allocations.load();
+  for (auto _ : state) {
+    slop::Database::MessageArena arena;
+    auto history = db->GetConversationHistoryViews(kHotSession, &arena, false, kHistoryWindowGroups);
+    messages = history->size();
+    benchmark::DoNotOptimize(history);
+  }
+  ReportAllocations(state, before, messages);
+}
+BENCHMARK(BM_LoadHistoryArena);
+
+// Visits the same history without materializing it.
+void BM_VisitHistory(benchmark::State& state) {
+  slop::Database* db = GetLedger();
+  size_t messages = 0;
+  int64_t before = g_allocations.load();
+  for (auto _ : state) {
+    size_t bytes = 0;
+    messages = 0;
+    (void)db->VisitConversationHistory(kHotSession, false, kHistoryWindowGroups,
+                                       [&](const slop::Database::MessageView& m) {
+                                         bytes += m.content.size();
+                                         messages++;
+                                       });
+    benchmark::DoNotOptimize(bytes);
+  }
+  ReportAllocations(state, before, messages);
+}
+BENCHMARK(BM_VisitHistory);
+
+// One iteration of the interaction loop's history reads: a message is appended and
+// the prompt window is read again. Arg: history cache capacity, 0 = read in full.
+void BM_HistoryAfterAppend(benchmark::State& state) {
+  slop::Database* db = GetLedger();
+  db->SetHistoryCacheCapacity(static_cast<size_t>(state.range(0)));
+  auto before = db->GetHistoryCacheStats();
+  static int turn = 0;
+  for (auto _ : state) {
+    (void)db->AppendMessage(kHotSession, "tool", "file contents", "read_file|read_file", "completed",
+                            absl::StrCat("append_", turn++ / kMessagesPerGroup), "gemini");
+    size_t bytes = 0;
+    (void)db->VisitConversationHistory(kHotSession, false, kHistoryWindowGroups,
+                                       [&](const slop::Database::MessageView& m) { bytes += m.content.size(); });
+    benchmark::DoNotOptimize(bytes);
+  }
+  auto after = db->GetHistoryCacheStats();
+  state.counters["hits"] =
+      benchmark::Counter(static_cast<double>(after.hits - before.hits), benchmark::Counter::kAvgIterations);
+  state.counters["misses"] =
+      benchmark::Counter(static_cast<double>(after.misses - before.misses), benchmark::Counter::kAvgIterations);
+  db->SetHistoryCacheCapacity(slop::Database::kDefaultHistoryCacheCapacity);
+}
+BENCHMARK(BM_HistoryAfterAppend)->Arg(0)->Arg(slop::Database::kDefaultHistoryCacheCapacity);
+
+// A careless query_db over the whole ledger. Arg: 0 = no limits, 1 = query_db's.
+void BM_QueryWholeLedger(benchmark::State& state) {
+  slop::Database* db = GetLedger();
+  slop::Database::QueryOptions options;
+  if (state.range(0) != 0) {
+    options.max_bytes = slop::ToolExecutor::kQueryDbMaxBytes;
+    options.max_rows = slop::ToolExecutor::kQueryDbMaxRows;
+  }
+  size_t bytes = 0;
+  int64_t before = g_allocations.load();
+  for (auto _ : state) {
+    auto result = db->Query("SELECT * FROM messages_resolved", {}, options);
+    if (!result.ok()) {
+      state.SkipWithError("query failed");
+      return;
+    }
+    bytes = result->output.size();
+    benchmark::DoNotOptimize(result);
+  }
+  state.counters["bytes"] = static_cast<double>(bytes);
+  state.counters["allocs"] = benchmark::Counter(static_cast<double>(g_allocations.load() - before),
+                                                benchmark::Counter::kAvgIterations);
+}
+BENCHMARK(BM_QueryWholeLedger)->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond);
+
+constexpr int kParallelToolCalls = 16;
+
+// Persists one LLM turn with kParallelToolCalls tool calls the way the interaction loop
+// does: the response (usage, one message per call, session state), then every tool
+// result. With `batched`, each of the two phases is a single WriteBatch.
+void PersistToolTurn(slop::Database* db, int turn, bool batched) {
+  std::string group_id = absl::StrCat("turn_", turn);
+  {
+    std::unique_ptr<slop::Database::WriteBatch> batch;
+    if (batched) batch = *db->BeginWriteBatch();
+    (void)db->RecordUsage(kHotSession, "bench-model", 1000, 200);
+    for (int i = 0; i < kParallelToolCalls; ++i) {
+      (void)db->AppendMessage(kHotSession, "assistant", R"({"functionCall":{"name":"read_file"}})", "read_file",
+                              "tool_call", group_id, "gemini", 1200);
+    }
+    (void)db->SetSessionState(kHotSession, absl::StrCat("### STATE\nTurn: ", turn));
+    if (batch) (void)batch->Commit();
+  }
+  {
+    std::unique_ptr<slop::Database::WriteBatch> batch;
+    if (batched) batch = *db->BeginWriteBatch();
+    for (int i = 0; i < kParallelToolCalls; ++i) {
+      (void)db->AppendMessage(kHotSession, "tool", std::string(512, 'r'), absl::StrCat("call_", i, "|read_file"),
+                              "completed", group_id, "gemini");
+    }
+    if (batch) (void)batch->Commit();
+  }
+}
+
+// Arg: 0 = one autocommit transaction per write (previous behaviour), 1 = batched.
+// Runs against a file-backed WAL database so that commits pay for their fsync.
+void BM_ToolTurnWrites(benchmark::State& state) {
+  std::string path = (std::filesystem::temp_directory_path() / "slop_bench_write_batch.db").string();
+  for (const char* suffix : {"", "-wal", "-shm"}) std::remove(absl::StrCat(path, suffix).c_str());
+
+  slop::Database db;
+  if (!db.Init(path).ok()) {
+    state.SkipWithError("failed to open database");
+    return;
+  }
+  bool batched = state.range(0) != 0;
+  int64_t commits_before = db.GetCommitCount();
+  int turn = 0;
+  for (auto _ : state) {
+    PersistToolTurn(&db, turn++, batched);
+  }
+  state.counters["commits"] = benchmark::Counter(static_cast<double>(db.GetCommitCount() - commits_before),
+                                                 benchmark::Counter::kAvgIterations);
+}
+BENCHMARK(BM_ToolTurnWrites)->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond);
+
+// The ledger updates of kParallelToolCalls tool calls, each made on its own dispatcher
+// thread as ToolExecutor and the orchestrator do, then read back once as the next
+// turn's prompt assembly does. Runs against a file-backed WAL database.
+void BM_ToolCallLedgerUpdates(benchmark::State& state) {
+  std::string path = (std::filesystem::temp_directory_path() / "slop_bench_ledger_updates.db").string();
+  for (const char* suffix : {"", "-wal", "-shm"}) std::remove(absl::StrCat(path, suffix).c_str());
+
+  slop::Database db;
+  if (!db.Init(path).ok()) {
+    state.SkipWithError("failed to open database");
+    return;
+  }
+  int64_t commits_before = db.GetCommitCount();
+  for (auto _ : state) {
+    std::vector<std::thread> threads;
+    for (int i = 0; i < kParallelToolCalls; ++i) {
+      threads.emplace_back([&db] {
+        (void)db.IncrementToolCallCount("read_file");
+        (void)db.RecordUsage(kHotSession, "bench-model", 1000, 200);
+      });
+    }
+    for (auto& t : threads) t.join();
+    benchmark::DoNotOptimize(db.GetEnabledTools());
+  }
+  state.counters["commits"] = benchmark::Counter(static_cast<double>(db.GetCommitCount() - commits_before),
+                                                 benchmark::Counter::kAvgIterations);
+}
+BENCHMARK(BM_ToolCallLedgerUpdates)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// Usage rows spread over 50 sessions, 4 models and 180 days, inserted through the
+// rollup triggers. Arg 0: rows. Arg 1: 0 = per-model SUM over the raw usage rows (the
+// previous /stats and GetTotalUsage), 1 = GetUsageByModel() over the rollup, priced.
+void BM_UsageByModel(benchmark::State& state) {
+  slop::Database db;
+  if (!db.Init(":memory:").ok()) {
+    state.SkipWithError("failed to open database");
+    return;
+  }
+  (void)db.SetModelPrice({"bench-model-*", 1.25, 10.0});
+  absl::Status status = db.Execute(absl::StrCat(
+      "WITH RECURSIVE n(i) AS (SELECT 0 UNION ALL SELECT i + 1 FROM n WHERE i + 1 < ", state.range(0),
+      ") INSERT INTO usage (session_id, model, prompt_tokens, completion_tokens, total_tokens, created_at) "
+      "SELECT 'session_' || (i % 50), 'bench-model-' || (i % 4), 1000, 200, 1200, "
+      "datetime('now', '-' || (i % 180) || ' days') FROM n"));
+  if (!status.ok()) {
+    state.SkipWithError("failed to fill the ledger");
+    return;
+  }
+  bool rollup = state.range(1) != 0;
+  for (auto _ : state) {
+    if (rollup) {
+      benchmark::DoNotOptimize(db.GetUsageByModel());
+    } else {
+      benchmark::DoNotOptimize(
+          db.Query("SELECT model, COUNT(*), SUM(prompt_tokens), SUM(completion_tokens), SUM(total_tokens) "
+                   "FROM usage GROUP BY model"));
+    }
+  }
+}
+BENCHMARK(BM_UsageByModel)
+    ->ArgsProduct({{10000, 100000}, {0, 1}})
+    ->ArgNames({"rows", "rollup"})
+    ->Unit(benchmark::kMicrosecond);
+
+// A ledger whose tool results are the repository's own sources, as read_file would
+// return them, next to short user and assistant messages.
+constexpr int kRealLedgerTurns = 400;
+
+struct RealLedger {
+  std::unique_ptr<slop::Database> db;
+  double db_bytes = 0;
+  double content_bytes = 0;
+};
+
+std::vector<std::string> ReadSourceFiles() {
+  std::vector<std::string> files;
+  std::filesystem::path dir = std::filesystem::path(__FILE__).parent_path();
+  std::error_code ec;
+  for (const auto& entry : std::filesystem::directory_iterator(dir, ec)) {
+    std::string ext = entry.path().extension().string();
+    if (ext != ".cpp" && ext != ".h") continue;
+    std::ifstream in(entry.path());
+    std::stringstream ss;
+    ss << in.rdbuf();
+    files.push_back(ss.str());
+  }
+  return files;
+}
+
+// Built once per compression setting: 0 = stored as text, 1 = compressed.
+RealLedger* GetRealLedger(bool compressed) {
+  static RealLedger* ledgers[2] = {nullptr, nullptr};
+  RealLedger*& ledger = ledgers[compressed ? 1 : 0];
+  if (ledger != nullptr) return ledger;
+
+  ledger = new RealLedger();
+  std::vector<std::string> files = ReadSourceFiles();
+  if (files.empty()) return ledger;
+  std::string path =
+      (std::filesystem::temp_directory_path() / absl::StrCat("slop_bench_real_ledger_", compressed, ".db")).string();
+  for (const char* suffix : {"", "-wal", "-shm"}) std::remove(absl::StrCat(path, suffix).c_str());
+
+  auto db = std::make_unique<slop::Database>();
+  if (!db->Init(path).ok()) return ledger;
+  db->SetCompressionThreshold(compressed ? slop::Database::kDefaultCompressionThreshold : 0);
+  for (int turn = 0; turn < kRealLedgerTurns; ++turn) {
+    auto batch = db->BeginWriteBatch();
+    if (!batch.ok()) return ledger;
+    std::string group_id = absl::StrCat("g", turn);
+    const std::string& file = files[turn % files.size()];
+    (void)db->AppendMessage(kHotSession, "user", "Read the next file and summarize it.", "", "completed", group_id);
+    (void)db->AppendMessage(kHotSession, "assistant", R"({"functionCall":{"name":"read_file"}})", "read_file",
+                            "tool_call", group_id, "gemini");
+    (void)db->AppendMessage(kHotSession, "tool", file, "read_file|read_file", "completed", group_id, "gemini");
+    (void)db->AppendMessage(kHotSession, "assistant", "Summary.\n### STATE\nGoal: read", "", "completed", group_id,
+                            "gemini");
+    ledger->content_bytes += file.size();
+    (void)(*batch)->Commit();
+  }
+  (void)db->Execute("PRAGMA wal_checkpoint(TRUNCATE);");
+  ledger->db_bytes = static_cast<double>(std::filesystem::file_size(path));
+  ledger->db = std::move(db);
+  return ledger;
+}
+
+void ReportLedger(benchmark::State& state, const RealLedger& ledger) {
+  state.counters["db_bytes"] = ledger.db_bytes;
+  state.counters["tool_bytes"] = ledger.content_bytes;
+}
+
+// Arg: 0 = text, 1 = compressed. Loads the whole history, inflating every message.
+void BM_RealLedgerHistory(benchmark::State& state) {
+  RealLedger* ledger = GetRealLedger(state.range(0) != 0);
+  if (!ledger->db) {
+    state.SkipWithError("no source files to build the ledger from");
+    return;
+  }
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(ledger->db->GetConversationHistory(kHotSession));
+  }
+  ReportLedger(state, *ledger);
+}
+BENCHMARK(BM_RealLedgerHistory)->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond);
+
+// Arg: 0 = text, 1 = compressed. Assembles a prompt over the whole ledger: tool
+// results outside the active turn are cut to a head and tail, and compressed ones
+// are only inflated that far.
+void BM_RealLedgerAssemblePrompt(benchmark::State& state) {
+  RealLedger* ledger = GetRealLedger(state.range(0) != 0);
+  if (!ledger->db) {
+    state.SkipWithError("no source files to build the ledger from");
+    return;
+  }
+  (void)ledger->db->SetContextWindow(kHotSession, 0);
+  slop::HttpClient http;
+  auto orchestrator = slop::Orchestrator::Builder(ledger->db.get(), &http).Build();
+  if (!orchestrator.ok()) {
+    state.SkipWithError("failed to build orchestrator");
+    return;
+  }
+  for (auto _ : state) {
+    benchmark::DoNotOptimize((*orchestrator)->AssemblePrompt(kHotSession));
+  }
+  ReportLedger(state, *ledger);
+}
+BENCHMARK(BM_RealLedgerAssemblePrompt)->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond);
+
+// Arg: 0 = text, 1 = compressed. Reads a five-turn prompt context in one snapshot,
+// with the average time of each section as counters.
+void BM_RealLedgerLoadPromptContext(benchmark::State& state) {
+  RealLedger* ledger = GetRealLedger(state.range(0) != 0);
+  if (!ledger->db) {
+    state.SkipWithError("no source files to build the ledger from");
+    return;
+  }
+  (void)ledger->db->SetContextWindow(kHotSession, 5);
+  slop::HttpClient http;
+  auto orchestrator = slop::Orchestrator::Builder(ledger->db.get(), &http).Build();
+  if (!orchestrator.ok()) {
+    state.SkipWithError("failed to build orchestrator");
+    return;
+  }
+  slop::Orchestrator::PromptContext::Timings sum;
+  for (auto _ : state) {
+    auto context = (*orchestrator)->LoadPromptContext(kHotSession);
+    if (!context.ok()) {
+      state.SkipWithError("failed to load the prompt context");
+      return;
+    }
+    sum.session += context->timings.session;
+    sum.history += context->timings.history;
+    sum.tools += context->timings.tools;
+    sum.memos += context->timings.memos;
+  }
+  auto average_us = [](absl::Duration d) {
+    return benchmark::Counter(absl::ToDoubleMicroseconds(d), benchmark::Counter::kAvgIterations);
+  };
+  state.counters["session_us"] = average_us(sum.session);
+  state.counters["history_us"] = average_us(sum.history);
+  state.counters["tools_us"] = average_us(sum.tools);
+  state.counters["memos_us"] = average_us(sum.memos);
+  ReportLedger(state, *ledger);
+}
+BENCHMARK(BM_RealLedgerLoadPromptContext)->Arg(0)->Arg(1)->Unit(benchmark::kMicrosecond);
+
+// A window of 200 messages, a tenth of them tool calls and results, and a loop of
+// 30 tool calls on top of it.
+constexpr int kPayloadWindowMessages = 200;
+constexpr int kPayloadLoopSteps = 30;
+
+slop::Database::Message PayloadMessage(const std::string& role, const std::string& content,
+                                       const std::string& tool_call_id = "", const std::string& status = "completed") {
+  slop::Database::Message m{};
+  m.session_id = kHotSession;
+  m.role = role;
+  m.content = content;
+  m.tool_call_id = tool_call_id;
+  m.status = status;
+  return m;
+}
+
+// Arg: 0 = each request serialized in full, by a new strategy, 1 = by the same
+// strategy, which serializes only what was appended. Each iteration runs
+// a tool loop of kPayloadLoopSteps requests over a kPayloadWindowMessages window,
+// each request resending the last one's history with a call and its result
+// appended. Reports requests/s.
+void BM_ToolLoopPayload(benchmark::State& state) {
+  slop::Database db;
+  if (!db.Init(":memory:").ok()) {
+    state.SkipWithError("failed to open database");
+    return;
+  }
+  slop::HttpClient http;
+  slop::GeminiOrchestrator strategy(&db, &http, "gemini-2.5-flash", "");
+  const std::string system_instruction(20000, 's');
+  const std::string call = R"({"functionCall":{"name":"read_file","args":{"path":"core/database.cpp"}}})";
+
+  std::vector<slop::Database::Message> window;
+  for (int i = 0; i < kPayloadWindowMessages; ++i) {
+    std::string body = absl::StrCat("message ", i, " \"quoted\"\n", std::string(800, 'x'));
+    if (i % 20 == 18) {
+      window.push_back(PayloadMessage("assistant", call, "read_file", "tool_call"));
+    } else if (i % 20 == 19) {
+      window.push_back(PayloadMessage("tool", body, "read_file|read_file"));
+    } else {
+      window.push_back(PayloadMessage(i % 2 == 0 ? "user" : "assistant", body));
+    }
+  }
+
+  bool incremental = state.range(0) != 0;
+  for (auto _ : state) {
+    std::vector<slop::Database::Message> history = window;
+    for (int step = 0; step < kPayloadLoopSteps; ++step) {
+      if (incremental) {
+        benchmark::DoNotOptimize(strategy.SerializePayload(kHotSession, system_instruction, history, "context", ""));
+      } else {
+        slop::GeminiOrchestrator fresh(&db, &http, "gemini-2.5-flash", "");
+        benchmark::DoNotOptimize(fresh.SerializePayload(kHotSession, system_instruction, history, "context", ""));
+      }
+      history.push_back(PayloadMessage("assistant", call, "read_file", "tool_call"));
+      history.push_back(PayloadMessage("tool", std::string(2000, 'r'), "read_file|read_file"));
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * kPayloadLoopSteps);
+}
+BENCHMARK(BM_ToolLoopPayload)->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond);
+
+// Arg: 0 = a document of nlohmann::json nodes, dumped; 1 = SerializePayload(),
+// which writes straight into one reserved buffer. Serializes a 2 MB prompt from
+// scratch: the two windows alternated between differ from their first message on,
+// so no entry is reused. Reports bytes/s.
+void BM_SerializeLargePrompt(benchmark::State& state) {
+  slop::Database db;
+  if (!db.Init(":memory:").ok()) {
+    state.SkipWithError("failed to open database");
+    return;
+  }
+  auto manifest = db.GetToolManifest();
+  if (!manifest.ok()) {
+    state.SkipWithError("failed to load tools");
+    return;
+  }
+  slop::HttpClient http;
+  slop::GeminiOrchestrator strategy(&db, &http, "gemini-2.5-flash", "");
+  const std::string system_instruction(20000, 's');
+  // Tool output: code, with quotes, backslashes, newlines and some UTF-8.
+  std::string output;
+  while (output.size() < 5000) output += "  if (s == \"\\n\") return caf\xC3\xA9;\n\tx = y;  // \xE2\x82\xAC ok\n";
+
+  std::vector<slop::Database::Message> windows[2];
+  size_t bytes = 0;
+  for (int i = 0; bytes < (2 << 20); ++i) {
+    const std::string& role = i % 2 == 0 ? "user" : "assistant";
+    for (auto& window : windows) window.push_back(PayloadMessage(role, output));
+    bytes += output.size();
+  }
+  windows[1][0].content = "another first message";
+
+  bool streaming = state.range(0) != 0;
+  size_t body_bytes = 0;
+  int iteration = 0;
+  for (auto _ : state) {
+    const auto& history = windows[iteration++ % 2];
+    if (streaming) {
+      auto body = strategy.SerializePayload(kHotSession, system_instruction, history, "", "");
+      body_bytes = body->size();
+      benchmark::DoNotOptimize(body);
+    } else {
+      nlohmann::json contents = nlohmann::json::array();
+      for (const auto& m : history) {
+        contents.push_back({{"role", m.role == "assistant" ? "model" : m.role}, {"parts", {{{"text", m.content}}}}});
+      }
+      nlohmann::json payload = {{"contents", std::move(contents)},
+                                {"system_instruction", {{"parts", {{{"text", system_instruction}}}}}},
+                                {"tools", strategy.ToolDeclarations(*manifest)}};
+      std::string body = payload.dump(-1, ' ', false, nlohmann::json::error_handler_t::replace);
+      body_bytes = body.size();
+      benchmark::DoNotOptimize(body);
+    }
+  }
+  state.SetBytesProcessed(state.iterations() * body_bytes);
+}
+BENCHMARK(BM_SerializeLargePrompt)->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond);
+
+// EstimateTokens, as AppendMessage runs it on every message, over the repository's
+// sources. Reports bytes/s.
+void BM_EstimateTokens(benchmark::State& state) {
+  std::string text;
+  for (const std::string& file : ReadSourceFiles()) text += file;
+  int64_t tokens = 0;
+  for (auto _ : state) {
+    tokens = slop::Database::EstimateTokens(text);
+    benchmark::DoNotOptimize(tokens);
+  }
+  state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(text.size()));
+  state.counters["bytes_per_token"] = static_cast<double>(text.size()) / std::max<int64_t>(tokens, 1);
+}
+BENCHMARK(BM_EstimateTokens)->Unit(benchmark::kMillisecond);
+
+constexpr int kMemos = 10000;
+
+// kMemos memos whose content and tags are drawn from a fixed vocabulary, some
+// tags compound ("arch-decision") the way save_memo callers write them.
+slop::Database* GetMemoStore() {
+  static slop::Database* db = [] {
+    const std::vector<std::string> words = absl::StrSplit(
+        "sqlite cache parser thread mutex index schema prompt token session history memo skill tool patch branch "
+        "build bazel test stream json http gemini openai context window truncate state compress blob dictionary writer",
+        ' ');
+    auto* db = new slop::Database();
+    if (!db->Init(":memory:").ok()) return db;
+    (void)db->Execute("BEGIN TRANSACTION;");
+    for (int i = 0; i < kMemos; ++i) {
+      const std::string& a = words[i % words.size()];
+      const std::string& b = words[(i / words.size()) % words.size()];
+      const std::string& c = words[(i * 7 + 3) % words.size()];
+      std::string content = absl::StrCat("When touching the ", a, " code, check the ", b, " and ", c,
+                                         " paths first; memo ", i, ".");
+      std::string tags = absl::StrCat(R"([")", a, R"(", ")", b, "-", c, R"("])");
+      (void)db->AddMemo(content, tags);
+    }
+    (void)db->Execute("COMMIT;");
+    return db;
+  }();
+  return db;
+}
+
+// Arg: 0 = GetMemosByTags (memo_tags lookup, ranked by matching tags), 1 = SearchMemos
+// (FTS5, BM25-ranked). Both return the top 5, as FindRelevantMemos would ask for.
+void BM_MemoRetrieval(benchmark::State& state) {
+  slop::Database* db = GetMemoStore();
+  std::vector<std::string> tags =
+      slop::Database::ExtractTags("The sqlite writer deadlocks when the dictionary is trained mid-turn");
+  bool fts = state.range(0) != 0;
+  size_t found = 0;
+  for (auto _ : state) {
+    auto memos = fts ? db->SearchMemos(tags, 5) : db->GetMemosByTags(tags, 5);
+    if (!memos.ok()) {
+      state.SkipWithError("memo retrieval failed");
+      return;
+    }
+    found = memos->size();
+    benchmark::DoNotOptimize(memos);
+  }
+  state.counters["memos_returned"] = found;
+}
+BENCHMARK(BM_MemoRetrieval)->Arg(0)->Arg(1)->Unit(benchmark::kMicrosecond);
+
+// Per-method benchmarks over generated ledgers of 1k, 100k and 1M messages, shaped
+// by slop::LedgerSpec. Registered as BM_Ledger/<Method>/messages:<n>; each ledger
+// is built (untimed) the first time a benchmark asks for its size, so filtering by
+// size, e.g. --benchmark_filter='BM_Ledger/.*/messages:1000$', skips the larger ones.
+// Write benchmarks add rows as they run; their paired calls (e.g. CloneSession
+// and DeleteSession) keep the ledger's size stable where they can.
+// scripts/benchmark.sh runs this binary with JSON output for comparing commits.
+constexpr int64_t kLedgerSizes[] = {1000, 100000, 1000000};
+
+std::string GeneratedLedgerPath(int64_t messages) {
+  return (std::filesystem::temp_directory_path() / absl::StrCat("slop_bench_ledger_", messages, ".db")).string();
+}
+
+absl::flat_hash_map<int64_t, std::unique_ptr<slop::Database>>& GeneratedLedgers() {
+  static auto* ledgers = new absl::flat_hash_map<int64_t, std::unique_ptr<slop::Database>>();
+  return *ledgers;
+}
+
+// The 1M-message ledger takes a few GB of disk; do not leave it behind.
+void RemoveGeneratedLedgers() {
+  for (auto& [messages, db] : GeneratedLedgers()) {
+    db.reset();
+    for (const char* suffix : {"", "-wal", "-shm"}) {
+      std::remove(absl::StrCat(GeneratedLedgerPath(messages), suffix).c_str());
+    }
+  }
+}
+
+slop::Database* GetGeneratedLedger(int64_t messages) {
+  auto& db = GeneratedLedgers()[messages];
+  if (db) return db.get();
+  static const bool cleanup_registered = std::atexit(RemoveGeneratedLedgers) == 0;
+  (void)cleanup_registered;
+  std::string path = GeneratedLedgerPath(messages);
+  for (const char* suffix : {"", "-wal", "-shm"}) std::remove(absl::StrCat(path, suffix).c_str());
+  db = std::make_unique<slop::Database>();
+  if (!db->Init(path).ok() || !slop::GenerateLedger(db.get(), slop::LedgerSpec::WithMessages(messages)).ok()) {
+    db.reset();
+    return nullptr;
+  }
+  (void)db->AddMemo("Prefer prepared statements for hot queries.", R"(["database","cache"])");
+  (void)db->UpdateScratchpad(kHotSession, "- [ ] measure");
+  (void)db->SetSessionState(kHotSession, "### STATE\nGoal: bench");
+  return db.get();
+}
+
+using LedgerOp = std::function<absl::Status(slop::Database*, int64_t)>;
+
+// Wraps a call whose result is a StatusOr so that it can be a LedgerOp.
+template <typename F>
+LedgerOp Read(F f) {
+  return [f](slop::Database* db, int64_t i) -> absl::Status {
+    auto result = f(db, i);
+    benchmark::DoNotOptimize(result);
+    return result.status();
+  };
+}
+
+const std::string& LastGroup() {
+  static const std::string group =
+      slop::LedgerGroupId(slop::LedgerSpec::WithMessages(kLedgerSizes[0]).groups_per_session - 1);
+  return group;
+}
+
+const std::vector<std::pair<const char*, LedgerOp>>& LedgerOps() {
+  static const auto* ops = new std::vector<std::pair<const char*, LedgerOp>>{
+      // Messages and history.
+      {"AppendMessage",
+       [](slop::Database* db, int64_t i) {
+         return db->AppendMessage(kHotSession, "assistant", absl::StrCat("bench reply ", i), "", "completed",
+                                  absl::StrCat("bench_", i), "gemini", 10);
+       }},
+      {"UpdateMessageStatus",
+       [](slop::Database* db, int64_t i) {
+         return db->UpdateMessageStatus(kHotSession, 1, i % 2 == 0 ? "dropped" : "completed");
+       }},
+      {"GetConversationHistory",
+       Read([](slop::Database* db, int64_t) { return db->GetConversationHistory(kHotSession); })},
+      {"GetConversationHistoryWindow5",
+       Read([](slop::Database* db, int64_t) { return db->GetConversationHistory(kHotSession, false, 5); })},
+      {"GetConversationHistoryViews",
+       Read([](slop::Database* db, int64_t) {
+         slop::Database::MessageArena arena;
+         return db->GetConversationHistoryViews(kHotSession, &arena, false, 5);
+       })},
+      {"VisitConversationHistory",
+       [](slop::Database* db, int64_t) {
+         size_t bytes = 0;
+         absl::Status status = db->VisitConversationHistory(
+             kHotSession, false, 5, [&](const slop::Database::MessageView& m) { bytes += m.content.size(); });
+         benchmark::DoNotOptimize(bytes);
+         return status;
+       }},
+      {"GetMessagesByGroups",
+       Read([](slop::Database* db, int64_t) { return db->GetMessagesByGroups({LastGroup()}); })},
+      {"GetLastGroupId", Read([](slop::Database* db, int64_t) { return db->GetLastGroupId(kHotSession); })},
+      {"GetLastMessageId", Read([](slop::Database* db, int64_t) { return db->GetLastMessageId(); })},
+      {"SearchMessages",
+       Read([](slop::Database* db, int64_t) { return db->SearchMessages({"rollback", "schema"}, kHotSession, 10); })},
+      // Usage.
+      {"RecordUsage",
+       [](slop::Database* db, int64_t) {
+         RETURN_IF_ERROR(db->RecordUsage(kHotSession, "bench-model", 1000, 200));
+         return db->FlushPendingWrites();
+       }},
+      {"GetTotalUsage", Read([](slop::Database* db, int64_t) { return db->GetTotalUsage(); })},
+      {"GetUsageByModel", Read([](slop::Database* db, int64_t) { return db->GetUsageByModel(); })},
+      {"GetUsageByDay", Read([](slop::Database* db, int64_t) { return db->GetUsageByDay("", 7); })},
+      {"SetModelPrice",
+       [](slop::Database* db, int64_t i) {
+         return db->SetModelPrice({"bench-*", 1.0 + static_cast<double>(i % 2), 2.0});
+       }},
+      {"GetModelPrices", Read([](slop::Database* db, int64_t) { return db->GetModelPrices(); })},
+      // Tools and skills.
+      {"RegisterTool",
+       [](slop::Database* db, int64_t) {
+         return db->RegisterTool({"bench_tool", "A benchmark tool.", R"({"type":"object"})", false});
+       }},
+      {"GetEnabledTools", Read([](slop::Database* db, int64_t) { return db->GetEnabledTools(); })},
+      {"IncrementToolCallCount",
+       [](slop::Database* db, int64_t) {
+         RETURN_IF_ERROR(db->IncrementToolCallCount("read_file"));
+         return db->FlushPendingWrites();
+       }},
+      {"RegisterSkill",
+       [](slop::Database* db, int64_t) {
+         return db->RegisterSkill({0, "bench_skill", "A benchmark skill.", "Be brief."});
+       }},
+      {"UpdateSkill",
+       [](slop::Database* db, int64_t i) {
+         RETURN_IF_ERROR(db->RegisterSkill({0, "bench_skill", "A benchmark skill.", "Be brief."}));
+         return db->UpdateSkill({0, "bench_skill", absl::StrCat("Revision ", i), "Be brief."});
+       }},
+      {"DeleteSkill",
+       [](slop::Database* db, int64_t) {
+         RETURN_IF_ERROR(db->RegisterSkill({0, "bench_skill_deleted", "A benchmark skill.", "Be brief."}));
+         return db->DeleteSkill("bench_skill_deleted");
+       }},
+      {"GetSkills", Read([](slop::Database* db, int64_t) { return db->GetSkills(); })},
+      {"SetToolEnabled",
+       [](slop::Database* db, int64_t) {
+         RETURN_IF_ERROR(db->RegisterTool({"bench_tool_toggled", "A benchmark tool.", R"({"type":"object"})", true}));
+         return db->SetToolEnabled("bench_tool_toggled", false);
+       }},
+      {"GetToolManifest", Read([](slop::Database* db, int64_t) { return db->GetToolManifest(); })},
+      {"IncrementSkillActivationCount",
+       [](slop::Database* db, int64_t) {
+         RETURN_IF_ERROR(db->IncrementSkillActivationCount("planner"));
+         return db->FlushPendingWrites();
+       }},
+      // Session settings and state.
+      {"SetActiveSkills",
+       [](slop::Database* db, int64_t) { return db->SetActiveSkills(kHotSession, {"planner", "dba"}); }},
+      {"GetActiveSkills", Read([](slop::Database* db, int64_t) { return db->GetActiveSkills(kHotSession); })},
+      {"SetContextWindow",
+       [](slop::Database* db, int64_t i) { return db->SetContextWindow(kHotSession, 5 + static_cast<int>(i % 2)); }},
+      {"GetContextSettings",
+       Read([](slop::Database* db, int64_t) { return db->GetContextSettings(kHotSession); })},
+      {"GetBudgetWindowSize",
+       Read([](slop::Database* db, int64_t) {
+         return db->GetBudgetWindowSize(kHotSession, 64000, {1250, 100, 30, 5});
+       })},
+      {"SetSessionState",
+       [](slop::Database* db, int64_t i) {
+         return db->SetSessionState(kHotSession, absl::StrCat("### STATE\nTurn: ", i));
+       }},
+      {"GetSessionState", Read([](slop::Database* db, int64_t) { return db->GetSessionState(kHotSession); })},
+      {"UpdateScratchpad",
+       [](slop::Database* db, int64_t i) { return db->UpdateScratchpad(kHotSession, absl::StrCat("- [ ] ", i)); }},
+      {"GetScratchpad", Read([](slop::Database* db, int64_t) { return db->GetScratchpad(kHotSession); })},
+      {"CloneAndDeleteSession",
+       [](slop::Database* db, int64_t) {
+         RETURN_IF_ERROR(db->CloneSession(kHotSession, "bench_clone"));
+         return db->DeleteSession("bench_clone");
+       }},
+      // Memos.
+      {"AddAndDeleteMemo",
+       [](slop::Database* db, int64_t i) {
+         RETURN_IF_ERROR(db->AddMemo(absl::StrCat("Benchmark memo ", i), R"(["bench","cache"])"));
+         ASSIGN_OR_RETURN(auto stmt, db->Prepare("SELECT MAX(id) FROM llm_memos"));
+         ASSIGN_OR_RETURN(bool row, stmt->Step());
+         if (!row) return absl::NotFoundError("memo not added");
+         return db->DeleteMemo(stmt->ColumnInt(0));
+       }},
+      {"UpdateMemo",
+       [](slop::Database* db, int64_t i) {
+         return db->UpdateMemo(1, absl::StrCat("Revised memo ", i), R"(["database","cache"])");
+       }},
+      {"GetMemo", Read([](slop::Database* db, int64_t) { return db->GetMemo(1); })},
+      {"GetMemosByTags",
+       Read([](slop::Database* db, int64_t) { return db->GetMemosByTags({"database", "schema"}, 5); })},
+      {"GetAllMemos", Read([](slop::Database* db, int64_t) { return db->GetAllMemos(); })},
+      {"SearchMemos", Read([](slop::Database* db, int64_t) { return db->SearchMemos({"rollback", "cache"}, 5); })},
+      // Ad-hoc SQL, as query_db issues it.
+      {"Query",
+       Read([](slop::Database* db, int64_t) {
+         return db->Query("SELECT role, COUNT(*) AS n FROM messages WHERE session_id = ? GROUP BY role",
+                          {kHotSession});
+       })},
+  };
+  return *ops;
+}
+
+void RunLedgerOp(benchmark::State& state, const LedgerOp& op) {
+  slop::Database* db = GetGeneratedLedger(state.range(0));
+  if (db == nullptr) {
+    state.SkipWithError("failed to generate the ledger");
+    return;
+  }
+  int64_t i = 0;
+  for (auto _ : state) {
+    absl::Status status = op(db, i++);
+    if (!status.ok()) {
+      state.SkipWithError(std::string(status.message()).c_str());
+      return;
+    }
+  }
+}
+
+const bool kLedgerOpsRegistered = [] {
+  for (const auto& [name, op] : LedgerOps()) {
+    auto* bm = benchmark::RegisterBenchmark(absl::StrCat("BM_Ledger/", name).c_str(),
+                                            [&op = op](benchmark::State& state) { RunLedgerOp(state, op); });
+    for (int64_t n : kLedgerSizes) bm->Arg(n);
+    bm->ArgName("messages")->Unit(benchmark::kMicrosecond);
+  }
+  return true;
+}();
+
+}  // namespace
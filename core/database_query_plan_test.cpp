@@ -0,0 +1,198 @@
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "absl/strings/match.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_join.h"
+
+#include "core/database.h"
+
+#include <gtest/gtest.h>
+#include <nlohmann/json.hpp>
+
+namespace {
+
+// The hot queries issued on every agent turn. Keep these in sync with core/database.cpp and
+// interface/command_handler.cpp; a query that is added or reshaped there belongs here too.
+struct HotQuery {
+  std::string name;
+  std::string sql;
+};
+
+std::vector<HotQuery> HotQueries() {
+  const std::string columns =
+      "SELECT id, session_id, role, IFNULL(content, (SELECT content FROM blobs WHERE hash = stored_messages.content_hash)), "
+      "tool_call_id, status, created_at, group_id, parsing_strategy, tokens ";
+  const std::string lineage =
+      "WITH RECURSIVE lineage(lineage_session_id, lineage_last_id) AS ("
+      "SELECT ?1, 9223372036854775807 "
+      "UNION ALL SELECT s.parent_id, MIN(l.lineage_last_id, s.branch_message_id) FROM lineage l "
+      "JOIN sessions s ON s.id = l.lineage_session_id WHERE s.parent_id IS NOT NULL) ";
+  const std::string lineage_columns =
+      "SELECT id, session_id, role, IFNULL(content, (SELECT content FROM blobs WHERE hash = stored_messages.content_hash)), "
+      "tool_call_id, IFNULL(override_status, status), created_at, group_id, parsing_strategy, tokens ";
+  const std::string lineage_messages =
+      "FROM lineage CROSS JOIN stored_messages ON session_id = lineage_session_id AND id <= lineage_last_id "
+      "LEFT JOIN message_overrides ON override_session_id = ?1 AND override_message_id = id ";
+  const std::string visible = "(override_message_id IS NULL OR override_status IS NOT NULL)";
+  return {
+      {"GetConversationHistory", lineage + lineage_columns + lineage_messages + "WHERE " + visible +
+                                     " AND IFNULL(override_status, status) != 'dropped' ORDER BY created_at ASC, id ASC"},
+      {"GetConversationHistoryWindowed",
+       lineage + lineage_columns + lineage_messages + "WHERE " + visible +
+           " AND IFNULL(override_status, status) != 'dropped' "
+           "AND (group_id IS NULL OR group_id IN (SELECT DISTINCT group_id " +
+           lineage_messages + "WHERE group_id IS NOT NULL AND " + visible +
+           " AND IFNULL(override_status, status) != 'dropped' ORDER BY created_at DESC, id DESC LIMIT ?2)) "
+           "ORDER BY created_at ASC, id ASC"},
+      {"GetBudgetWindowSize",
+       lineage.substr(0, lineage.size() - 1) +
+           ", ranked AS (SELECT group_id, ROW_NUMBER() OVER (ORDER BY MAX(created_at) DESC, MAX(id) DESC) AS rank, "
+           "SUM(CASE WHEN role != 'tool' THEN IFNULL(tokens, 0) ELSE MIN(IFNULL(tokens, 0), ?4) END) AS cost " +
+           lineage_messages + "WHERE group_id IS NOT NULL AND " + visible +
+           " AND IFNULL(override_status, status) != 'dropped' GROUP BY group_id), "
+           "active AS (SELECT SUM(CASE WHEN role != 'tool' THEN tokens WHEN recency <= ?5 THEN MIN(tokens, ?2) "
+           "ELSE MIN(tokens, ?3) END) AS cost FROM (SELECT role, IFNULL(tokens, 0) AS tokens, "
+           "ROW_NUMBER() OVER (PARTITION BY role = 'tool' ORDER BY created_at DESC, id DESC) AS recency " +
+           lineage_messages + "WHERE group_id = (SELECT group_id FROM ranked WHERE rank = 1) AND " + visible +
+           " AND IFNULL(override_status, status) != 'dropped')), "
+           "running AS (SELECT rank, SUM(CASE WHEN rank = 1 THEN (SELECT cost FROM active) ELSE cost END) "
+           "OVER (ORDER BY rank ROWS UNBOUNDED PRECEDING) AS total FROM ranked) "
+           "SELECT COUNT(*) FROM running WHERE rank = 1 OR total <= ?6"},
+      {"GetMessagesByGroups",
+       columns + "FROM stored_messages WHERE group_id IN (?, ?) AND id > ? ORDER BY created_at ASC, id ASC"},
+      {"ExtendHistoryWindow",
+       columns +
+           ", group_id IS NOT NULL AND EXISTS (SELECT 1 FROM stored_messages o "
+           "WHERE o.group_id = stored_messages.group_id "
+           "AND o.id <= ?1 AND o.status != 'dropped') AS preceded "
+           "FROM stored_messages WHERE id > ?1 AND +session_id = ?2 ORDER BY created_at ASC, id ASC"},
+      {"GetLastMessageId", "SELECT IFNULL(MAX(id), 0) FROM stored_messages"},
+      {"GetSessionPromptState",
+       "SELECT s.id IS NOT NULL, s.context_size, IFNULL(s.context_budget, 0), st.state_blob, s.scratchpad "
+       "FROM (SELECT ? AS id) AS q LEFT JOIN sessions s ON s.id = q.id "
+       "LEFT JOIN session_state st ON st.session_id = q.id"},
+      {"GetLastGroupId", lineage + "SELECT group_id " + lineage_messages + "WHERE group_id IS NOT NULL AND " +
+                             visible + " ORDER BY created_at DESC, id DESC LIMIT 1"},
+      {"MessageList",
+       lineage.substr(0, lineage.size() - 1) +
+           ", session_messages AS (SELECT id, role, created_at, group_id, tokens " + lineage_messages +
+           "WHERE group_id IS NOT NULL AND " + visible +
+           " UNION ALL SELECT id, role, created_at, group_id, tokens FROM archived_messages "
+           "WHERE session_id = ?1 AND group_id IS NOT NULL), "
+           "groups AS (SELECT group_id, MIN(CASE WHEN role = 'user' THEN id END) AS prompt_id, "
+           "MIN(CASE WHEN role = 'user' THEN created_at END) AS prompt_at, "
+           "MAX(CASE WHEN role = 'assistant' THEN tokens END) AS assistant_tokens "
+           "FROM session_messages GROUP BY group_id) "
+           "SELECT group_id, IFNULL((SELECT IFNULL(content, (SELECT content FROM blobs WHERE hash = m.content_hash)) "
+           "FROM stored_messages m WHERE m.id = prompt_id), archived_content(prompt_id)), assistant_tokens "
+           "FROM groups WHERE prompt_id IS NOT NULL ORDER BY prompt_at DESC, prompt_id DESC LIMIT ?2"},
+      {"MessageView", lineage + lineage_columns + lineage_messages + "WHERE group_id = ?2 AND " + visible +
+                          " UNION ALL SELECT id, session_id, role, archived_content(id), tool_call_id, status, "
+                          "created_at, group_id, parsing_strategy, tokens FROM archived_messages "
+                          "WHERE session_id = ?1 AND group_id = ?2 ORDER BY 7, 1"},
+      {"RemoveGroup", "DELETE FROM stored_messages WHERE group_id = ?"},
+      {"TruncationHint", "SELECT content FROM messages WHERE id = ?"},
+  };
+}
+
+std::vector<std::string> ExplainQueryPlan(slop::Database& db, const std::string& sql) {
+  std::vector<std::string> details;
+  auto res = db.Query("EXPLAIN QUERY PLAN " + sql);
+  EXPECT_TRUE(res.ok()) << res.status().message();
+  if (!res.ok()) return details;
+  auto j = nlohmann::json::parse(*res, nullptr, false);
+  if (j.is_discarded()) return details;
+  for (const auto& row : j) {
+    details.push_back(row.value("detail", ""));
+  }
+  return details;
+}
+
+// A "SCAN" of the stored_messages table (with or without an index) visits every row in the ledger.
+// The messages view (m1) is a UNION ALL with archived_messages and is run as a co-routine;
+// scanning its output visits only the rows that its own SEARCHes found.
+bool ScansMessages(const std::string& detail, bool resolved_is_coroutine) {
+  if (resolved_is_coroutine && (detail == "SCAN messages" || detail == "SCAN m1")) return false;
+  return absl::StartsWith(detail, "SCAN messages") || absl::StartsWith(detail, "SCAN stored_messages") ||
+         absl::StartsWith(detail, "SCAN archived_messages") || absl::StartsWith(detail, "SCAN m1") ||
+         absl::StartsWith(detail, "SCAN m2") || absl::StartsWith(detail, "SCAN o");
+}
+
+void PopulateLedger(slop::Database& db) {
+  ASSERT_TRUE(db.Execute("BEGIN TRANSACTION;").ok());
+  for (int i = 0; i < 2000; ++i) {
+    std::string session = absl::StrCat("s", i % 20);
+    std::string group = absl::StrCat("g", i / 4);
+    ASSERT_TRUE(db.AppendMessage(session, i % 4 == 0 ? "user" : "assistant", "content", "", "completed", group).ok());
+  }
+  ASSERT_TRUE(db.Execute("COMMIT;").ok());
+}
+
+void ExpectNoMessageScans(slop::Database& db) {
+  for (const auto& q : HotQueries()) {
+    std::vector<std::string> plan = ExplainQueryPlan(db, q.sql);
+    ASSERT_FALSE(plan.empty()) << q.name;
+    bool resolved_is_coroutine = std::find(plan.begin(), plan.end(), "CO-ROUTINE messages") != plan.end();
+    for (const auto& detail : plan) {
+      EXPECT_FALSE(ScansMessages(detail, resolved_is_coroutine))
+          << q.name << " regressed to a table scan:\n" << absl::StrJoin(plan, "\n");
+    }
+  }
+}
+
+TEST(DatabaseQueryPlanTest, IndexesExist) {
+  slop::Database db;
+  ASSERT_TRUE(db.Init(":memory:").ok());
+
+  auto res = db.Query("SELECT name FROM sqlite_master WHERE type = 'index' AND tbl_name = 'stored_messages'");
+  ASSERT_TRUE(res.ok());
+  EXPECT_TRUE(absl::StrContains(*res, "idx_messages_session_group"));
+  EXPECT_TRUE(absl::StrContains(*res, "idx_messages_group"));
+  EXPECT_TRUE(absl::StrContains(*res, "idx_messages_content_hash"));
+}
+
+TEST(DatabaseQueryPlanTest, HotQueriesUseIndexesOnFreshDatabase) {
+  slop::Database db;
+  ASSERT_TRUE(db.Init(":memory:").ok());
+  ExpectNoMessageScans(db);
+}
+
+TEST(DatabaseQueryPlanTest, HotQueriesUseIndexesAfterAnalyze) {
+  slop::Database db;
+  ASSERT_TRUE(db.Init(":memory:").ok());
+  PopulateLedger(db);
+  ASSERT_TRUE(db.Execute("ANALYZE;").ok());
+  ExpectNoMessageScans(db);
+}
+
+TEST(DatabaseQueryPlanTest, HistoryExtensionReadsOnlyNewRows) {
+  slop::Database db;
+  ASSERT_TRUE(db.Init(":memory:").ok());
+  PopulateLedger(db);
+  ASSERT_TRUE(db.Execute("ANALYZE;").ok());
+  for (const auto& q : HotQueries()) {
+    if (q.name != "ExtendHistoryWindow") continue;
+    std::vector<std::string> plan = ExplainQueryPlan(db, q.sql);
+    ASSERT_FALSE(plan.empty());
+    EXPECT_TRUE(absl::StrContains(plan[0], "INTEGER PRIMARY KEY (rowid>?)")) << absl::StrJoin(plan, "\n");
+  }
+}
+
+TEST(DatabaseQueryPlanTest, MemoTagLookupUsesIndex) {
+  slop::Database db;
+  ASSERT_TRUE(db.Init(":memory:").ok());
+  std::vector<std::string> plan = ExplainQueryPlan(
+      db,
+      "SELECT m.id, m.content, m.semantic_tags, m.created_at "
+      "FROM (SELECT memo_id, COUNT(*) AS matches FROM memo_tags WHERE tag IN (?, ?) GROUP BY memo_id) t "
+      "JOIN llm_memos m ON m.id = t.memo_id ORDER BY t.matches DESC, m.id DESC LIMIT ?");
+  ASSERT_FALSE(plan.empty());
+  for (const auto& detail : plan) {
+    EXPECT_FALSE(absl::StartsWith(detail, "SCAN memo_tags") || absl::StartsWith(detail, "SCAN m "))
+        << absl::StrJoin(plan, "\n");
+  }
+}
+
+}  // namespace
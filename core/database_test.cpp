@@ -1,6 +1,11 @@
 #include "core/database.h"
 
+#include <cstdio>
+#include <thread>
+
+#include "absl/strings/match.h"
 #include "absl/strings/str_cat.h"
+#include "absl/time/clock.h"
 
 #include <gtest/gtest.h>
 #include <nlohmann/json.hpp>
@@ -17,7 +22,8 @@ TEST(DatabaseTest, TablesExist) {
 
   // Check if tables exist by trying to insert/select
   EXPECT_TRUE(db.Execute("INSERT INTO tools (name, description) VALUES ('test_tool', 'a test tool')").ok());
-  EXPECT_TRUE(db.Execute("INSERT INTO messages (session_id, role, content) VALUES ('session1', 'user', 'hello')").ok());
+  EXPECT_TRUE(
+      db.Execute("INSERT INTO stored_messages (session_id, role, content) VALUES ('session1', 'user', 'hello')").ok());
 }
 
 TEST(DatabaseTest, DefaultSkillsAndToolsRegistered) {
@@ -227,6 +233,52 @@ TEST(DatabaseTest, TokenPersistence) {
   EXPECT_EQ((*history)[1].tokens, 25);
 }
 
+TEST(DatabaseTest, BudgetWindowKeepsTheNewestGroupsThatFit) {
+  slop::Database db;
+  ASSERT_TRUE(db.Init(":memory:").ok());
+
+  // Unset tokens are estimated at insert.
+  ASSERT_TRUE(db.AppendMessage("s1", "user", "Read the schema notes.", "", "completed", "g0").ok());
+  auto history = db.GetConversationHistory("s1");
+  ASSERT_TRUE(history.ok());
+  EXPECT_EQ((*history)[0].tokens, slop::Database::EstimateTokens("Read the schema notes."));
+  EXPECT_EQ((*history)[0].tokens, 5);
+  ASSERT_TRUE(db.Execute("DELETE FROM stored_messages").ok());
+  // A tool result of 4000 tokens in each group, and a 100-token prompt.
+  for (const char* group : {"g1", "g2", "g3"}) {
+    ASSERT_TRUE(db.AppendMessage("s1", "user", "prompt", "", "completed", group, "", 100).ok());
+    ASSERT_TRUE(db.AppendMessage("s1", "tool", "result", "c1", "completed", group, "", 4000).ok());
+  }
+
+  slop::Database::TokenTiers tiers;
+  tiers.active_full_fidelity = 1000;
+  tiers.active_degraded = 100;
+  tiers.inactive = 30;
+  tiers.full_fidelity_count = 1;
+  // g3 is active: 100 + 1000. g2 and g1 are inactive: 100 + 30 each.
+  for (auto [budget, groups] : std::vector<std::pair<int, int>>{{1, 1}, {1229, 1}, {1230, 2}, {1360, 3}}) {
+    auto size = db.GetBudgetWindowSize("s1", budget, tiers);
+    ASSERT_TRUE(size.ok()) << size.status();
+    EXPECT_EQ(*size, groups) << "budget " << budget;
+  }
+  // Only the newest full_fidelity_count tool results of the active group keep the high tier.
+  ASSERT_TRUE(db.AppendMessage("s1", "tool", "result", "c2", "completed", "g3", "", 4000).ok());
+  EXPECT_EQ(*db.GetBudgetWindowSize("s1", 1330, tiers), 2);
+  EXPECT_EQ(*db.GetBudgetWindowSize("s1", 1329, tiers), 1);
+
+  // The budget replaces the window size until a window size is set again, and forks inherit it.
+  ASSERT_TRUE(db.SetContextBudget("s1", 64000).ok());
+  auto settings = db.GetContextSettings("s1");
+  ASSERT_TRUE(settings.ok());
+  EXPECT_EQ(settings->budget, 64000);
+  ASSERT_TRUE(db.CloneSession("s1", "s2").ok());
+  EXPECT_EQ(db.GetContextSettings("s2")->budget, 64000);
+  EXPECT_EQ(*db.GetBudgetWindowSize("s2", 1330, tiers), 2);
+  ASSERT_TRUE(db.SetContextWindow("s1", 3).ok());
+  EXPECT_EQ(db.GetContextSettings("s1")->budget, 0);
+  EXPECT_FALSE(db.SetContextBudget("s1", -1).ok());
+}
+
 TEST(DatabaseTest, GetConversationHistoryWindowed) {
   slop::Database db;
   ASSERT_TRUE(db.Init(":memory:").ok());
@@ -307,7 +359,7 @@ TEST(DatabaseTest, UpdateMessageStatusWorks) {
   int msg_id = (*history)[0].id;
   EXPECT_EQ((*history)[0].status, "completed");
 
-  ASSERT_TRUE(db.UpdateMessageStatus(msg_id, "dropped").ok());
+  ASSERT_TRUE(db.UpdateMessageStatus("s1", msg_id, "dropped").ok());
 
   auto history2 = db.GetConversationHistory("s1", true);
   ASSERT_TRUE(history2.ok());
@@ -488,6 +540,71 @@ TEST(DatabaseTest, MemoSearchCompoundTags) {
   EXPECT_EQ(partial->size(), 1);
 }
 
+TEST(DatabaseTest, MemoTagsRankByMatchesAndLimitInSql) {
+  slop::Database db;
+  ASSERT_TRUE(db.Init(":memory:").ok());
+  ASSERT_TRUE(db.AddMemo("One match", R"(["sqlite"])").ok());
+  ASSERT_TRUE(db.AddMemo("Three matches", R"(["sqlite", "Arch-Decision-Log", "wal"])").ok());
+  ASSERT_TRUE(db.AddMemo("Two matches", R"(["wal", "cache"])").ok());
+  ASSERT_TRUE(db.AddMemo("No match", R"(["frontend"])").ok());
+
+  // Tags match case-insensitively on any run of their hyphen-separated parts.
+  auto memos = db.GetMemosByTags({"sqlite", "decision-log", "WAL", "cache"});
+  ASSERT_TRUE(memos.ok()) << memos.status();
+  ASSERT_EQ(memos->size(), 3);
+  EXPECT_EQ((*memos)[0].content, "Three matches");
+  EXPECT_EQ((*memos)[1].content, "Two matches");
+  EXPECT_EQ((*memos)[2].content, "One match");
+
+  memos = db.GetMemosByTags({"sqlite", "decision-log", "WAL", "cache"}, 1);
+  ASSERT_TRUE(memos.ok());
+  ASSERT_EQ(memos->size(), 1);
+  EXPECT_EQ((*memos)[0].content, "Three matches");
+
+  // Parts match whole, not as substrings.
+  EXPECT_TRUE(db.GetMemosByTags({"decisions"})->empty());
+  EXPECT_TRUE(db.GetMemosByTags({"sql"})->empty());
+
+  // The index follows updates and deletes.
+  int64_t id = (*memos)[0].id;
+  ASSERT_TRUE(db.UpdateMemo(id, "Retagged", R"(["frontend"])").ok());
+  EXPECT_TRUE(db.GetMemosByTags({"decision"})->empty());
+  EXPECT_EQ(db.GetMemosByTags({"frontend"})->size(), 2);
+  ASSERT_TRUE(db.DeleteMemo(id).ok());
+  EXPECT_EQ(db.GetMemosByTags({"frontend"})->size(), 1);
+  auto rows = db.Query(absl::StrCat("SELECT tag FROM memo_tags WHERE memo_id = ", id));
+  ASSERT_TRUE(rows.ok());
+  EXPECT_TRUE(nlohmann::json::parse(*rows).empty());
+}
+
+TEST(DatabaseTest, SearchMemosRanksByRelevance) {
+  slop::Database db;
+  ASSERT_TRUE(db.Init(":memory:").ok());
+  ASSERT_TRUE(db.AddMemo("Use WAL for concurrent readers", R"(["sqlite", "wal"])").ok());
+  ASSERT_TRUE(db.AddMemo("The parser handles sqlite output", R"(["parser"])").ok());
+  ASSERT_TRUE(db.AddMemo("Unrelated", R"(["ui"])").ok());
+
+  auto memos = db.SearchMemos({"sqlite", "wal"}, 5);
+  ASSERT_TRUE(memos.ok()) << memos.status();
+  ASSERT_EQ(memos->size(), 2);
+  EXPECT_EQ((*memos)[0].content, "Use WAL for concurrent readers");
+
+  // Compound tags match by component, and the index follows updates and deletes.
+  ASSERT_TRUE(db.UpdateMemo((*memos)[1].id, "Parser notes", R"(["arch-decision"])").ok());
+  memos = db.SearchMemos({"arch"}, 5);
+  ASSERT_TRUE(memos.ok());
+  ASSERT_EQ(memos->size(), 1);
+  EXPECT_EQ((*memos)[0].content, "Parser notes");
+  ASSERT_TRUE(db.DeleteMemo((*memos)[0].id).ok());
+  EXPECT_TRUE(db.SearchMemos({"arch"}, 5)->empty());
+
+  // Terms are words, not FTS5 syntax.
+  memos = db.SearchMemos({"wal\"", "NOT", "concurrent-readers"}, 5);
+  ASSERT_TRUE(memos.ok()) << memos.status();
+  EXPECT_EQ(memos->size(), 1);
+  EXPECT_TRUE(db.SearchMemos({}, 5)->empty());
+}
+
 TEST(DatabaseTest, ToolUsageCounters) {
   slop::Database db;
   ASSERT_TRUE(db.Init(":memory:").ok());
@@ -518,3 +635,1418 @@ TEST(DatabaseTest, ToolUsageCounters) {
   EXPECT_EQ(it->call_count, 2);
   EXPECT_EQ(it->description, "updated desc");
 }
+
+TEST(DatabaseTest, ToolManifestIsSharedUntilToolsOrSkillsChange) {
+  slop::Database db;
+  ASSERT_TRUE(db.Init(":memory:").ok());
+  slop::Database::Tool tool = {"test_tool", "desc", "{}", true};
+  ASSERT_TRUE(db.RegisterTool(tool).ok());
+  slop::Database::Skill skill = {0, "test_skill", "desc", "patch"};
+  ASSERT_TRUE(db.RegisterSkill(skill).ok());
+
+  auto manifest = *db.GetToolManifest();
+  EXPECT_TRUE(manifest->tool_names.contains("test_tool"));
+  EXPECT_EQ(manifest->tool_names.size(), manifest->tools.size());
+  EXPECT_EQ(*db.GetToolManifest(), manifest);
+
+  // Neither the counters nor writes that change nothing invalidate it.
+  ASSERT_TRUE(db.IncrementToolCallCount("test_tool").ok());
+  ASSERT_TRUE(db.IncrementSkillActivationCount("test_skill").ok());
+  ASSERT_TRUE(db.FlushPendingWrites().ok());
+  ASSERT_TRUE(db.RegisterTool(tool).ok());
+  ASSERT_TRUE(db.RegisterSkill(skill).ok());
+  ASSERT_TRUE(db.SetToolEnabled("test_tool", true).ok());
+  skill.activation_count = 1;
+  ASSERT_TRUE(db.UpdateSkill(skill).ok());
+  EXPECT_EQ(*db.GetToolManifest(), manifest);
+
+  ASSERT_TRUE(db.SetToolEnabled("test_tool", false).ok());
+  auto disabled = *db.GetToolManifest();
+  EXPECT_NE(disabled, manifest);
+  EXPECT_FALSE(disabled->tool_names.contains("test_tool"));
+  EXPECT_TRUE(absl::IsNotFound(db.SetToolEnabled("no_such_tool", true)));
+
+  skill.system_prompt_patch = "new patch";
+  ASSERT_TRUE(db.UpdateSkill(skill).ok());
+  auto updated = *db.GetToolManifest();
+  EXPECT_NE(updated, disabled);
+  auto it = std::find_if(updated->skills.begin(), updated->skills.end(),
+                         [](const auto& s) { return s.name == "test_skill"; });
+  ASSERT_NE(it, updated->skills.end());
+  EXPECT_EQ(it->system_prompt_patch, "new patch");
+
+  // SQL that writes either table invalidates it too, and so does a rolled back write.
+  ASSERT_TRUE(db.Execute("UPDATE skills SET description = 'by query_db' WHERE name = 'test_skill'").ok());
+  auto by_sql = *db.GetToolManifest();
+  EXPECT_NE(by_sql, updated);
+  {
+    auto batch = db.BeginWriteBatch();
+    ASSERT_TRUE(batch.ok());
+    ASSERT_TRUE(db.RegisterTool({"rolled_back", "desc", "{}", true}).ok());
+    EXPECT_TRUE((*db.GetToolManifest())->tool_names.contains("rolled_back"));
+    ASSERT_TRUE((*batch)->Rollback().ok());
+  }
+  EXPECT_FALSE((*db.GetToolManifest())->tool_names.contains("rolled_back"));
+  ASSERT_TRUE(db.DeleteSkill("test_skill").ok());
+  EXPECT_TRUE(std::none_of((*db.GetToolManifest())->skills.begin(), (*db.GetToolManifest())->skills.end(),
+                           [](const auto& s) { return s.name == "test_skill"; }));
+}
+
+TEST(DatabaseTest, StatementCacheReusesHandles) {
+  slop::Database db;
+  ASSERT_TRUE(db.Init(":memory:").ok());
+
+  auto before = db.GetStatementCacheStats();
+  EXPECT_EQ(before.capacity, slop::Database::kDefaultStatementCacheCapacity);
+
+  ASSERT_TRUE(db.AppendMessage("s1", "user", "first").ok());
+  ASSERT_TRUE(db.AppendMessage("s2", "user", "second").ok());
+
+  // Same SQL, different bindings: the reused handle must be rebound, not replay old values.
+  auto h1 = db.GetConversationHistory("s1");
+  auto h2 = db.GetConversationHistory("s2");
+  ASSERT_TRUE(h1.ok());
+  ASSERT_TRUE(h2.ok());
+  ASSERT_EQ(h1->size(), 1);
+  ASSERT_EQ(h2->size(), 1);
+  EXPECT_EQ((*h1)[0].content, "first");
+  EXPECT_EQ((*h2)[0].content, "second");
+
+  auto after = db.GetStatementCacheStats();
+  EXPECT_GT(after.hits, before.hits);
+  EXPECT_GT(after.size, 0);
+}
+
+TEST(DatabaseTest, StatementCacheConcurrentCheckout) {
+  slop::Database db;
+  ASSERT_TRUE(db.Init(":memory:").ok());
+
+  const std::string sql = "SELECT ?";
+  auto a = db.Prepare(sql);
+  auto b = db.Prepare(sql);
+  ASSERT_TRUE(a.ok());
+  ASSERT_TRUE(b.ok());
+  ASSERT_TRUE((*a)->BindText(1, "a").ok());
+  ASSERT_TRUE((*b)->BindText(1, "b").ok());
+  ASSERT_TRUE(*(*a)->Step());
+  ASSERT_TRUE(*(*b)->Step());
+  EXPECT_EQ((*a)->ColumnText(0), "a");
+  EXPECT_EQ((*b)->ColumnText(0), "b");
+  a->reset();
+  b->reset();
+
+  // Only one idle handle per SQL text is kept.
+  int64_t hits = db.GetStatementCacheStats().hits;
+  auto c = db.Prepare(sql);
+  ASSERT_TRUE(c.ok());
+  auto d = db.Prepare(sql);
+  ASSERT_TRUE(d.ok());
+  EXPECT_EQ(db.GetStatementCacheStats().hits, hits + 1);
+}
+
+TEST(DatabaseTest, StatementCacheEvictionAndDisable) {
+  slop::Database db;
+  ASSERT_TRUE(db.Init(":memory:").ok());
+
+  db.SetStatementCacheCapacity(2);
+  for (int i = 0; i < 5; ++i) {
+    ASSERT_TRUE(db.Query(absl::StrCat("SELECT ", i)).ok());
+  }
+  auto stats = db.GetStatementCacheStats();
+  EXPECT_EQ(stats.size, 2);
+  EXPECT_GE(stats.evictions, 3);
+
+  db.SetStatementCacheCapacity(0);
+  stats = db.GetStatementCacheStats();
+  EXPECT_EQ(stats.size, 0);
+  int64_t hits = stats.hits;
+  ASSERT_TRUE(db.Query("SELECT 1").ok());
+  ASSERT_TRUE(db.Query("SELECT 1").ok());
+  EXPECT_EQ(db.GetStatementCacheStats().hits, hits);
+}
+
+TEST(DatabaseTest, WriteBatchCommitsOnce) {
+  slop::Database db;
+  ASSERT_TRUE(db.Init(":memory:").ok());
+
+  int64_t commits = db.GetCommitCount();
+  auto batch_or = db.BeginWriteBatch();
+  ASSERT_TRUE(batch_or.ok());
+  ASSERT_TRUE(db.RecordUsage("s1", "model", 10, 5).ok());
+  for (int i = 0; i < 16; ++i) {
+    ASSERT_TRUE(db.AppendMessage("s1", "tool", absl::StrCat("result ", i), absl::StrCat("call_", i), "completed", "g1")
+                    .ok());
+  }
+  ASSERT_TRUE(db.SetSessionState("s1", "### STATE").ok());
+  EXPECT_EQ(db.GetCommitCount(), commits);
+  ASSERT_TRUE((*batch_or)->Commit().ok());
+  EXPECT_EQ(db.GetCommitCount(), commits + 1);
+
+  auto history = db.GetMessagesByGroups({"g1"});
+  ASSERT_TRUE(history.ok());
+  EXPECT_EQ(history->size(), 16);
+  EXPECT_FALSE((*batch_or)->Commit().ok());
+}
+
+TEST(DatabaseTest, WriteBatchRollsBackWhenDropped) {
+  slop::Database db;
+  ASSERT_TRUE(db.Init(":memory:").ok());
+
+  {
+    auto batch_or = db.BeginWriteBatch();
+    ASSERT_TRUE(batch_or.ok());
+    ASSERT_TRUE(db.AppendMessage("s1", "user", "lost", "", "completed", "g1").ok());
+  }
+  auto history = db.GetConversationHistory("s1");
+  ASSERT_TRUE(history.ok());
+  EXPECT_TRUE(history->empty());
+
+  // The writer is usable again after the rollback.
+  ASSERT_TRUE(db.AppendMessage("s1", "user", "kept", "", "completed", "g2").ok());
+  history = db.GetConversationHistory("s1");
+  ASSERT_TRUE(history.ok());
+  EXPECT_EQ(history->size(), 1);
+}
+
+TEST(DatabaseTest, NestedWriteBatchRollsBackToSavepoint) {
+  slop::Database db;
+  ASSERT_TRUE(db.Init(":memory:").ok());
+
+  auto outer_or = db.BeginWriteBatch();
+  ASSERT_TRUE(outer_or.ok());
+  ASSERT_TRUE(db.AppendMessage("s1", "user", "outer", "", "completed", "g1").ok());
+  {
+    auto inner_or = db.BeginWriteBatch();
+    ASSERT_TRUE(inner_or.ok());
+    ASSERT_TRUE(db.AppendMessage("s1", "assistant", "inner", "", "completed", "g1").ok());
+    ASSERT_TRUE((*inner_or)->Rollback().ok());
+  }
+  {
+    auto inner_or = db.BeginWriteBatch();
+    ASSERT_TRUE(inner_or.ok());
+    ASSERT_TRUE(db.AppendMessage("s1", "assistant", "kept", "", "completed", "g1").ok());
+    ASSERT_TRUE((*inner_or)->Commit().ok());
+  }
+  ASSERT_TRUE((*outer_or)->Commit().ok());
+
+  auto history = db.GetConversationHistory("s1");
+  ASSERT_TRUE(history.ok());
+  ASSERT_EQ(history->size(), 2);
+  EXPECT_EQ((*history)[0].content, "outer");
+  EXPECT_EQ((*history)[1].content, "kept");
+}
+
+TEST(DatabaseTest, CloneSessionInsideWriteBatch) {
+  slop::Database db;
+  ASSERT_TRUE(db.Init(":memory:").ok());
+  ASSERT_TRUE(db.AppendMessage("src", "user", "hello").ok());
+
+  auto batch_or = db.BeginWriteBatch();
+  ASSERT_TRUE(batch_or.ok());
+  ASSERT_TRUE(db.CloneSession("src", "dst").ok());
+  EXPECT_FALSE(db.CloneSession("src", "dst").ok());
+  ASSERT_TRUE((*batch_or)->Commit().ok());
+
+  auto history = db.GetConversationHistory("dst");
+  ASSERT_TRUE(history.ok());
+  EXPECT_EQ(history->size(), 1);
+}
+
+TEST(DatabaseTest, RowVisitorExposesColumnViews) {
+  slop::Database db;
+  ASSERT_TRUE(db.Init(":memory:").ok());
+  ASSERT_TRUE(db.AppendMessage("s1", "user", "hello", "", "completed", "g1").ok());
+  ASSERT_TRUE(db.AppendMessage("s1", "assistant", "reply", "", "completed", "g1").ok());
+
+  auto stmt_or = db.Prepare("SELECT role, content, tool_call_id FROM messages ORDER BY id");
+  ASSERT_TRUE(stmt_or.ok());
+  std::vector<std::string> rows;
+  ASSERT_TRUE((*stmt_or)
+                  ->ForEachRow([&](slop::Database::Statement& row) {
+                    rows.push_back(absl::StrCat(row.ColumnTextView(0), ":", row.ColumnTextView(1).size(), ":",
+                                                row.ColumnTextView(2).empty()));
+                  })
+                  .ok());
+  EXPECT_EQ(rows, (std::vector<std::string>{"user:5:1", "assistant:5:1"}));
+
+  int visited = 0;
+  ASSERT_TRUE(db.VisitConversationHistory("s1", false, 0, [&](const slop::Database::MessageView& m) {
+                  EXPECT_EQ(m.session_id, "s1");
+                  EXPECT_EQ(m.group_id, "g1");
+                  visited++;
+                }).ok());
+  EXPECT_EQ(visited, 2);
+}
+
+TEST(DatabaseTest, ArenaBackedHistoryMatchesHistory) {
+  slop::Database db;
+  ASSERT_TRUE(db.Init(":memory:").ok());
+  for (int i = 0; i < 50; ++i) {
+    ASSERT_TRUE(db.AppendMessage("s1", i % 2 ? "assistant" : "user", std::string(4000 + i, 'a' + i % 26), "",
+                                 "completed", absl::StrCat("g", i / 2), "gemini", i)
+                    .ok());
+  }
+  auto history = db.GetConversationHistory("s1", false, 5);
+  ASSERT_TRUE(history.ok());
+
+  slop::Database::MessageArena arena;
+  auto views = db.GetConversationHistoryViews("s1", &arena, false, 5);
+  ASSERT_TRUE(views.ok());
+  // Views stay valid when the arena moves.
+  slop::Database::MessageArena moved = std::move(arena);
+  ASSERT_EQ(views->size(), history->size());
+  ASSERT_EQ(views->size(), 10);
+  for (size_t i = 0; i < views->size(); ++i) {
+    const auto& expected = (*history)[i];
+    auto actual = (*views)[i].ToMessage();
+    EXPECT_EQ(actual.id, expected.id);
+    EXPECT_EQ(actual.role, expected.role);
+    EXPECT_EQ(actual.content, expected.content);
+    EXPECT_EQ(actual.group_id, expected.group_id);
+    EXPECT_EQ(actual.parsing_strategy, expected.parsing_strategy);
+    EXPECT_EQ(actual.tokens, expected.tokens);
+  }
+  EXPECT_GT(moved.bytes_used(), 40000);
+}
+
+// A tool result large enough to be stored compressed.
+std::string LargeToolOutput(int seed) {
+  std::string out;
+  for (int line = 0; out.size() < 3 * slop::Database::kDefaultCompressionThreshold; ++line) {
+    absl::StrAppend(&out, "src/file_", seed, ".cc:", line, ": int Function", line % 13, "(int x) { return x; }\n");
+  }
+  return out;
+}
+
+TEST(DatabaseTest, LargeContentIsStoredCompressed) {
+  slop::Database db;
+  ASSERT_TRUE(db.Init(":memory:").ok());
+  db.SetDedupThreshold(0);
+  std::string large = LargeToolOutput(0);
+  ASSERT_TRUE(db.AppendMessage("s1", "tool", large, "call|read_file", "completed", "g1").ok());
+  ASSERT_TRUE(db.AppendMessage("s1", "user", "small", "", "completed", "g1").ok());
+
+  auto stored = db.Query("SELECT typeof(content) AS type, length(content) AS size FROM stored_messages ORDER BY id");
+  ASSERT_TRUE(stored.ok());
+  auto rows = nlohmann::json::parse(*stored);
+  EXPECT_EQ(rows[0]["type"], "blob");
+  EXPECT_LT(rows[0]["size"].get<size_t>(), large.size() / 2);
+  EXPECT_EQ(rows[1]["type"], "text");
+
+  // Every read path but the visitor sees text.
+  auto history = db.GetConversationHistory("s1");
+  ASSERT_TRUE(history.ok());
+  EXPECT_EQ((*history)[0].content, large);
+  auto by_group = db.GetMessagesByGroups({"g1"});
+  ASSERT_TRUE(by_group.ok());
+  EXPECT_EQ((*by_group)[0].content, large);
+  slop::Database::MessageArena arena;
+  auto views = db.GetConversationHistoryViews("s1", &arena);
+  ASSERT_TRUE(views.ok());
+  EXPECT_EQ((*views)[0].content, large);
+
+  auto query = db.Query("SELECT content FROM messages WHERE role = 'tool'");
+  ASSERT_TRUE(query.ok());
+  EXPECT_EQ(nlohmann::json::parse(*query)[0]["content"], large);
+  auto like = db.Query("SELECT id FROM stored_messages WHERE inflate(content) LIKE '%file_0.cc:7:%'");
+  ASSERT_TRUE(like.ok());
+  EXPECT_EQ(nlohmann::json::parse(*like).size(), 1);
+
+  ASSERT_TRUE(db.VisitConversationHistory("s1", false, 0, [&](const slop::Database::MessageView& m) {
+                  if (m.role != "tool") return;
+                  EXPECT_TRUE(slop::Database::IsCompressedContent(m.content));
+                  EXPECT_EQ(*slop::Database::GetContentSize(m.content), large.size());
+                  EXPECT_EQ(*db.InflateContentRange(m.content, 100, 50), large.substr(100, 50));
+                }).ok());
+}
+
+TEST(DatabaseTest, CompressionThresholdZeroStoresText) {
+  slop::Database db;
+  ASSERT_TRUE(db.Init(":memory:").ok());
+  db.SetCompressionThreshold(0);
+  db.SetDedupThreshold(0);
+  ASSERT_TRUE(db.AppendMessage("s1", "tool", LargeToolOutput(0)).ok());
+  auto stored = db.Query("SELECT typeof(content) AS type FROM stored_messages");
+  ASSERT_TRUE(stored.ok());
+  EXPECT_EQ(nlohmann::json::parse(*stored)[0]["type"], "text");
+}
+
+TEST(DatabaseTest, CompressionDictionaryIsTrainedAndReloaded) {
+  std::string path = absl::StrCat(testing::TempDir(), "/compression_dictionary.db");
+  for (const char* suffix : {"", "-wal", "-shm"}) std::remove(absl::StrCat(path, suffix).c_str());
+
+  std::string last;
+  {
+    slop::Database db;
+    ASSERT_TRUE(db.Init(path).ok());
+    for (int i = 0; i <= slop::Database::kDictionaryTrainingThreshold; ++i) {
+      last = LargeToolOutput(i);
+      ASSERT_TRUE(db.AppendMessage("s1", "tool", last).ok());
+    }
+    auto dictionaries = db.Query("SELECT COUNT(*) AS n FROM content_dictionaries");
+    ASSERT_TRUE(dictionaries.ok());
+    EXPECT_EQ(nlohmann::json::parse(*dictionaries)[0]["n"], 1);
+  }
+
+  slop::Database db;
+  ASSERT_TRUE(db.Init(path).ok());
+  auto history = db.GetConversationHistory("s1");
+  ASSERT_TRUE(history.ok());
+  ASSERT_EQ(history->size(), slop::Database::kDictionaryTrainingThreshold + 1);
+  EXPECT_EQ(history->back().content, last);
+  EXPECT_EQ(history->front().content, LargeToolOutput(0));
+}
+
+int CountRows(slop::Database& db, const std::string& sql) {
+  auto res = db.Query(sql);
+  EXPECT_TRUE(res.ok()) << res.status();
+  if (!res.ok()) return -1;
+  return nlohmann::json::parse(*res)[0]["n"].get<int>();
+}
+
+TEST(DatabaseTest, RepeatedContentIsStoredOnce) {
+  slop::Database db;
+  ASSERT_TRUE(db.Init(":memory:").ok());
+  std::string large = LargeToolOutput(0);
+  std::string medium(2 * slop::Database::kDefaultDedupThreshold, 'x');
+  for (int i = 0; i < 3; ++i) {
+    ASSERT_TRUE(db.AppendMessage("s1", "tool", large, "call|read_file", "completed", absl::StrCat("g", i)).ok());
+    ASSERT_TRUE(db.AppendMessage("s1", "tool", medium, "call|grep_tool", "completed", absl::StrCat("g", i)).ok());
+  }
+  ASSERT_TRUE(db.AppendMessage("s1", "user", "small", "", "completed", "g3").ok());
+
+  EXPECT_EQ(CountRows(db, "SELECT COUNT(*) AS n FROM blobs"), 2);
+  EXPECT_EQ(CountRows(db, "SELECT COUNT(*) AS n FROM stored_messages WHERE content IS NULL"), 6);
+  EXPECT_EQ(
+      CountRows(db, "SELECT COUNT(*) AS n FROM stored_messages WHERE content = 'small' AND content_hash IS NULL"), 1);
+
+  auto history = db.GetConversationHistory("s1");
+  ASSERT_TRUE(history.ok());
+  ASSERT_EQ(history->size(), 7);
+  EXPECT_EQ((*history)[4].content, large);
+  EXPECT_EQ((*history)[5].content, medium);
+  auto by_group = db.GetMessagesByGroups({"g2"});
+  ASSERT_TRUE(by_group.ok());
+  ASSERT_EQ(by_group->size(), 2);
+  EXPECT_EQ((*by_group)[0].content, large);
+
+  auto resolved = db.Query("SELECT content FROM messages WHERE id = 1");
+  ASSERT_TRUE(resolved.ok());
+  EXPECT_EQ(nlohmann::json::parse(*resolved)[0]["content"], large);
+  EXPECT_EQ(CountRows(db, "SELECT COUNT(*) AS n FROM messages_resolved WHERE content LIKE '%file_0.cc:7:%'"), 3);
+}
+
+TEST(DatabaseTest, DedupThresholdZeroStoresInline) {
+  slop::Database db;
+  ASSERT_TRUE(db.Init(":memory:").ok());
+  db.SetDedupThreshold(0);
+  ASSERT_TRUE(db.AppendMessage("s1", "tool", LargeToolOutput(0)).ok());
+  ASSERT_TRUE(db.AppendMessage("s1", "tool", LargeToolOutput(0)).ok());
+  EXPECT_EQ(CountRows(db, "SELECT COUNT(*) AS n FROM blobs"), 0);
+  EXPECT_EQ(CountRows(db, "SELECT COUNT(*) AS n FROM stored_messages WHERE content_hash IS NULL"), 2);
+}
+
+TEST(DatabaseTest, ClonedSessionsShareBlobsUntilLastReferenceIsDeleted) {
+  slop::Database db;
+  ASSERT_TRUE(db.Init(":memory:").ok());
+  std::string large = LargeToolOutput(1);
+  ASSERT_TRUE(db.AppendMessage("s1", "tool", large, "call|read_file", "completed", "g1").ok());
+  ASSERT_TRUE(db.CloneSession("s1", "s2").ok());
+
+  EXPECT_EQ(CountRows(db, "SELECT COUNT(*) AS n FROM blobs"), 1);
+  auto cloned = db.GetConversationHistory("s2");
+  ASSERT_TRUE(cloned.ok());
+  ASSERT_EQ(cloned->size(), 1);
+  EXPECT_EQ((*cloned)[0].content, large);
+
+  ASSERT_TRUE(db.DeleteSession("s1").ok());
+  EXPECT_EQ(CountRows(db, "SELECT COUNT(*) AS n FROM blobs"), 1);
+  cloned = db.GetConversationHistory("s2");
+  ASSERT_TRUE(cloned.ok());
+  EXPECT_EQ((*cloned)[0].content, large);
+
+  ASSERT_TRUE(db.DeleteSession("s2").ok());
+  EXPECT_EQ(CountRows(db, "SELECT COUNT(*) AS n FROM blobs"), 0);
+}
+
+TEST(DatabaseTest, SearchMessagesFindsResolvedContent) {
+  slop::Database db;
+  ASSERT_TRUE(db.Init(":memory:").ok());
+  std::string large = LargeToolOutput(3) + "segmentation fault in ParseHeader\n";
+  ASSERT_TRUE(db.AppendMessage("s1", "user", "why does the parser crash?", "", "completed", "g1").ok());
+  ASSERT_TRUE(db.AppendMessage("s1", "tool", large, "call|execute_bash", "completed", "g1").ok());
+  ASSERT_TRUE(db.AppendMessage("s1", "tool", large, "call|execute_bash", "completed", "g2").ok());
+  ASSERT_TRUE(db.AppendMessage("s2", "user", "parser segmentation fault again", "", "completed", "g3").ok());
+  ASSERT_TRUE(db.UpdateMessageStatus("s1", 3, "dropped").ok());
+
+  auto hits = db.SearchMessages({"segmentation", "fault"}, "s1", 10);
+  ASSERT_TRUE(hits.ok()) << hits.status();
+  ASSERT_EQ(hits->size(), 1);
+  EXPECT_EQ((*hits)[0].id, 2);
+  EXPECT_EQ((*hits)[0].group_id, "g1");
+  EXPECT_TRUE(absl::StrContains((*hits)[0].snippet, "**segmentation** **fault**")) << (*hits)[0].snippet;
+
+  // Across sessions the message matching more terms ranks first.
+  hits = db.SearchMessages({"parser", "segmentation", "fault"}, "", 10);
+  ASSERT_TRUE(hits.ok());
+  ASSERT_EQ(hits->size(), 3);
+  EXPECT_EQ((*hits)[0].session_id, "s2");
+
+  // Words are stemmed.
+  hits = db.SearchMessages({"crashes"}, "", 10);
+  ASSERT_TRUE(hits.ok());
+  ASSERT_EQ(hits->size(), 1);
+  EXPECT_EQ((*hits)[0].id, 1);
+
+  ASSERT_TRUE(db.DeleteSession("s1").ok());
+  hits = db.SearchMessages({"segmentation"}, "", 10);
+  ASSERT_TRUE(hits.ok());
+  ASSERT_EQ(hits->size(), 1);
+  EXPECT_EQ((*hits)[0].session_id, "s2");
+}
+
+TEST(DatabaseTest, SearchIndexesAreBuiltForExistingRows) {
+  std::string path = absl::StrCat(testing::TempDir(), "/search_backfill.db");
+  for (const char* suffix : {"", "-wal", "-shm"}) std::remove(absl::StrCat(path, suffix).c_str());
+  {
+    slop::Database db;
+    ASSERT_TRUE(db.Init(path).ok());
+    ASSERT_TRUE(db.AppendMessage("s1", "tool", LargeToolOutput(4)).ok());
+    ASSERT_TRUE(db.AddMemo("Prefer prepared statements", R"(["sqlite"])").ok());
+    // As if the database predated the indexes, and schema versioning.
+    ASSERT_TRUE(db.Execute("UPDATE stored_messages SET tokens = 0").ok());
+    ASSERT_TRUE(db.Execute("DROP VIEW messages_resolved").ok());
+    ASSERT_TRUE(db.Execute("DROP VIEW messages").ok());
+    ASSERT_TRUE(db.Execute("ALTER TABLE stored_messages RENAME TO messages").ok());
+    for (const char* trigger : {"messages_fts_insert", "messages_fts_delete", "messages_fts_update",
+                                "archived_messages_fts_delete", "archived_messages_fts_stale", "memos_fts_insert",
+                                "memos_fts_delete", "memos_fts_update", "memo_tags_delete"}) {
+      ASSERT_TRUE(db.Execute(absl::StrCat("DROP TRIGGER ", trigger)).ok());
+    }
+    ASSERT_TRUE(db.Execute("DROP TABLE messages_fts").ok());
+    ASSERT_TRUE(db.Execute("DROP TABLE memos_fts").ok());
+    ASSERT_TRUE(db.Execute("DROP TABLE memo_tags").ok());
+    ASSERT_TRUE(db.Execute("PRAGMA user_version = 0").ok());
+  }
+  slop::Database db;
+  ASSERT_TRUE(db.Init(path).ok());
+  // Tokens are estimated from the inflated content, not the compressed bytes.
+  EXPECT_EQ(CountRows(db, "SELECT tokens AS n FROM messages"), slop::Database::EstimateTokens(LargeToolOutput(4)));
+  auto hits = db.SearchMessages({"Function7"}, "s1", 10);
+  ASSERT_TRUE(hits.ok()) << hits.status();
+  EXPECT_EQ(hits->size(), 1);
+  auto memos = db.SearchMemos({"statements"}, 5);
+  ASSERT_TRUE(memos.ok());
+  EXPECT_EQ(memos->size(), 1);
+  memos = db.GetMemosByTags({"sqlite"});
+  ASSERT_TRUE(memos.ok());
+  EXPECT_EQ(memos->size(), 1);
+  EXPECT_EQ(CountRows(db, "SELECT COUNT(*) AS n FROM metadata WHERE key LIKE '%_stale'"), 0);
+}
+
+TEST(DatabaseTest, BackfillsLeftPendingRunOnTheNextInit) {
+  std::string path = absl::StrCat(testing::TempDir(), "/pending_backfill.db");
+  for (const char* suffix : {"", "-wal", "-shm"}) std::remove(absl::StrCat(path, suffix).c_str());
+  {
+    slop::Database db;
+    ASSERT_TRUE(db.Init(path).ok());
+    ASSERT_TRUE(db.AppendMessage("s1", "user", "Why is the parser slow?").ok());
+    ASSERT_TRUE(db.AddMemo("Prefer prepared statements", R"(["sqlite"])").ok());
+    // As if the process stopped after the migration committed, before its backfills.
+    ASSERT_TRUE(db.Execute("UPDATE stored_messages SET tokens = 0").ok());
+    ASSERT_TRUE(db.Execute("INSERT INTO memos_fts (memos_fts) VALUES ('delete-all')").ok());
+    ASSERT_TRUE(db.Execute("DELETE FROM memo_tags").ok());
+    ASSERT_TRUE(db.Execute("INSERT INTO metadata (key, value) VALUES ('memos_fts_stale', '1'), "
+                           "('memo_tags_stale', '1'), ('message_tokens_stale', '1')")
+                    .ok());
+    // A backfill that fails keeps its key.
+    ASSERT_TRUE(db.Execute("CREATE TRIGGER fail_tokens BEFORE UPDATE OF tokens ON stored_messages "
+                           "BEGIN SELECT RAISE(ABORT, 'disk full'); END")
+                    .ok());
+  }
+  {
+    slop::Database db;
+    EXPECT_FALSE(db.Init(path).ok());
+    EXPECT_EQ(CountRows(db, "SELECT COUNT(*) AS n FROM metadata WHERE key = 'message_tokens_stale'"), 1);
+    ASSERT_TRUE(db.Execute("DROP TRIGGER fail_tokens").ok());
+  }
+  slop::Database db;
+  ASSERT_TRUE(db.Init(path).ok());
+  EXPECT_EQ(CountRows(db, "SELECT COUNT(*) AS n FROM metadata WHERE key LIKE '%_stale'"), 0);
+  EXPECT_EQ(CountRows(db, "SELECT tokens AS n FROM messages"),
+            slop::Database::EstimateTokens("Why is the parser slow?"));
+  auto memos = db.SearchMemos({"statements"}, 5);
+  ASSERT_TRUE(memos.ok());
+  EXPECT_EQ(memos->size(), 1);
+  memos = db.GetMemosByTags({"sqlite"});
+  ASSERT_TRUE(memos.ok());
+  EXPECT_EQ(memos->size(), 1);
+}
+
+TEST(DatabaseTest, MessagesReadsResolvedContentAfterUpgrade) {
+  std::string path = absl::StrCat(testing::TempDir(), "/messages_view.db");
+  for (const char* suffix : {"", "-wal", "-shm"}) std::remove(absl::StrCat(path, suffix).c_str());
+  std::string large = LargeToolOutput(2);
+  {
+    slop::Database db;
+    ASSERT_TRUE(db.Init(path).ok());
+    ASSERT_TRUE(db.AppendMessage("s1", "tool", large, "call|read_file", "completed", "g1").ok());
+    ASSERT_TRUE(db.AppendMessage("s1", "tool", large, "call|read_file", "completed", "g2").ok());
+    // As if the database predated schema versioning, when `messages` was the table.
+    ASSERT_TRUE(db.Execute("DROP VIEW messages_resolved").ok());
+    ASSERT_TRUE(db.Execute("DROP VIEW messages").ok());
+    ASSERT_TRUE(db.Execute("ALTER TABLE stored_messages RENAME TO messages").ok());
+    ASSERT_TRUE(db.Execute("PRAGMA user_version = 0").ok());
+  }
+  slop::Database db;
+  ASSERT_TRUE(db.Init(path).ok());
+  EXPECT_EQ(CountRows(db, "SELECT COUNT(*) AS n FROM stored_messages WHERE content IS NULL"), 2);
+  // The truncation hint's query.
+  auto content = db.Query("SELECT content FROM messages WHERE id = 2");
+  ASSERT_TRUE(content.ok()) << content.status();
+  EXPECT_EQ(nlohmann::json::parse(*content)[0]["content"], large);
+
+  ASSERT_TRUE(db.RemoveGroup("s1", "g1").ok());
+  EXPECT_EQ(CountRows(db, "SELECT COUNT(*) AS n FROM blobs"), 1);
+  ASSERT_TRUE(db.AppendMessage("s1", "user", "after the upgrade", "", "completed", "g3").ok());
+  auto hits = db.SearchMessages({"upgrade"}, "s1", 10);
+  ASSERT_TRUE(hits.ok()) << hits.status();
+  EXPECT_EQ(hits->size(), 1);
+  EXPECT_TRUE(db.Execute("INSERT INTO messages_fts (messages_fts) VALUES ('integrity-check')").ok());
+}
+
+TEST(DatabaseTest, InitWritesNothingToAnUpToDateDatabase) {
+  std::string path = absl::StrCat(testing::TempDir(), "/startup.db");
+  for (const char* suffix : {"", "-wal", "-shm"}) std::remove(absl::StrCat(path, suffix).c_str());
+  {
+    slop::Database db;
+    ASSERT_TRUE(db.Init(path).ok());
+    EXPECT_EQ(CountRows(db, "SELECT user_version AS n FROM pragma_user_version()"), slop::Database::kSchemaVersion);
+    ASSERT_TRUE(db.Execute("UPDATE tools SET is_enabled = 0 WHERE name = 'execute_bash'").ok());
+    ASSERT_TRUE(db.DeleteSkill("dba").ok());
+  }
+  {
+    slop::Database db;
+    ASSERT_TRUE(db.Init(path).ok());
+    EXPECT_EQ(db.GetCommitCount(), 0);
+    // The built-in definitions have not changed, so the user's edits stand.
+    EXPECT_EQ(CountRows(db, "SELECT is_enabled AS n FROM tools WHERE name = 'execute_bash'"), 0);
+    EXPECT_EQ(CountRows(db, "SELECT COUNT(*) AS n FROM skills WHERE name = 'dba'"), 0);
+    ASSERT_TRUE(db.Execute("UPDATE metadata SET value = 'stale' WHERE key = 'default_tools_hash'").ok());
+  }
+  slop::Database db;
+  ASSERT_TRUE(db.Init(path).ok());
+  EXPECT_EQ(CountRows(db, "SELECT is_enabled AS n FROM tools WHERE name = 'execute_bash'"), 1);
+  EXPECT_EQ(CountRows(db, "SELECT COUNT(*) AS n FROM skills WHERE name = 'dba'"), 0);
+}
+
+// Ids and contents of a session's history, for comparing two readers.
+std::vector<std::string> HistoryDigest(slop::Database& db, const std::string& session_id, int window_size) {
+  std::vector<std::string> digest;
+  auto history = db.GetConversationHistory(session_id, false, window_size);
+  EXPECT_TRUE(history.ok()) << history.status();
+  if (!history.ok()) return digest;
+  for (const auto& m : *history) digest.push_back(absl::StrCat(m.id, ":", m.group_id, ":", m.content));
+  return digest;
+}
+
+TEST(DatabaseTest, HistoryCacheFollowsEveryChange) {
+  std::string path = absl::StrCat(testing::TempDir(), "/history_cache.db");
+  for (const char* suffix : {"", "-wal", "-shm"}) std::remove(absl::StrCat(path, suffix).c_str());
+  slop::Database db;
+  ASSERT_TRUE(db.Init(path).ok());
+  slop::Database uncached;
+  ASSERT_TRUE(uncached.Init(path).ok());
+  uncached.SetHistoryCacheCapacity(0);
+
+  auto expect_same = [&](const std::string& step) {
+    for (int window_size : {0, 2}) {
+      EXPECT_EQ(HistoryDigest(db, "s1", window_size), HistoryDigest(uncached, "s1", window_size))
+          << step << ", window " << window_size;
+    }
+  };
+
+  for (int i = 0; i < 4; ++i) {
+    ASSERT_TRUE(db.AppendMessage("s1", "user", absl::StrCat("prompt ", i), "", "completed", absl::StrCat("g", i)).ok());
+    ASSERT_TRUE(db.AppendMessage("s2", "user", "other session", "", "completed", absl::StrCat("g", i)).ok());
+    expect_same(absl::StrCat("append ", i));
+  }
+  ASSERT_TRUE(db.AppendMessage("s1", "assistant", "answer", "", "completed", "g3").ok());
+  ASSERT_TRUE(db.AppendMessage("s1", "user", "no group").ok());
+  expect_same("append to the newest group and without a group");
+
+  // g0 has fallen out of the two-group window; a message in it brings it back.
+  ASSERT_TRUE(db.AppendMessage("s1", "assistant", "late answer", "", "completed", "g0").ok());
+  expect_same("append to a group outside the window");
+
+  auto history = db.GetConversationHistory("s1");
+  ASSERT_TRUE(history.ok());
+  ASSERT_TRUE(db.UpdateMessageStatus("s1", history->back().id, "dropped").ok());
+  expect_same("drop");
+  ASSERT_TRUE(db.AppendMessage("s1", "tool", "dropped result", "", "dropped", "g3").ok());
+  expect_same("append dropped");
+
+  ASSERT_TRUE(db.Execute("DELETE FROM stored_messages WHERE group_id = ?", std::string("g3")).ok());
+  expect_same("undo");
+
+  {
+    auto batch = db.BeginWriteBatch();
+    ASSERT_TRUE(batch.ok());
+    ASSERT_TRUE(db.AppendMessage("s1", "user", "rolled back", "", "completed", "g9").ok());
+    // Read inside the transaction, so the cached window holds the message.
+    EXPECT_EQ(HistoryDigest(db, "s1", 2).back(), absl::StrCat(*db.GetLastMessageId(), ":g9:rolled back"));
+    ASSERT_TRUE((*batch)->Rollback().ok());
+  }
+  expect_same("rollback");
+
+  ASSERT_TRUE(db.DeleteSession("s1").ok());
+  expect_same("delete session");
+  ASSERT_TRUE(db.AppendMessage("s1", "user", "fresh start", "", "completed", "g10").ok());
+  expect_same("append after delete");
+}
+
+TEST(DatabaseTest, ReadSnapshotIgnoresLaterWrites) {
+  std::string path = absl::StrCat(testing::TempDir(), "/read_snapshot.db");
+  for (const char* suffix : {"", "-wal", "-shm"}) std::remove(absl::StrCat(path, suffix).c_str());
+  slop::Database db;
+  ASSERT_TRUE(db.Init(path).ok());
+  ASSERT_TRUE(db.AppendMessage("s1", "user", "before", "", "completed", "g1").ok());
+  ASSERT_TRUE(db.UpdateScratchpad("s1", "old").ok());
+
+  {
+    auto snapshot = db.BeginReadSnapshot();
+    ASSERT_TRUE(snapshot.ok());
+    EXPECT_EQ(*db.GetScratchpad("s1"), "old");
+    // The other thread also caches a window newer than the snapshot.
+    std::thread other([&] {
+      ASSERT_TRUE(db.UpdateScratchpad("s1", "new").ok());
+      ASSERT_TRUE(db.AppendMessage("s1", "user", "after", "", "completed", "g2").ok());
+      EXPECT_EQ(HistoryDigest(db, "s1", 0).size(), 2);
+    });
+    other.join();
+
+    EXPECT_EQ(*db.GetScratchpad("s1"), "old");
+    EXPECT_EQ(HistoryDigest(db, "s1", 0).size(), 1);
+    auto nested = db.BeginReadSnapshot();
+    ASSERT_TRUE(nested.ok());
+    EXPECT_EQ(db.GetSessionPromptState("s1")->scratchpad, "old");
+  }
+  EXPECT_EQ(*db.GetScratchpad("s1"), "new");
+  EXPECT_EQ(HistoryDigest(db, "s1", 0).size(), 2);
+}
+
+TEST(DatabaseTest, ReadSnapshotOfInMemoryDatabase) {
+  slop::Database db;
+  ASSERT_TRUE(db.Init(":memory:").ok());
+  ASSERT_TRUE(db.UpdateScratchpad("s1", "notes").ok());
+  {
+    auto snapshot = db.BeginReadSnapshot();
+    ASSERT_TRUE(snapshot.ok());
+    EXPECT_EQ(*db.GetScratchpad("s1"), "notes");
+  }
+  // The writer held by the snapshot was released.
+  std::thread other([&] { EXPECT_TRUE(db.UpdateScratchpad("s1", "more notes").ok()); });
+  other.join();
+  EXPECT_EQ(*db.GetScratchpad("s1"), "more notes");
+}
+
+TEST(DatabaseTest, SessionPromptStateMatchesSeparateReads) {
+  slop::Database db;
+  ASSERT_TRUE(db.Init(":memory:").ok());
+  auto missing = db.GetSessionPromptState("s1");
+  ASSERT_TRUE(missing.ok());
+  EXPECT_EQ(missing->settings.size, db.GetContextSettings("s1")->size);
+  EXPECT_EQ(missing->settings.budget, 0);
+  EXPECT_EQ(missing->state, "");
+  EXPECT_EQ(missing->scratchpad, "");
+
+  ASSERT_TRUE(db.SetContextBudget("s1", 2000).ok());
+  ASSERT_TRUE(db.SetSessionState("s1", "Goal: ship").ok());
+  ASSERT_TRUE(db.UpdateScratchpad("s1", "- [ ] test").ok());
+  auto state = db.GetSessionPromptState("s1");
+  ASSERT_TRUE(state.ok());
+  EXPECT_EQ(state->settings.size, db.GetContextSettings("s1")->size);
+  EXPECT_EQ(state->settings.budget, 2000);
+  EXPECT_EQ(state->state, "Goal: ship");
+  EXPECT_EQ(state->scratchpad, "- [ ] test");
+}
+
+TEST(DatabaseTest, HistoryCacheReadsOnlyAppendedMessages) {
+  slop::Database db;
+  ASSERT_TRUE(db.Init(":memory:").ok());
+  ASSERT_TRUE(db.AppendMessage("s1", "user", "first", "", "completed", "g1").ok());
+  ASSERT_TRUE(db.GetConversationHistory("s1", false, 5).ok());
+  auto before = db.GetHistoryCacheStats();
+  EXPECT_EQ(before.size, 1);
+  EXPECT_EQ(before.capacity, slop::Database::kDefaultHistoryCacheCapacity);
+
+  ASSERT_TRUE(db.AppendMessage("s1", "assistant", "second", "", "completed", "g1").ok());
+  ASSERT_TRUE(db.AppendMessage("s1", "user", "third", "", "completed", "g2").ok());
+  auto history = db.GetConversationHistory("s1", false, 5);
+  ASSERT_TRUE(history.ok());
+  ASSERT_EQ(history->size(), 3);
+  EXPECT_EQ(history->back().content, "third");
+  auto after = db.GetHistoryCacheStats();
+  EXPECT_EQ(after.hits - before.hits, 1);
+  EXPECT_EQ(after.misses, before.misses);
+
+  // Compressed content is cached as stored and inflated on the way out.
+  std::string large = LargeToolOutput(1);
+  ASSERT_TRUE(db.AppendMessage("s1", "tool", large, "call|read_file", "completed", "g2").ok());
+  history = db.GetConversationHistory("s1", false, 5);
+  ASSERT_TRUE(history.ok());
+  EXPECT_EQ(history->back().content, large);
+
+  ASSERT_TRUE(db.UpdateMessageStatus("s1", history->front().id, "dropped").ok());
+  history = db.GetConversationHistory("s1", false, 5);
+  ASSERT_TRUE(history.ok());
+  EXPECT_EQ(history->front().content, "second");
+  EXPECT_EQ(db.GetHistoryCacheStats().misses, after.misses + 1);
+}
+
+TEST(DatabaseTest, MessagesByGroupsAfterId) {
+  slop::Database db;
+  ASSERT_TRUE(db.Init(":memory:").ok());
+  EXPECT_EQ(*db.GetLastMessageId(), 0);
+  ASSERT_TRUE(db.AppendMessage("s1", "user", "prompt", "", "completed", "g1").ok());
+  auto last_id = db.GetLastMessageId();
+  ASSERT_TRUE(last_id.ok());
+  ASSERT_TRUE(db.AppendMessage("s1", "assistant", "answer", "", "completed", "g1").ok());
+  auto added = db.GetMessagesByGroups({"g1"}, *last_id);
+  ASSERT_TRUE(added.ok());
+  ASSERT_EQ(added->size(), 1);
+  EXPECT_EQ((*added)[0].content, "answer");
+  EXPECT_EQ(db.GetMessagesByGroups({"g1"})->size(), 2);
+}
+
+TEST(DatabaseTest, QueryStopsAtItsBudget) {
+  slop::Database db;
+  ASSERT_TRUE(db.Init(":memory:").ok());
+  for (int i = 0; i < 50; ++i) {
+    ASSERT_TRUE(db.AppendMessage("s1", "tool", absl::StrCat("result ", i, std::string(100, 'x'))).ok());
+  }
+
+  slop::Database::QueryOptions options;
+  options.max_rows = 10;
+  auto result = db.Query("SELECT id, content FROM messages_resolved ORDER BY id;", {}, options);
+  ASSERT_TRUE(result.ok()) << result.status();
+  EXPECT_EQ(result->rows, 10);
+  EXPECT_EQ(result->omitted_rows, 40);
+  auto rows = nlohmann::json::parse(result->output);
+  ASSERT_EQ(rows.size(), 10);
+  EXPECT_EQ(rows[9]["id"], 10);
+
+  options.max_rows = 0;
+  options.max_bytes = 1000;
+  result = db.Query("SELECT content FROM messages_resolved WHERE session_id = ?", {"s1"}, options);
+  ASSERT_TRUE(result.ok()) << result.status();
+  EXPECT_LE(result->output.size(), 1000);
+  EXPECT_EQ(nlohmann::json::parse(result->output).size(), result->rows);
+  EXPECT_EQ(result->rows + result->omitted_rows, 50);
+
+  // The first row is written even when it alone is over budget.
+  options.max_bytes = 10;
+  result = db.Query("SELECT content FROM messages_resolved WHERE id = 1", {}, options);
+  ASSERT_TRUE(result.ok());
+  EXPECT_EQ(result->rows, 1);
+  EXPECT_EQ(result->omitted_rows, 0);
+
+  // Rows past the budget are counted by stepping the statement, not by running it
+  // again, so any statement can be counted, and counting stops at a multiple of the
+  // rows written.
+  options.max_bytes = 0;
+  options.max_rows = 1;
+  result = db.Query("PRAGMA table_info(stored_messages)", {}, options);
+  ASSERT_TRUE(result.ok());
+  EXPECT_EQ(result->omitted_rows, 10);
+  EXPECT_FALSE(result->omitted_rows_at_least);
+  options.max_rows = 2;
+  result = db.Query("WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 100) SELECT i FROM n",
+                    {}, options);
+  ASSERT_TRUE(result.ok());
+  EXPECT_EQ(result->rows, 2);
+  EXPECT_EQ(result->omitted_rows, 2 * slop::Database::kOmittedRowsCountFactor);
+  EXPECT_TRUE(result->omitted_rows_at_least);
+}
+
+TEST(DatabaseTest, QueryWritesTsv) {
+  slop::Database db;
+  ASSERT_TRUE(db.Init(":memory:").ok());
+  slop::Database::QueryOptions options;
+  options.format = slop::Database::QueryFormat::kTsv;
+  auto result = db.Query(
+      "SELECT 1 AS n, 'a\tb\\c' AS text, NULL AS missing, 2.5 AS x UNION ALL SELECT 2, 'line\nbreak', 'v', 0", {},
+      options);
+  ASSERT_TRUE(result.ok()) << result.status();
+  EXPECT_EQ(result->output, "n\ttext\tmissing\tx\n1\ta\\tb\\\\c\t\t2.5\n2\tline\\nbreak\tv\t0\n");
+  EXPECT_EQ(result->rows, 2);
+}
+
+TEST(DatabaseTest, QueryKeepsColumnOrderAndTypes) {
+  slop::Database db;
+  ASSERT_TRUE(db.Init(":memory:").ok());
+  auto res = db.Query("SELECT 'z' AS zeta, 1 AS alpha, 0.5 AS half, NULL AS none, x'C3A9' AS blob");
+  ASSERT_TRUE(res.ok()) << res.status();
+  EXPECT_EQ(*res, R"([{"zeta":"z","alpha":1,"half":0.5,"none":null,"blob":"é"}])");
+  EXPECT_EQ(*db.Query("SELECT 1 WHERE 0"), "[]");
+}
+
+std::string ArchiveTestPath(const std::string& name) {
+  std::string path = absl::StrCat(testing::TempDir(), "/", name, ".db");
+  for (const char* suffix : {"", "-wal", "-shm", ".archive", ".archive-wal", ".archive-shm"}) {
+    std::remove(absl::StrCat(path, suffix).c_str());
+  }
+  return path;
+}
+
+TEST(DatabaseTest, ArchivedGroupsStillResolveById) {
+  std::string path = ArchiveTestPath("archive");
+  std::string large = LargeToolOutput(2);
+  slop::Database db;
+  ASSERT_TRUE(db.Init(path).ok());
+  ASSERT_TRUE(db.SetContextWindow("s1", 2).ok());
+  for (int i = 0; i < 5; ++i) {
+    std::string group_id = absl::StrCat("g", i);
+    ASSERT_TRUE(db.AppendMessage("s1", "user", absl::StrCat("prompt ", i), "", "completed", group_id).ok());
+    ASSERT_TRUE(db.AppendMessage("s1", "tool", large, "call|read_file", "completed", group_id).ok());
+  }
+  // Same group ids, and a window that keeps everything.
+  ASSERT_TRUE(db.SetContextWindow("s2", 0).ok());
+  for (int i = 0; i < 5; ++i) {
+    std::string group_id = absl::StrCat("g", i);
+    ASSERT_TRUE(db.AppendMessage("s2", "user", absl::StrCat("prompt ", i), "", "completed", group_id).ok());
+    ASSERT_TRUE(db.AppendMessage("s2", "tool", large, "call|read_file", "completed", group_id).ok());
+  }
+  ASSERT_TRUE(db.Execute("UPDATE stored_messages SET created_at = datetime(created_at, '-60 days')").ok());
+  auto window = HistoryDigest(db, "s1", 2);
+
+  slop::Database::ArchivePolicy policy;
+  policy.max_age = absl::Hours(24 * 30);
+  auto stats = db.ArchiveGroups(policy);
+  ASSERT_TRUE(stats.ok()) << stats.status();
+  EXPECT_EQ(stats->groups, 3);
+  EXPECT_EQ(stats->messages, 6);
+  EXPECT_EQ(CountRows(db, "SELECT COUNT(*) AS n FROM stored_messages WHERE session_id = 's1'"), 4);
+  EXPECT_EQ(CountRows(db, "SELECT COUNT(*) AS n FROM archived_messages"), 6);
+  EXPECT_EQ(HistoryDigest(db, "s1", 2), window);
+  auto other = db.GetConversationHistory("s2");
+  ASSERT_TRUE(other.ok());
+  ASSERT_EQ(other->size(), 10);
+  EXPECT_EQ((*other)[1].content, large);
+
+  // Lookups by id and by group, as truncation hints and /message view do.
+  auto res = db.Query("SELECT content FROM messages WHERE id = 2");
+  ASSERT_TRUE(res.ok()) << res.status();
+  EXPECT_EQ(nlohmann::json::parse(*res)[0]["content"], large);
+  res = db.Query("SELECT role, content FROM messages_resolved WHERE group_id = 'g1' AND session_id = 's1' ORDER BY id");
+  ASSERT_TRUE(res.ok()) << res.status();
+  auto rows = nlohmann::json::parse(*res);
+  ASSERT_EQ(rows.size(), 2);
+  EXPECT_EQ(rows[0]["content"], "prompt 1");
+  EXPECT_EQ(rows[1]["content"], large);
+  auto group = db.GetGroupMessages("s1", "g1");
+  ASSERT_TRUE(group.ok()) << group.status();
+  ASSERT_EQ(group->size(), 2);
+  EXPECT_EQ((*group)[1].content, large);
+  auto groups = db.ListGroups("s1", 10);
+  ASSERT_TRUE(groups.ok()) << groups.status();
+  ASSERT_EQ(groups->size(), 5);
+  EXPECT_EQ(groups->back().prompt, "prompt 0");
+
+  stats = db.ArchiveGroups(policy);
+  ASSERT_TRUE(stats.ok());
+  EXPECT_EQ(stats->groups, 0);
+
+  {
+    slop::Database reopened;
+    ASSERT_TRUE(reopened.Init(path).ok());
+    res = reopened.Query("SELECT content FROM messages_resolved WHERE id = 3");
+    ASSERT_TRUE(res.ok()) << res.status();
+    EXPECT_EQ(nlohmann::json::parse(*res)[0]["content"], "prompt 1");
+  }
+
+  ASSERT_TRUE(db.DeleteSession("s1").ok());
+  EXPECT_EQ(CountRows(db, "SELECT COUNT(*) AS n FROM archived_messages"), 0);
+  ASSERT_TRUE(db.ArchiveGroups(policy).ok());
+  EXPECT_EQ(CountRows(db, "SELECT COUNT(*) AS n FROM archive.messages"), 0);
+}
+
+TEST(DatabaseTest, ArchivedMessagesStaySearchable) {
+  std::string path = ArchiveTestPath("archive_search");
+  slop::Database db;
+  ASSERT_TRUE(db.Init(path).ok());
+  ASSERT_TRUE(db.SetContextWindow("s1", 1).ok());
+  ASSERT_TRUE(db.AppendMessage("s1", "user", "the flaky migration test", "", "completed", "g0").ok());
+  ASSERT_TRUE(db.AppendMessage("s1", "user", "something else", "", "completed", "g1").ok());
+  ASSERT_TRUE(db.Execute("UPDATE stored_messages SET created_at = datetime(created_at, '-60 days')").ok());
+  slop::Database::ArchivePolicy policy;
+  policy.max_age = absl::Hours(24 * 30);
+  auto stats = db.ArchiveGroups(policy);
+  ASSERT_TRUE(stats.ok()) << stats.status();
+  ASSERT_EQ(stats->groups, 1);
+
+  auto hits = db.SearchMessages({"flaky"}, "s1", 10);
+  ASSERT_TRUE(hits.ok()) << hits.status();
+  ASSERT_EQ(hits->size(), 1);
+  EXPECT_EQ((*hits)[0].session_id, "s1");
+  EXPECT_EQ((*hits)[0].group_id, "g0");
+  EXPECT_EQ((*hits)[0].snippet, "the **flaky** migration test");
+  {
+    slop::Database reopened;
+    ASSERT_TRUE(reopened.Init(path).ok());
+    hits = reopened.SearchMessages({"flaky"}, "", 10);
+    ASSERT_TRUE(hits.ok()) << hits.status();
+    EXPECT_EQ(hits->size(), 1);
+  }
+
+  // Removing the archived group takes it out of the index.
+  ASSERT_TRUE(db.RemoveGroup("s1", "g0").ok());
+  hits = db.SearchMessages({"flaky"}, "", 10);
+  ASSERT_TRUE(hits.ok());
+  EXPECT_TRUE(hits->empty());
+  EXPECT_TRUE(db.Execute("INSERT INTO messages_fts (messages_fts) VALUES ('integrity-check')").ok());
+}
+
+TEST(DatabaseTest, ArchivedMessagesAreRemovedWithoutTheArchive) {
+  std::string path = ArchiveTestPath("archive_missing");
+  {
+    slop::Database db;
+    ASSERT_TRUE(db.Init(path).ok());
+    ASSERT_TRUE(db.SetContextWindow("s1", 1).ok());
+    ASSERT_TRUE(db.AppendMessage("s1", "user", "the flaky migration test", "", "completed", "g0").ok());
+    ASSERT_TRUE(db.AppendMessage("s1", "user", "something else", "", "completed", "g1").ok());
+    ASSERT_TRUE(db.AppendMessage("s1", "user", "the latest turn", "", "completed", "g2").ok());
+    ASSERT_TRUE(db.Execute("UPDATE stored_messages SET created_at = datetime(created_at, '-60 days')").ok());
+    slop::Database::ArchivePolicy policy;
+    policy.max_age = absl::Hours(24 * 30);
+    auto stats = db.ArchiveGroups(policy);
+    ASSERT_TRUE(stats.ok()) << stats.status();
+    ASSERT_EQ(stats->groups, 2);
+  }
+  std::string archive = absl::StrCat(path, ".archive");
+  ASSERT_EQ(std::rename(archive.c_str(), absl::StrCat(archive, ".moved").c_str()), 0);
+  {
+    slop::Database db;
+    ASSERT_TRUE(db.Init(path).ok());
+    // The index entry stays behind, unreachable, until the archive is back.
+    ASSERT_TRUE(db.RemoveGroup("s1", "g0").ok());
+    ASSERT_TRUE(db.RunMaintenance().ok());
+    EXPECT_EQ(CountRows(db, "SELECT COUNT(*) AS n FROM metadata WHERE key = 'messages_fts_stale'"), 1);
+    auto hits = db.SearchMessages({"flaky"}, "", 10);
+    ASSERT_TRUE(hits.ok()) << hits.status();
+    EXPECT_TRUE(hits->empty());
+  }
+  ASSERT_EQ(std::rename(absl::StrCat(archive, ".moved").c_str(), archive.c_str()), 0);
+  slop::Database db;
+  ASSERT_TRUE(db.Init(path).ok());
+  EXPECT_EQ(CountRows(db, "SELECT COUNT(*) AS n FROM metadata WHERE key = 'messages_fts_stale'"), 0);
+  EXPECT_TRUE(db.Execute("INSERT INTO messages_fts (messages_fts) VALUES ('integrity-check')").ok());
+  auto hits = db.SearchMessages({"else"}, "", 10);
+  ASSERT_TRUE(hits.ok()) << hits.status();
+  EXPECT_EQ(hits->size(), 1);
+}
+
+TEST(DatabaseTest, ArchiverCapsGroupsOutsideTheWindow) {
+  slop::Database memory;
+  ASSERT_TRUE(memory.Init(":memory:").ok());
+  EXPECT_TRUE(absl::IsFailedPrecondition(memory.ArchiveGroups({}).status()));
+
+  std::string path = ArchiveTestPath("archiver");
+  slop::Database db;
+  ASSERT_TRUE(db.Init(path).ok());
+  ASSERT_TRUE(db.SetContextWindow("s2", 1).ok());
+  for (int i = 0; i < 8; ++i) {
+    ASSERT_TRUE(db.AppendMessage("s1", "user", "prompt", "", "completed", absl::StrCat("a", i)).ok());
+  }
+  for (int i = 0; i < 5; ++i) {
+    ASSERT_TRUE(db.AppendMessage("s2", "user", "prompt", "", "completed", absl::StrCat("b", i)).ok());
+  }
+  // A dropped group takes no place in the window and ranks last.
+  ASSERT_TRUE(db.UpdateMessageStatus("s2", 13, "dropped").ok());
+  // 1 token a group: a budget of 2 holds c5 and c4 at most.
+  ASSERT_TRUE(db.SetContextBudget("s3", 2).ok());
+  for (int i = 0; i < 6; ++i) {
+    ASSERT_TRUE(db.AppendMessage("s3", "user", "prompt", "", "completed", absl::StrCat("c", i)).ok());
+  }
+
+  slop::Database::ArchivePolicy policy;
+  policy.max_groups_per_session = 3;
+  db.StartArchiver(policy, absl::Minutes(10));
+  int archived = 0;
+  for (int i = 0; i < 500 && archived < 8; ++i) {
+    absl::SleepFor(absl::Milliseconds(10));
+    archived = CountRows(db, "SELECT COUNT(*) AS n FROM archived_messages");
+  }
+  db.StopArchiver();
+  // s1 keeps its default window of 5 groups; s2 keeps b3 (its window), b2 and b1 (within the cap);
+  // s3 keeps c5, c4 and c3.
+  EXPECT_EQ(archived, 8);
+  auto res = db.Query("SELECT group_id FROM stored_messages ORDER BY id");
+  ASSERT_TRUE(res.ok());
+  EXPECT_EQ(*res, R"([{"group_id":"a3"},{"group_id":"a4"},{"group_id":"a5"},{"group_id":"a6"},{"group_id":"a7"},)"
+                  R"({"group_id":"b1"},{"group_id":"b2"},{"group_id":"b3"},)"
+                  R"({"group_id":"c3"},{"group_id":"c4"},{"group_id":"c5"}])");
+}
+
+std::vector<std::string> HistoryContents(slop::Database& db, const std::string& session_id, int window_size = 0) {
+  std::vector<std::string> contents;
+  auto history = db.GetConversationHistory(session_id, false, window_size);
+  EXPECT_TRUE(history.ok()) << history.status();
+  if (history.ok()) {
+    for (const auto& m : *history) contents.push_back(m.content);
+  }
+  return contents;
+}
+
+TEST(DatabaseTest, ForksInheritHistoryWithoutCopyingIt) {
+  slop::Database db;
+  ASSERT_TRUE(db.Init(":memory:").ok());
+  for (int i = 0; i < 3; ++i) {
+    ASSERT_TRUE(db.AppendMessage("p", "user", absl::StrCat("parent ", i), "", "completed", absl::StrCat("g", i)).ok());
+  }
+  ASSERT_TRUE(db.RecordUsage("p", "gpt-4", 10, 20).ok());
+  ASSERT_TRUE(db.RecordUsage("p", "gpt-4", 1, 2).ok());
+
+  ASSERT_TRUE(db.CloneSession("p", "c").ok());
+  EXPECT_EQ(CountRows(db, "SELECT COUNT(*) AS n FROM messages"), 3);
+  EXPECT_EQ(CountRows(db, "SELECT COUNT(*) AS n FROM usage WHERE session_id = 'c'"), 1);
+  EXPECT_EQ(db.GetTotalUsage("c")->total_tokens, 33);
+  EXPECT_EQ(db.GetLastGroupId("c").value_or(""), "g2");
+
+  ASSERT_TRUE(db.AppendMessage("p", "user", "parent after fork", "", "completed", "g3").ok());
+  ASSERT_TRUE(db.AppendMessage("c", "user", "child", "", "completed", "c0").ok());
+  ASSERT_TRUE(db.CloneSession("c", "gc").ok());
+  ASSERT_TRUE(db.AppendMessage("c", "user", "child after fork", "", "completed", "c1").ok());
+  ASSERT_TRUE(db.AppendMessage("gc", "user", "grandchild", "", "completed", "gc0").ok());
+
+  using Contents = std::vector<std::string>;
+  EXPECT_EQ(HistoryContents(db, "p"), (Contents{"parent 0", "parent 1", "parent 2", "parent after fork"}));
+  EXPECT_EQ(HistoryContents(db, "c"), (Contents{"parent 0", "parent 1", "parent 2", "child", "child after fork"}));
+  EXPECT_EQ(HistoryContents(db, "c", 2), (Contents{"child", "child after fork"}));
+  Contents grandchild = {"parent 0", "parent 1", "parent 2", "child", "grandchild"};
+  EXPECT_EQ(HistoryContents(db, "gc"), grandchild);
+  EXPECT_EQ(HistoryContents(db, "gc", 3), (Contents{"parent 2", "child", "grandchild"}));
+
+  auto hits = db.SearchMessages({"parent"}, "gc", 10);
+  ASSERT_TRUE(hits.ok()) << hits.status();
+  EXPECT_EQ(hits->size(), 3);
+
+  // A deleted ancestor stays hidden while its forks inherit from it.
+  ASSERT_TRUE(db.DeleteSession("p").ok());
+  EXPECT_TRUE(HistoryContents(db, "p").empty());
+  EXPECT_FALSE(db.CloneSession("p", "p2").ok());
+  EXPECT_EQ(CountRows(db, "SELECT COUNT(*) AS n FROM messages"), 6);
+  EXPECT_EQ(HistoryContents(db, "c"), (Contents{"parent 0", "parent 1", "parent 2", "child", "child after fork"}));
+  EXPECT_EQ(HistoryContents(db, "gc"), grandchild);
+  ASSERT_TRUE(db.DeleteSession("c").ok());
+  EXPECT_EQ(HistoryContents(db, "gc"), grandchild);
+  EXPECT_EQ(CountRows(db, "SELECT COUNT(*) AS n FROM sessions WHERE deleted_at IS NOT NULL"), 2);
+
+  // The last fork takes them with it.
+  ASSERT_TRUE(db.DeleteSession("gc").ok());
+  EXPECT_EQ(CountRows(db, "SELECT COUNT(*) AS n FROM sessions"), 0);
+  EXPECT_EQ(CountRows(db, "SELECT COUNT(*) AS n FROM messages"), 0);
+}
+
+TEST(DatabaseTest, ForkChangesLeaveTheParentUnchanged) {
+  slop::Database db;
+  ASSERT_TRUE(db.Init(":memory:").ok());
+  ASSERT_TRUE(db.AppendMessage("p", "user", "parent 0", "", "completed", "g0").ok());
+  ASSERT_TRUE(db.AppendMessage("p", "assistant", "call", "", "tool_call", "g1").ok());
+  ASSERT_TRUE(db.AppendMessage("p", "tool", "result", "call|read_file", "completed", "g1").ok());
+  ASSERT_TRUE(db.CloneSession("p", "c").ok());
+  ASSERT_TRUE(db.CloneSession("c", "gc").ok());
+  ASSERT_TRUE(db.AppendMessage("c", "user", "child", "", "completed", "c0").ok());
+
+  // The fork drops an inherited message for itself alone: nothing is copied, and its
+  // fork, which saw the message through it, keeps it.
+  auto history = db.GetConversationHistory("c");
+  ASSERT_TRUE(history.ok());
+  ASSERT_EQ(history->size(), 4);
+  EXPECT_EQ((*history)[2].session_id, "p");
+  ASSERT_TRUE(db.UpdateMessageStatus("c", (*history)[2].id, "dropped").ok());
+
+  using Contents = std::vector<std::string>;
+  Contents parent = {"parent 0", "call", "result"};
+  EXPECT_EQ(HistoryContents(db, "p"), parent);
+  EXPECT_EQ(HistoryContents(db, "c"), (Contents{"parent 0", "call", "child"}));
+  EXPECT_EQ(HistoryContents(db, "gc"), parent);
+  EXPECT_EQ(CountRows(db, "SELECT COUNT(*) AS n FROM stored_messages"), 4);
+  EXPECT_EQ(CountRows(db, "SELECT COUNT(*) AS n FROM message_overrides"), 1);
+
+  // The parent changing a message a fork sees leaves the fork's unchanged.
+  ASSERT_TRUE(db.CloneSession("p", "c2").ok());
+  ASSERT_TRUE(db.UpdateMessageStatus("p", 2, "dropped").ok());
+  EXPECT_EQ(HistoryContents(db, "p"), (Contents{"parent 0", "result"}));
+  EXPECT_EQ(HistoryContents(db, "c2"), parent);
+
+  // Undo on a fresh fork removes the inherited last group from the fork alone.
+  ASSERT_TRUE(db.CloneSession("p", "c3").ok());
+  auto last = db.GetLastGroupId("c3");
+  ASSERT_TRUE(last.ok()) << last.status();
+  EXPECT_EQ(*last, "g1");
+  ASSERT_TRUE(db.RemoveGroup("c3", *last).ok());
+  EXPECT_EQ(HistoryContents(db, "c3"), (Contents{"parent 0"}));
+  EXPECT_EQ(HistoryContents(db, "p"), (Contents{"parent 0", "result"}));
+
+  EXPECT_TRUE(absl::IsNotFound(db.UpdateMessageStatus("c3", 2, "dropped")));
+  EXPECT_EQ(db.GetLastGroupId("c3").value_or(""), "g0");
+  auto hits = db.SearchMessages({"result"}, "c3", 10);
+  ASSERT_TRUE(hits.ok()) << hits.status();
+  EXPECT_TRUE(hits->empty());
+  hits = db.SearchMessages({"result"}, "p", 10);
+  ASSERT_TRUE(hits.ok()) << hits.status();
+  EXPECT_EQ(hits->size(), 1);
+
+  // Undo in the parent keeps the group for its forks; once the last of them is gone,
+  // the group goes.
+  ASSERT_TRUE(db.RemoveGroup("p", "g1").ok());
+  EXPECT_EQ(HistoryContents(db, "p"), (Contents{"parent 0"}));
+  EXPECT_EQ(HistoryContents(db, "c2"), parent);
+  auto group = db.GetGroupMessages("c2", "g1");
+  ASSERT_TRUE(group.ok()) << group.status();
+  EXPECT_EQ(group->size(), 2);
+  group = db.GetGroupMessages("p", "g1");
+  ASSERT_TRUE(group.ok()) << group.status();
+  EXPECT_TRUE(group->empty());
+  auto groups = db.ListGroups("c", 10);
+  ASSERT_TRUE(groups.ok()) << groups.status();
+  ASSERT_EQ(groups->size(), 2);
+  EXPECT_EQ((*groups)[0].prompt, "child");
+  EXPECT_EQ((*groups)[1].group_id, "g0");
+  EXPECT_EQ(CountRows(db, "SELECT COUNT(*) AS n FROM stored_messages WHERE group_id = 'g1'"), 2);
+  for (const char* fork : {"c", "gc", "c2", "c3"}) ASSERT_TRUE(db.DeleteSession(fork).ok());
+  EXPECT_EQ(HistoryContents(db, "p"), (Contents{"parent 0"}));
+  EXPECT_EQ(CountRows(db, "SELECT COUNT(*) AS n FROM stored_messages"), 1);
+  EXPECT_EQ(CountRows(db, "SELECT COUNT(*) AS n FROM message_overrides"), 0);
+}
+
+TEST(DatabaseTest, ReadsAddQueuedCountersWithoutWritingThem) {
+  slop::Database db;
+  ASSERT_TRUE(db.Init(":memory:").ok());
+  ASSERT_TRUE(db.RegisterTool({"test_tool", "desc", "{}", true}).ok());
+  ASSERT_TRUE(db.RegisterSkill({0, "test_skill", "desc", "patch"}).ok());
+  auto find_tool = [&] {
+    auto tools = db.GetEnabledTools();
+    EXPECT_TRUE(tools.ok());
+    auto it = std::find_if(tools->begin(), tools->end(), [](const auto& t) { return t.name == "test_tool"; });
+    return it == tools->end() ? -1 : it->call_count;
+  };
+
+  // An open batch keeps the background thread from writing the queue.
+  auto batch_or = db.BeginWriteBatch();
+  ASSERT_TRUE(batch_or.ok());
+  ASSERT_TRUE(db.IncrementToolCallCount("test_tool").ok());
+  ASSERT_TRUE(db.IncrementToolCallCount("test_tool").ok());
+  ASSERT_TRUE(db.IncrementSkillActivationCount("test_skill").ok());
+  ASSERT_TRUE(db.RecordUsage("s1", "model", 10, 20, 4).ok());
+
+  EXPECT_EQ(find_tool(), 2);
+  auto skills = db.GetSkills();
+  ASSERT_TRUE(skills.ok());
+  for (const auto& s : *skills) {
+    if (s.name == "test_skill") EXPECT_EQ(s.activation_count, 1);
+  }
+  auto usage = db.GetTotalUsage("s1");
+  ASSERT_TRUE(usage.ok());
+  EXPECT_EQ(usage->total_tokens, 30);
+  EXPECT_EQ(usage->cached_tokens, 4);
+  ASSERT_TRUE(db.Query("SELECT COUNT(*) AS n FROM messages").ok());
+
+  // None of them wrote the queue into the batch, so rolling it back loses nothing.
+  ASSERT_TRUE((*batch_or)->Rollback().ok());
+  EXPECT_EQ(CountRows(db, "SELECT call_count AS n FROM tools WHERE name = 'test_tool'"), 2);
+  EXPECT_EQ(find_tool(), 2);
+  EXPECT_EQ(db.GetTotalUsage("s1")->total_tokens, 30);
+}
+
+TEST(DatabaseTest, QueryFlushesQueuedWritesOnlyForTheTablesTheyWrite) {
+  slop::Database db;
+  ASSERT_TRUE(db.Init(":memory:").ok());
+  ASSERT_TRUE(db.RegisterTool({"test_tool", "desc", "{}", true}).ok());
+  ASSERT_TRUE(db.Execute("CREATE VIEW counters AS SELECT name, call_count FROM tools").ok());
+
+  // Naming the tables in a string does not read them: the queue stays out of the batch.
+  auto batch_or = db.BeginWriteBatch();
+  ASSERT_TRUE(batch_or.ok());
+  ASSERT_TRUE(db.IncrementToolCallCount("test_tool").ok());
+  ASSERT_TRUE(db.Query("SELECT 'tools, skills and usage' AS note FROM messages").ok());
+  ASSERT_TRUE((*batch_or)->Rollback().ok());
+
+  // A view over `tools` reads it, whatever it is called.
+  ASSERT_TRUE(db.IncrementToolCallCount("test_tool").ok());
+  EXPECT_EQ(CountRows(db, "SELECT call_count AS n FROM counters WHERE name = 'test_tool'"), 2);
+}
+
+TEST(DatabaseTest, UsageRollupsTrackTheLedgerAndPriceIt) {
+  slop::Database db;
+  ASSERT_TRUE(db.Init(":memory:").ok());
+
+  ASSERT_TRUE(db.RecordUsage("s1", "gemini-2.5-pro", 1000, 2000, 600).ok());
+  ASSERT_TRUE(db.RecordUsage("s1", "gemini-2.5-pro", 500, 500).ok());
+  ASSERT_TRUE(db.RecordUsage("s1", "gpt-4o", 100, 100).ok());
+  ASSERT_TRUE(db.RecordUsage("s2", "gemini-2.5-flash", 4000, 0).ok());
+  ASSERT_TRUE(db.Execute("INSERT INTO usage (session_id, model, prompt_tokens, completion_tokens, total_tokens, "
+                         "created_at) VALUES ('s2', 'gemini-2.5-flash', 7, 7, 14, '2020-01-01 12:00:00')")
+                  .ok());
+  ASSERT_TRUE(db.CloneSession("s1", "s3").ok());
+
+  // The rollup matches the raw ledger after inserts, leaving out the clone's copy.
+  const std::string kLedger =
+      "SELECT IFNULL(session_id, '') || '|' || IFNULL(model, '') || '|' || date(created_at) || '|' || COUNT(*) || "
+      "'|' || SUM(prompt_tokens) || '|' || SUM(completion_tokens) || '|' || SUM(total_tokens) || '|' || "
+      "SUM(IFNULL(cached_tokens, 0)) AS k FROM usage WHERE inherited_requests = 0 "
+      "GROUP BY session_id, model, date(created_at) ORDER BY 1";
+  const std::string kRollup =
+      "SELECT session_id || '|' || model || '|' || day || '|' || requests || '|' || prompt_tokens || '|' || "
+      "completion_tokens || '|' || total_tokens || '|' || cached_tokens AS k FROM usage_daily ORDER BY 1";
+  auto ledger = db.Query(kLedger);
+  auto rollup = db.Query(kRollup);
+  ASSERT_TRUE(ledger.ok() && rollup.ok());
+  EXPECT_EQ(*ledger, *rollup);
+
+  auto by_model = db.GetUsageByModel("s1");
+  ASSERT_TRUE(by_model.ok()) << by_model.status();
+  ASSERT_EQ(by_model->size(), 2);
+  EXPECT_EQ((*by_model)[0].model, "gemini-2.5-pro");
+  EXPECT_EQ((*by_model)[0].requests, 2);
+  EXPECT_EQ((*by_model)[0].prompt_tokens, 1500);
+  EXPECT_EQ((*by_model)[0].cached_tokens, 600);
+  EXPECT_EQ((*by_model)[0].total_tokens, 4000);
+  EXPECT_FALSE((*by_model)[0].cost.has_value());
+
+  // The longest matching pattern prices a model.
+  ASSERT_TRUE(db.SetModelPrice({"gemini-*", 1.0, 2.0}).ok());
+  ASSERT_TRUE(db.SetModelPrice({"gemini-2.5-pro*", 10.0, 20.0}).ok());
+  by_model = db.GetUsageByModel();
+  ASSERT_TRUE(by_model.ok()) << by_model.status();
+  ASSERT_EQ(by_model->size(), 3);
+  for (const auto& r : *by_model) {
+    if (r.model == "gemini-2.5-pro") {
+      ASSERT_TRUE(r.cost.has_value());
+      EXPECT_DOUBLE_EQ(*r.cost, (1500 * 10.0 + 2500 * 20.0) / 1e6);
+    } else if (r.model == "gemini-2.5-flash") {
+      ASSERT_TRUE(r.cost.has_value());
+      EXPECT_DOUBLE_EQ(*r.cost, (4007 * 1.0 + 7 * 2.0) / 1e6);
+    } else {
+      EXPECT_FALSE(r.cost.has_value()) << r.model;
+    }
+  }
+  auto prices = db.GetModelPrices();
+  ASSERT_TRUE(prices.ok());
+  EXPECT_EQ(prices->size(), 2);
+
+  // Only the recent row falls in the window.
+  auto daily = db.GetUsageByDay("s2", 7);
+  ASSERT_TRUE(daily.ok()) << daily.status();
+  ASSERT_EQ(daily->size(), 1);
+  EXPECT_EQ((*daily)[0].prompt_tokens, 4000);
+  EXPECT_FALSE((*daily)[0].day.empty());
+
+  // Deletes roll back out, removing emptied groups.
+  ASSERT_TRUE(db.DeleteSession("s1").ok());
+  ASSERT_TRUE(db.Execute("UPDATE usage SET prompt_tokens = 1, total_tokens = 8 WHERE created_at < '2021-01-01'").ok());
+  ledger = db.Query(kLedger);
+  rollup = db.Query(kRollup);
+  ASSERT_TRUE(ledger.ok() && rollup.ok());
+  EXPECT_EQ(*ledger, *rollup);
+  EXPECT_EQ(CountRows(db, "SELECT COUNT(*) AS n FROM usage_daily WHERE session_id = 's1'"), 0);
+}
+
+std::vector<std::string> UsageRows(const absl::StatusOr<std::vector<slop::Database::UsageRollup>>& rows) {
+  std::vector<std::string> out;
+  EXPECT_TRUE(rows.ok()) << rows.status();
+  if (rows.ok()) {
+    for (const auto& r : *rows) {
+      out.push_back(absl::StrCat(r.model, "|", r.day, "|", r.requests, "|", r.prompt_tokens, "|",
+                                 r.completion_tokens, "|", r.total_tokens, "|", r.cached_tokens));
+    }
+  }
+  return out;
+}
+
+TEST(DatabaseTest, ClonesDoNotCountInheritedUsageAgain) {
+  slop::Database db;
+  ASSERT_TRUE(db.Init(":memory:").ok());
+  ASSERT_TRUE(db.RecordUsage("s1", "gemini-2.5-pro", 1000, 2000, 600).ok());
+  ASSERT_TRUE(db.RecordUsage("s1", "gemini-2.5-pro", 500, 500).ok());
+  ASSERT_TRUE(db.RecordUsage("s1", "gpt-4o", 100, 100).ok());
+  auto by_model = UsageRows(db.GetUsageByModel(""));
+  auto daily = UsageRows(db.GetUsageByDay("", 7));
+  auto source = UsageRows(db.GetUsageByModel("s1"));
+
+  ASSERT_TRUE(db.CloneSession("s1", "s2").ok());
+  ASSERT_TRUE(db.CloneSession("s2", "s3").ok());
+  EXPECT_EQ(UsageRows(db.GetUsageByModel("")), by_model);
+  EXPECT_EQ(UsageRows(db.GetUsageByDay("", 7)), daily);
+  EXPECT_EQ(db.GetTotalUsage("")->total_tokens, 4200);
+
+  // Each clone reports the requests it inherited as its own, without a day.
+  EXPECT_EQ(UsageRows(db.GetUsageByModel("s2")), source);
+  EXPECT_EQ(UsageRows(db.GetUsageByModel("s3")), source);
+  EXPECT_EQ(db.GetTotalUsage("s3")->total_tokens, 4200);
+  EXPECT_TRUE(UsageRows(db.GetUsageByDay("s3", 7)).empty());
+
+  ASSERT_TRUE(db.RecordUsage("s3", "gpt-4o", 1, 1).ok());
+  auto clone = db.GetUsageByModel("s3");
+  ASSERT_TRUE(clone.ok()) << clone.status();
+  ASSERT_EQ(clone->size(), 2);
+  EXPECT_EQ((*clone)[1].model, "gpt-4o");
+  EXPECT_EQ((*clone)[1].requests, 2);
+  EXPECT_EQ(db.GetTotalUsage("")->total_tokens, 4202);
+
+  ASSERT_TRUE(db.DeleteSession("s2").ok());
+  ASSERT_TRUE(db.DeleteSession("s3").ok());
+  EXPECT_EQ(UsageRows(db.GetUsageByModel("")), by_model);
+}
+
+TEST(DatabaseTest, TuningAppliesToConnectionsAndMaintenanceFreesPages) {
+  std::string path = absl::StrCat(testing::TempDir(), "/tuning.db");
+  for (const char* suffix : {"", "-wal", "-shm"}) std::remove(absl::StrCat(path, suffix).c_str());
+  slop::Database::Tuning tuning;
+  tuning.mmap_bytes = 1 << 20;
+  tuning.cache_bytes = 8 << 20;
+  tuning.maintenance_interval = absl::ZeroDuration();
+  slop::Database db;
+  ASSERT_TRUE(db.Init(path, tuning).ok());
+  db.SetCompressionThreshold(1 << 30);
+  db.SetDedupThreshold(1 << 30);
+
+  auto pragma = [&](bool writer, const std::string& name) -> int64_t {
+    auto stmt = writer ? db.Prepare("PRAGMA " + name) : db.PrepareRead("PRAGMA " + name);
+    if (!stmt.ok() || !(*stmt)->Step().value_or(false)) return -1;
+    return (*stmt)->ColumnInt64(0);
+  };
+  for (bool writer : {true, false}) {
+    EXPECT_EQ(pragma(writer, "mmap_size"), 1 << 20) << writer;
+    EXPECT_EQ(pragma(writer, "cache_size"), -8192) << writer;
+    EXPECT_EQ(pragma(writer, "temp_store"), 2) << writer;  // MEMORY
+  }
+  EXPECT_EQ(pragma(true, "synchronous"), 1);  // NORMAL
+  EXPECT_EQ(pragma(true, "auto_vacuum"), 2);  // INCREMENTAL
+
+  for (int i = 0; i < 200; ++i) {
+    ASSERT_TRUE(db.AppendMessage("big", "tool", absl::StrCat(i, std::string(4000, 'a' + i % 26)), "", "completed",
+                                 absl::StrCat("g", i))
+                    .ok());
+  }
+  auto stats = db.GetStorageStats();
+  ASSERT_TRUE(stats.ok()) << stats.status();
+  EXPECT_EQ(stats->journal_mode, "wal");
+  EXPECT_GT(stats->db_file_bytes, 0);
+  EXPECT_GT(stats->wal_frames, 0);
+  EXPECT_LE(stats->wal_checkpointed_frames, stats->wal_frames);
+  EXPECT_GT(stats->cache_hits + stats->cache_misses, 0);
+  EXPECT_GE(stats->connections, 2);
+  EXPECT_GT(stats->page_count, 200);
+
+  ASSERT_TRUE(db.DeleteSession("big").ok());
+  stats = db.GetStorageStats();
+  ASSERT_TRUE(stats.ok());
+  int64_t freed = stats->freelist_pages;
+  EXPECT_GT(freed, 100);
+  ASSERT_TRUE(db.RunMaintenance().ok());
+  stats = db.GetStorageStats();
+  ASSERT_TRUE(stats.ok());
+  EXPECT_LT(stats->freelist_pages, freed);
+}
@@ -0,0 +1,228 @@
+#include <atomic>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "absl/strings/match.h"
+#include "absl/strings/str_cat.h"
+
+#include "core/database.h"
+#include "core/tool_dispatcher.h"
+#include "core/tool_executor.h"
+
+#include <gtest/gtest.h>
+#include <nlohmann/json.hpp>
+
+namespace slop {
+namespace {
+
+// Returns a path for a fresh file-backed database; WAL needs a real file.
+std::string FreshDbPath(const std::string& name) {
+  std::string path = absl::StrCat(testing::TempDir(), "/", name, ".db");
+  for (const char* suffix : {"", "-wal", "-shm"}) {
+    std::remove(absl::StrCat(path, suffix).c_str());
+  }
+  return path;
+}
+
+int64_t CountRows(Database& db, const std::string& sql) {
+  auto res = db.Query(sql);
+  EXPECT_TRUE(res.ok()) << res.status().message();
+  if (!res.ok()) return -1;
+  auto j = nlohmann::json::parse(*res);
+  return j[0]["n"].get<int64_t>();
+}
+
+TEST(DatabaseThreadSafetyTest, FileDatabaseUsesWalAndReadConnections) {
+  Database db;
+  ASSERT_TRUE(db.Init(FreshDbPath("wal_mode")).ok());
+
+  auto mode = db.Query("PRAGMA journal_mode;");
+  ASSERT_TRUE(mode.ok());
+  EXPECT_TRUE(absl::StrContains(*mode, "wal")) << *mode;
+
+  ASSERT_TRUE(db.AppendMessage("s1", "user", "hello").ok());
+  auto history = db.GetConversationHistory("s1");
+  ASSERT_TRUE(history.ok());
+  EXPECT_EQ(history->size(), 1u);
+  EXPECT_GE(db.GetReadConnectionCount(), 1u);
+}
+
+TEST(DatabaseThreadSafetyTest, InMemoryDatabaseReadsThroughWriter) {
+  Database db;
+  ASSERT_TRUE(db.Init(":memory:").ok());
+  ASSERT_TRUE(db.AppendMessage("s1", "user", "hello").ok());
+  auto history = db.GetConversationHistory("s1");
+  ASSERT_TRUE(history.ok());
+  EXPECT_EQ(history->size(), 1u);
+  EXPECT_EQ(db.GetReadConnectionCount(), 0u);
+}
+
+TEST(DatabaseThreadSafetyTest, ReadsObserveOpenTransaction) {
+  Database db;
+  ASSERT_TRUE(db.Init(FreshDbPath("open_transaction")).ok());
+
+  ASSERT_TRUE(db.Execute("BEGIN TRANSACTION;").ok());
+  ASSERT_TRUE(db.AppendMessage("s1", "user", "uncommitted").ok());
+  auto history = db.GetConversationHistory("s1");
+  ASSERT_TRUE(history.ok());
+  EXPECT_EQ(history->size(), 1u);
+  ASSERT_TRUE(db.Execute("ROLLBACK;").ok());
+
+  history = db.GetConversationHistory("s1");
+  ASSERT_TRUE(history.ok());
+  EXPECT_TRUE(history->empty());
+}
+
+TEST(DatabaseThreadSafetyTest, QueryRoutesWritesToWriter) {
+  Database db;
+  ASSERT_TRUE(db.Init(FreshDbPath("query_writes")).ok());
+
+  ASSERT_TRUE(db.Query("INSERT INTO llm_memos (content, semantic_tags) VALUES ('m', '[]')").ok());
+  ASSERT_TRUE(db.Query("CREATE TEMP TABLE scratch (x INTEGER)").ok());
+  ASSERT_TRUE(db.Query("INSERT INTO scratch VALUES (1)").ok());
+  EXPECT_EQ(CountRows(db, "SELECT COUNT(*) AS n FROM scratch"), 1);
+  EXPECT_EQ(CountRows(db, "SELECT COUNT(*) AS n FROM llm_memos"), 1);
+}
+
+// Mirrors the turn loop: the main thread appends messages while the dispatcher runs
+// database-backed tools in parallel and another thread keeps reading history, as the
+// UI does. Run under --config=tsan to check the connection handling for races.
+TEST(DatabaseThreadSafetyTest, ParallelToolCallsWithConcurrentHistoryReads) {
+  constexpr int kTurns = 20;
+  constexpr int kCallsPerTurn = 12;
+  const std::string session = "stress";
+
+  Database db;
+  ASSERT_TRUE(db.Init(FreshDbPath("stress")).ok());
+  auto executor_or = ToolExecutor::Create(&db);
+  ASSERT_TRUE(executor_or.ok());
+  auto& executor = *executor_or;
+
+  ToolDispatcher dispatcher(
+      [&](const std::string& name, const nlohmann::json& args, std::shared_ptr<CancellationRequest> cancellation) {
+        return executor->Execute(name, args, cancellation);
+      },
+      4);
+
+  std::atomic<bool> done{false};
+  std::atomic<int> reads{0};
+  std::atomic<int> read_errors{0};
+  std::thread reader([&] {
+    size_t last_size = 0;
+    while (!done.load()) {
+      auto history = db.GetConversationHistory(session);
+      if (!history.ok() || history->size() < last_size) {
+        read_errors++;
+        continue;
+      }
+      last_size = history->size();
+      if (!db.GetLastGroupId(session).ok() && last_size > 0) read_errors++;
+      reads++;
+    }
+  });
+
+  for (int turn = 0; turn < kTurns; ++turn) {
+    std::string group_id = absl::StrCat("g", turn);
+    ASSERT_TRUE(db.AppendMessage(session, "user", "go", "", "completed", group_id).ok());
+
+    std::vector<ToolDispatcher::Call> calls;
+    for (int i = 0; i < kCallsPerTurn; ++i) {
+      std::string id = absl::StrCat(turn, "_", i);
+      switch (i % 3) {
+        case 0:
+          calls.push_back({id, "save_memo", {{"content", absl::StrCat("memo ", id)}, {"tags", {"stress"}}}});
+          break;
+        case 1:
+          calls.push_back({id, "retrieve_memos", {{"tags", {"stress"}}}});
+          break;
+        default:
+          calls.push_back({id, "query_db", {{"sql", "SELECT COUNT(*) AS n FROM messages"}}});
+          break;
+      }
+    }
+    auto results = dispatcher.Dispatch(calls, nullptr);
+    ASSERT_EQ(results.size(), calls.size());
+    for (const auto& r : results) {
+      ASSERT_TRUE(r.output.ok()) << r.name << ": " << r.output.status().message();
+      ASSERT_TRUE(db.AppendMessage(session, "tool", *r.output, r.id, "completed", group_id).ok());
+    }
+  }
+
+  // Keep the reader running until it has overlapped with at least a few turns.
+  while (reads.load() < 10) std::this_thread::yield();
+  done = true;
+  reader.join();
+
+  EXPECT_EQ(read_errors.load(), 0);
+  EXPECT_EQ(CountRows(db, "SELECT COUNT(*) AS n FROM messages"), kTurns * (1 + kCallsPerTurn));
+  EXPECT_EQ(CountRows(db, "SELECT COUNT(*) AS n FROM llm_memos"), kTurns * kCallsPerTurn / 3);
+  for (const char* tool : {"save_memo", "retrieve_memos", "query_db"}) {
+    EXPECT_EQ(CountRows(db, absl::StrCat("SELECT call_count AS n FROM tools WHERE name = '", tool, "'")),
+              kTurns * kCallsPerTurn / 3)
+        << tool;
+  }
+  EXPECT_LE(db.GetReadConnectionCount(), Database::kMaxReadConnections);
+}
+
+// Tool call counts, skill activations and usage rows are queued by the dispatcher
+// threads and written behind; after a burst they must add up exactly, both when read
+// back and when the database is closed before the queue's next flush.
+TEST(DatabaseThreadSafetyTest, QueuedCountersAreExactAfterParallelToolCalls) {
+  constexpr int kCalls = 1000;
+  const std::vector<std::string> tools = {"retrieve_memos", "query_db", "describe_db"};
+  const std::string path = FreshDbPath("write_behind");
+
+  auto burst = [&](Database& db) {
+    auto executor_or = ToolExecutor::Create(&db);
+    ASSERT_TRUE(executor_or.ok());
+    auto& executor = *executor_or;
+    ToolDispatcher dispatcher(
+        [&](const std::string& name, const nlohmann::json& args, std::shared_ptr<CancellationRequest> cancellation) {
+          EXPECT_TRUE(db.RecordUsage("burst", "model", 10, 1).ok());
+          EXPECT_TRUE(db.IncrementSkillActivationCount("planner").ok());
+          return executor->Execute(name, args, cancellation);
+        },
+        16);
+    std::vector<ToolDispatcher::Call> calls;
+    for (int i = 0; i < kCalls; ++i) {
+      const std::string& tool = tools[i % tools.size()];
+      nlohmann::json args = nlohmann::json::object();
+      if (tool == "retrieve_memos") args = {{"tags", {"burst"}}};
+      if (tool == "query_db") args = {{"sql", "SELECT COUNT(*) AS n FROM usage"}};
+      calls.push_back({absl::StrCat("c", i), tool, args});
+    }
+    auto results = dispatcher.Dispatch(calls, nullptr);
+    ASSERT_EQ(results.size(), calls.size());
+    for (const auto& r : results) ASSERT_TRUE(r.output.ok()) << r.name << ": " << r.output.status().message();
+  };
+  auto expect_counts = [&](Database& db, int bursts) {
+    for (size_t t = 0; t < tools.size(); ++t) {
+      int64_t expected = bursts * ((kCalls - t + tools.size() - 1) / tools.size());
+      EXPECT_EQ(CountRows(db, absl::StrCat("SELECT call_count AS n FROM tools WHERE name = '", tools[t], "'")),
+                expected)
+          << tools[t];
+    }
+    EXPECT_EQ(CountRows(db, "SELECT activation_count AS n FROM skills WHERE name = 'planner'"), bursts * kCalls);
+    EXPECT_EQ(CountRows(db, "SELECT COUNT(*) AS n FROM usage WHERE session_id = 'burst'"), bursts * kCalls);
+    auto usage = db.GetTotalUsage("burst");
+    ASSERT_TRUE(usage.ok());
+    EXPECT_EQ(usage->total_tokens, bursts * kCalls * 11);
+  };
+
+  {
+    Database db;
+    ASSERT_TRUE(db.Init(path).ok());
+    burst(db);
+    expect_counts(db, 1);
+    // Closed right after the burst: destruction writes what is still queued.
+    burst(db);
+  }
+  Database db;
+  ASSERT_TRUE(db.Init(path).ok());
+  expect_counts(db, 2);
+}
+
+}  // namespace
+}  // namespace slop
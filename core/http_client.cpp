@@ -144,7 +144,9 @@ absl::StatusOr<std::string> HttpClient::ExecuteWithRetry(const std::string& url,
 
     curl_easy_setopt(curl.get(), CURLOPT_URL, url.c_str());
     if (method == "POST") {
-      curl_easy_setopt(curl.get(), CURLOPT_POSTFIELDS, body.c_str());
+      // Sent from `body` itself: curl neither copies it nor scans it for its length.
+      curl_easy_setopt(curl.get(), CURLOPT_POSTFIELDSIZE_LARGE, static_cast<curl_off_t>(body.size()));
+      curl_easy_setopt(curl.get(), CURLOPT_POSTFIELDS, body.data());
     } else {
       curl_easy_setopt(curl.get(), CURLOPT_HTTPGET, 1L);
     }
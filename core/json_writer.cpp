@@ -0,0 +1,236 @@
+#include "core/json_writer.h"
+
+#include <charconv>
+#include <cmath>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "absl/numeric/bits.h"
+#include "absl/strings/str_cat.h"
+
+namespace slop {
+
+namespace {
+
+constexpr char kReplacementCharacter[] = "\xEF\xBF\xBD";
+
+// Length of the valid UTF-8 sequence starting at `s[i]`, or 0 if it is invalid,
+// with `*bad` set to the length of the invalid prefix to replace (at least 1).
+size_t ValidSequenceLength(absl::string_view s, size_t i, size_t* bad) {
+  unsigned char lead = static_cast<unsigned char>(s[i]);
+  size_t length;
+  // Bounds of the second byte; later continuation bytes are 0x80-0xBF (Unicode 3.9, Table 3-7).
+  unsigned char low = 0x80, high = 0xBF;
+  if (lead >= 0xC2 && lead <= 0xDF) {
+    length = 2;
+  } else if (lead >= 0xE0 && lead <= 0xEF) {
+    length = 3;
+    if (lead == 0xE0) low = 0xA0;
+    if (lead == 0xED) high = 0x9F;
+  } else if (lead >= 0xF0 && lead <= 0xF4) {
+    length = 4;
+    if (lead == 0xF0) low = 0x90;
+    if (lead == 0xF4) high = 0x8F;
+  } else {
+    *bad = 1;
+    return 0;
+  }
+  for (size_t k = 1; k < length; ++k) {
+    if (i + k >= s.size()) {
+      *bad = k;
+      return 0;
+    }
+    unsigned char c = static_cast<unsigned char>(s[i + k]);
+    if (c < (k == 1 ? low : 0x80) || c > (k == 1 ? high : 0xBF)) {
+      // The byte that broke the sequence may start the next one.
+      *bad = k;
+      return 0;
+    }
+  }
+  return length;
+}
+
+// Whether `c` is copied as is without a closer look: printable ASCII other than '"' and '\\'.
+bool IsPlain(unsigned char c) { return c >= 0x20 && c < 0x80 && c != '"' && c != '\\'; }
+
+// Index of the first byte of `value` from `i` on that is not plain, or its size.
+// Text sent to models is mostly plain, so it is scanned 16 bytes at a time where
+// the target has vector instructions.
+size_t SkipPlain(absl::string_view value, size_t i) {
+  const char* data = value.data();
+  size_t size = value.size();
+#if defined(__SSE2__)
+  const __m128i space = _mm_set1_epi8(0x20);
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  for (; i + 16 <= size; i += 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+    // Signed: bytes from 0x80 up are negative, so below ' ' as well.
+    __m128i special = _mm_or_si128(_mm_cmplt_epi8(v, space),
+                                   _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)));
+    int mask = _mm_movemask_epi8(special);
+    if (mask != 0) return i + absl::countr_zero(static_cast<unsigned>(mask));
+  }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  const uint8x16_t space = vdupq_n_u8(0x20);
+  const uint8x16_t high = vdupq_n_u8(0x80);
+  const uint8x16_t quote = vdupq_n_u8('"');
+  const uint8x16_t backslash = vdupq_n_u8('\\');
+  for (; i + 16 <= size; i += 16) {
+    uint8x16_t v = vld1q_u8(reinterpret_cast<const uint8_t*>(data + i));
+    uint8x16_t special = vorrq_u8(vorrq_u8(vcltq_u8(v, space), vcgeq_u8(v, high)),
+                                  vorrq_u8(vceqq_u8(v, quote), vceqq_u8(v, backslash)));
+    if (vmaxvq_u8(special) != 0) break;  // Found below.
+  }
+#endif
+  while (i < size && IsPlain(static_cast<unsigned char>(data[i]))) ++i;
+  return i;
+}
+
+}  // namespace
+
+void AppendJsonString(std::string* out, absl::string_view value) {
+  out->push_back('"');
+  AppendEscapedJson(out, value);
+  out->push_back('"');
+}
+
+void AppendEscapedJson(std::string* out, absl::string_view value) {
+  static constexpr char kHex[] = "0123456789abcdef";
+  size_t run = 0;  // Start of the bytes not yet copied.
+  size_t i = 0;
+  while (i < value.size()) {
+    i = SkipPlain(value, i);
+    if (i == value.size()) break;
+    unsigned char c = static_cast<unsigned char>(value[i]);
+    if (c >= 0x80) {
+      size_t bad = 0;
+      size_t length = ValidSequenceLength(value, i, &bad);
+      if (length > 0) {
+        i += length;
+        continue;
+      }
+      out->append(value.data() + run, i - run);
+      out->append(kReplacementCharacter);
+      i += bad;
+      run = i;
+      continue;
+    }
+    out->append(value.data() + run, i - run);
+    switch (c) {
+      case '"':
+        out->append("\\\"");
+        break;
+      case '\\':
+        out->append("\\\\");
+        break;
+      case '\b':
+        out->append("\\b");
+        break;
+      case '\f':
+        out->append("\\f");
+        break;
+      case '\n':
+        out->append("\\n");
+        break;
+      case '\r':
+        out->append("\\r");
+        break;
+      case '\t':
+        out->append("\\t");
+        break;
+      default: {
+        char escape[] = {'\\', 'u', '0', '0', kHex[c >> 4], kHex[c & 0xF]};
+        out->append(escape, sizeof(escape));
+      }
+    }
+    ++i;
+    run = i;
+  }
+  out->append(value.data() + run, value.size() - run);
+}
+
+void JsonWriter::BeforeValue() {
+  if (after_key_) {
+    after_key_ = false;
+    return;
+  }
+  if (has_elements_.empty()) return;
+  if (has_elements_.back()) out_->push_back(',');
+  has_elements_.back() = true;
+}
+
+void JsonWriter::BeginObject() {
+  BeforeValue();
+  out_->push_back('{');
+  has_elements_.push_back(false);
+}
+
+void JsonWriter::EndObject() {
+  out_->push_back('}');
+  has_elements_.pop_back();
+}
+
+void JsonWriter::BeginArray() {
+  BeforeValue();
+  out_->push_back('[');
+  has_elements_.push_back(false);
+}
+
+void JsonWriter::EndArray() {
+  out_->push_back(']');
+  has_elements_.pop_back();
+}
+
+void JsonWriter::Key(absl::string_view key) {
+  BeforeValue();
+  AppendJsonString(out_, key);
+  out_->push_back(':');
+  after_key_ = true;
+}
+
+void JsonWriter::String(absl::string_view value) {
+  BeforeValue();
+  AppendJsonString(out_, value);
+}
+
+void JsonWriter::Int(int64_t value) {
+  BeforeValue();
+  absl::StrAppend(out_, value);
+}
+
+void JsonWriter::Double(double value) {
+  BeforeValue();
+  if (!std::isfinite(value)) {
+    out_->append("null");
+    return;
+  }
+  // Shortest text that reads back as the same double; like nlohmann::json, a
+  // whole number keeps a ".0" so that it reads back as a float.
+  char buffer[32];
+  auto result = std::to_chars(buffer, buffer + sizeof(buffer), value);
+  absl::string_view text(buffer, result.ptr - buffer);
+  out_->append(text.data(), text.size());
+  if (text.find_first_of(".e") == absl::string_view::npos) out_->append(".0");
+}
+
+void JsonWriter::Bool(bool value) {
+  BeforeValue();
+  out_->append(value ? "true" : "false");
+}
+
+void JsonWriter::Null() {
+  BeforeValue();
+  out_->append("null");
+}
+
+void JsonWriter::Raw(absl::string_view json) {
+  BeforeValue();
+  out_->append(json.data(), json.size());
+}
+
+}  // namespace slop
@@ -0,0 +1,57 @@
+#ifndef SLOP_CORE_JSON_WRITER_H_
+#define SLOP_CORE_JSON_WRITER_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "absl/strings/string_view.h"
+
+namespace slop {
+
+// Appends `value` to `out` as a quoted JSON string, escaped the way
+// nlohmann::json::dump() escapes it with error_handler_t::replace: '"', '\\' and
+// control characters are escaped, other UTF-8 is copied as is, and each invalid
+// UTF-8 sequence becomes U+FFFD.
+void AppendJsonString(std::string* out, absl::string_view value);
+// The same without the quotes, for a string written in pieces.
+void AppendEscapedJson(std::string* out, absl::string_view value);
+
+// Writes compact JSON straight into a string, without building a document first.
+// Separators are inserted as values are added; callers keep Begin/End calls
+// balanced and precede every value in an object with Key().
+class JsonWriter {
+ public:
+  explicit JsonWriter(std::string* out) : out_(out) {}
+
+  void BeginObject();
+  void EndObject();
+  void BeginArray();
+  void EndArray();
+  void Key(absl::string_view key);
+
+  void String(absl::string_view value);
+  void Int(int64_t value);
+  // Non-finite values are written as null, as nlohmann::json does.
+  void Double(double value);
+  void Bool(bool value);
+  void Null();
+  // A value already serialized as compact JSON, copied as is.
+  void Raw(absl::string_view json);
+
+  // Number of containers begun and not yet ended.
+  size_t depth() const { return has_elements_.size(); }
+
+ private:
+  // Writes the separator the next value needs.
+  void BeforeValue();
+
+  std::string* out_;
+  // Per open container, whether it already holds an element.
+  std::vector<bool> has_elements_;
+  bool after_key_ = false;
+};
+
+}  // namespace slop
+
+#endif  // SLOP_CORE_JSON_WRITER_H_
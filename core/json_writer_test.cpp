@@ -0,0 +1,99 @@
+#include "core/json_writer.h"
+
+#include <random>
+#include <string>
+
+#include <gtest/gtest.h>
+#include <nlohmann/json.hpp>
+
+namespace slop {
+namespace {
+
+std::string Dump(const nlohmann::json& j) { return j.dump(-1, ' ', false, nlohmann::json::error_handler_t::replace); }
+
+std::string Escaped(const std::string& s) {
+  std::string out;
+  AppendJsonString(&out, s);
+  return out;
+}
+
+TEST(JsonWriterTest, EscapesLikeNlohmann) {
+  for (std::string s : {std::string(""), std::string("plain"), std::string("quote \" and \\ backslash"),
+                        std::string("\b\f\n\r\t"), std::string("\x01\x1f\x7f", 3), std::string("nul\0byte", 8),
+                        std::string("caf\xC3\xA9 \xE2\x82\xAC \xF0\x9F\x98\x80"), std::string("bad \xFF lead"),
+                        std::string("overlong \xC0\xAF"), std::string("surrogate \xED\xA0\x80"),
+                        std::string("cut \xE2\x82"), std::string("cut at end \xF0\x9F\x98"),
+                        std::string("broken \xE2(\xA1 sequence"), std::string("too high \xF4\x90\x80\x80")}) {
+    EXPECT_EQ(Escaped(s), Dump(s)) << s;
+  }
+}
+
+TEST(JsonWriterTest, EscapesRandomBytesLikeNlohmann) {
+  std::mt19937 rng(42);
+  // Biased towards the bytes that take the slow paths.
+  const std::string alphabet = std::string("ab\"\\\n\x01\x7f\x80\xBF\xC2\xC3\xE0\xE2\xED\xF0\xF4\xF5\xFF", 19);
+  for (int i = 0; i < 20000; ++i) {
+    std::string s(rng() % 12, ' ');
+    for (char& c : s) c = alphabet[rng() % alphabet.size()];
+    ASSERT_EQ(Escaped(s), Dump(s)) << nlohmann::json(std::vector<uint8_t>(s.begin(), s.end())).dump();
+  }
+}
+
+TEST(JsonWriterTest, EscapesLongStringsLikeNlohmann) {
+  // Each special byte at every offset of a few 16-byte blocks, and runs of them.
+  for (std::string special : {std::string("\""), std::string("\\"), std::string("\n"), std::string("\x1f"),
+                              std::string("\x7f"), std::string("\xC3\xA9"), std::string("\xE2\x82\xAC"),
+                              std::string("\xFF"), std::string("\xF0\x9F\x98")}) {
+    for (size_t at = 0; at < 50; ++at) {
+      std::string s(50, 'x');
+      s.insert(at, special);
+      ASSERT_EQ(Escaped(s), Dump(s)) << at;
+      s.insert(at, special);
+      ASSERT_EQ(Escaped(s), Dump(s)) << at;
+    }
+  }
+  std::string plain(100000, 'p');
+  EXPECT_EQ(Escaped(plain), Dump(plain));
+
+  std::string pieces;
+  AppendEscapedJson(&pieces, "line \"one\"");
+  AppendEscapedJson(&pieces, "\n");
+  AppendEscapedJson(&pieces, "line two");
+  EXPECT_EQ("\"" + pieces + "\"", Dump("line \"one\"\nline two"));
+}
+
+TEST(JsonWriterTest, WritesNestedValues) {
+  std::string out;
+  JsonWriter w(&out);
+  w.BeginArray();
+  w.BeginObject();
+  w.Key("id");
+  w.Int(-7);
+  w.Key("ratio");
+  w.Double(0.25);
+  w.Key("whole");
+  w.Double(3);
+  w.Key("nan");
+  w.Double(std::nan(""));
+  w.Key("tags");
+  w.BeginArray();
+  w.String("a");
+  w.Bool(true);
+  w.Null();
+  w.EndArray();
+  w.Key("empty");
+  w.BeginObject();
+  w.EndObject();
+  w.Key("raw");
+  w.Raw(R"({"k":[1]})");
+  w.EndObject();
+  w.Int(2);
+  w.EndArray();
+  EXPECT_EQ(w.depth(), 0);
+  EXPECT_EQ(out,
+            R"([{"id":-7,"ratio":0.25,"whole":3.0,"nan":null,"tags":["a",true,null],"empty":{},"raw":{"k":[1]}},2])");
+  EXPECT_EQ(nlohmann::json::parse(out)[0]["whole"].get<double>(), 3.0);
+}
+
+}  // namespace
+}  // namespace slop
@@ -0,0 +1,113 @@
+#include "core/ledger_generator.h"
+
+#include <algorithm>
+#include <iterator>
+#include <memory>
+#include <random>
+
+#include "absl/strings/str_cat.h"
+
+#include "core/status_macros.h"
+
+namespace slop {
+
+namespace {
+
+constexpr const char* kWords[] = {
+    "the",     "session", "context",  "prompt",   "history", "tool",   "result", "message", "group",  "cache",
+    "query",   "index",   "schema",   "database", "build",   "test",   "file",   "line",    "value",  "status",
+    "error",   "return",  "string",   "vector",   "memo",    "skill",  "model",  "token",   "window", "summary",
+    "request", "append",  "rollback", "commit",   "search",  "update", "create", "delete",  "read",   "write"};
+constexpr const char* kTags[] = {"database", "cache", "build", "test", "ui", "http", "prompt", "schema"};
+constexpr int kMessagesPerBatch = 4096;
+
+const char* Word(std::mt19937& rng) { return kWords[rng() % std::size(kWords)]; }
+
+// Prose of about `bytes` bytes.
+std::string Prose(std::mt19937& rng, size_t bytes) {
+  std::string text;
+  text.reserve(bytes + 16);
+  while (text.size() < bytes) absl::StrAppend(&text, Word(rng), " ");
+  return text;
+}
+
+// Source-like text of about `bytes` bytes, as read_file or grep would return.
+std::string SourceText(std::mt19937& rng, size_t bytes) {
+  std::string text;
+  text.reserve(bytes + 64);
+  for (int line = 1; text.size() < bytes; ++line) {
+    absl::StrAppend(&text, line, ":  auto ", Word(rng), "_", rng() % 100, " = ", Word(rng), "(", Word(rng), ", ",
+                    rng() % 1000, ");\n");
+  }
+  return text;
+}
+
+}  // namespace
+
+LedgerSpec LedgerSpec::WithMessages(int64_t messages) {
+  LedgerSpec spec;
+  int64_t per_session = static_cast<int64_t>(spec.sessions) * spec.messages_per_group;
+  spec.groups_per_session = static_cast<int>(std::max<int64_t>(1, messages / per_session));
+  return spec;
+}
+
+std::string LedgerSessionId(int session) { return absl::StrCat("session_", session); }
+
+std::string LedgerGroupId(int group) { return absl::StrCat("g", group); }
+
+absl::Status GenerateLedger(Database* db, const LedgerSpec& spec) {
+  if (spec.tool_result_ratio < 0 || spec.tool_result_ratio > 1) {
+    return absl::InvalidArgumentError("tool_result_ratio must be between 0 and 1");
+  }
+  if (spec.messages_per_group < 1) return absl::InvalidArgumentError("messages_per_group must be at least 1");
+  std::mt19937 rng(spec.seed);
+  std::bernoulli_distribution is_tool_result(spec.tool_result_ratio);
+
+  std::unique_ptr<Database::WriteBatch> batch;
+  int in_batch = 0;
+  int call = 0;
+  // Groups are interleaved across sessions, as concurrent sessions would write them.
+  for (int g = 0; g < spec.groups_per_session; ++g) {
+    for (int s = 0; s < spec.sessions; ++s) {
+      if (!batch) {
+        ASSIGN_OR_RETURN(batch, db->BeginWriteBatch());
+      }
+      std::string session_id = LedgerSessionId(s);
+      std::string group_id = LedgerGroupId(g);
+      RETURN_IF_ERROR(db->AppendMessage(session_id, "user", Prose(rng, spec.message_bytes), "", "completed",
+                                        group_id, "", static_cast<int>(spec.message_bytes / 4)));
+      for (int m = 1; m < spec.messages_per_group; ++m) {
+        if (is_tool_result(rng)) {
+          RETURN_IF_ERROR(db->AppendMessage(session_id, "tool", SourceText(rng, spec.tool_result_bytes),
+                                            absl::StrCat("call_", call++, "|read_file"), "completed", group_id,
+                                            "gemini", static_cast<int>(spec.tool_result_bytes / 4)));
+        } else {
+          RETURN_IF_ERROR(db->AppendMessage(session_id, "assistant", Prose(rng, spec.message_bytes), "",
+                                            "completed", group_id, "gemini",
+                                            static_cast<int>(spec.message_bytes / 4)));
+        }
+      }
+      RETURN_IF_ERROR(db->RecordUsage(session_id, "bench-model", 1000 + static_cast<int>(rng() % 1000),
+                                      200 + static_cast<int>(rng() % 200)));
+      in_batch += spec.messages_per_group;
+      if (in_batch >= kMessagesPerBatch) {
+        RETURN_IF_ERROR(batch->Commit());
+        batch.reset();
+        in_batch = 0;
+      }
+    }
+  }
+  for (int i = 0; i < spec.memos; ++i) {
+    if (!batch) {
+      ASSIGN_OR_RETURN(batch, db->BeginWriteBatch());
+    }
+    const char* first = kTags[i % std::size(kTags)];
+    const char* second = kTags[(i / std::size(kTags) + i + 1) % std::size(kTags)];
+    RETURN_IF_ERROR(
+        db->AddMemo(Prose(rng, spec.message_bytes), absl::StrCat(R"([")", first, R"(",")", second, R"("])")));
+  }
+  if (batch) RETURN_IF_ERROR(batch->Commit());
+  return db->FlushPendingWrites();
+}
+
+}  // namespace slop
@@ -0,0 +1,48 @@
+#ifndef SLOP_CORE_LEDGER_GENERATOR_H_
+#define SLOP_CORE_LEDGER_GENERATOR_H_
+
+#include <cstdint>
+#include <string>
+
+#include "absl/status/status.h"
+
+#include "core/database.h"
+
+namespace slop {
+
+// Shape of a synthetic ledger for benchmarks. Sessions are named "session_<i>" and
+// groups "g<j>"; every group starts with a user prompt and is followed by assistant
+// replies and tool results, one usage row per group.
+struct LedgerSpec {
+  int sessions = 10;
+  int groups_per_session = 25;
+  int messages_per_group = 4;
+  // Approximate size of user and assistant messages.
+  size_t message_bytes = 200;
+  // Approximate size of tool results, which are source-like text.
+  size_t tool_result_bytes = 1024;
+  // Fraction of the non-user messages in a group that are tool results.
+  double tool_result_ratio = 0.5;
+  int memos = 100;
+  // Seeds the text generator; the same spec always yields the same ledger.
+  uint32_t seed = 1;
+
+  int64_t messages() const {
+    return static_cast<int64_t>(sessions) * groups_per_session * messages_per_group;
+  }
+
+  // The default shape scaled to about `messages` messages.
+  static LedgerSpec WithMessages(int64_t messages);
+};
+
+// Appends the ledger described by `spec` to `db`, in write batches of a few thousand
+// messages, and flushes the queued usage rows.
+absl::Status GenerateLedger(Database* db, const LedgerSpec& spec);
+
+// Session and group names used by GenerateLedger.
+std::string LedgerSessionId(int session);
+std::string LedgerGroupId(int group);
+
+}  // namespace slop
+
+#endif  // SLOP_CORE_LEDGER_GENERATOR_H_
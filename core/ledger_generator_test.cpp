@@ -0,0 +1,76 @@
+#include "core/ledger_generator.h"
+
+#include <string>
+
+#include "core/database.h"
+
+#include <gtest/gtest.h>
+#include <nlohmann/json.hpp>
+
+namespace slop {
+namespace {
+
+int64_t QueryCount(Database& db, const std::string& sql) {
+  auto result = db.Query(sql);
+  if (!result.ok()) return -1;
+  auto j = nlohmann::json::parse(*result, nullptr, false);
+  if (j.is_discarded() || !j.is_array() || j.empty()) return -1;
+  return j[0].value("n", int64_t{-1});
+}
+
+TEST(LedgerGeneratorTest, GeneratesTheSpecifiedShape) {
+  Database db;
+  ASSERT_TRUE(db.Init(":memory:").ok());
+  LedgerSpec spec;
+  spec.sessions = 3;
+  spec.groups_per_session = 20;
+  spec.messages_per_group = 5;
+  spec.tool_result_ratio = 0.25;
+  spec.memos = 7;
+  ASSERT_TRUE(GenerateLedger(&db, spec).ok());
+
+  EXPECT_EQ(QueryCount(db, "SELECT COUNT(*) AS n FROM messages"), spec.messages());
+  EXPECT_EQ(QueryCount(db, "SELECT COUNT(DISTINCT session_id) AS n FROM messages"), 3);
+  EXPECT_EQ(QueryCount(db, "SELECT COUNT(DISTINCT group_id) AS n FROM messages"), 20);
+  EXPECT_EQ(QueryCount(db, "SELECT COUNT(*) AS n FROM messages WHERE role = 'user'"), 60);
+  int64_t tool_results = QueryCount(db, "SELECT COUNT(*) AS n FROM messages WHERE role = 'tool'");
+  EXPECT_GT(tool_results, 240 * 0.15);
+  EXPECT_LT(tool_results, 240 * 0.35);
+  EXPECT_EQ(QueryCount(db, "SELECT COUNT(*) AS n FROM usage"), 60);
+  EXPECT_EQ(QueryCount(db, "SELECT COUNT(*) AS n FROM llm_memos"), 7);
+
+  auto history = db.GetConversationHistory(LedgerSessionId(0));
+  ASSERT_TRUE(history.ok());
+  ASSERT_EQ(history->size(), 100);
+  EXPECT_EQ((*history)[0].role, "user");
+  EXPECT_EQ((*history)[0].group_id, LedgerGroupId(0));
+}
+
+TEST(LedgerGeneratorTest, IsDeterministic) {
+  LedgerSpec spec;
+  spec.sessions = 2;
+  spec.groups_per_session = 5;
+  std::string contents[2];
+  for (std::string& content : contents) {
+    Database db;
+    ASSERT_TRUE(db.Init(":memory:").ok());
+    ASSERT_TRUE(GenerateLedger(&db, spec).ok());
+    auto result = db.Query("SELECT role, content, tool_call_id FROM messages_resolved ORDER BY id");
+    ASSERT_TRUE(result.ok());
+    content = *result;
+  }
+  EXPECT_EQ(contents[0], contents[1]);
+}
+
+TEST(LedgerGeneratorTest, ScalesToTheRequestedSize) {
+  EXPECT_EQ(LedgerSpec::WithMessages(1000).messages(), 1000);
+  EXPECT_EQ(LedgerSpec::WithMessages(1000000).messages(), 1000000);
+  LedgerSpec spec;
+  spec.tool_result_ratio = 1.5;
+  Database db;
+  ASSERT_TRUE(db.Init(":memory:").ok());
+  EXPECT_EQ(GenerateLedger(&db, spec).code(), absl::StatusCode::kInvalidArgument);
+}
+
+}  // namespace
+}  // namespace slop
@@ -3,6 +3,7 @@
 #include <algorithm>
 #include <fstream>
 #include <iostream>
+#include <limits>
 #include <map>
 #include <set>
 #include <sstream>
@@ -19,12 +20,23 @@
 #include "core/constants.h"
 #include "core/orchestrator_gemini.h"
 #include "core/orchestrator_openai.h"
+#include "core/status_macros.h"
 #include "core/system_prompt_data.h"
+#include "core/token_counter.h"
 #ifdef HAVE_SYSTEM_PROMPT_H
 #endif
 
 namespace slop {
 
+namespace {
+
+// A window of -1 groups without a token budget leaves the context out entirely.
+bool IsContextDisabled(const Database::ContextSettings& settings) {
+  return settings.budget <= 0 && settings.size == -1;
+}
+
+}  // namespace
+
 Orchestrator::Builder::Builder(Database* db, HttpClient* http_client) : db_(db), http_client_(http_client) {}
 
 Orchestrator::Builder::Builder(const Orchestrator& orchestrator)
@@ -65,6 +77,11 @@ Orchestrator::Builder& Orchestrator::Builder::WithStripReasoning(bool enabled) {
   return *this;
 }
 
+Orchestrator::Builder& Orchestrator::Builder::WithContextCacheTtl(absl::Duration ttl) {
+  config_.context_cache_ttl = ttl;
+  return *this;
+}
+
 absl::StatusOr<std::unique_ptr<Orchestrator>> Orchestrator::Builder::Build() {
   if (db_ == nullptr) {
     return absl::InvalidArgumentError("Database cannot be null");
@@ -90,7 +107,9 @@ void Orchestrator::UpdateStrategy() {
       strategy_ = std::make_unique<GeminiGcaOrchestrator>(db_, http_client_, config_.model, config_.base_url,
                                                           config_.project_id);
     } else {
-      strategy_ = std::make_unique<GeminiOrchestrator>(db_, http_client_, config_.model, config_.base_url);
+      auto gemini = std::make_unique<GeminiOrchestrator>(db_, http_client_, config_.model, config_.base_url);
+      gemini->SetContextCacheTtl(config_.context_cache_ttl);
+      strategy_ = std::move(gemini);
     }
   } else {
     auto openai = std::make_unique<OpenAiOrchestrator>(db_, http_client_, config_.model, config_.base_url);
@@ -106,71 +125,181 @@ void Orchestrator::UpdateStrategy() {
  * 1. Fetching session context settings (e.g., window size).
  * 2. Retrieving relevant conversation history from the database.
  * 3. Building system instructions including skills and history guidelines.
- * 4. Injecting relevant memos based on history context.
- * 5. delegating the final payload formatting to the strategy (Gemini/OpenAI).
+ * 4. Building the session context: state, scratchpad and the memos relevant to
+ *    the last user message.
+ * 5. delegating the final payload formatting to the strategy (Gemini/OpenAI),
+ *    which puts the session context with the current request.
  *
  * @param session_id The active session ID.
  * @param active_skills List of skills currently active for the turn.
+ * @param breakdown If not null, receives the tokens of each section.
  * @return absl::StatusOr<nlohmann::json> The prepared JSON payload for the LLM API.
  */
 absl::StatusOr<nlohmann::json> Orchestrator::AssemblePrompt(const std::string& session_id,
-                                                            const std::vector<std::string>& active_skills) {
-  auto settings_or = db_->GetContextSettings(session_id);
-  if (!settings_or.ok()) return settings_or.status();
-  if (settings_or->size == -1) {
+                                                            const std::vector<std::string>& active_skills,
+                                                            PromptBreakdown* breakdown) {
+  if (breakdown != nullptr) *breakdown = {};
+  ASSIGN_OR_RETURN(std::optional<PromptParts> parts, BuildPromptParts(session_id, active_skills, breakdown));
+  if (!parts) return nlohmann::json({{"contents", nlohmann::json::array()}});
+  auto payload_or =
+      strategy_->AssemblePayload(session_id, parts->system_instruction, parts->history, parts->session_context);
+  if (payload_or.ok() && std::getenv("SLOP_TOOL_DEBUG")) {
+    LOG(INFO) << "--- ASSEMBLED PROMPT ---\n" << payload_or->dump(2) << "\n--- END PROMPT ---";
+  }
+  return payload_or;
+}
+
+/**
+ * @brief Constructs the request body for the LLM, serialized.
+ *
+ * The prompt of AssemblePrompt(), serialized by the strategy, which reuses what
+ * it serialized for the previous call: through a tool loop, only the messages
+ * the last iteration appended are serialized again. Providers that keep a cache
+ * of the stable prefix get `api_key` to create it.
+ *
+ * @param session_id The active session ID.
+ * @param active_skills List of skills currently active for the turn.
+ * @param api_key The provider's API key, or empty with OAuth.
+ * @return absl::StatusOr<std::string> The body to post to the LLM API.
+ */
+absl::StatusOr<std::string> Orchestrator::AssembleRequestBody(const std::string& session_id,
+                                                              const std::vector<std::string>& active_skills,
+                                                              const std::string& api_key) {
+  ASSIGN_OR_RETURN(std::optional<PromptParts> parts, BuildPromptParts(session_id, active_skills, nullptr));
+  if (!parts) return std::string(R"({"contents":[]})");
+  auto body_or = strategy_->SerializePayload(session_id, parts->system_instruction, parts->history,
+                                             parts->session_context, api_key);
+  if (body_or.ok() && std::getenv("SLOP_TOOL_DEBUG")) {
+    LOG(INFO) << "--- ASSEMBLED PROMPT ---\n" << *body_or << "\n--- END PROMPT ---";
+  }
+  return body_or;
+}
+
+absl::StatusOr<std::optional<Orchestrator::PromptParts>> Orchestrator::BuildPromptParts(
+    const std::string& session_id, const std::vector<std::string>& active_skills, PromptBreakdown* breakdown) {
+  ASSIGN_OR_RETURN(PromptContext context, LoadPromptContext(session_id));
+  if (IsContextDisabled(context.settings)) {
     last_selected_groups_.clear();
-    return nlohmann::json({{"contents", nlohmann::json::array()}});
+    return std::nullopt;
   }
 
-  auto history_or = GetRelevantHistory(session_id, settings_or->size);
-  if (!history_or.ok()) return history_or.status();
+  PromptParts parts;
+  parts.history = std::move(context.history);
+  const auto& history = parts.history;
+  parts.system_instruction = BuildSystemInstructions(active_skills, *context.manifest, breakdown);
+  parts.session_context = BuildSessionContext(context, breakdown);
+  // The session context changes from turn to turn, so it goes last, with the
+  // current request: the system instruction, the tools and the history before it
+  // then stay a prefix that providers can cache. Without a user message to carry
+  // it, it ends the system instruction.
+  if (std::none_of(history.begin(), history.end(), [](const Database::Message& m) { return m.role == "user"; })) {
+    absl::StrAppend(&parts.system_instruction, parts.session_context);
+    parts.session_context.clear();
+  }
+  if (breakdown != nullptr) {
+    const TokenCounter& counter = TokenCounter::Default();
+    for (const auto& m : history) breakdown->history += counter.Count(m.content);
+    const nlohmann::json& declarations = strategy_->ToolDeclarations(context.manifest);
+    if (!declarations.is_null()) breakdown->tools += counter.Count(declarations.dump());
+  }
+  return parts;
+}
+
+/**
+ * @brief Reads what the session's next prompt is assembled from.
+ *
+ * Settings, state and scratchpad come from one query; then, when the context is
+ * enabled, the history window (tool results truncated while still in the
+ * transaction, since truncation may read compression dictionaries), the tool
+ * manifest and the memos relevant to the last user message. Everything is read
+ * from one snapshot of the database, and the time spent on each section is
+ * recorded in the result and kept for GetLastPromptLoadTimings().
+ *
+ * @param session_id The active session ID.
+ * @return absl::StatusOr<PromptContext> The prompt context.
+ */
+absl::StatusOr<Orchestrator::PromptContext> Orchestrator::LoadPromptContext(const std::string& session_id) {
+  PromptContext context;
+  absl::Time start = absl::Now();
+  absl::Time section_start = start;
+  auto end_section = [&](absl::Duration* field) {
+    absl::Time now = absl::Now();
+    *field += now - section_start;
+    section_start = now;
+  };
+
+  ASSIGN_OR_RETURN(std::unique_ptr<Database::ReadSnapshot> snapshot, db_->BeginReadSnapshot());
+  ASSIGN_OR_RETURN(Database::SessionPromptState session, db_->GetSessionPromptState(session_id));
+  context.settings = session.settings;
+  context.state = std::move(session.state);
+  context.scratchpad = std::move(session.scratchpad);
+  end_section(&context.timings.session);
+
+  if (!IsContextDisabled(context.settings)) {
+    ASSIGN_OR_RETURN(int window_size, ResolveWindowSize(session_id, context.settings));
+    // Tool results stay compressed until truncation reads the part that is kept.
+    ASSIGN_OR_RETURN(context.history, LoadHistory(session_id, window_size, /*inflate_tool_results=*/false));
+    RETURN_IF_ERROR(TruncateToolResults(&context.history));
+    end_section(&context.timings.history);
+
+    ASSIGN_OR_RETURN(context.manifest, db_->GetToolManifest());
+    end_section(&context.timings.tools);
+
+    context.memos = FindRelevantMemos(context.history);
+    end_section(&context.timings.memos);
+  }
 
-  auto history = std::move(*history_or);
+  snapshot.reset();
+  context.timings.total = absl::Now() - start;
+  last_prompt_load_timings_ = context.timings;
+  return context;
+}
 
+absl::Status Orchestrator::TruncateToolResults(std::vector<Database::Message>* history) {
   // Identify the active group_id (the most recent one)
   std::string active_group_id;
-  if (!history.empty()) {
-    active_group_id = history.back().group_id;
+  if (!history->empty()) {
+    active_group_id = history->back().group_id;
   }
 
   // Pre-truncate tool results based on group activity and recency.
   size_t total_active_tools = 0;
-  for (const auto& m : history) {
+  for (const auto& m : *history) {
     if (m.role == "tool" && !active_group_id.empty() && m.group_id == active_group_id) {
       total_active_tools++;
     }
   }
 
   size_t active_tool_idx = 0;
-  for (auto& m : history) {
+  for (auto& m : *history) {
     if (m.role == "tool") {
       bool is_active_group = (!active_group_id.empty() && m.group_id == active_group_id);
       if (!is_active_group) {
-        m.content = SmarterTruncate(m.content, config_.truncation.inactive_limit, m.id);
+        ASSIGN_OR_RETURN(m.content, TruncateStoredContent(m.content, config_.truncation.inactive_limit, m.id));
       } else {
         bool is_recent = (active_tool_idx >= (total_active_tools > config_.truncation.full_fidelity_count
                                                   ? total_active_tools - config_.truncation.full_fidelity_count
                                                   : 0));
         size_t limit =
             is_recent ? config_.truncation.active_full_fidelity_limit : config_.truncation.active_degraded_limit;
-        m.content = SmarterTruncate(m.content, limit, m.id);
+        ASSIGN_OR_RETURN(m.content, TruncateStoredContent(m.content, limit, m.id));
         active_tool_idx++;
       }
     }
   }
-
-  std::string system_instruction = BuildSystemInstructions(session_id, active_skills);
-  InjectRelevantMemos(history, &system_instruction);
-  auto payload_or = strategy_->AssemblePayload(session_id, system_instruction, history);
-  if (payload_or.ok() && std::getenv("SLOP_TOOL_DEBUG")) {
-    LOG(INFO) << "--- ASSEMBLED PROMPT ---\n" << payload_or->dump(2) << "\n--- END PROMPT ---";
-  }
-  return payload_or;
+  return absl::OkStatus();
 }
 
 absl::StatusOr<int> Orchestrator::ProcessResponse(const std::string& session_id, const std::string& response_json,
                                                   const std::string& group_id) {
-  return strategy_->ProcessResponse(session_id, response_json, group_id);
+  // Every response part and the session state are committed together; a response
+  // that fails to process leaves none of them behind. Usage is queued for the
+  // write-behind thread instead and is kept either way: the provider billed it.
+  ASSIGN_OR_RETURN(auto batch, db_->BeginWriteBatch());
+  auto tokens_or = strategy_->ProcessResponse(session_id, response_json, group_id);
+  if (!tokens_or.ok()) return tokens_or.status();
+  RETURN_IF_ERROR(batch->Commit());
+  return tokens_or;
 }
 
 absl::StatusOr<std::vector<ToolCall>> Orchestrator::ParseToolCalls(const Database::Message& msg) {
@@ -188,15 +317,19 @@ absl::StatusOr<nlohmann::json> Orchestrator::GetQuota(const std::string& oauth_t
 /**
  * @brief Constructs the system instruction string for the LLM.
  *
- * Combines the builtin system prompt, conversation history guidelines,
- * and the definitions/usage instructions for any active skills.
+ * Combines the builtin system prompt, the tool list, the definitions/usage
+ * instructions for any active skills and the conversation history guidelines:
+ * only what changes when the tools or skills do, so that the instruction stays
+ * a stable prefix of the payload from turn to turn.
  *
- * @param session_id The active session ID.
  * @param active_skills List of skill names to include in the instructions.
+ * @param manifest The enabled tools and the skills.
+ * @param breakdown If not null, receives the tokens of each section.
  * @return std::string The complete system instruction string.
  */
-std::string Orchestrator::BuildSystemInstructions(const std::string& session_id,
-                                                  const std::vector<std::string>& active_skills) {
+std::string Orchestrator::BuildSystemInstructions(const std::vector<std::string>& active_skills,
+                                                  const Database::ToolManifest& manifest,
+                                                  PromptBreakdown* breakdown) {
   static constexpr absl::string_view kHistoryInstructions = R"(
 ## Conversation History Guidelines
 1. The following messages are sequential and chronological.
@@ -213,25 +346,9 @@ Technical Anchors: [Ports, IPs, constant values]
 
   std::string system_instruction;
 #ifdef HAVE_SYSTEM_PROMPT_H
-  {
-    // The builtin system prompt may contain metadata headers like #patch: or #purpose:.
-    // This loop extracts only the content that follows these headers, allowing
-    // for a clean separation of the actual instruction from development-time notes.
-    std::stringstream ss(kBuiltinSystemPrompt);
-    std::string line;
-    bool in_patch = false;
-    while (std::getline(ss, line)) {
-      absl::string_view s = absl::StripLeadingAsciiWhitespace(line);
-      if (absl::StartsWith(s, "#patch:") || absl::StartsWith(s, "#purpose:") || absl::StartsWith(s, "# patch:") ||
-          absl::StartsWith(s, "# purpose:")) {
-        in_patch = true;
-        continue;
-      }
-      if (in_patch) {
-        absl::StrAppend(&system_instruction, line, "\n");
-      }
-    }
-  }
+  // Already without its metadata: the generate_system_prompt genrule keeps only
+  // what follows the "# purpose:" (or "# patch:") headers.
+  system_instruction = kBuiltinSystemPrompt;
 #endif
 
   if (system_instruction.empty()) {
@@ -240,19 +357,29 @@ Technical Anchors: [Ports, IPs, constant values]
 
   if (system_instruction.back() != '\n') absl::StrAppend(&system_instruction, "\n");
 
-  auto tools_or = db_->GetEnabledTools();
-  if (tools_or.ok() && !tools_or->empty()) {
+  // Each section's tokens go to `field` of the breakdown, if there is one.
+  const TokenCounter& counter = TokenCounter::Default();
+  size_t section_start = 0;
+  auto end_section = [&](int PromptBreakdown::*field) {
+    if (breakdown != nullptr) {
+      breakdown->*field += counter.Count(absl::string_view(system_instruction).substr(section_start));
+    }
+    section_start = system_instruction.size();
+  };
+  end_section(&PromptBreakdown::system);
+
+  if (!manifest.tools.empty()) {
     absl::StrAppend(&system_instruction, "\n## Available Tools\n",
                     "You have access to the following tools. Use them to fulfill the user's request.\n");
-    for (const auto& t : *tools_or) {
+    for (const auto& t : manifest.tools) {
       absl::StrAppend(&system_instruction, "- ", t.name, ": ", t.description, "\n");
     }
   }
+  end_section(&PromptBreakdown::tools);
 
-  auto all_skills_or = db_->GetSkills();
-  if (all_skills_or.ok() && !active_skills.empty()) {
+  if (!active_skills.empty()) {
     absl::StrAppend(&system_instruction, "\n## Active Personas & Skills\n");
-    for (const auto& skill : *all_skills_or) {
+    for (const auto& skill : manifest.skills) {
       for (const auto& active_name : active_skills) {
         if (skill.name == active_name) {
           absl::StrAppend(&system_instruction, "### Skill: ", skill.name, "\n", skill.system_prompt_patch, "\n");
@@ -260,35 +387,89 @@ Technical Anchors: [Ports, IPs, constant values]
       }
     }
   }
+  end_section(&PromptBreakdown::skills);
 
   absl::StrAppend(&system_instruction, kHistoryInstructions, "\n");
+  end_section(&PromptBreakdown::system);
+
+  return system_instruction;
+}
+
+/**
+ * @brief Constructs the parts of the prompt that change from turn to turn.
+ *
+ * The global state anchor, the scratchpad and the memos relevant to the last
+ * user message, as loaded into `context`.
+ *
+ * @param context The loaded prompt context.
+ * @param breakdown If not null, receives the tokens of each section.
+ * @return std::string The session context, empty when there is none.
+ */
+std::string Orchestrator::BuildSessionContext(const PromptContext& context, PromptBreakdown* breakdown) {
+  std::string session_context;
+  const TokenCounter& counter = TokenCounter::Default();
+  size_t section_start = 0;
+  auto end_section = [&](int PromptBreakdown::*field) {
+    if (breakdown != nullptr) {
+      breakdown->*field += counter.Count(absl::string_view(session_context).substr(section_start));
+    }
+    section_start = session_context.size();
+  };
 
-  auto state_or = db_->GetSessionState(session_id);
-  if (state_or.ok() && !state_or->empty()) {
-    absl::StrAppend(&system_instruction, "## Global State (Anchor)\n", *state_or, "\n");
+  if (!context.state.empty()) {
+    absl::StrAppend(&session_context, "## Global State (Anchor)\n", context.state, "\n");
   }
+  end_section(&PromptBreakdown::state);
 
-  auto scratchpad_or = db_->GetScratchpad(session_id);
-  if (scratchpad_or.ok() && !scratchpad_or->empty()) {
-    absl::StrAppend(&system_instruction, "## Active Scratchpad\n", *scratchpad_or, "\n");
+  if (!context.scratchpad.empty()) {
+    absl::StrAppend(&session_context, "## Active Scratchpad\n", context.scratchpad, "\n");
   }
+  end_section(&PromptBreakdown::scratchpad);
 
-  return system_instruction;
+  if (!context.memos.empty()) {
+    absl::StrAppend(&session_context, "\n## Relevant Memos\n",
+                    "The following memos were automatically retrieved as they might be relevant to the "
+                    "current context:\n");
+    for (const auto& m : context.memos) {
+      absl::StrAppend(&session_context, "- [", m.semantic_tags, "] ", m.content, "\n");
+    }
+  }
+  end_section(&PromptBreakdown::memos);
+
+  return session_context;
+}
+
+absl::StatusOr<int> Orchestrator::ResolveWindowSize(const std::string& session_id,
+                                                    const Database::ContextSettings& settings) {
+  if (settings.budget <= 0) return settings.size;
+  // Truncation limits are in bytes; a tool result keeps at most that many.
+  auto tokens = [](size_t limit) {
+    size_t cap = (limit + Database::kBytesPerToken - 1) / Database::kBytesPerToken;
+    return static_cast<int>(std::min<size_t>(cap, std::numeric_limits<int>::max()));
+  };
+  Database::TokenTiers tiers;
+  tiers.active_full_fidelity = tokens(config_.truncation.active_full_fidelity_limit);
+  tiers.active_degraded = tokens(config_.truncation.active_degraded_limit);
+  tiers.inactive = tokens(config_.truncation.inactive_limit);
+  tiers.full_fidelity_count = static_cast<int>(config_.truncation.full_fidelity_count);
+  return db_->GetBudgetWindowSize(session_id, settings.budget, tiers);
 }
 
 absl::StatusOr<std::vector<Database::Message>> Orchestrator::GetRelevantHistory(const std::string& session_id,
                                                                                 int window_size) {
-  // Use Phase 2 windowed fetching if window_size > 0
-  auto hist_or = db_->GetConversationHistory(session_id, false, window_size);
-  if (!hist_or.ok()) return hist_or.status();
+  return LoadHistory(session_id, window_size, /*inflate_tool_results=*/true);
+}
 
+absl::StatusOr<std::vector<Database::Message>> Orchestrator::LoadHistory(const std::string& session_id,
+                                                                         int window_size, bool inflate_tool_results) {
   std::vector<Database::Message> history;
-  history.reserve(hist_or->size());
-
+  absl::Status status;
   const std::string& current_strategy = strategy_->GetName();
   std::set<std::string> group_ids;
 
-  for (auto& m : *hist_or) {
+  // Use Phase 2 windowed fetching if window_size > 0. Rows are filtered on the
+  // cursor so that skipped messages are never copied.
+  RETURN_IF_ERROR(db_->VisitConversationHistory(session_id, false, window_size, [&](const Database::MessageView& m) {
     bool is_tool_related = (m.role == "tool" || m.status == "tool_call");
     bool strategy_matches = (m.parsing_strategy.empty() || m.parsing_strategy == current_strategy ||
                              (current_strategy == "gemini_gca" && m.parsing_strategy == "gemini") ||
@@ -296,11 +477,21 @@ absl::StatusOr<std::vector<Database::Message>> Orchestrator::GetRelevantHistory(
 
     if (!is_tool_related || strategy_matches) {
       if (!m.group_id.empty()) {
-        group_ids.insert(m.group_id);
+        group_ids.emplace(m.group_id);
+      }
+      Database::Message message = m.ToMessage();
+      if (status.ok() && (inflate_tool_results || m.role != "tool") && Database::IsCompressedContent(m.content)) {
+        auto content_or = db_->InflateContent(m.content);
+        if (content_or.ok()) {
+          message.content = std::move(*content_or);
+        } else {
+          status = content_or.status();
+        }
       }
-      history.push_back(std::move(m));
+      history.push_back(std::move(message));
     }
-  }
+  }));
+  if (!status.ok()) return status;
 
   last_selected_groups_.assign(group_ids.begin(), group_ids.end());
   return history;
@@ -309,7 +500,8 @@ absl::StatusOr<std::vector<Database::Message>> Orchestrator::GetRelevantHistory(
 absl::Status Orchestrator::RebuildContext(const std::string& session_id) {
   auto settings_or = db_->GetContextSettings(session_id);
   if (!settings_or.ok()) return settings_or.status();
-  auto history_or = GetRelevantHistory(session_id, settings_or->size);
+  ASSIGN_OR_RETURN(int window_size, ResolveWindowSize(session_id, *settings_or));
+  auto history_or = GetRelevantHistory(session_id, window_size);
   if (!history_or.ok()) return history_or.status();
 
   for (const auto& msg : *history_or) {
@@ -323,9 +515,7 @@ absl::Status Orchestrator::RebuildContext(const std::string& session_id) {
   return absl::OkStatus();
 }
 
-void Orchestrator::InjectRelevantMemos(const std::vector<Database::Message>& history, std::string* system_instruction) {
-  if (history.empty()) return;
-
+std::vector<Database::Memo> Orchestrator::FindRelevantMemos(const std::vector<Database::Message>& history) {
   // Find the last user message
   std::string last_user_text;
   for (auto it = history.rbegin(); it != history.rend(); ++it) {
@@ -334,27 +524,51 @@ void Orchestrator::InjectRelevantMemos(const std::vector<Database::Message>& his
       break;
     }
   }
-  if (last_user_text.empty()) return;
+  if (last_user_text.empty()) return {};
 
   std::vector<std::string> tags = Database::ExtractTags(last_user_text);
-  if (tags.empty()) return;
+  if (tags.empty()) return {};
 
-  auto memos_or = db_->GetMemosByTags(tags);
-  if (memos_or.ok() && !memos_or->empty()) {
-    absl::StrAppend(system_instruction, "\n## Relevant Memos\n",
-                    "The following memos were automatically retrieved as they might be relevant to the "
-                    "current context:\n");
-    // Limit to top 5 memos to avoid clutter
-    int count = 0;
-    for (const auto& m : *memos_or) {
-      absl::StrAppend(system_instruction, "- [", m.semantic_tags, "] ", m.content, "\n");
-      if (++count >= 5) break;
-    }
+  // Limit to the 5 best ranked memos to avoid clutter
+  auto memos_or = db_->SearchMemos(tags, 5);
+  if (!memos_or.ok()) return {};
+  return std::move(*memos_or);
+}
+
+absl::StatusOr<std::string> Orchestrator::TruncateStoredContent(const std::string& content, size_t limit,
+                                                                 int message_id) {
+  if (!Database::IsCompressedContent(content)) return SmarterTruncate(content, limit, message_id);
+  ASSIGN_OR_RETURN(size_t size, Database::GetContentSize(content));
+  if (size <= ContentCodec::kChunkSize) {
+    // Head and tail share the only chunk; inflate it once.
+    ASSIGN_OR_RETURN(std::string text, db_->InflateContent(content));
+    return SmarterTruncate(text, limit, message_id);
   }
+  absl::Status status;
+  std::string truncated = SmarterTruncate(
+      size,
+      [&](size_t offset, size_t length) {
+        auto range_or = db_->InflateContentRange(content, offset, length);
+        if (!range_or.ok()) {
+          status = range_or.status();
+          return std::string();
+        }
+        return std::move(*range_or);
+      },
+      limit, message_id);
+  if (!status.ok()) return status;
+  return truncated;
 }
 
 std::string Orchestrator::SmarterTruncate(const std::string& content, size_t limit, int message_id) {
-  if (content.size() <= limit) return content;
+  return SmarterTruncate(
+      content.size(), [&](size_t offset, size_t length) { return content.substr(offset, length); }, limit,
+      message_id);
+}
+
+std::string Orchestrator::SmarterTruncate(size_t size, absl::FunctionRef<std::string(size_t, size_t)> read,
+                                          size_t limit, int message_id) {
+  if (size <= limit) return read(0, size);
 
   // Sandwich Truncation: 20% Head, 80% Tail.
   // We reserve some space for the truncation hint.
@@ -368,16 +582,19 @@ std::string Orchestrator::SmarterTruncate(const std::string& content, size_t lim
     hint = absl::Substitute(
         "\n\n... [TRUNCATED: Showing partial output of $0 bytes. Use query_db or specific tool range to see more.] "
         "...\n\n",
-        content.size());
+        size);
   }
 
   if (limit <= hint.size() + 10) {
     // If the limit is extremely small, just do basic head truncation to fit.
     size_t tiny_limit = limit > 3 ? limit - 3 : limit;
-    while (tiny_limit > 0 && (static_cast<unsigned char>(content[tiny_limit]) & 0xC0) == 0x80) {
+    // One byte past the cut, to find the character boundary.
+    std::string head = read(0, tiny_limit + 1);
+    while (tiny_limit > 0 && (static_cast<unsigned char>(head[tiny_limit]) & 0xC0) == 0x80) {
       tiny_limit--;
     }
-    return content.substr(0, tiny_limit) + "...";
+    head.resize(tiny_limit);
+    return head + "...";
   }
 
   size_t available_content = limit - hint.size();
@@ -386,17 +603,20 @@ std::string Orchestrator::SmarterTruncate(const std::string& content, size_t lim
   size_t tail_size = available_content - head_size;
 
   // UTF-8 safety for Head (avoid cutting in middle of multi-byte char)
-  while (head_size > 0 && (static_cast<unsigned char>(content[head_size]) & 0xC0) == 0x80) {
+  std::string head = read(0, head_size + 1);
+  while (head_size > 0 && (static_cast<unsigned char>(head[head_size]) & 0xC0) == 0x80) {
     head_size--;
   }
+  head.resize(head_size);
 
   // UTF-8 safety for Tail (ensure we start at a character boundary)
-  size_t tail_start = content.size() - tail_size;
-  while (tail_start < content.size() && (static_cast<unsigned char>(content[tail_start]) & 0xC0) == 0x80) {
+  std::string tail = read(size - tail_size, tail_size);
+  size_t tail_start = 0;
+  while (tail_start < tail.size() && (static_cast<unsigned char>(tail[tail_start]) & 0xC0) == 0x80) {
     tail_start++;
   }
 
-  return content.substr(0, head_size) + hint + content.substr(tail_start);
+  return head + hint + tail.substr(tail_start);
 }
 
 std::optional<std::string> Orchestrator::ExtractState(const std::string& text) {
@@ -2,10 +2,13 @@
 #define SLOP_SQL_ORCHESTRATOR_H_
 
 #include <memory>
+#include <optional>
 #include <string>
 #include <vector>
 
+#include "absl/functional/function_ref.h"
 #include "absl/status/statusor.h"
+#include "absl/time/time.h"
 
 #include "core/database.h"
 #include "core/http_client.h"
@@ -29,6 +32,42 @@ class Orchestrator {
     size_t full_fidelity_count = 5;
   };
 
+  // Tokens, by TokenCounter, of each section of an assembled prompt.
+  struct PromptBreakdown {
+    int system = 0;      // Builtin prompt and history guidelines.
+    int tools = 0;       // Tool list and function declarations.
+    int skills = 0;      // Active skill patches.
+    int state = 0;       // Global state anchor.
+    int scratchpad = 0;  // Session scratchpad.
+    int memos = 0;       // Relevant memos.
+    int history = 0;     // Messages of the window, as truncated.
+
+    int Total() const { return system + tools + skills + state + scratchpad + memos + history; }
+  };
+
+  // What a prompt is assembled from, read in one snapshot of the database; see
+  // Database::BeginReadSnapshot(). Only `settings` is loaded when the session's
+  // context is disabled.
+  struct PromptContext {
+    Database::ContextSettings settings;
+    // Messages of the window, tool results truncated.
+    std::vector<Database::Message> history;
+    std::shared_ptr<const Database::ToolManifest> manifest;  // Tools and skills.
+    std::string state;
+    std::string scratchpad;
+    // Memos relevant to the last user message of `history`.
+    std::vector<Database::Memo> memos;
+
+    // Time spent reading each section.
+    struct Timings {
+      absl::Duration session;  // Settings, state and scratchpad, in one query.
+      absl::Duration history;  // Window size, messages and their truncation.
+      absl::Duration tools;    // Tools and skills.
+      absl::Duration memos;
+      absl::Duration total;  // Everything, transaction included.
+    } timings;
+  };
+
   struct Config {
     Provider provider = Provider::GEMINI;
     std::string model;
@@ -37,6 +76,9 @@ class Orchestrator {
     std::string base_url;
     int throttle = 0;
     bool strip_reasoning = false;
+    // Gemini API only: how long an explicit context cache of the system
+    // instruction and tools lives. Zero keeps none.
+    absl::Duration context_cache_ttl = absl::ZeroDuration();
     TruncationSettings truncation = {};
   };
 
@@ -52,6 +94,7 @@ class Orchestrator {
     Builder& WithBaseUrl(const std::string& url);
     Builder& WithThrottle(int seconds);
     Builder& WithStripReasoning(bool enabled);
+    Builder& WithContextCacheTtl(absl::Duration ttl);
 
     absl::StatusOr<std::unique_ptr<Orchestrator>> Build();
     void BuildInto(Orchestrator* orchestrator);
@@ -73,11 +116,23 @@ class Orchestrator {
 
   Builder Update() const { return Builder(*this); }
 
+  // Fills `breakdown`, when given, with the tokens of each section; counting them
+  // costs a pass of TokenCounter over the prompt, so requests leave it out.
   absl::StatusOr<nlohmann::json> AssemblePrompt(const std::string& session_id,
-                                                const std::vector<std::string>& active_skills = {});
+                                                const std::vector<std::string>& active_skills = {},
+                                                PromptBreakdown* breakdown = nullptr);
   absl::StatusOr<int> ProcessResponse(const std::string& session_id, const std::string& response_json,
                                       const std::string& group_id = "");
 
+  // AssemblePrompt(), serialized as the request body; see OrchestratorStrategy::SerializePayload().
+  absl::StatusOr<std::string> AssembleRequestBody(const std::string& session_id,
+                                                  const std::vector<std::string>& active_skills,
+                                                  const std::string& api_key);
+
+  // Reads everything the session's next prompt is assembled from in one read
+  // transaction, so that it is consistent however the session changes meanwhile.
+  absl::StatusOr<PromptContext> LoadPromptContext(const std::string& session_id);
+
   // Rebuilds the session state (### STATE anchor) from the current window's history.
   absl::Status RebuildContext(const std::string& session_id);
 
@@ -87,6 +142,7 @@ class Orchestrator {
   absl::StatusOr<nlohmann::json> GetQuota(const std::string& oauth_token);
 
   std::vector<std::string> GetLastSelectedGroups() const { return last_selected_groups_; }
+  PromptContext::Timings GetLastPromptLoadTimings() const { return last_prompt_load_timings_; }
 
   // Exposed for rebuilding and testing
   absl::StatusOr<std::vector<Database::Message>> GetRelevantHistory(const std::string& session_id, int window_size);
@@ -96,6 +152,10 @@ class Orchestrator {
 
   // Utility for truncating large tool results.
   static std::string SmarterTruncate(const std::string& content, size_t limit, int message_id = -1);
+  // Same, for content of `size` bytes that is read on demand: `read(offset, length)`
+  // is only asked for the head and the tail that are kept.
+  static std::string SmarterTruncate(size_t size, absl::FunctionRef<std::string(size_t, size_t)> read, size_t limit,
+                                     int message_id = -1);
 
   // Extracts the ### STATE block from a message, terminating at the next header or EOF.
   static std::optional<std::string> ExtractState(const std::string& text);
@@ -107,12 +167,40 @@ class Orchestrator {
   HttpClient* http_client_;
   Config config_;
   std::vector<std::string> last_selected_groups_;
+  PromptContext::Timings last_prompt_load_timings_;
 
   std::unique_ptr<OrchestratorStrategy> strategy_;
 
+  // What the strategy assembles a prompt from.
+  struct PromptParts {
+    std::string system_instruction;
+    std::vector<Database::Message> history;
+    std::string session_context;
+  };
+
   // Helper methods for AssemblePrompt
-  std::string BuildSystemInstructions(const std::string& session_id, const std::vector<std::string>& active_skills);
-  void InjectRelevantMemos(const std::vector<Database::Message>& history, std::string* system_instruction);
+  // The parts of the session's prompt, and its breakdown if `breakdown` is given;
+  // nullopt when its context is disabled.
+  absl::StatusOr<std::optional<PromptParts>> BuildPromptParts(const std::string& session_id,
+                                                              const std::vector<std::string>& active_skills,
+                                                              PromptBreakdown* breakdown);
+  // Window size, in groups, of the session's settings: its token budget resolved
+  // against the truncation tiers, or its group count.
+  absl::StatusOr<int> ResolveWindowSize(const std::string& session_id, const Database::ContextSettings& settings);
+  // GetRelevantHistory(), optionally leaving compressed tool results compressed.
+  absl::StatusOr<std::vector<Database::Message>> LoadHistory(const std::string& session_id, int window_size,
+                                                             bool inflate_tool_results);
+  // SmarterTruncate() for content as stored, inflating only what is kept.
+  absl::StatusOr<std::string> TruncateStoredContent(const std::string& content, size_t limit, int message_id);
+  // Truncates the tool results of `history` by group activity and recency.
+  absl::Status TruncateToolResults(std::vector<Database::Message>* history);
+  // The best ranked memos for the tags of the last user message of `history`.
+  std::vector<Database::Memo> FindRelevantMemos(const std::vector<Database::Message>& history);
+  // The stable prefix: builtin prompt, tool list, active skills and history guidelines.
+  std::string BuildSystemInstructions(const std::vector<std::string>& active_skills,
+                                      const Database::ToolManifest& manifest, PromptBreakdown* breakdown);
+  // What changes from turn to turn: state anchor, scratchpad and relevant memos.
+  std::string BuildSessionContext(const PromptContext& context, PromptBreakdown* breakdown);
 };
 
 }  // namespace slop
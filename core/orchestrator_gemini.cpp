@@ -1,113 +1,263 @@
 #include "core/orchestrator_gemini.h"
 
+#include <algorithm>
+#include <functional>
 #include <iostream>
+#include <optional>
 
 #include "absl/container/flat_hash_set.h"
 #include "absl/log/check.h"
 #include "absl/log/log.h"
+#include "absl/strings/str_cat.h"
 #include "absl/strings/substitute.h"
 #include "absl/time/clock.h"
 
+#include "core/json_writer.h"
 #include "core/message_parser.h"
 #include "core/orchestrator.h"
+#include "core/payload_builder.h"
+#include "core/status_macros.h"
+#include "core/token_counter.h"
 namespace slop {
 
-GeminiOrchestrator::GeminiOrchestrator(Database* db, HttpClient* http_client, const std::string& model,
-                                       const std::string& base_url)
-    : db_(db), http_client_(http_client), model_(model), base_url_(base_url) {}
+namespace {
+
+// Groups `history` into "contents" entries, marking the current request and putting
+// the session context with it. Function responses must follow a model turn; those
+// that do not are dropped.
+std::vector<PayloadEntry> GroupContents(const std::vector<Database::Message>& history,
+                                        const std::string& session_context,
+                                        const absl::flat_hash_set<std::string>& enabled_tool_names) {
+  std::vector<PayloadEntry> contents;
+  for (auto& part : DecorateHistory(history, session_context)) {
+    const Database::Message& msg = *part.msg;
+    std::string role = (msg.role == "assistant") ? "model" : (msg.role == "tool" ? "function" : msg.role);
+    // Responses of tools no longer enabled are sent as user text.
+    if (msg.status != "tool_call" && msg.role == "tool" && !enabled_tool_names.contains(ToolResponseName(msg))) {
+      role = "user";
+    }
 
-absl::StatusOr<nlohmann::json> GeminiOrchestrator::AssemblePayload(const std::string& session_id,
-                                                                   const std::string& system_instruction,
-                                                                   const std::vector<Database::Message>& history) {
-  (void)session_id;
-  nlohmann::json payload;
-  nlohmann::json contents = nlohmann::json::array();
-
-  absl::flat_hash_set<std::string> enabled_tool_names;
-  auto tools_or = db_->GetEnabledTools();
-  if (tools_or.ok()) {
-    for (const auto& t : *tools_or) {
-      enabled_tool_names.insert(t.name);
+    if (!contents.empty() && contents.back().role == role) {
+      contents.back().parts.push_back(std::move(part));
+    } else {
+      contents.push_back({role, {}});
+      contents.back().parts.push_back(std::move(part));
     }
   }
 
-  for (size_t i = 0; i < history.size(); ++i) {
-    const auto& msg = history[i];
-    std::string display_content = msg.content;
-
-    if (i == 0) display_content = "## Begin Conversation History\n" + display_content;
-    if (i == history.size() - 1 && msg.role == "user" && i > 0) {
-      display_content = "## End of History\n\n### CURRENT REQUEST\n" + display_content;
-    }
+  std::vector<PayloadEntry> valid_contents;
+  for (auto& c : contents) {
+    if (c.role == "function" && (valid_contents.empty() || valid_contents.back().role != "model")) continue;
+    valid_contents.push_back(std::move(c));
+  }
+  return valid_contents;
+}
 
-    if (msg.role == "system") continue;
+void WriteText(absl::string_view text, JsonWriter* w) {
+  w->BeginObject();
+  w->Key("text");
+  w->String(text);
+  w->EndObject();
+}
 
-    std::string role = (msg.role == "assistant") ? "model" : (msg.role == "tool" ? "function" : msg.role);
-    nlohmann::json part;
-
-    if (msg.status == "tool_call") {
-      auto j = nlohmann::json::parse(msg.content, nullptr, false);
-      if (!j.is_discarded()) {
-        bool valid = true;
-        if (j.contains("functionCall")) {
-          std::string name = j["functionCall"]["name"];
-          if (!enabled_tool_names.contains(name)) {
-            LOG(WARNING) << "Filtering out invalid tool call: " << name;
-            valid = false;
-          }
-        }
-        if (valid) {
-          part = j;
-        } else {
-          part = {{"text", "[Invalid tool call suppressed: " + msg.content + "]"}};
-        }
-      } else {
-        part = {{"text", display_content}};
-      }
-    } else if (msg.role == "tool") {
-      bool valid = true;
-      std::string name = msg.tool_call_id.substr(msg.tool_call_id.find('|') + 1);
+// Writes `part` as an element of "parts", keys sorted as nlohmann::json sorts them.
+void WritePart(const PayloadPart& part, const absl::flat_hash_set<std::string>& enabled_tool_names, JsonWriter* w) {
+  const Database::Message& msg = *part.msg;
+  if (msg.status == "tool_call") {
+    // Stored as the model sent it: parsed to check the tool, and rewritten compact.
+    auto j = nlohmann::json::parse(msg.content, nullptr, false);
+    if (j.is_discarded()) return WriteText(part.text(), w);
+    if (j.contains("functionCall")) {
+      std::string name = j["functionCall"]["name"];
       if (!enabled_tool_names.contains(name)) {
-        LOG(WARNING) << "Filtering out invalid tool response: " << name;
-        valid = false;
+        LOG(WARNING) << "Filtering out invalid tool call: " << name;
+        return WriteText("[Invalid tool call suppressed: " + msg.content + "]", w);
       }
+    }
+    w->Raw(DumpJson(j));
+    return;
+  }
+  if (msg.role == "tool") {
+    std::string name = ToolResponseName(msg);
+    if (!enabled_tool_names.contains(name)) {
+      LOG(WARNING) << "Filtering out invalid tool response: " << name;
+      return WriteText("[Invalid tool response suppressed]", w);
+    }
+    w->BeginObject();
+    w->Key("functionResponse");
+    w->BeginObject();
+    w->Key("name");
+    w->String(name);
+    w->Key("response");
+    w->BeginObject();
+    w->Key("content");
+    w->String(msg.content);
+    w->EndObject();
+    w->EndObject();
+    w->EndObject();
+    return;
+  }
+  WriteText(part.text(), w);
+}
 
-      if (valid) {
-        part = {{"functionResponse", {{"name", name}, {"response", {{"content", msg.content}}}}}};
-      } else {
-        role = "user";
-        part = {{"text", "[Invalid tool response suppressed]"}};
-      }
+void WriteContent(const PayloadEntry& entry, const absl::flat_hash_set<std::string>& enabled_tool_names,
+                  JsonWriter* w) {
+  w->BeginObject();
+  w->Key("parts");
+  w->BeginArray();
+  for (const auto& part : entry.parts) WritePart(part, enabled_tool_names, w);
+  w->EndArray();
+  w->Key("role");
+  w->String(entry.role);
+  w->EndObject();
+}
+
+void WriteSystemInstruction(absl::string_view system_instruction, JsonWriter* w) {
+  w->BeginObject();
+  w->Key("parts");
+  w->BeginArray();
+  WriteText(system_instruction, w);
+  w->EndArray();
+  w->EndObject();
+}
+
+}  // namespace
+
+GeminiOrchestrator::GeminiOrchestrator(Database* db, HttpClient* http_client, const std::string& model,
+                                       const std::string& base_url)
+    : db_(db), http_client_(http_client), model_(model), base_url_(base_url) {}
+
+absl::StatusOr<nlohmann::json> GeminiOrchestrator::AssemblePayload(const std::string& session_id,
+                                                                   const std::string& system_instruction,
+                                                                   const std::vector<Database::Message>& history,
+                                                                   const std::string& session_context) {
+  (void)session_id;
+  std::string body;
+  JsonWriter w(&body);
+  RETURN_IF_ERROR(SerializeRequest({}, system_instruction, history, session_context, &w));
+  return nlohmann::json::parse(body);
+}
+
+absl::StatusOr<std::string> GeminiOrchestrator::SerializePayload(const std::string& session_id,
+                                                                 const std::string& system_instruction,
+                                                                 const std::vector<Database::Message>& history,
+                                                                 const std::string& session_context,
+                                                                 const std::string& api_key) {
+  (void)session_id;
+  std::string body;
+  body.reserve(EstimateRequestSize(history, system_instruction.size() + session_context.size() +
+                                                tool_declarations_body_.size()));
+  JsonWriter w(&body);
+  RequestOptions options;
+  options.api_key = &api_key;
+  options.incremental = true;
+  RETURN_IF_ERROR(SerializeRequest(options, system_instruction, history, session_context, &w));
+  return body;
+}
+
+absl::Status GeminiOrchestrator::SerializeRequest(const RequestOptions& options, const std::string& system_instruction,
+                                                  const std::vector<Database::Message>& history,
+                                                  const std::string& session_context, JsonWriter* w) {
+  ASSIGN_OR_RETURN(std::shared_ptr<const Database::ToolManifest> manifest, db_->GetToolManifest());
+  const absl::flat_hash_set<std::string>& enabled_tool_names = manifest->tool_names;
+  ToolDeclarations(manifest);
+
+  std::string cached_content;
+  if (options.api_key != nullptr && context_cache_ttl_ > absl::ZeroDuration() && !system_instruction.empty()) {
+    std::string system_body;
+    JsonWriter system(&system_body);
+    WriteSystemInstruction(system_instruction, &system);
+    auto name_or = ContextCacheName(system_body, tool_declarations_body_, *options.api_key);
+    if (name_or.ok()) {
+      cached_content = std::move(*name_or);
     } else {
-      part = {{"text", display_content}};
+      LOG(WARNING) << "Sending the prompt without a context cache: " << name_or.status();
     }
-
-    if (!contents.empty() && contents.back()["role"] == role)
-      contents.back()["parts"].push_back(part);
-    else
-      contents.push_back({{"role", role}, {"parts", {part}}});
   }
 
-  nlohmann::json valid_contents = nlohmann::json::array();
-  for (const auto& c : contents) {
-    if (c["role"] == "function" && (valid_contents.empty() || valid_contents.back()["role"] != "model")) continue;
-    valid_contents.push_back(c);
+  // Keys sorted, as nlohmann::json writes them.
+  w->BeginObject();
+  if (!cached_content.empty()) {
+    w->Key("cachedContent");
+    w->String(cached_content);
   }
+  w->Key("contents");
+  std::vector<PayloadEntry> contents = GroupContents(history, session_context, enabled_tool_names);
+  if (options.incremental) {
+    contents_builder_.BeginArray();
+    for (const auto& entry : contents) {
+      contents_builder_.AddEntry(PayloadEntryKey(manifest->generation, entry), [&](std::string* out) {
+        JsonWriter entry_writer(out);
+        WriteContent(entry, enabled_tool_names, &entry_writer);
+      });
+    }
+    w->Raw(contents_builder_.EndArray());
+  } else {
+    w->BeginArray();
+    for (const auto& entry : contents) WriteContent(entry, enabled_tool_names, w);
+    w->EndArray();
+  }
+  if (options.session_id != nullptr) {
+    w->Key("session_id");
+    w->String(*options.session_id);
+  }
+  if (cached_content.empty()) {
+    if (!system_instruction.empty()) {
+      w->Key("system_instruction");
+      WriteSystemInstruction(system_instruction, w);
+    }
+    if (!tool_declarations_body_.empty()) {
+      w->Key("tools");
+      w->Raw(tool_declarations_body_);
+    }
+  }
+  w->EndObject();
+  return absl::OkStatus();
+}
 
-  payload["contents"] = valid_contents;
-  if (!system_instruction.empty()) payload["system_instruction"] = {{"parts", {{{"text", system_instruction}}}}};
-
+const nlohmann::json& GeminiOrchestrator::ToolDeclarations(
+    const std::shared_ptr<const Database::ToolManifest>& manifest) {
+  if (manifest == declared_manifest_) return tool_declarations_;
   nlohmann::json f_decls = nlohmann::json::array();
-  if (tools_or.ok()) {
-    for (const auto& t : *tools_or) {
-      auto schema = nlohmann::json::parse(t.json_schema, nullptr, false);
-      if (!schema.is_discarded())
-        f_decls.push_back({{"name", t.name}, {"description", t.description}, {"parameters", schema}});
-    }
+  for (const auto& t : manifest->tools) {
+    auto schema = nlohmann::json::parse(t.json_schema, nullptr, false);
+    if (!schema.is_discarded())
+      f_decls.push_back({{"name", t.name}, {"description", t.description}, {"parameters", schema}});
   }
-  if (!f_decls.empty()) payload["tools"] = {{{"function_declarations", f_decls}}};
+  tool_declarations_ = f_decls.empty() ? nlohmann::json() : nlohmann::json{{{"function_declarations", f_decls}}};
+  tool_declarations_body_ = tool_declarations_.is_null() ? "" : DumpJson(tool_declarations_);
+  declared_manifest_ = manifest;
+  return tool_declarations_;
+}
 
-  return payload;
+absl::StatusOr<std::string> GeminiOrchestrator::ContextCacheName(const std::string& system_body,
+                                                                 const std::string& tools_body,
+                                                                 const std::string& api_key) {
+  std::string prefix_body = R"({"model":)";
+  AppendJsonString(&prefix_body, "models/" + model_);
+  absl::StrAppend(&prefix_body, R"(,"systemInstruction":)", system_body);
+  if (!tools_body.empty()) absl::StrAppend(&prefix_body, R"(,"tools":)", tools_body);
+  prefix_body.push_back('}');
+  size_t prefix_hash = std::hash<std::string>()(prefix_body);
+
+  absl::Time now = absl::Now();
+  if (prefix_hash != context_cache_.prefix_hash || now >= context_cache_.renew_at) {
+    // Renewed a little before the API drops it, so that no request names an expired cache.
+    context_cache_ = {prefix_hash, "", now + context_cache_ttl_ - std::min(absl::Minutes(1), context_cache_ttl_ / 10)};
+    if (TokenCounter::Default().Count(prefix_body) < kMinCachedTokens) return std::string();
+
+    prefix_body.pop_back();
+    absl::StrAppend(&prefix_body, R"(,"ttl":")", absl::ToInt64Seconds(context_cache_ttl_), "s\"}");
+    auto resp_or = http_client_->Post(base_url_ + "/cachedContents", prefix_body,
+                                      {"Content-Type: application/json", "x-goog-api-key: " + api_key});
+    if (!resp_or.ok()) return resp_or.status();
+    auto j = nlohmann::json::parse(*resp_or, nullptr, false);
+    if (j.is_discarded() || !j.contains("name") || !j["name"].is_string()) {
+      return absl::InternalError("Failed to parse cachedContents response");
+    }
+    context_cache_.name = j["name"];
+  }
+  return context_cache_.name;
 }
 
 absl::StatusOr<int> GeminiOrchestrator::ProcessResponse(const std::string& session_id, const std::string& response_json,
@@ -128,8 +278,10 @@ absl::StatusOr<int> GeminiOrchestrator::ProcessResponse(const std::string& sessi
     auto& usage = (*target)["usageMetadata"];
     int prompt = usage.value("promptTokenCount", 0);
     int completion = usage.value("candidatesTokenCount", 0);
+    // Prompt tokens read from a cachedContent or an implicit cache hit.
+    int cached = usage.value("cachedContentTokenCount", 0);
     total_tokens = prompt + completion;
-    (void)db_->RecordUsage(session_id, model_, prompt, completion);
+    (void)db_->RecordUsage(session_id, model_, prompt, completion, cached);
   }
 
   absl::Status status = absl::InternalError("No candidates in response");
@@ -142,10 +294,10 @@ absl::StatusOr<int> GeminiOrchestrator::ProcessResponse(const std::string& sessi
       if (part.contains("functionCall")) {
         status = db_->AppendMessage(session_id, "assistant",
                                     part.dump(-1, ' ', false, nlohmann::json::error_handler_t::replace),
-                                    part["functionCall"]["name"], "tool_call", group_id, GetName(), total_tokens);
+                                    part["functionCall"]["name"], "tool_call", group_id, GetName());
       } else if (part.contains("text")) {
         std::string text = part["text"];
-        status = db_->AppendMessage(session_id, "assistant", text, "", "completed", group_id, GetName(), total_tokens);
+        status = db_->AppendMessage(session_id, "assistant", text, "", "completed", group_id, GetName());
 
         auto state = Orchestrator::ExtractState(text);
         if (state) {
@@ -193,8 +345,9 @@ GeminiGcaOrchestrator::GeminiGcaOrchestrator(Database* db, HttpClient* http_clie
 
 absl::StatusOr<nlohmann::json> GeminiGcaOrchestrator::AssemblePayload(const std::string& session_id,
                                                                       const std::string& system_instruction,
-                                                                      const std::vector<Database::Message>& history) {
-  auto payload_or = GeminiOrchestrator::AssemblePayload(session_id, system_instruction, history);
+                                                                      const std::vector<Database::Message>& history,
+                                                                      const std::string& session_context) {
+  auto payload_or = GeminiOrchestrator::AssemblePayload(session_id, system_instruction, history, session_context);
   if (!payload_or.ok()) return payload_or.status();
 
   nlohmann::json wrapped;
@@ -207,6 +360,31 @@ absl::StatusOr<nlohmann::json> GeminiGcaOrchestrator::AssemblePayload(const std:
   return wrapped;
 }
 
+absl::StatusOr<std::string> GeminiGcaOrchestrator::SerializePayload(const std::string& session_id,
+                                                                    const std::string& system_instruction,
+                                                                    const std::vector<Database::Message>& history,
+                                                                    const std::string& session_context,
+                                                                    const std::string& api_key) {
+  (void)api_key;
+  std::string body;
+  body.reserve(EstimateRequestSize(history, system_instruction.size() + session_context.size()));
+  JsonWriter w(&body);
+  w.BeginObject();
+  w.Key("model");
+  w.String(model_);
+  w.Key("project");
+  w.String(project_id_);
+  w.Key("request");
+  RequestOptions options;
+  options.session_id = &session_id;
+  options.incremental = true;
+  RETURN_IF_ERROR(SerializeRequest(options, system_instruction, history, session_context, &w));
+  w.Key("user_prompt_id");
+  w.String(std::to_string(absl::ToUnixNanos(absl::Now())));
+  w.EndObject();
+  return body;
+}
+
 absl::StatusOr<int> GeminiGcaOrchestrator::ProcessResponse(const std::string& session_id,
                                                            const std::string& response_json,
                                                            const std::string& group_id) {
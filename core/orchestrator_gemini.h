@@ -1,9 +1,13 @@
 #ifndef SLOP_SQL_ORCHESTRATOR_GEMINI_H_
 #define SLOP_SQL_ORCHESTRATOR_GEMINI_H_
 
+#include "absl/time/time.h"
+
 #include "core/database.h"
 #include "core/http_client.h"
+#include "core/json_writer.h"
 #include "core/orchestrator_strategy.h"
+#include "core/payload_builder.h"
 
 namespace slop {
 
@@ -11,10 +15,27 @@ class GeminiOrchestrator : public OrchestratorStrategy {
  public:
   GeminiOrchestrator(Database* db, HttpClient* http_client, const std::string& model, const std::string& base_url);
 
+  // How long an explicit context cache lives; zero (the default) keeps none and
+  // leaves caching to the provider's implicit cache.
+  void SetContextCacheTtl(absl::Duration ttl) { context_cache_ttl_ = ttl; }
+
   std::string GetName() const override { return "gemini"; }
 
   absl::StatusOr<nlohmann::json> AssemblePayload(const std::string& session_id, const std::string& system_instruction,
-                                                 const std::vector<Database::Message>& history) override;
+                                                 const std::vector<Database::Message>& history,
+                                                 const std::string& session_context) override;
+
+  // When a context cache TTL is set, the system instruction and tools are stored as a
+  // cachedContents resource, once per prefix and TTL, and named in the body in their
+  // place. Prefixes below kMinCachedTokens are sent inline: the API refuses to cache
+  // them. Failing to cache only logs a warning.
+  absl::StatusOr<std::string> SerializePayload(const std::string& session_id, const std::string& system_instruction,
+                                               const std::vector<Database::Message>& history,
+                                               const std::string& session_context,
+                                               const std::string& api_key) override;
+
+  // Built once per manifest.
+  const nlohmann::json& ToolDeclarations(const std::shared_ptr<const Database::ToolManifest>& manifest) override;
 
   absl::StatusOr<int> ProcessResponse(const std::string& session_id, const std::string& response_json,
                                       const std::string& group_id) override;
@@ -25,10 +46,50 @@ class GeminiOrchestrator : public OrchestratorStrategy {
   absl::StatusOr<nlohmann::json> GetQuota(const std::string& oauth_token) override;
 
  protected:
+  // How SerializeRequest() writes a request.
+  struct RequestOptions {
+    // The request's "session_id", as Code Assist takes it; none if null.
+    const std::string* session_id = nullptr;
+    // Key to create a context cache with; none is used if null.
+    const std::string* api_key = nullptr;
+    // Reuses the history serialized for the last incremental request.
+    bool incremental = false;
+  };
+  // Writes the request AssemblePayload() assembles as the next value of `w`.
+  absl::Status SerializeRequest(const RequestOptions& options, const std::string& system_instruction,
+                                const std::vector<Database::Message>& history, const std::string& session_context,
+                                JsonWriter* w);
+
   Database* db_;
   HttpClient* http_client_;
   std::string model_;
   std::string base_url_;
+
+ private:
+  // The cachedContents resource holding `system_body` and `tools_body` (serialized,
+  // the latter empty without tools), created if needed; empty if there is none.
+  absl::StatusOr<std::string> ContextCacheName(const std::string& system_body, const std::string& tools_body,
+                                               const std::string& api_key);
+
+  std::shared_ptr<const Database::ToolManifest> declared_manifest_;
+  nlohmann::json tool_declarations_;
+  // tool_declarations_ serialized, or empty when it is null.
+  std::string tool_declarations_body_;
+
+  // "contents" of the last SerializePayload().
+  PayloadBuilder contents_builder_;
+
+  static constexpr int kMinCachedTokens = 1024;
+
+  // The cachedContents resource of the last prefix. `name` is empty when creating it
+  // failed or was skipped; it is not tried again before `renew_at`.
+  struct ContextCache {
+    size_t prefix_hash = 0;
+    std::string name;
+    absl::Time renew_at = absl::InfinitePast();
+  };
+  absl::Duration context_cache_ttl_ = absl::ZeroDuration();
+  ContextCache context_cache_;
 };
 
 class GeminiGcaOrchestrator : public GeminiOrchestrator {
@@ -39,7 +100,14 @@ class GeminiGcaOrchestrator : public GeminiOrchestrator {
   std::string GetName() const override { return "gemini_gca"; }
 
   absl::StatusOr<nlohmann::json> AssemblePayload(const std::string& session_id, const std::string& system_instruction,
-                                                 const std::vector<Database::Message>& history) override;
+                                                 const std::vector<Database::Message>& history,
+                                                 const std::string& session_context) override;
+
+  // Never uses a context cache: Code Assist has none.
+  absl::StatusOr<std::string> SerializePayload(const std::string& session_id, const std::string& system_instruction,
+                                               const std::vector<Database::Message>& history,
+                                               const std::string& session_context,
+                                               const std::string& api_key) override;
 
   absl::StatusOr<int> ProcessResponse(const std::string& session_id, const std::string& response_json,
                                       const std::string& group_id) override;
@@ -1,116 +1,220 @@
 #include "core/orchestrator_openai.h"
 
 #include <iostream>
+#include <optional>
 
 #include "absl/container/flat_hash_set.h"
 #include "absl/log/check.h"
 #include "absl/log/log.h"
+#include "absl/strings/str_cat.h"
 #include "absl/strings/substitute.h"
 
+#include "core/json_writer.h"
 #include "core/message_parser.h"
 #include "core/orchestrator.h"
+#include "core/payload_builder.h"
+#include "core/status_macros.h"
 namespace slop {
 
-OpenAiOrchestrator::OpenAiOrchestrator(Database* db, HttpClient* http_client, const std::string& model,
-                                       const std::string& base_url)
-    : db_(db), http_client_(http_client), model_(model), base_url_(base_url) {}
+namespace {
 
-absl::StatusOr<nlohmann::json> OpenAiOrchestrator::AssemblePayload(const std::string& session_id,
-                                                                   const std::string& system_instruction,
-                                                                   const std::vector<Database::Message>& history) {
-  (void)session_id;
-  nlohmann::json messages = nlohmann::json::array();
-  if (!system_instruction.empty()) messages.push_back({{"role", "system"}, {"content", system_instruction}});
-
-  absl::flat_hash_set<std::string> enabled_tool_names;
-  auto tools_or = db_->GetEnabledTools();
-  if (tools_or.ok()) {
-    for (const auto& t : *tools_or) {
-      enabled_tool_names.insert(t.name);
-    }
+// Whether `part` is the response of a tool that is no longer enabled.
+bool IsSuppressedToolResponse(const PayloadPart& part, const absl::flat_hash_set<std::string>& enabled_tool_names) {
+  const Database::Message& msg = *part.msg;
+  return msg.status != "tool_call" && msg.role == "tool" && !enabled_tool_names.contains(ToolResponseName(msg));
+}
+
+// Text `part` is sent as when it goes as a text message.
+absl::string_view PartText(const PayloadPart& part, const absl::flat_hash_set<std::string>& enabled_tool_names) {
+  if (IsSuppressedToolResponse(part, enabled_tool_names)) {
+    LOG(WARNING) << "Filtering out invalid tool response: " << ToolResponseName(*part.msg);
+    return "[Invalid tool response suppressed]";
   }
+  return part.text();
+}
 
-  for (size_t i = 0; i < history.size(); ++i) {
-    const auto& msg = history[i];
-    std::string display_content = msg.content;
+// Groups `history` into "messages" entries, marking the current request and putting
+// the session context with it.
+std::vector<PayloadEntry> GroupMessages(const std::vector<Database::Message>& history,
+                                        const std::string& session_context,
+                                        const absl::flat_hash_set<std::string>& enabled_tool_names) {
+  std::vector<PayloadEntry> messages;
+  for (auto& part : DecorateHistory(history, session_context)) {
+    const Database::Message& msg = *part.msg;
+    std::string role = msg.role;
+    // Responses of tools no longer enabled are sent as user text.
+    if (IsSuppressedToolResponse(part, enabled_tool_names)) role = "user";
 
-    if (i == 0) display_content = "## Begin Conversation History\n" + display_content;
-    if (i == history.size() - 1 && msg.role == "user" && i > 0) {
-      display_content = "## End of History\n\n### CURRENT REQUEST\n" + display_content;
+    if (!messages.empty() && messages.back().role == msg.role && msg.role == "user") {
+      messages.back().parts.push_back(std::move(part));
+    } else {
+      messages.push_back({role, {}});
+      messages.back().parts.push_back(std::move(part));
     }
+  }
+  return messages;
+}
 
-    if (msg.role == "system") continue;
-
-    nlohmann::json msg_obj;
-
-    if (msg.status == "tool_call") {
-      auto j = nlohmann::json::parse(msg.content, nullptr, false);
-      if (!j.is_discarded()) {
-        bool valid = true;
-        if (j.contains("tool_calls")) {
-          for (auto& tc : j["tool_calls"]) {
-            std::string name = tc["function"]["name"];
-            if (!enabled_tool_names.contains(name)) {
-              LOG(WARNING) << "Filtering out invalid tool call: " << name;
-              valid = false;
-              break;
-            }
-          }
-        }
-        if (valid) {
-          msg_obj = j;
-        } else {
-          msg_obj = {{"role", "assistant"}, {"content", "[Invalid tool call suppressed]"}};
-        }
-      } else {
-        msg_obj = {{"role", msg.role}, {"content", display_content}};
-      }
-    } else if (msg.role == "tool") {
-      bool valid = true;
-      std::string name = msg.tool_call_id.substr(msg.tool_call_id.find('|') + 1);
-      if (!enabled_tool_names.contains(name)) {
-        LOG(WARNING) << "Filtering out invalid tool response: " << name;
-        valid = false;
-      }
+void WriteTextMessage(absl::string_view role, absl::string_view content, JsonWriter* w) {
+  w->BeginObject();
+  w->Key("content");
+  w->String(content);
+  w->Key("role");
+  w->String(role);
+  w->EndObject();
+}
 
-      if (valid) {
-        msg_obj = {{"role", msg.role}};
-        msg_obj["tool_call_id"] = msg.tool_call_id.substr(0, msg.tool_call_id.find('|'));
-        msg_obj["content"] = msg.content;
-      } else {
-        msg_obj = {{"role", "user"}, {"content", "[Invalid tool response suppressed]"}};
+// Writes the message of `part`, keys sorted as nlohmann::json sorts them.
+void WritePart(const PayloadPart& part, const absl::flat_hash_set<std::string>& enabled_tool_names, JsonWriter* w) {
+  const Database::Message& msg = *part.msg;
+  if (msg.status == "tool_call") {
+    // Stored as the model sent it: parsed to check the tools, and rewritten compact.
+    auto j = nlohmann::json::parse(msg.content, nullptr, false);
+    if (j.is_discarded()) return WriteTextMessage(msg.role, part.text(), w);
+    if (j.contains("tool_calls")) {
+      for (auto& tc : j["tool_calls"]) {
+        std::string name = tc["function"]["name"];
+        if (!enabled_tool_names.contains(name)) {
+          LOG(WARNING) << "Filtering out invalid tool call: " << name;
+          return WriteTextMessage("assistant", "[Invalid tool call suppressed]", w);
+        }
       }
-    } else {
-      msg_obj = {{"role", msg.role}, {"content", display_content}};
     }
-
-    if (!messages.empty() && messages.back()["role"] == msg.role && msg.role == "user") {
-      messages.back()["content"] =
-          messages.back()["content"].get<std::string>() + "\n" + msg_obj["content"].get<std::string>();
-    } else {
-      messages.push_back(msg_obj);
+    // OpenAI rejects messages without a role; stored calls may lack one.
+    if (!j.contains("role")) j["role"] = "assistant";
+    w->Raw(DumpJson(j));
+    return;
+  }
+  if (msg.role == "tool") {
+    if (IsSuppressedToolResponse(part, enabled_tool_names)) {
+      return WriteTextMessage("user", PartText(part, enabled_tool_names), w);
     }
+    w->BeginObject();
+    w->Key("content");
+    w->String(msg.content);
+    w->Key("role");
+    w->String(msg.role);
+    w->Key("tool_call_id");
+    w->String(absl::string_view(msg.tool_call_id).substr(0, msg.tool_call_id.find('|')));
+    w->EndObject();
+    return;
+  }
+  WriteTextMessage(msg.role, part.text(), w);
+}
+
+void WriteMessage(const PayloadEntry& entry, const absl::flat_hash_set<std::string>& enabled_tool_names,
+                  JsonWriter* w) {
+  if (entry.parts.size() == 1) return WritePart(entry.parts[0], enabled_tool_names, w);
+  // Consecutive user messages, joined by newlines.
+  std::string content = "\"";
+  for (size_t i = 0; i < entry.parts.size(); ++i) {
+    if (i > 0) content += "\\n";
+    AppendEscapedJson(&content, PartText(entry.parts[i], enabled_tool_names));
   }
+  content += "\"";
+  w->BeginObject();
+  w->Key("content");
+  w->Raw(content);
+  w->Key("role");
+  w->String(entry.role);
+  w->EndObject();
+}
 
-  nlohmann::json payload = {{"model", model_}, {"messages", messages}};
+}  // namespace
 
-  nlohmann::json tools = nlohmann::json::array();
-  if (tools_or.ok()) {
-    for (const auto& t : *tools_or) {
-      auto schema = nlohmann::json::parse(t.json_schema, nullptr, false);
-      if (!schema.is_discarded()) {
-        tools.push_back({{"type", "function"},
-                         {"function", {{"name", t.name}, {"description", t.description}, {"parameters", schema}}}});
-      }
+OpenAiOrchestrator::OpenAiOrchestrator(Database* db, HttpClient* http_client, const std::string& model,
+                                       const std::string& base_url)
+    : db_(db), http_client_(http_client), model_(model), base_url_(base_url) {}
+
+absl::StatusOr<nlohmann::json> OpenAiOrchestrator::AssemblePayload(const std::string& session_id,
+                                                                   const std::string& system_instruction,
+                                                                   const std::vector<Database::Message>& history,
+                                                                   const std::string& session_context) {
+  (void)session_id;
+  std::string body;
+  JsonWriter w(&body);
+  RETURN_IF_ERROR(SerializeRequest(/*incremental=*/false, system_instruction, history, session_context, &w));
+  return nlohmann::json::parse(body);
+}
+
+absl::StatusOr<std::string> OpenAiOrchestrator::SerializePayload(const std::string& session_id,
+                                                                 const std::string& system_instruction,
+                                                                 const std::vector<Database::Message>& history,
+                                                                 const std::string& session_context,
+                                                                 const std::string& api_key) {
+  (void)session_id;
+  (void)api_key;
+  std::string body;
+  body.reserve(EstimateRequestSize(history, system_instruction.size() + session_context.size() +
+                                                tool_declarations_body_.size()));
+  JsonWriter w(&body);
+  RETURN_IF_ERROR(SerializeRequest(/*incremental=*/true, system_instruction, history, session_context, &w));
+  return body;
+}
+
+absl::Status OpenAiOrchestrator::SerializeRequest(bool incremental, const std::string& system_instruction,
+                                                  const std::vector<Database::Message>& history,
+                                                  const std::string& session_context, JsonWriter* w) {
+  ASSIGN_OR_RETURN(std::shared_ptr<const Database::ToolManifest> manifest, db_->GetToolManifest());
+  const absl::flat_hash_set<std::string>& enabled_tool_names = manifest->tool_names;
+  ToolDeclarations(manifest);
+
+  // Keys sorted, as nlohmann::json writes them.
+  w->BeginObject();
+  w->Key("messages");
+  std::vector<PayloadEntry> messages = GroupMessages(history, session_context, enabled_tool_names);
+  if (incremental) {
+    messages_builder_.BeginArray();
+    if (!system_instruction.empty()) {
+      messages_builder_.AddEntry(PayloadTextKey("system", system_instruction), [&](std::string* out) {
+        JsonWriter entry_writer(out);
+        WriteTextMessage("system", system_instruction, &entry_writer);
+      });
+    }
+    for (const auto& entry : messages) {
+      messages_builder_.AddEntry(PayloadEntryKey(manifest->generation, entry), [&](std::string* out) {
+        JsonWriter entry_writer(out);
+        WriteMessage(entry, enabled_tool_names, &entry_writer);
+      });
     }
+    w->Raw(messages_builder_.EndArray());
+  } else {
+    w->BeginArray();
+    if (!system_instruction.empty()) WriteTextMessage("system", system_instruction, w);
+    for (const auto& entry : messages) WriteMessage(entry, enabled_tool_names, w);
+    w->EndArray();
+  }
+  w->Key("model");
+  w->String(model_);
+  if (!tool_declarations_body_.empty()) {
+    w->Key("tools");
+    w->Raw(tool_declarations_body_);
   }
-  if (!tools.empty()) payload["tools"] = tools;
-
   if (strip_reasoning_) {
-    payload["transforms"] = {"strip_reasoning"};
+    w->Key("transforms");
+    w->BeginArray();
+    w->String("strip_reasoning");
+    w->EndArray();
   }
+  w->EndObject();
+  return absl::OkStatus();
+}
 
-  return payload;
+const nlohmann::json& OpenAiOrchestrator::ToolDeclarations(
+    const std::shared_ptr<const Database::ToolManifest>& manifest) {
+  if (manifest == declared_manifest_) return tool_declarations_;
+  nlohmann::json tools = nlohmann::json::array();
+  for (const auto& t : manifest->tools) {
+    auto schema = nlohmann::json::parse(t.json_schema, nullptr, false);
+    if (!schema.is_discarded()) {
+      tools.push_back({{"type", "function"},
+                       {"function", {{"name", t.name}, {"description", t.description}, {"parameters", schema}}}});
+    }
+  }
+  tool_declarations_ = tools.empty() ? nlohmann::json() : std::move(tools);
+  tool_declarations_body_ = tool_declarations_.is_null() ? "" : DumpJson(tool_declarations_);
+  declared_manifest_ = manifest;
+  return tool_declarations_;
 }
 
 absl::StatusOr<int> OpenAiOrchestrator::ProcessResponse(const std::string& session_id, const std::string& response_json,
@@ -126,8 +230,16 @@ absl::StatusOr<int> OpenAiOrchestrator::ProcessResponse(const std::string& sessi
     auto& usage = j["usage"];
     int prompt = usage.value("prompt_tokens", 0);
     int completion = usage.value("completion_tokens", 0);
+    // Prompt tokens served from the provider's prompt cache.
+    int cached = 0;
+    auto details = usage.find("prompt_tokens_details");
+    if (details != usage.end() && details->is_object()) {
+      // Some compatible servers send null here.
+      auto cached_tokens = details->find("cached_tokens");
+      if (cached_tokens != details->end() && cached_tokens->is_number()) cached = cached_tokens->get<int>();
+    }
     total_tokens = prompt + completion;
-    (void)db_->RecordUsage(session_id, model_, prompt, completion);
+    (void)db_->RecordUsage(session_id, model_, prompt, completion, cached);
   }
 
   absl::Status status = absl::InternalError("No choices in response");
@@ -141,10 +253,10 @@ absl::StatusOr<int> OpenAiOrchestrator::ProcessResponse(const std::string& sessi
                                   msg.dump(-1, ' ', false, nlohmann::json::error_handler_t::replace),
                                   msg["tool_calls"][0]["id"].get<std::string>() + "|" +
                                       msg["tool_calls"][0]["function"]["name"].get<std::string>(),
-                                  "tool_call", group_id, GetName(), total_tokens);
+                                  "tool_call", group_id, GetName());
     } else if (msg.contains("content") && !msg["content"].is_null()) {
       std::string text = msg["content"];
-      status = db_->AppendMessage(session_id, "assistant", text, "", "completed", group_id, GetName(), total_tokens);
+      status = db_->AppendMessage(session_id, "assistant", text, "", "completed", group_id, GetName());
 
       auto state = Orchestrator::ExtractState(text);
       if (state) {
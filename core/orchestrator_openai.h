@@ -3,7 +3,9 @@
 
 #include "core/database.h"
 #include "core/http_client.h"
+#include "core/json_writer.h"
 #include "core/orchestrator_strategy.h"
+#include "core/payload_builder.h"
 
 namespace slop {
 
@@ -16,7 +18,16 @@ class OpenAiOrchestrator : public OrchestratorStrategy {
   std::string GetName() const override { return "openai"; }
 
   absl::StatusOr<nlohmann::json> AssemblePayload(const std::string& session_id, const std::string& system_instruction,
-                                                 const std::vector<Database::Message>& history) override;
+                                                 const std::vector<Database::Message>& history,
+                                                 const std::string& session_context) override;
+
+  absl::StatusOr<std::string> SerializePayload(const std::string& session_id, const std::string& system_instruction,
+                                               const std::vector<Database::Message>& history,
+                                               const std::string& session_context,
+                                               const std::string& api_key) override;
+
+  // Built once per manifest.
+  const nlohmann::json& ToolDeclarations(const std::shared_ptr<const Database::ToolManifest>& manifest) override;
 
   absl::StatusOr<int> ProcessResponse(const std::string& session_id, const std::string& response_json,
                                       const std::string& group_id) override;
@@ -27,11 +38,25 @@ class OpenAiOrchestrator : public OrchestratorStrategy {
   absl::StatusOr<nlohmann::json> GetQuota(const std::string& oauth_token) override;
 
  private:
+  // Writes the request AssemblePayload() assembles as the next value of `w`;
+  // `incremental` reuses the history serialized for the last incremental request.
+  absl::Status SerializeRequest(bool incremental, const std::string& system_instruction,
+                                const std::vector<Database::Message>& history, const std::string& session_context,
+                                JsonWriter* w);
+
   Database* db_;
   HttpClient* http_client_;
   std::string model_;
   std::string base_url_;
   bool strip_reasoning_ = false;
+
+  std::shared_ptr<const Database::ToolManifest> declared_manifest_;
+  nlohmann::json tool_declarations_;
+  // tool_declarations_ serialized, or empty when it is null.
+  std::string tool_declarations_body_;
+
+  // "messages" of the last SerializePayload().
+  PayloadBuilder messages_builder_;
 };
 
 }  // namespace slop
@@ -20,7 +20,7 @@ TEST_F(OpenAiOrchestratorTest, AssemblePayloadIncludesStripReasoning) {
   OpenAiOrchestrator orchestrator(&db, &http, "gpt-4", "https://api.openai.com/v1");
   orchestrator.SetStripReasoning(true);
 
-  auto result = orchestrator.AssemblePayload("s1", "System prompt", {});
+  auto result = orchestrator.AssemblePayload("s1", "System prompt", {}, "");
   ASSERT_TRUE(result.ok());
 
   nlohmann::json payload = *result;
@@ -33,7 +33,7 @@ TEST_F(OpenAiOrchestratorTest, AssemblePayloadExcludesStripReasoningWhenDisabled
   OpenAiOrchestrator orchestrator(&db, &http, "gpt-4", "https://api.openai.com/v1");
   orchestrator.SetStripReasoning(false);
 
-  auto result = orchestrator.AssemblePayload("s1", "System prompt", {});
+  auto result = orchestrator.AssemblePayload("s1", "System prompt", {}, "");
   ASSERT_TRUE(result.ok());
 
   nlohmann::json payload = *result;
@@ -45,7 +45,7 @@ TEST_F(OpenAiOrchestratorTest, PayloadStructureWithStripReasoning) {
   OpenAiOrchestrator orchestrator(&db, &http, "gpt-4-turbo", "https://api.openai.com/v1");
   orchestrator.SetStripReasoning(true);
 
-  auto result = orchestrator.AssemblePayload("session1", "You are helpful.", {});
+  auto result = orchestrator.AssemblePayload("session1", "You are helpful.", {}, "");
   ASSERT_TRUE(result.ok());
 
   nlohmann::json payload = *result;
@@ -71,7 +71,7 @@ TEST_F(OpenAiOrchestratorTest, PayloadStructureWithoutStripReasoning) {
   OpenAiOrchestrator orchestrator(&db, &http, "gpt-4-turbo", "https://api.openai.com/v1");
   orchestrator.SetStripReasoning(false);
 
-  auto result = orchestrator.AssemblePayload("session1", "You are helpful.", {});
+  auto result = orchestrator.AssemblePayload("session1", "You are helpful.", {}, "");
   ASSERT_TRUE(result.ok());
 
   nlohmann::json payload = *result;
@@ -111,7 +111,7 @@ TEST_F(OpenAiOrchestratorTest, OpenAiProactiveFiltering) {
   auto history_or = db.GetConversationHistory("s1", false);
   ASSERT_TRUE(history_or.ok());
 
-  auto result = orchestrator.AssemblePayload("s1", "System prompt", *history_or);
+  auto result = orchestrator.AssemblePayload("s1", "System prompt", *history_or, "");
   ASSERT_TRUE(result.ok());
 
   nlohmann::json payload = *result;
@@ -134,4 +134,32 @@ TEST_F(OpenAiOrchestratorTest, OpenAiProactiveFiltering) {
   EXPECT_TRUE(absl::StrContains(messages[4]["content"].get<std::string>(), "suppressed"));
 }
 
+TEST_F(OpenAiOrchestratorTest, SuppressesDisabledToolResponseMergedWithUserText) {
+  OpenAiOrchestrator orchestrator(&db, &http, "gpt-4", "https://api.openai.com/v1");
+  ASSERT_TRUE(db.RegisterTool({"tool1", "desc1", "{}", true}).ok());
+  ASSERT_TRUE(db.SetToolEnabled("tool1", false).ok());
+
+  nlohmann::json tool_call = {
+      {"role", "assistant"},
+      {"tool_calls", {{{"id", "c1"}, {"type", "function"}, {"function", {{"name", "tool1"}, {"arguments", "{}"}}}}}}};
+  ASSERT_TRUE(db.AppendMessage("s1", "assistant", tool_call.dump(), "c1|tool1", "tool_call").ok());
+  ASSERT_TRUE(db.AppendMessage("s1", "tool", "secret tool output", "c1|tool1", "completed").ok());
+  ASSERT_TRUE(db.AppendMessage("s1", "user", "next question").ok());
+
+  auto history_or = db.GetConversationHistory("s1", false);
+  ASSERT_TRUE(history_or.ok());
+  for (const auto& api_key : {std::string(), std::string("key")}) {
+    auto body = orchestrator.SerializePayload("s1", "System prompt", *history_or, "", api_key);
+    ASSERT_TRUE(body.ok()) << body.status();
+    EXPECT_FALSE(absl::StrContains(*body, "secret tool output"));
+
+    nlohmann::json messages = nlohmann::json::parse(*body)["messages"];
+    ASSERT_EQ(messages.size(), 3);
+    EXPECT_EQ(messages[2]["role"], "user");
+    std::string content = messages[2]["content"];
+    EXPECT_TRUE(absl::StartsWith(content, "[Invalid tool response suppressed]\n")) << content;
+    EXPECT_TRUE(absl::StrContains(content, "next question")) << content;
+  }
+}
+
 }  // namespace slop
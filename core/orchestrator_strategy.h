@@ -1,6 +1,7 @@
 #ifndef SLOP_SQL_ORCHESTRATOR_STRATEGY_H_
 #define SLOP_SQL_ORCHESTRATOR_STRATEGY_H_
 
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -32,10 +33,26 @@ class OrchestratorStrategy {
   virtual std::string GetName() const = 0;
 
   // Assembles the JSON payload for the specific provider.
-  // The system_instruction and history are provided by the Orchestrator.
+  // The system_instruction, history and session_context are provided by the
+  // Orchestrator. The session_context changes from turn to turn and goes at the
+  // head of the last user message of `history`, which has one when it is not empty.
   virtual absl::StatusOr<nlohmann::json> AssemblePayload(const std::string& session_id,
                                                          const std::string& system_instruction,
-                                                         const std::vector<Database::Message>& history) = 0;
+                                                         const std::vector<Database::Message>& history,
+                                                         const std::string& session_context) = 0;
+
+  // The request body AssemblePayload() would give, serialized, with the stable prefix
+  // replaced by a reference to a provider-side cache of it when the strategy keeps
+  // one (created with `api_key`). Called once per tool-loop iteration: what the
+  // previous call serialized is reused for the history it still shares.
+  virtual absl::StatusOr<std::string> SerializePayload(const std::string& session_id,
+                                                       const std::string& system_instruction,
+                                                       const std::vector<Database::Message>& history,
+                                                       const std::string& session_context,
+                                                       const std::string& api_key) = 0;
+
+  // The "tools" of a payload declaring `manifest`'s tools, or null if it has none.
+  virtual const nlohmann::json& ToolDeclarations(const std::shared_ptr<const Database::ToolManifest>& manifest) = 0;
 
   // Parses the provider's response, records usage, and appends messages to the DB.
   // Returns the total tokens used in this turn.
@@ -1,9 +1,11 @@
 #include "core/orchestrator.h"
 
 #include "absl/strings/match.h"
+#include "absl/strings/str_cat.h"
 
 #include "core/database.h"
 
+#include <gmock/gmock.h>
 #include <gtest/gtest.h>
 namespace slop {
 
@@ -47,10 +49,71 @@ TEST_F(OrchestratorTest, MemoInjection) {
   auto result = orchestrator->AssemblePrompt("s1", {});
   ASSERT_TRUE(result.ok());
 
-  // 4. Verify system instruction contains the memo
+  // 4. Verify the current request carries the memo, and the system instruction does not
+  std::string request = (*result)["contents"].back()["parts"][0]["text"];
+  EXPECT_TRUE(absl::StrContains(request, "## Relevant Memos"));
+  EXPECT_TRUE(absl::StrContains(request, "SQLite is awesome"));
   std::string instr = (*result)["system_instruction"]["parts"][0]["text"];
-  EXPECT_TRUE(absl::StrContains(instr, "## Relevant Memos"));
-  EXPECT_TRUE(absl::StrContains(instr, "SQLite is awesome"));
+  EXPECT_FALSE(absl::StrContains(instr, "SQLite is awesome"));
+}
+
+TEST_F(OrchestratorTest, SessionContextFollowsTheStablePrefix) {
+  auto orchestrator_or = Orchestrator::Builder(&db, &http).Build();
+  ASSERT_TRUE(orchestrator_or.ok());
+  auto orchestrator = std::move(*orchestrator_or);
+
+  ASSERT_TRUE(db.SetSessionState("s1", "Goal: first").ok());
+  ASSERT_TRUE(db.AppendMessage("s1", "user", "Start", "", "completed", "g1").ok());
+  ASSERT_TRUE(db.AppendMessage("s1", "assistant", "Started", "", "completed", "g1").ok());
+  ASSERT_TRUE(db.AppendMessage("s1", "user", "Continue", "", "completed", "g2").ok());
+  auto first = orchestrator->AssemblePrompt("s1", {});
+  ASSERT_TRUE(first.ok());
+
+  ASSERT_TRUE(db.SetSessionState("s1", "Goal: second").ok());
+  ASSERT_TRUE(db.UpdateScratchpad("s1", "- [ ] finish").ok());
+  auto second = orchestrator->AssemblePrompt("s1", {});
+  ASSERT_TRUE(second.ok());
+
+  // The system instruction and everything before the current request are unchanged.
+  EXPECT_EQ((*first)["system_instruction"], (*second)["system_instruction"]);
+  EXPECT_FALSE(absl::StrContains((*second)["system_instruction"].dump(), "Goal: second"));
+  ASSERT_EQ((*second)["contents"].size(), 3);
+  EXPECT_EQ((*first)["contents"][0], (*second)["contents"][0]);
+  EXPECT_EQ((*first)["contents"][1], (*second)["contents"][1]);
+
+  std::string request = (*second)["contents"][2]["parts"][0]["text"];
+  size_t state = request.find("## Global State (Anchor)\nGoal: second");
+  size_t scratchpad = request.find("## Active Scratchpad\n- [ ] finish");
+  size_t current = request.find("### CURRENT REQUEST\nContinue");
+  ASSERT_NE(state, std::string::npos) << request;
+  ASSERT_NE(scratchpad, std::string::npos) << request;
+  ASSERT_NE(current, std::string::npos) << request;
+  EXPECT_LT(state, scratchpad);
+  EXPECT_LT(scratchpad, current);
+
+  // Through a tool loop the context stays with the request, not the tool results.
+  ASSERT_TRUE(db.AppendMessage("s1", "assistant", R"({"functionCall":{"name":"read_file","args":{}}})", "read_file",
+                               "tool_call", "g2")
+                  .ok());
+  ASSERT_TRUE(db.AppendMessage("s1", "tool", "contents", "read_file|read_file", "completed", "g2").ok());
+  auto looping = orchestrator->AssemblePrompt("s1", {});
+  ASSERT_TRUE(looping.ok());
+  EXPECT_EQ((*looping)["contents"][2], (*second)["contents"][2]);
+}
+
+TEST_F(OrchestratorTest, SessionContextWithoutAUserMessageEndsTheSystemInstruction) {
+  auto orchestrator_or =
+      Orchestrator::Builder(&db, &http).WithProvider(Orchestrator::Provider::OPENAI).WithModel("gpt-4o").Build();
+  ASSERT_TRUE(orchestrator_or.ok());
+  auto orchestrator = std::move(*orchestrator_or);
+
+  ASSERT_TRUE(db.SetSessionState("s1", "Goal: anchor").ok());
+  ASSERT_TRUE(db.AppendMessage("s1", "assistant", "Ready.").ok());
+  auto result = orchestrator->AssemblePrompt("s1", {});
+  ASSERT_TRUE(result.ok());
+  ASSERT_EQ((*result)["messages"][0]["role"], "system");
+  std::string instr = (*result)["messages"][0]["content"];
+  EXPECT_TRUE(absl::EndsWith(instr, "## Global State (Anchor)\nGoal: anchor\n")) << instr;
 }
 
 TEST_F(OrchestratorTest, AssemblePromptWithSkills) {
@@ -144,6 +207,107 @@ TEST_F(OrchestratorTest, TruncatePreviousToolResults) {
   EXPECT_TRUE(found_g2);
 }
 
+TEST_F(OrchestratorTest, TokenBudgetCountsToolResultsAsTruncated) {
+  auto orchestrator_or = Orchestrator::Builder(&db, &http).Build();
+  ASSERT_TRUE(orchestrator_or.ok());
+  auto orchestrator = std::move(*orchestrator_or);
+  ASSERT_TRUE(
+      db.Execute("INSERT INTO tools (name, description, json_schema, is_enabled) VALUES ('test_tool', 'desc', '{}', 1)")
+          .ok());
+  // 2500 tokens each, but the active one is sent at 1250 (5000 bytes) and the
+  // inactive ones at 30 (120 bytes).
+  std::string large(10000, 'x');
+  for (const char* group : {"g1", "g2", "g3"}) {
+    ASSERT_TRUE(db.AppendMessage("s1", "user", absl::StrCat("prompt ", group), "", "completed", group).ok());
+    ASSERT_TRUE(db.AppendMessage("s1", "tool", large, "id|test_tool", "completed", group, "", 2500).ok());
+  }
+
+  // g3: 3 + 1250, g2: 3 + 30, g1: 3 + 30.
+  ASSERT_TRUE(db.SetContextBudget("s1", 1300).ok());
+  ASSERT_TRUE(orchestrator->AssemblePrompt("s1", {}).ok());
+  EXPECT_EQ(orchestrator->GetLastSelectedGroups(), (std::vector<std::string>{"g2", "g3"}));
+
+  ASSERT_TRUE(db.SetContextBudget("s1", 1319).ok());
+  ASSERT_TRUE(orchestrator->AssemblePrompt("s1", {}).ok());
+  EXPECT_EQ(orchestrator->GetLastSelectedGroups(), (std::vector<std::string>{"g1", "g2", "g3"}));
+
+  // Even a budget the active group exceeds keeps it.
+  ASSERT_TRUE(db.SetContextBudget("s1", 10).ok());
+  ASSERT_TRUE(orchestrator->AssemblePrompt("s1", {}).ok());
+  EXPECT_EQ(orchestrator->GetLastSelectedGroups(), (std::vector<std::string>{"g3"}));
+}
+
+TEST_F(OrchestratorTest, PromptBreakdownCountsEachSection) {
+  auto orchestrator_or = Orchestrator::Builder(&db, &http).Build();
+  ASSERT_TRUE(orchestrator_or.ok());
+  auto orchestrator = std::move(*orchestrator_or);
+  ASSERT_TRUE(db.Execute("INSERT INTO tools (name, description, json_schema, is_enabled) VALUES ('test_tool', "
+                         "'Reads a file', '{\"type\": \"object\"}', 1)")
+                  .ok());
+  ASSERT_TRUE(db.RegisterSkill({0, "planner", "Plans", "Plan before acting."}).ok());
+  ASSERT_TRUE(db.SetSessionState("s1", "Goal: ship the counter").ok());
+  ASSERT_TRUE(db.AddMemo("The parser caches its tables.", "[\"parser\"]").ok());
+  ASSERT_TRUE(db.AppendMessage("s1", "user", "Why is the parser slow?", "", "completed", "g1").ok());
+  ASSERT_TRUE(db.AppendMessage("s1", "assistant", "It rebuilds its tables.", "", "completed", "g1").ok());
+
+  Orchestrator::PromptBreakdown breakdown;
+  ASSERT_TRUE(orchestrator->AssemblePrompt("s1", {"planner"}, &breakdown).ok());
+  EXPECT_GT(breakdown.system, 0);
+  EXPECT_GT(breakdown.tools, 0);
+  EXPECT_GT(breakdown.skills, 0);
+  EXPECT_GT(breakdown.state, 0);
+  EXPECT_EQ(breakdown.scratchpad, 0);
+  EXPECT_GT(breakdown.memos, 0);
+  EXPECT_EQ(breakdown.history, Database::EstimateTokens("Why is the parser slow?") +
+                                   Database::EstimateTokens("It rebuilds its tables."));
+
+  // Sections that are not sent count nothing.
+  Orchestrator::PromptBreakdown without_skills;
+  ASSERT_TRUE(orchestrator->AssemblePrompt("s1", {}, &without_skills).ok());
+  EXPECT_EQ(without_skills.skills, 0);
+  EXPECT_EQ(without_skills.system, breakdown.system);
+  EXPECT_EQ(without_skills.history, breakdown.history);
+}
+
+TEST_F(OrchestratorTest, LoadPromptContextReadsEverySection) {
+  auto orchestrator_or = Orchestrator::Builder(&db, &http).Build();
+  ASSERT_TRUE(orchestrator_or.ok());
+  auto orchestrator = std::move(*orchestrator_or);
+  ASSERT_TRUE(db.Execute("INSERT INTO tools (name, description, json_schema, is_enabled) VALUES ('test_tool', "
+                         "'Reads a file', '{\"type\": \"object\"}', 1)")
+                  .ok());
+  ASSERT_TRUE(db.SetSessionState("s1", "Goal: ship the counter").ok());
+  ASSERT_TRUE(db.UpdateScratchpad("s1", "- [ ] profile the parser").ok());
+  ASSERT_TRUE(db.AddMemo("The parser caches its tables.", "[\"parser\"]").ok());
+  ASSERT_TRUE(db.AppendMessage("s1", "user", "Why is the parser slow?", "", "completed", "g1").ok());
+  ASSERT_TRUE(db.AppendMessage("s1", "assistant", "It rebuilds its tables.", "", "completed", "g1").ok());
+
+  auto context = orchestrator->LoadPromptContext("s1");
+  ASSERT_TRUE(context.ok());
+  EXPECT_EQ(context->state, "Goal: ship the counter");
+  EXPECT_EQ(context->scratchpad, "- [ ] profile the parser");
+  ASSERT_EQ(context->history.size(), 2);
+  EXPECT_EQ(context->history[1].content, "It rebuilds its tables.");
+  ASSERT_NE(context->manifest, nullptr);
+  EXPECT_TRUE(context->manifest->tool_names.contains("test_tool"));
+  ASSERT_EQ(context->memos.size(), 1);
+  EXPECT_EQ(context->memos[0].content, "The parser caches its tables.");
+
+  const Orchestrator::PromptContext::Timings& timings = context->timings;
+  EXPECT_GE(timings.total, timings.session + timings.history + timings.tools + timings.memos);
+  EXPECT_EQ(orchestrator->GetLastPromptLoadTimings().total, timings.total);
+
+  // With the context disabled, only the settings are read.
+  ASSERT_TRUE(db.SetContextWindow("s1", -1).ok());
+  context = orchestrator->LoadPromptContext("s1");
+  ASSERT_TRUE(context.ok());
+  EXPECT_EQ(context->settings.size, -1);
+  EXPECT_TRUE(context->history.empty());
+  EXPECT_EQ(context->manifest, nullptr);
+  EXPECT_TRUE(context->memos.empty());
+  EXPECT_EQ(context->timings.history, absl::ZeroDuration());
+}
+
 TEST_F(OrchestratorTest, TruncateActiveToolResults) {
   auto orchestrator_or = Orchestrator::Builder(&db, &http).WithProvider(Orchestrator::Provider::GEMINI).Build();
   ASSERT_TRUE(orchestrator_or.ok());
@@ -292,6 +456,61 @@ TEST_F(OrchestratorTest, SmarterTruncateUtf8) {
   EXPECT_TRUE(absl::StrContains(result, "さようなら"));
 }
 
+TEST_F(OrchestratorTest, SmarterTruncateReadsOnlyHeadAndTail) {
+  std::string content = "HEAD" + std::string(100000, 'x') + "TAIL";
+  size_t bytes_read = 0;
+  auto read = [&](size_t offset, size_t length) {
+    bytes_read += length;
+    return content.substr(offset, length);
+  };
+  std::string result = Orchestrator::SmarterTruncate(content.size(), read, 1000, 42);
+  EXPECT_EQ(result, Orchestrator::SmarterTruncate(content, 1000, 42));
+  EXPECT_LT(bytes_read, 1000u);
+}
+
+TEST_F(OrchestratorTest, TruncatesCompressedToolResults) {
+  auto orchestrator_or = Orchestrator::Builder(&db, &http).WithProvider(Orchestrator::Provider::GEMINI).Build();
+  ASSERT_TRUE(orchestrator_or.ok());
+  auto orchestrator = std::move(*orchestrator_or);
+
+  std::string large = "BUILD_START\n" + std::string(3 * Database::kDefaultCompressionThreshold, 'l') + "\nBUILD_FAILED";
+  ASSERT_TRUE(db.AppendMessage("s1", "user", "build it", "", "completed", "g1").ok());
+  ASSERT_TRUE(db.AppendMessage("s1", "assistant", "calling", "", "tool_call", "g1").ok());
+  ASSERT_TRUE(db.AppendMessage("s1", "tool", large, "id1|test_tool", "completed", "g1").ok());
+  ASSERT_TRUE(db.AppendMessage("s1", "user", "and again", "", "completed", "g2").ok());
+  ASSERT_TRUE(db.AppendMessage("s1", "assistant", "calling", "", "tool_call", "g2").ok());
+  ASSERT_TRUE(db.AppendMessage("s1", "tool", large, "id2|test_tool", "completed", "g2").ok());
+  ASSERT_TRUE(
+      db.Execute("INSERT INTO tools (name, description, json_schema, is_enabled) VALUES ('test_tool', 'desc', '{}', 1)")
+          .ok());
+
+  auto result = orchestrator->AssemblePrompt("s1", {});
+  ASSERT_TRUE(result.ok()) << result.status();
+
+  std::vector<std::string> tool_contents;
+  for (const auto& content : (*result)["contents"]) {
+    for (const auto& part : content["parts"]) {
+      if (part.contains("functionResponse")) {
+        tool_contents.push_back(part["functionResponse"]["response"]["content"]);
+      }
+    }
+  }
+  ASSERT_EQ(tool_contents.size(), 2u);
+  // Inactive group: head and tail only.
+  EXPECT_TRUE(absl::StrContains(tool_contents[0], "TRUNCATED"));
+  EXPECT_TRUE(absl::StrContains(tool_contents[0], "BUILD_FAILED"));
+  // Active group: cut to the full fidelity limit.
+  Orchestrator::TruncationSettings ts;
+  EXPECT_TRUE(absl::StartsWith(tool_contents[1], "BUILD_START"));
+  EXPECT_TRUE(absl::EndsWith(tool_contents[1], "BUILD_FAILED"));
+  EXPECT_NEAR(tool_contents[1].size(), ts.active_full_fidelity_limit, 50);
+
+  // The hint's query_db call returns the full text.
+  auto full = orchestrator->GetRelevantHistory("s1", 0);
+  ASSERT_TRUE(full.ok());
+  EXPECT_EQ(full->back().content, large);
+}
+
 TEST_F(OrchestratorTest, SafeJsonDump) {
   // Test that dumping invalid UTF-8 with the replace handler doesn't crash (even with -fno-exceptions)
   nlohmann::json j;
@@ -384,6 +603,26 @@ TEST_F(OrchestratorTest, AssemblePromptWithTools) {
   EXPECT_TRUE(found);
 }
 
+TEST_F(OrchestratorTest, DisabledToolsAreNotDeclared) {
+  ASSERT_TRUE(db.RegisterTool({"test_tool", "desc", R"({"type":"object"})", true}).ok());
+  for (auto provider : {Orchestrator::Provider::GEMINI, Orchestrator::Provider::OPENAI}) {
+    auto orchestrator_or = Orchestrator::Builder(&db, &http).WithProvider(provider).Build();
+    ASSERT_TRUE(orchestrator_or.ok());
+    auto orchestrator = std::move(*orchestrator_or);
+    auto declares = [&](const std::string& name) {
+      auto prompt = orchestrator->AssemblePrompt("s1", {});
+      EXPECT_TRUE(prompt.ok());
+      return absl::StrContains((*prompt)["tools"].dump(), absl::StrCat("\"", name, "\""));
+    };
+    ASSERT_TRUE(db.SetToolEnabled("test_tool", true).ok());
+    EXPECT_TRUE(declares("test_tool"));
+    EXPECT_TRUE(declares("read_file"));
+    ASSERT_TRUE(db.SetToolEnabled("test_tool", false).ok());
+    EXPECT_FALSE(declares("test_tool"));
+    EXPECT_TRUE(declares("read_file"));
+  }
+}
+
 TEST_F(OrchestratorTest, AssembleOpenAIPrompt) {
   auto orchestrator_or =
       Orchestrator::Builder(&db, &http).WithProvider(Orchestrator::Provider::OPENAI).WithModel("gpt-4o").Build();
@@ -636,7 +875,8 @@ TEST_F(OrchestratorTest, ProcessResponseExtractsUsageGemini) {
         "candidates": [{"content": {"parts": [{"text": "Hello"}]}}],
         "usageMetadata": {
             "promptTokenCount": 10,
-            "candidatesTokenCount": 5
+            "candidatesTokenCount": 5,
+            "cachedContentTokenCount": 8
         }
     })";
 
@@ -646,6 +886,7 @@ TEST_F(OrchestratorTest, ProcessResponseExtractsUsageGemini) {
   ASSERT_TRUE(usage_or.ok());
   EXPECT_EQ(usage_or->prompt_tokens, 10);
   EXPECT_EQ(usage_or->completion_tokens, 5);
+  EXPECT_EQ(usage_or->cached_tokens, 8);
 }
 
 TEST_F(OrchestratorTest, ProcessResponseExtractsUsageOpenAI) {
@@ -658,7 +899,8 @@ TEST_F(OrchestratorTest, ProcessResponseExtractsUsageOpenAI) {
         "choices": [{"message": {"role": "assistant", "content": "Hello"}}],
         "usage": {
             "prompt_tokens": 20,
-            "completion_tokens": 10
+            "completion_tokens": 10,
+            "prompt_tokens_details": {"cached_tokens": 16}
         }
     })";
 
@@ -668,6 +910,109 @@ TEST_F(OrchestratorTest, ProcessResponseExtractsUsageOpenAI) {
   ASSERT_TRUE(usage_or.ok());
   EXPECT_EQ(usage_or->prompt_tokens, 20);
   EXPECT_EQ(usage_or->completion_tokens, 10);
+  EXPECT_EQ(usage_or->cached_tokens, 16);
+
+  // Compatible servers may send no details, or null ones.
+  ASSERT_TRUE(orchestrator
+                  ->ProcessResponse("s1", R"({"choices": [{"message": {"role": "assistant", "content": "Hi"}}],
+                     "usage": {"prompt_tokens": 1, "completion_tokens": 1,
+                               "prompt_tokens_details": {"cached_tokens": null}}})")
+                  .ok());
+  EXPECT_EQ(db.GetTotalUsage("s1")->cached_tokens, 16);
+}
+
+class CachingHttpClient : public HttpClient {
+ public:
+  MOCK_METHOD(absl::StatusOr<std::string>, Post,
+              (const std::string&, const std::string&, const std::vector<std::string>&), (override));
+};
+
+TEST_F(OrchestratorTest, GeminiContextCacheReplacesTheStablePrefix) {
+  CachingHttpClient caching_http;
+  auto orchestrator_or = Orchestrator::Builder(&db, &caching_http)
+                             .WithModel("gemini-2.5-flash")
+                             .WithBaseUrl("https://gemini.test/v1beta")
+                             .WithContextCacheTtl(absl::Minutes(10))
+                             .Build();
+  ASSERT_TRUE(orchestrator_or.ok());
+  auto orchestrator = std::move(*orchestrator_or);
+
+  // Long enough for the API to cache.
+  std::string patch;
+  for (int i = 0; i < 800; ++i) absl::StrAppend(&patch, "Always check the result of step ", i, ". ");
+  ASSERT_TRUE(db.RegisterSkill({0, "careful", "Checks", patch}).ok());
+  ASSERT_TRUE(db.AppendMessage("s1", "user", "Hello").ok());
+
+  std::string cache_body;
+  EXPECT_CALL(caching_http, Post("https://gemini.test/v1beta/cachedContents", testing::_,
+                                 testing::Contains("x-goog-api-key: key")))
+      .WillOnce(testing::DoAll(testing::SaveArg<1>(&cache_body),
+                               testing::Return(std::string(R"({"name": "cachedContents/abc"})"))));
+
+  for (int turn = 0; turn < 2; ++turn) {
+    auto body = orchestrator->AssembleRequestBody("s1", {"careful"}, "key");
+    ASSERT_TRUE(body.ok());
+    auto payload = nlohmann::json::parse(*body, nullptr, false);
+    ASSERT_FALSE(payload.is_discarded()) << *body;
+    EXPECT_EQ(payload["cachedContent"], "cachedContents/abc");
+    EXPECT_FALSE(payload.contains("system_instruction"));
+    EXPECT_FALSE(payload.contains("tools"));
+    EXPECT_TRUE(absl::StrContains(payload["contents"].dump(), "Hello"));
+  }
+  auto cache = nlohmann::json::parse(cache_body);
+  EXPECT_EQ(cache["model"], "models/gemini-2.5-flash");
+  EXPECT_EQ(cache["ttl"], "600s");
+  EXPECT_TRUE(absl::StrContains(cache["systemInstruction"].dump(), "step 799"));
+  EXPECT_TRUE(cache.contains("tools"));
+
+  // Another prefix gets its own cache.
+  EXPECT_CALL(caching_http, Post("https://gemini.test/v1beta/cachedContents", testing::_, testing::_))
+      .WillOnce(testing::Return(std::string(R"({"name": "cachedContents/def"})")));
+  auto body = orchestrator->AssembleRequestBody("s1", {}, "key");
+  ASSERT_TRUE(body.ok());
+  EXPECT_EQ(nlohmann::json::parse(*body)["cachedContent"], "cachedContents/def");
+}
+
+TEST_F(OrchestratorTest, RequestBodyMatchesTheAssembledPromptThroughAToolLoop) {
+  for (auto provider : {Orchestrator::Provider::GEMINI, Orchestrator::Provider::OPENAI}) {
+    bool gemini = provider == Orchestrator::Provider::GEMINI;
+    SCOPED_TRACE(gemini ? "gemini" : "openai");
+    std::string session = gemini ? "s1" : "s2";
+    ASSERT_TRUE(db.SetSessionState(session, "Goal: loop").ok());
+    ASSERT_TRUE(db.AppendMessage(session, "user", "Start \xff", "", "completed", "g1").ok());
+    ASSERT_TRUE(db.AppendMessage(session, "assistant", "Started", "", "completed", "g1").ok());
+    ASSERT_TRUE(db.AppendMessage(session, "user", "Read it", "", "completed", "g2").ok());
+    ASSERT_TRUE(db.AppendMessage(session, "user", "Both files", "", "completed", "g2").ok());
+
+    auto orchestrator_or = Orchestrator::Builder(&db, &http).WithProvider(provider).WithModel("m").Build();
+    ASSERT_TRUE(orchestrator_or.ok());
+    auto orchestrator = std::move(*orchestrator_or);
+    auto expect_same = [&] {
+      auto payload = orchestrator->AssemblePrompt(session, {});
+      auto body = orchestrator->AssembleRequestBody(session, {}, "");
+      ASSERT_TRUE(payload.ok());
+      ASSERT_TRUE(body.ok());
+      EXPECT_EQ(*body, payload->dump(-1, ' ', false, nlohmann::json::error_handler_t::replace));
+    };
+    expect_same();
+    expect_same();
+
+    // Each iteration appends a call and its result; earlier results move to lower
+    // truncation tiers as the loop goes on.
+    std::string call = gemini ? R"({"functionCall":{"name":"read_file","args":{}}})"
+                              : R"({"role":"assistant","content":null,"tool_calls":[{"id":"c","type":"function",)"
+                                R"("function":{"name":"read_file","arguments":"{}"}}]})";
+    for (int step = 0; step < 7; ++step) {
+      ASSERT_TRUE(db.AppendMessage(session, "assistant", call, "c|read_file", "tool_call", "g2").ok());
+      ASSERT_TRUE(
+          db.AppendMessage(session, "tool", std::string(1000, 'a' + step), "c|read_file", "completed", "g2").ok());
+      expect_same();
+    }
+    ASSERT_TRUE(db.AppendMessage(session, "tool", "gone", "c|no_such_tool", "completed", "g2").ok());
+    expect_same();
+    ASSERT_TRUE(db.AppendMessage(session, "user", "Thanks", "", "completed", "g3").ok());
+    expect_same();
+  }
 }
 
 TEST_F(OrchestratorTest, GeminiDoesNotIncludeTransforms) {
@@ -0,0 +1,126 @@
+#include "core/payload_builder.h"
+
+#include "absl/hash/hash.h"
+#include "absl/strings/str_cat.h"
+
+namespace slop {
+
+void PayloadBuilder::BeginArray() {
+  if (ended_) serialized_.pop_back();
+  ended_ = false;
+  position_ = 0;
+  diverged_ = false;
+  kept_ = 0;
+  serialized_count_ = 0;
+}
+
+void PayloadBuilder::Diverge() {
+  diverged_ = true;
+  entries_.resize(position_);
+  serialized_.resize(entries_.empty() ? 1 : entries_.back().end);
+}
+
+void PayloadBuilder::AddEntry(absl::string_view key, absl::FunctionRef<void(std::string*)> serialize) {
+  if (!diverged_) {
+    if (position_ < entries_.size() && entries_[position_].key == key) {
+      ++position_;
+      ++kept_;
+      return;
+    }
+    Diverge();
+  }
+  if (position_ > 0) serialized_ += ',';
+  serialize(&serialized_);
+  entries_.push_back({std::string(key), serialized_.size()});
+  ++position_;
+  ++serialized_count_;
+}
+
+absl::string_view PayloadBuilder::EndArray() {
+  // The previous array may have had more entries.
+  if (!diverged_) Diverge();
+  serialized_.push_back(']');
+  ended_ = true;
+  return serialized_;
+}
+
+std::vector<PayloadPart> DecorateHistory(const std::vector<Database::Message>& history,
+                                         const std::string& session_context) {
+  size_t last_user = history.size();
+  for (size_t i = history.size(); i-- > 0;) {
+    if (history[i].role == "user") {
+      last_user = i;
+      break;
+    }
+  }
+
+  std::vector<PayloadPart> parts;
+  parts.reserve(history.size());
+  for (size_t i = 0; i < history.size(); ++i) {
+    const auto& msg = history[i];
+    if (msg.role == "system") continue;
+
+    PayloadPart part{&msg, std::nullopt};
+    if (i == 0 || i == last_user) {
+      std::string display_content = msg.content;
+      // Marked the same way through a tool loop, so that the request stays in the cached prefix.
+      bool current_request = i == last_user && i > 0;
+      if (current_request) display_content = "### CURRENT REQUEST\n" + display_content;
+      if (i == last_user && !session_context.empty()) display_content = session_context + "\n" + display_content;
+      if (current_request) display_content = "## End of History\n\n" + display_content;
+      if (i == 0) display_content = "## Begin Conversation History\n" + display_content;
+      part.decorated = std::move(display_content);
+    }
+    parts.push_back(std::move(part));
+  }
+  return parts;
+}
+
+std::string ToolResponseName(const Database::Message& msg) {
+  return msg.tool_call_id.substr(msg.tool_call_id.find('|') + 1);
+}
+
+std::string DumpJson(const nlohmann::json& j) {
+  return j.dump(-1, ' ', false, nlohmann::json::error_handler_t::replace);
+}
+
+size_t EstimateRequestSize(const std::vector<Database::Message>& history, size_t text) {
+  size_t size = text + 256;
+  for (const auto& m : history) size += m.content.size() + 64;
+  return size;
+}
+
+namespace {
+
+// Stands for `text` in a key: its length and hash, so that keys stay small and
+// comparing them does not walk the text.
+void AppendTextDigest(std::string* key, absl::string_view text) {
+  absl::StrAppend(key, text.size(), ":", absl::Hash<absl::string_view>{}(text), ";");
+}
+
+}  // namespace
+
+std::string PayloadEntryKey(int64_t manifest_generation, const PayloadEntry& entry) {
+  std::string key = absl::StrCat(manifest_generation, "|", entry.role);
+  for (const auto& part : entry.parts) {
+    const Database::Message& msg = *part.msg;
+    // A stored message only changes its status, and its content by being truncated
+    // to another length; one that was never stored is known by its content alone.
+    absl::StrAppend(&key, "|", msg.id, ":", msg.status, ":");
+    if (msg.id > 0) {
+      absl::StrAppend(&key, msg.content.size(), ";");
+    } else {
+      AppendTextDigest(&key, msg.content);
+    }
+    if (part.decorated) AppendTextDigest(&key, *part.decorated);
+  }
+  return key;
+}
+
+std::string PayloadTextKey(absl::string_view kind, absl::string_view text) {
+  std::string key = absl::StrCat(kind, "|");
+  AppendTextDigest(&key, text);
+  return key;
+}
+
+}  // namespace slop
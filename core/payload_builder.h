@@ -0,0 +1,107 @@
+#ifndef SLOP_CORE_PAYLOAD_BUILDER_H_
+#define SLOP_CORE_PAYLOAD_BUILDER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "absl/functional/function_ref.h"
+#include "absl/strings/string_view.h"
+
+#include "core/database.h"
+
+#include <nlohmann/json.hpp>
+
+namespace slop {
+
+// Serializes the history array of a request payload ("contents", "messages") across
+// the iterations of a tool loop, which resend the previous iteration's array with a
+// few entries appended. Each entry is added with a key standing for everything its
+// serialization depends on. While the keys match the previous array's, position by
+// position, its serialization is kept; from the first entry that differs (a new
+// message, a tool result truncated to another tier, a window that slid) the rest
+// is serialized again.
+//
+// Not thread-safe.
+class PayloadBuilder {
+ public:
+  PayloadBuilder() = default;
+
+  PayloadBuilder(const PayloadBuilder&) = delete;
+  PayloadBuilder& operator=(const PayloadBuilder&) = delete;
+
+  // Starts an array.
+  void BeginArray();
+  // Adds the next entry. `serialize` appends it, as compact JSON, to the string it
+  // is given, and is only called when the entry is not kept from the previous array.
+  void AddEntry(absl::string_view key, absl::FunctionRef<void(std::string*)> serialize);
+  // Ends the array and returns it, valid until the next BeginArray().
+  absl::string_view EndArray();
+
+  // Entries of the last array kept from the one before, and serialized for it.
+  size_t kept_entries() const { return kept_; }
+  size_t serialized_entries() const { return serialized_count_; }
+
+ private:
+  // Drops the entries from `position_` on, which the current array no longer shares.
+  void Diverge();
+
+  struct Entry {
+    std::string key;
+    size_t end;  // Offset in serialized_ just past the entry.
+  };
+  std::vector<Entry> entries_;
+  // "[" and the entries, separated by commas, and the closing bracket once ended.
+  std::string serialized_ = "[";
+  bool ended_ = false;
+  size_t position_ = 0;
+  bool diverged_ = false;
+  size_t kept_ = 0;
+  size_t serialized_count_ = 0;
+};
+
+// What the strategies build their history arrays from.
+
+// A message of the history as a part of an entry of the array.
+struct PayloadPart {
+  const Database::Message* msg;
+  // The text sent for the message when it carries headers or the session context.
+  std::optional<std::string> decorated;
+
+  const std::string& text() const { return decorated ? *decorated : msg->content; }
+};
+
+// An entry of the array: a run of parts sent with one role.
+struct PayloadEntry {
+  std::string role;
+  std::vector<PayloadPart> parts;
+};
+
+// The messages of `history` as parts, "system" messages left out. The first one is
+// marked as the beginning of the history, and the current request (the last user
+// message) is marked and carries `session_context`.
+std::vector<PayloadPart> DecorateHistory(const std::vector<Database::Message>& history,
+                                         const std::string& session_context);
+
+// The name of the tool a "tool" message answers.
+std::string ToolResponseName(const Database::Message& msg);
+
+// `j` as compact JSON, invalid UTF-8 replaced.
+std::string DumpJson(const nlohmann::json& j);
+
+// Bytes a request carrying `history` and `text` (system instruction, tools...)
+// takes, about: the size its buffer is reserved at.
+size_t EstimateRequestSize(const std::vector<Database::Message>& history, size_t text);
+
+// Keys for PayloadBuilder::AddEntry(): of `entry`, written with the tools of the
+// manifest of `manifest_generation`, and of an entry written from `text` alone.
+// They hold ids, lengths and hashes rather than text, so a key is a few dozen
+// bytes however long its messages are.
+std::string PayloadEntryKey(int64_t manifest_generation, const PayloadEntry& entry);
+std::string PayloadTextKey(absl::string_view kind, absl::string_view text);
+
+}  // namespace slop
+
+#endif  // SLOP_CORE_PAYLOAD_BUILDER_H_
@@ -0,0 +1,102 @@
+#include "core/payload_builder.h"
+
+#include <string>
+#include <vector>
+
+#include "absl/strings/str_cat.h"
+
+#include <gtest/gtest.h>
+
+namespace slop {
+namespace {
+
+// Builds the array of `keys`, each entry serialized as the quoted key.
+std::string Build(PayloadBuilder* builder, const std::vector<std::string>& keys) {
+  builder->BeginArray();
+  for (const std::string& key : keys) {
+    builder->AddEntry(key, [&](std::string* out) { absl::StrAppend(out, "\"", key, "\""); });
+  }
+  return std::string(builder->EndArray());
+}
+
+TEST(PayloadBuilderTest, SerializesOnlyWhatWasAppended) {
+  PayloadBuilder builder;
+  EXPECT_EQ(Build(&builder, {}), "[]");
+  EXPECT_EQ(Build(&builder, {"a", "b"}), R"(["a","b"])");
+  EXPECT_EQ(builder.serialized_entries(), 2);
+
+  EXPECT_EQ(Build(&builder, {"a", "b", "c", "d"}), R"(["a","b","c","d"])");
+  EXPECT_EQ(builder.kept_entries(), 2);
+  EXPECT_EQ(builder.serialized_entries(), 2);
+
+  EXPECT_EQ(Build(&builder, {"a", "b", "c", "d"}), R"(["a","b","c","d"])");
+  EXPECT_EQ(builder.kept_entries(), 4);
+  EXPECT_EQ(builder.serialized_entries(), 0);
+}
+
+TEST(PayloadBuilderTest, SerializesAgainFromTheFirstChange) {
+  PayloadBuilder builder;
+  Build(&builder, {"a", "b", "c", "d"});
+
+  // A middle entry changed, as a tool result moved to another truncation tier.
+  EXPECT_EQ(Build(&builder, {"a", "B", "c", "d", "e"}), R"(["a","B","c","d","e"])");
+  EXPECT_EQ(builder.kept_entries(), 1);
+  EXPECT_EQ(builder.serialized_entries(), 4);
+
+  // The window slid.
+  EXPECT_EQ(Build(&builder, {"B", "c", "d", "e"}), R"(["B","c","d","e"])");
+  EXPECT_EQ(builder.kept_entries(), 0);
+
+  // Fewer entries than before.
+  EXPECT_EQ(Build(&builder, {"B", "c"}), R"(["B","c"])");
+  EXPECT_EQ(builder.kept_entries(), 2);
+  EXPECT_EQ(Build(&builder, {}), "[]");
+  EXPECT_EQ(Build(&builder, {"x"}), R"(["x"])");
+}
+
+TEST(PayloadBuilderTest, DecoratesTheFirstMessageAndTheCurrentRequest) {
+  std::vector<Database::Message> history(4);
+  history[0].role = "user";
+  history[0].content = "first";
+  history[1].role = "system";
+  history[2].role = "assistant";
+  history[2].content = "answer";
+  history[3].role = "user";
+  history[3].content = "second";
+
+  std::vector<PayloadPart> parts = DecorateHistory(history, "## Active Scratchpad\n");
+  ASSERT_EQ(parts.size(), 3);
+  EXPECT_EQ(parts[0].text(), "## Begin Conversation History\nfirst");
+  EXPECT_FALSE(parts[1].decorated);
+  EXPECT_EQ(parts[1].text(), "answer");
+  EXPECT_EQ(parts[2].text(), "## End of History\n\n## Active Scratchpad\n\n### CURRENT REQUEST\nsecond");
+}
+
+TEST(PayloadBuilderTest, KeysStandForTheTextWithoutHoldingIt) {
+  Database::Message msg;
+  msg.id = 7;
+  msg.role = "tool";
+  msg.status = "completed";
+  msg.content = std::string(100000, 'x');
+  PayloadEntry entry{"function", {PayloadPart{&msg, std::nullopt}}};
+  std::string key = PayloadEntryKey(1, entry);
+  EXPECT_LT(key.size(), 100);
+  EXPECT_EQ(PayloadEntryKey(1, entry), key);
+  EXPECT_NE(PayloadEntryKey(2, entry), key);
+
+  // Truncated to another tier.
+  msg.content.resize(400);
+  EXPECT_NE(PayloadEntryKey(1, entry), key);
+  key = PayloadEntryKey(1, entry);
+  entry.parts[0].decorated = "## Begin Conversation History\n" + msg.content;
+  EXPECT_NE(PayloadEntryKey(1, entry), key);
+  key = PayloadEntryKey(1, entry);
+  entry.parts[0].decorated = "## Begin Conversation History\n" + std::string(400, 'y');
+  EXPECT_NE(PayloadEntryKey(1, entry), key);
+
+  EXPECT_EQ(PayloadTextKey("system", "prompt"), PayloadTextKey("system", "prompt"));
+  EXPECT_NE(PayloadTextKey("system", "prompt"), PayloadTextKey("system", "prompT"));
+}
+
+}  // namespace
+}  // namespace slop
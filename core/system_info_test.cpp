@@ -33,6 +33,8 @@ TEST_F(SystemInfoTest, BuiltinPromptIsLoaded) {
   // Since kBuiltinSystemPrompt is baked in at compile time from system_prompt.md,
   // we check for high-level strings we know are there.
   EXPECT_TRUE(absl::StrContains(instr, "Interactive CLI agent")) << "Missing character definition";
+  EXPECT_FALSE(absl::StrContains(instr, "# purpose:")) << "Metadata headers not stripped";
+  EXPECT_FALSE(absl::StrContains(instr, "# description:")) << "Metadata not stripped";
   EXPECT_TRUE(absl::StrContains(instr, "Primary Workflows")) << "Missing workflow definition";
   EXPECT_TRUE(absl::StrContains(instr, "manage_scratchpad")) << "Missing scratchpad instruction";
   EXPECT_TRUE(absl::StrContains(instr, "## Available Tools")) << "Missing tools section header";
@@ -0,0 +1,116 @@
+#include "core/token_counter.h"
+
+#include <algorithm>
+#include <array>
+
+#include "absl/strings/str_split.h"
+
+#include "core/token_vocab_data.h"
+
+namespace slop {
+
+namespace {
+
+enum CharClass : unsigned char { kLower, kUpper, kDigit, kSpace, kPunct, kUtf8Lead, kUtf8Continuation };
+
+constexpr std::array<CharClass, 256> MakeClasses() {
+  std::array<CharClass, 256> classes{};
+  for (int c = 0; c < 256; ++c) {
+    if (c >= 'a' && c <= 'z') {
+      classes[c] = kLower;
+    } else if (c >= 'A' && c <= 'Z') {
+      classes[c] = kUpper;
+    } else if (c >= '0' && c <= '9') {
+      classes[c] = kDigit;
+    } else if (c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' || c == '\v') {
+      classes[c] = kSpace;
+    } else if (c >= 0xC0) {
+      classes[c] = kUtf8Lead;
+    } else if (c >= 0x80) {
+      classes[c] = kUtf8Continuation;
+    } else {
+      classes[c] = kPunct;
+    }
+  }
+  return classes;
+}
+
+constexpr std::array<CharClass, 256> kClasses = MakeClasses();
+
+inline CharClass ClassOf(const char* p) { return kClasses[static_cast<unsigned char>(*p)]; }
+
+}  // namespace
+
+TokenCounter::TokenCounter(absl::string_view vocab) : vocab_(vocab) {
+  for (absl::string_view piece : absl::StrSplit(vocab_, '\n', absl::SkipWhitespace())) {
+    pieces_.insert(piece);
+    max_piece_ = std::max(max_piece_, piece.size());
+  }
+}
+
+const TokenCounter& TokenCounter::Default() {
+  static const TokenCounter* counter = new TokenCounter(kTokenVocab);
+  return *counter;
+}
+
+int TokenCounter::CountWord(absl::string_view lower) const {
+  if (lower.size() <= max_piece_ && pieces_.contains(lower)) return 1;
+  int tokens = 0;
+  size_t pos = 0;
+  while (pos < lower.size()) {
+    size_t length = std::min(max_piece_, lower.size() - pos);
+    while (length > 1 && !pieces_.contains(lower.substr(pos, length))) --length;
+    pos += length;
+    ++tokens;
+  }
+  return tokens;
+}
+
+int TokenCounter::Count(absl::string_view text) const {
+  const char* p = text.data();
+  const char* end = p + text.size();
+  char word[kMaxWord];
+  int tokens = 0;
+  while (p < end) {
+    const char* start = p;
+    switch (ClassOf(p)) {
+      case kUpper:
+      case kLower: {
+        // One piece of [A-Z]+(?![a-z])|[A-Z]?[a-z]+: "HTTPServer" is "HTTP", "Server".
+        size_t n = 0;
+        while (p < end && ClassOf(p) == kUpper && n < kMaxWord) word[n++] = static_cast<char>(*p++ | 0x20);
+        if (n > 1 && p < end && ClassOf(p) == kLower) {
+          // The last capital starts the next word.
+          --p;
+          --n;
+        } else if (n <= 1) {
+          while (p < end && ClassOf(p) == kLower && n < kMaxWord) word[n++] = *p++;
+        }
+        tokens += CountWord(absl::string_view(word, n));
+        break;
+      }
+      case kDigit:
+        while (p < end && ClassOf(p) == kDigit) ++p;
+        tokens += static_cast<int>((p - start + 2) / 3);
+        break;
+      case kSpace:
+        while (p < end && ClassOf(p) == kSpace) ++p;
+        // A single space belongs to the word or number after it.
+        if (!(p - start == 1 && *start == ' ' && p < end && ClassOf(p) <= kDigit)) ++tokens;
+        break;
+      case kPunct:
+        while (p < end && ClassOf(p) == kPunct) ++p;
+        tokens += static_cast<int>((p - start + 1) / 2);
+        break;
+      case kUtf8Lead:
+      case kUtf8Continuation:
+        ++p;
+        while (p < end && ClassOf(p) == kUtf8Continuation) ++p;
+        ++tokens;
+        break;
+    }
+  }
+  return tokens;
+}
+
+}  // namespace slop
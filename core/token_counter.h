@@ -0,0 +1,52 @@
+#ifndef SLOP_CORE_TOKEN_COUNTER_H_
+#define SLOP_CORE_TOKEN_COUNTER_H_
+
+#include <string>
+
+#include "absl/container/flat_hash_set.h"
+#include "absl/strings/string_view.h"
+
+namespace slop {
+
+// Estimates how many tokens a BPE tokenizer cuts text into, without the model's
+// tokenizer. Text is pre-tokenized the way BPE tokenizers do it: words (runs of ASCII
+// letters, broken at camelCase boundaries) carry a single space before them for
+// free; digits go three to a token; whitespace runs and pairs of punctuation are one
+// token; any other character is one. Each word is then matched, lowercased, against
+// the vocabulary, longest piece first.
+//
+// The built-in vocabulary (core/token_vocab.txt, compiled in by the
+// generate_token_vocab genrule) is trained by scripts/train_token_vocab.py on this
+// repository's prose and code. Counts are estimates for budgeting context, not
+// billing: providers report what a request actually cost.
+//
+// Thread-safe.
+class TokenCounter {
+ public:
+  // `vocab` holds one lowercase piece per line.
+  explicit TokenCounter(absl::string_view vocab);
+
+  TokenCounter(const TokenCounter&) = delete;
+  TokenCounter& operator=(const TokenCounter&) = delete;
+
+  // The counter of the built-in vocabulary.
+  static const TokenCounter& Default();
+
+  int Count(absl::string_view text) const;
+
+  size_t vocab_size() const { return pieces_.size(); }
+
+ private:
+  // Tokens of the word `lower`, at most kMaxWord lowercase letters.
+  int CountWord(absl::string_view lower) const;
+
+  static constexpr size_t kMaxWord = 64;
+
+  std::string vocab_;
+  absl::flat_hash_set<absl::string_view> pieces_;
+  size_t max_piece_ = 1;
+};
+
+}  // namespace slop
+
+#endif  // SLOP_CORE_TOKEN_COUNTER_H_
@@ -0,0 +1,67 @@
+#include "core/token_counter.h"
+
+#include <string>
+
+#include <gtest/gtest.h>
+
+namespace slop {
+namespace {
+
+TEST(TokenCounterTest, EmptyTextHasNoTokens) { EXPECT_EQ(TokenCounter::Default().Count(""), 0); }
+
+TEST(TokenCounterTest, WordsInTheVocabularyAreOneToken) {
+  const TokenCounter& counter = TokenCounter::Default();
+  EXPECT_EQ(counter.Count("the"), 1);
+  EXPECT_EQ(counter.Count("session"), 1);
+  // The space before a word comes with it.
+  EXPECT_EQ(counter.Count("the session"), 2);
+  // Case does not matter.
+  EXPECT_EQ(counter.Count("Session"), 1);
+  EXPECT_EQ(counter.Count("SESSION"), 1);
+}
+
+TEST(TokenCounterTest, SplitsIdentifiersAtCamelCase) {
+  TokenCounter counter("a\nb\nc\nd\ne\nf\ng\nh\ni\nj\nk\nl\nm\nn\no\np\nq\nr\ns\nt\nu\nv\nw\nx\ny\nz\nhttp\nserver\n");
+  EXPECT_EQ(counter.Count("HTTPServer"), 2);
+  EXPECT_EQ(counter.Count("httpServer"), 2);
+  EXPECT_EQ(counter.Count("http_server"), 3);
+  EXPECT_EQ(counter.Count("httpserver"), 2);
+}
+
+TEST(TokenCounterTest, UnknownWordsFallBackToTheLongestPieces) {
+  TokenCounter counter("a\nb\nc\nd\ne\nf\ng\nh\ni\nj\nk\nl\nm\nn\no\np\nq\nr\ns\nt\nu\nv\nw\nx\ny\nz\nab\nabc\n");
+  EXPECT_EQ(counter.Count("abcab"), 2);
+  EXPECT_EQ(counter.Count("abcabx"), 3);
+  EXPECT_EQ(counter.Count("xyz"), 3);
+  // Words longer than the buffer are counted in chunks, not dropped.
+  EXPECT_EQ(counter.Count(std::string(200, 'x')), 200);
+  EXPECT_EQ(counter.Count(std::string(200, 'X')), 200);
+}
+
+TEST(TokenCounterTest, CountsDigitsWhitespaceAndPunctuation) {
+  const TokenCounter& counter = TokenCounter::Default();
+  EXPECT_EQ(counter.Count("1234567"), 3);
+  EXPECT_EQ(counter.Count("\n\n    "), 1);
+  EXPECT_EQ(counter.Count(" "), 1);
+  EXPECT_EQ(counter.Count("{}"), 1);
+  EXPECT_EQ(counter.Count("();"), 2);
+}
+
+TEST(TokenCounterTest, CountsEachNonAsciiCharacterOnce) {
+  const TokenCounter& counter = TokenCounter::Default();
+  EXPECT_EQ(counter.Count("\xC3\xA9\xE2\x82\xAC\xF0\x9F\x98\x80"), 3);
+  // A stray continuation byte is one token, not a crash.
+  EXPECT_EQ(counter.Count("\x80\x80"), 1);
+}
+
+TEST(TokenCounterTest, EstimatesProseAtAFewCharactersPerToken) {
+  const std::string text =
+      "The orchestrator assembles the prompt from the session history, the active skills and the "
+      "memos that match the latest message, then sends it to the model.";
+  int tokens = TokenCounter::Default().Count(text);
+  EXPECT_GT(tokens, static_cast<int>(text.size()) / 8);
+  EXPECT_LT(tokens, static_cast<int>(text.size()) / 3);
+}
+
+}  // namespace
+}  // namespace slop
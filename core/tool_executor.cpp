@@ -1,5 +1,6 @@
 #include "core/tool_executor.h"
 
+#include <algorithm>
 #include <array>
 #include <cstring>
 #include <filesystem>
@@ -12,6 +13,7 @@
 #include "absl/log/log.h"
 #include "absl/status/status.h"
 #include "absl/strings/str_cat.h"
+#include "absl/strings/str_split.h"
 #include "absl/strings/substitute.h"
 
 #include "core/shell_util.h"
@@ -78,6 +80,8 @@ absl::StatusOr<std::string> ToolExecutor::Execute(const std::string& name, const
     result = SaveMemo(args.get<SaveMemoRequest>());
   } else if (name == "retrieve_memos") {
     result = RetrieveMemos(args.get<RetrieveMemosRequest>());
+  } else if (name == "search_history") {
+    result = SearchHistory(args.get<SearchHistoryRequest>());
   } else if (name == "list_directory") {
     result = ListDirectory(args.get<ListDirectoryRequest>(), cancellation);
   } else if (name == "manage_scratchpad") {
@@ -220,7 +224,26 @@ absl::StatusOr<std::string> ToolExecutor::ApplyPatch(const ApplyPatchRequest& re
   return WriteFile({req.path, content});
 }
 
-absl::StatusOr<std::string> ToolExecutor::QueryDb(const QueryDbRequest& req) { return db_->Query(req.sql); }
+absl::StatusOr<std::string> ToolExecutor::QueryDb(const QueryDbRequest& req) {
+  Database::QueryOptions options;
+  if (req.format == "tsv") {
+    options.format = Database::QueryFormat::kTsv;
+  } else if (req.format != "json") {
+    return absl::InvalidArgumentError(absl::StrCat("Unknown format '", req.format, "'; use json or tsv"));
+  }
+  options.max_bytes = kQueryDbMaxBytes;
+  options.max_rows = kQueryDbMaxRows;
+  auto result_or = db_->Query(req.sql, {}, options);
+  if (!result_or.ok()) return result_or.status();
+  std::string output = std::move(result_or->output);
+  if (result_or->omitted_rows > 0) {
+    absl::StrAppend(&output, "\n[", result_or->omitted_rows_at_least ? "At least " : "", result_or->omitted_rows,
+                    " more rows not shown. Narrow the query or page with LIMIT/OFFSET.]");
+  } else if (result_or->omitted_rows < 0) {
+    absl::StrAppend(&output, "\n[More rows not shown. Narrow the query or page with LIMIT/OFFSET.]");
+  }
+  return output;
+}
 
 absl::StatusOr<std::string> ToolExecutor::ExecuteBash(const ExecuteBashRequest& req,
                                                       std::shared_ptr<CancellationRequest> cancellation) {
@@ -414,6 +437,26 @@ absl::StatusOr<std::string> ToolExecutor::RetrieveMemos(const RetrieveMemosReque
   return result.dump(2, ' ', false, nlohmann::json::error_handler_t::replace);
 }
 
+absl::StatusOr<std::string> ToolExecutor::SearchHistory(const SearchHistoryRequest& req) {
+  if (!req.all_sessions && session_id_.empty()) return absl::FailedPreconditionError("No active session");
+  std::vector<std::string> terms = absl::StrSplit(req.query, ' ', absl::SkipWhitespace());
+  auto hits_or = db_->SearchMessages(terms, req.all_sessions ? "" : session_id_, std::clamp(req.limit, 1, 50));
+  if (!hits_or.ok()) return hits_or.status();
+
+  nlohmann::json result = nlohmann::json::array();
+  for (const auto& hit : *hits_or) {
+    result.push_back({
+        {"id", hit.id},
+        {"session_id", hit.session_id},
+        {"group_id", hit.group_id},
+        {"role", hit.role},
+        {"created_at", hit.created_at},
+        {"snippet", hit.snippet},
+    });
+  }
+  return result.dump(2, ' ', false, nlohmann::json::error_handler_t::replace);
+}
+
 absl::StatusOr<std::string> ToolExecutor::ListDirectory(const ListDirectoryRequest& req,
                                                         std::shared_ptr<CancellationRequest> cancellation) {
   int max_depth = req.depth.value_or(1);
@@ -483,7 +526,7 @@ absl::StatusOr<std::string> ToolExecutor::ManageScratchpad(const ManageScratchpa
 }
 
 absl::StatusOr<std::string> ToolExecutor::DescribeDb() {
-  return db_->Query("SELECT name, sql FROM sqlite_master WHERE type='table'");
+  return db_->Query("SELECT name, sql FROM sqlite_master WHERE type IN ('table', 'view')");
 }
 
 absl::StatusOr<std::string> ToolExecutor::UseSkill(const UseSkillRequest& req) {
@@ -27,6 +27,11 @@ class ToolExecutor {
 
   void SetSessionId(const std::string& session_id) { session_id_ = session_id; }
 
+  // query_db stops reading rows once its output reaches either limit, and says how
+  // many it left out.
+  static constexpr size_t kQueryDbMaxBytes = 256 * 1024;
+  static constexpr size_t kQueryDbMaxRows = 1000;
+
  private:
   explicit ToolExecutor(Database* db) : db_(db) {}
 
@@ -75,6 +80,7 @@ class ToolExecutor {
   absl::StatusOr<std::string> GitGrep(const GitGrepRequest& req, std::shared_ptr<CancellationRequest> cancellation);
   absl::StatusOr<std::string> SaveMemo(const SaveMemoRequest& req);
   absl::StatusOr<std::string> RetrieveMemos(const RetrieveMemosRequest& req);
+  absl::StatusOr<std::string> SearchHistory(const SearchHistoryRequest& req);
 
   absl::StatusOr<std::string> GitBranchStaging(const GitBranchStagingRequest& req);
   absl::StatusOr<std::string> GitCommitPatch(const GitCommitPatchRequest& req);
@@ -198,6 +198,40 @@ TEST(ToolExecutorTest, QueryDb) {
   auto res = executor.Execute("query_db", {{"sql", "SELECT 1 as val"}});
   ASSERT_TRUE(res.ok());
   EXPECT_TRUE(res->find("\"val\":1") != std::string::npos);
+
+  res = executor.Execute("query_db", {{"sql", "SELECT 1 as val, 'a' as name"}, {"format", "tsv"}});
+  ASSERT_TRUE(res.ok());
+  EXPECT_TRUE(absl::StrContains(*res, "val\tname\n1\ta\n")) << *res;
+
+  res = executor.Execute("query_db", {{"sql", "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n "
+                                              "WHERE i < 5000) SELECT i FROM n"}});
+  ASSERT_TRUE(res.ok());
+  EXPECT_TRUE(absl::StrContains(*res, "\n[4000 more rows not shown.")) << res->substr(res->size() - 100);
+
+  res = executor.Execute("query_db", {{"sql", "SELECT 1"}, {"format", "xml"}});
+  ASSERT_TRUE(res.ok());
+  EXPECT_TRUE(absl::StrContains(*res, "Error: INVALID_ARGUMENT: Unknown format 'xml'")) << *res;
+}
+
+TEST(ToolExecutorTest, SearchHistory) {
+  Database db;
+  ASSERT_TRUE(db.Init(":memory:").ok());
+  ASSERT_TRUE(db.AppendMessage("s1", "tool", "linker error: undefined reference to Foo", "id|execute_bash").ok());
+  ASSERT_TRUE(db.AppendMessage("s2", "tool", "another linker error", "id|execute_bash").ok());
+  auto executor_or = ToolExecutor::Create(&db);
+  ASSERT_TRUE(executor_or.ok());
+  auto& executor = **executor_or;
+  executor.SetSessionId("s1");
+
+  auto res = executor.Execute("search_history", {{"query", "linker undefined"}});
+  ASSERT_TRUE(res.ok());
+  EXPECT_TRUE(res->find("**linker** error: **undefined**") != std::string::npos) << *res;
+  EXPECT_TRUE(res->find("another") == std::string::npos);
+
+  res = executor.Execute("search_history", {{"query", "linker"}, {"all_sessions", true}});
+  ASSERT_TRUE(res.ok());
+  EXPECT_TRUE(res->find("**linker** error") != std::string::npos);
+  EXPECT_TRUE(res->find("another **linker**") != std::string::npos);
 }
 
 TEST(ToolExecutorTest, GrepToolWorks) {
@@ -69,6 +69,8 @@ struct ExecuteBashRequest {
 
 struct QueryDbRequest {
   std::string sql;
+  // "json" or "tsv".
+  std::string format = "json";
 };
 
 struct SaveMemoRequest {
@@ -80,6 +82,12 @@ struct RetrieveMemosRequest {
   std::vector<std::string> tags;
 };
 
+struct SearchHistoryRequest {
+  std::string query;
+  int limit = 10;
+  bool all_sessions = false;
+};
+
 struct ListDirectoryRequest {
   std::string path = ".";
   std::optional<int> depth;
@@ -223,7 +231,10 @@ inline void from_json(const nlohmann::json& j, ExecuteBashRequest& r) {
   r.input = j.value("input", "");
 }
 
-inline void from_json(const nlohmann::json& j, QueryDbRequest& r) { r.sql = j.at("sql").get<std::string>(); }
+inline void from_json(const nlohmann::json& j, QueryDbRequest& r) {
+  r.sql = j.at("sql").get<std::string>();
+  r.format = j.value("format", "json");
+}
 
 inline void from_json(const nlohmann::json& j, SaveMemoRequest& r) {
   r.content = j.at("content").get<std::string>();
@@ -234,6 +245,12 @@ inline void from_json(const nlohmann::json& j, RetrieveMemosRequest& r) {
   r.tags = j.at("tags").get<std::vector<std::string>>();
 }
 
+inline void from_json(const nlohmann::json& j, SearchHistoryRequest& r) {
+  r.query = j.at("query").get<std::string>();
+  r.limit = j.value("limit", 10);
+  r.all_sessions = j.value("all_sessions", false);
+}
+
 inline void from_json(const nlohmann::json& j, ListDirectoryRequest& r) {
   r.path = j.value("path", ".");
   if (j.contains("depth")) r.depth = j.at("depth").get<std::optional<int>>();
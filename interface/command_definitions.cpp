@@ -9,7 +9,14 @@ const std::vector<CommandDefinition>& GetCommandDefinitions() {
       {"/exit", {}, {"/quit"}, {"Exit the program"}, "Core Operations"},
       {"/edit", {}, {}, {"Open last input in EDITOR"}, "Core Operations"},
       {"/exec", {}, {}, {"/exec <command>        Execute shell command"}, "Core Operations"},
-      {"/stats", {}, {"/usage"}, {"Show session usage statistics"}, "Core Operations"},
+      {"/stats",
+       {"daily", "cost", "price"},
+       {"/usage"},
+       {"/stats                 Show session usage statistics and cost",
+        "/stats daily [N]       Usage and cost per day and model over the last N days (default 7)",
+        "/stats cost            Usage and cost per model across all sessions",
+        "/stats price [<glob> <prompt> <completion>]  List or set model prices (USD per 1M tokens)"},
+       "Core Operations"},
 
       // Session & Memory
       {"/session",
@@ -40,10 +47,11 @@ const std::vector<CommandDefinition>& GetCommandDefinitions() {
        "Context & History"},
       {"/undo", {}, {}, {"Remove last message and rebuild context"}, "Context & History"},
       {"/context",
-       {"show", "window", "rebuild"},
+       {"show", "window", "budget", "rebuild"},
        {},
        {"/context show          Show context status and assembled prompt",
         "/context window <N>    Set context to a rolling window of last N groups (0 for full)",
+        "/context budget <N>    Keep the newest groups that fit in N estimated tokens (0 for off)",
         "/context rebuild       Rebuild session state from conversation history"},
        "Context & History"},
       {"/review",
@@ -65,6 +73,12 @@ const std::vector<CommandDefinition>& GetCommandDefinitions() {
       {"/models", {}, {}, {"/models [filter]       List available models"}, "Model & Configuration"},
       {"/throttle", {}, {}, {"/throttle [N]          Set/show request throttle"}, "Model & Configuration"},
       {"/schema", {}, {}, {"Show current database schema"}, "Model & Configuration"},
+      {"/db",
+       {"stats", "optimize"},
+       {},
+       {"/db stats              Show page cache hit rate, file sizes and checkpoint lag",
+        "/db optimize           Run PRAGMA optimize and reclaim free pages now"},
+       "Model & Configuration"},
       {"/mode",
        {"mail", "standard"},
        {},
@@ -73,9 +87,10 @@ const std::vector<CommandDefinition>& GetCommandDefinitions() {
 
       // Agent Capabilities
       {"/tool",
-       {"list", "show"},
+       {"list", "show", "enable", "disable"},
        {},
-       {"/tool list             List available tools", "/tool show <name>      Show tool details"},
+       {"/tool list             List available tools", "/tool show <name>      Show tool details",
+        "/tool enable <name>    Offer the tool to the model", "/tool disable <name>   Stop offering the tool"},
        "Agent Capabilities"},
       {"/skill",
        {"list", "activate", "deactivate", "add", "edit", "delete"},
@@ -12,11 +12,13 @@
 #include "absl/strings/match.h"
 #include "absl/strings/numbers.h"
 #include "absl/strings/str_cat.h"
+#include "absl/strings/str_format.h"
 #include "absl/strings/str_join.h"
 #include "absl/strings/str_replace.h"
 #include "absl/strings/str_split.h"
 #include "absl/strings/strip.h"
 #include "absl/strings/substitute.h"
+#include "absl/time/time.h"
 #include "nlohmann/json.hpp"
 
 #include "core/message_parser.h"
@@ -55,6 +57,7 @@ void CommandHandler::RegisterCommands() {
   commands_["/models"] = [this](CommandArgs& args) { return HandleModels(args); };
   commands_["/exec"] = [this](CommandArgs& args) { return HandleExec(args); };
   commands_["/schema"] = [this](CommandArgs& args) { return HandleSchema(args); };
+  commands_["/db"] = [this](CommandArgs& args) { return HandleDb(args); };
   commands_["/model"] = [this](CommandArgs& args) { return HandleModel(args); };
   commands_["/throttle"] = [this](CommandArgs& args) { return HandleThrottle(args); };
   commands_["/memo"] = [this](CommandArgs& args) { return HandleMemo(args); };
@@ -135,53 +138,38 @@ CommandHandler::Result CommandHandler::HandleMessage(CommandArgs& args) {
       std::cerr << "Invalid number: " << sub_args << std::endl;
       return Result::HANDLED;
     }
-    std::string sql =
-        "SELECT m1.group_id, m1.content as prompt, MAX(m2.tokens) as tokens "
-        "FROM messages m1 "
-        "LEFT JOIN messages m2 ON m1.group_id = m2.group_id AND m2.role = 'assistant' "
-        "WHERE m1.session_id = ? AND m1.role = 'user' "
-        "GROUP BY m1.group_id ORDER BY m1.created_at DESC LIMIT " +
-        std::to_string(n);
-    auto res = db_->Query(sql, {args.session_id});
-    if (res.ok()) {
-      auto j = nlohmann::json::parse(*res, nullptr, false);
-      if (!j.is_discarded() && j.is_array()) {
-        std::string md = absl::Substitute("### Message History (Last $0)\n\n", n);
-        md += "| Group ID | User Prompt Snippet | Assistant Tokens |\n";
-        md += "| :--- | :--- | :---: |\n";
-        for (const auto& row : j) {
-          std::string prompt = row.value("prompt", "");
-          std::string escaped_prompt = absl::StrReplaceAll(prompt, {{"|", "\\|"}, {"\n", " "}});
-          if (escaped_prompt.length() > 50) escaped_prompt = escaped_prompt.substr(0, 47) + "...";
-          std::string tokens_str = "N/A";
-          if (row.contains("tokens") && !row["tokens"].is_null()) {
-            tokens_str = std::to_string(row.value("tokens", 0));
-          }
-          md += absl::Substitute("| `$0` | $1 | $2 |\n", row.value("group_id", ""), escaped_prompt, tokens_str);
-        }
-        PrintMarkdown(md);
-      }
+    auto groups = db_->ListGroups(args.session_id, n);
+    if (!groups.ok()) {
+      HandleStatus(groups.status());
+      return Result::HANDLED;
     }
+    std::string md = absl::Substitute("### Message History (Last $0)\n\n", n);
+    md += "| Group ID | User Prompt Snippet | Assistant Tokens |\n";
+    md += "| :--- | :--- | :---: |\n";
+    for (const auto& group : *groups) {
+      std::string escaped_prompt = absl::StrReplaceAll(group.prompt, {{"|", "\\|"}, {"\n", " "}});
+      if (escaped_prompt.length() > 50) escaped_prompt = escaped_prompt.substr(0, 47) + "...";
+      std::string tokens_str = group.assistant_tokens ? std::to_string(*group.assistant_tokens) : "N/A";
+      md += absl::Substitute("| `$0` | $1 | $2 |\n", group.group_id, escaped_prompt, tokens_str);
+    }
+    PrintMarkdown(md);
   } else if (sub_cmd == "view" || sub_cmd == "show") {
-    auto res =
-        db_->Query("SELECT role, content, tokens FROM messages WHERE group_id = ? ORDER BY created_at ASC", {sub_args});
-    if (res.ok()) {
-      auto j = nlohmann::json::parse(*res, nullptr, false);
-      if (!j.is_discarded() && !j.empty()) {
-        std::string md = absl::Substitute("### Interaction Group: `$0` \n\n", sub_args);
-        for (const auto& m : j) {
-          std::string role = m.value("role", "unknown");
-          md += absl::Substitute("#### $0", role);
-          if (m.contains("tokens") && !m["tokens"].is_null() && m["tokens"].get<int>() > 0) {
-            md += absl::Substitute(" ($0 tokens)", m["tokens"].get<int>());
-          }
-          md += "\n" + m.value("content", "") + "\n\n";
-        }
-        PrintMarkdown(md);
+    auto messages = db_->GetGroupMessages(args.session_id, sub_args);
+    if (!messages.ok()) {
+      HandleStatus(messages.status());
+      return Result::HANDLED;
+    }
+    if (!messages->empty()) {
+      std::string md = absl::Substitute("### Interaction Group: `$0` \n\n", sub_args);
+      for (const auto& m : *messages) {
+        md += absl::Substitute("#### $0", m.role);
+        if (m.tokens > 0) md += absl::Substitute(" ($0 tokens)", m.tokens);
+        md += "\n" + m.content + "\n\n";
       }
+      PrintMarkdown(md);
     }
   } else if (sub_cmd == "remove") {
-    HandleStatus(db_->Execute("DELETE FROM messages WHERE group_id = ?", {sub_args}));
+    HandleStatus(db_->RemoveGroup(args.session_id, sub_args));
     std::cout << "Message group " << sub_args << " deleted." << std::endl;
   }
   return Result::HANDLED;
@@ -191,7 +179,7 @@ CommandHandler::Result CommandHandler::HandleUndo(CommandArgs& args) {
   auto gid_or = db_->GetLastGroupId(args.session_id);
   if (gid_or.ok()) {
     std::string gid = *gid_or;
-    HandleStatus(db_->Execute("DELETE FROM messages WHERE group_id = ?", {gid}));
+    HandleStatus(db_->RemoveGroup(args.session_id, gid));
     std::cout << "Undid last interaction (Group ID: " + gid + ")" << std::endl;
     if (orchestrator_) {
       auto status = orchestrator_->RebuildContext(args.session_id);
@@ -223,6 +211,23 @@ CommandHandler::Result CommandHandler::HandleContext(CommandArgs& args) {
     return Result::HANDLED;
   }
 
+  if (sub_cmd == "budget") {
+    int tokens = 0;
+    if (!absl::SimpleAtoi(sub_args, &tokens) || tokens < 0) {
+      std::cerr << "Usage: /context budget <tokens>" << std::endl;
+      return Result::HANDLED;
+    }
+    absl::Status status = db_->SetContextBudget(args.session_id, tokens);
+    if (!status.ok()) {
+      HandleStatus(status);
+    } else if (tokens > 0) {
+      std::cout << "Token Budget Context: newest groups within " << tokens << " tokens." << std::endl;
+    } else {
+      std::cout << "Token budget off; using the rolling window of groups." << std::endl;
+    }
+    return Result::HANDLED;
+  }
+
   if (sub_cmd == "rebuild") {
     if (orchestrator_) {
       auto status = orchestrator_->RebuildContext(args.session_id);
@@ -243,16 +248,36 @@ CommandHandler::Result CommandHandler::HandleContext(CommandArgs& args) {
     ss << "Window Size: ";
     ss << (s.ok() ? (s->size == 0 ? "Infinite" : std::to_string(s->size)) : "Error");
     ss << "\n";
+    if (s.ok() && s->budget > 0) ss << "Token Budget: " << s->budget << " (replaces the window size)\n";
     if (!args.active_skills.empty()) {
       ss << "Active Skills: " << absl::StrJoin(args.active_skills, ", ") << std::endl;
     }
 
     if (orchestrator_) {
-      auto prompt_or = orchestrator_->AssemblePrompt(args.session_id, args.active_skills);
+      Orchestrator::PromptBreakdown b;
+      auto prompt_or = orchestrator_->AssemblePrompt(args.session_id, args.active_skills, &b);
       if (prompt_or.ok()) {
+        ss << "\n| Section | Tokens |\n| :--- | ---: |\n";
+        for (const auto& [name, tokens] : std::vector<std::pair<const char*, int>>{{"System", b.system},
+                                                                                    {"Tools", b.tools},
+                                                                                    {"Skills", b.skills},
+                                                                                    {"State", b.state},
+                                                                                    {"Scratchpad", b.scratchpad},
+                                                                                    {"Memos", b.memos},
+                                                                                    {"History", b.history}}) {
+          ss << "| " << name << " | " << tokens << " |\n";
+        }
+        ss << "| **Total** | **" << b.Total() << "** |\n";
+        Orchestrator::PromptContext::Timings t = orchestrator_->GetLastPromptLoadTimings();
+        ss << "\nLoaded in " << absl::FormatDuration(t.total) << " (session " << absl::FormatDuration(t.session)
+           << ", history " << absl::FormatDuration(t.history) << ", tools " << absl::FormatDuration(t.tools)
+           << ", memos " << absl::FormatDuration(t.memos) << ")\n";
+        PrintMarkdown(ss.str());
         DisplayAssembledContext(prompt_or->dump());
+        return Result::HANDLED;
       }
     }
+    PrintMarkdown(ss.str());
     return Result::HANDLED;
   }
   return Result::HANDLED;
@@ -289,6 +314,14 @@ CommandHandler::Result CommandHandler::HandleTool(CommandArgs& args) {
         PrintMarkdown(md);
       }
     }
+  } else if (sub_cmd == "enable" || sub_cmd == "disable") {
+    bool enable = sub_cmd == "enable";
+    auto status = db_->SetToolEnabled(sub_args, enable);
+    if (status.ok()) {
+      std::cout << icons::Tool << " Tool '" << sub_args << "' " << (enable ? "enabled." : "disabled.") << std::endl;
+    } else {
+      HandleStatus(status);
+    }
   }
   return Result::HANDLED;
 }
@@ -430,7 +463,10 @@ CommandHandler::Result CommandHandler::HandleSession(CommandArgs& args) {
   std::string sub_args = (sub_parts.size() > 1) ? sub_parts[1] : "";
 
   if (sub_cmd == "list") {
-    auto res = db_->Query("SELECT DISTINCT session_id FROM messages UNION SELECT DISTINCT id FROM sessions");
+    auto res = db_->Query(
+        "SELECT DISTINCT session_id FROM stored_messages WHERE session_id NOT IN "
+        "(SELECT id FROM sessions WHERE deleted_at IS NOT NULL) "
+        "UNION SELECT DISTINCT id FROM sessions WHERE deleted_at IS NULL");
     if (res.ok()) {
       auto j = nlohmann::json::parse(*res, nullptr, false);
       if (!j.is_discarded() && j.is_array()) {
@@ -511,33 +547,135 @@ CommandHandler::Result CommandHandler::HandleSession(CommandArgs& args) {
   return Result::HANDLED;
 }
 
+namespace {
+
+std::string FormatCost(const std::optional<double>& cost) {
+  return cost ? absl::StrFormat("$%.4f", *cost) : "-";
+}
+
+// A markdown usage table, with a Day column when `by_day`, and a totals row. Cached
+// is the part of Prompt the provider served from its prompt cache.
+std::string UsageTable(const std::vector<Database::UsageRollup>& rollups, bool by_day) {
+  std::string md = by_day ? "| Day | Model | Requests | Prompt | Cached | Completion | Total | Cost |\n"
+                          : "| Model | Requests | Prompt | Cached | Completion | Total | Cost |\n";
+  md += by_day ? "| :--- | :--- | :---: | :---: | :---: | :---: | :---: | ---: |\n"
+               : "| :--- | :---: | :---: | :---: | :---: | :---: | ---: |\n";
+  Database::UsageRollup total;
+  bool all_priced = true;
+  for (const auto& r : rollups) {
+    if (by_day) absl::StrAppend(&md, "| ", r.day, " ");
+    absl::StrAppend(&md, absl::Substitute("| $0 | $1 | $2 | $3 | $4 | $5 | $6 |\n",
+                                          r.model.empty() ? "unknown" : r.model, r.requests, r.prompt_tokens,
+                                          r.cached_tokens, r.completion_tokens, r.total_tokens, FormatCost(r.cost)));
+    total.requests += r.requests;
+    total.prompt_tokens += r.prompt_tokens;
+    total.cached_tokens += r.cached_tokens;
+    total.completion_tokens += r.completion_tokens;
+    total.total_tokens += r.total_tokens;
+    if (r.cost) total.cost = total.cost.value_or(0) + *r.cost;
+    all_priced = all_priced && r.cost.has_value();
+  }
+  if (rollups.size() > 1) {
+    if (by_day) md += "| ";
+    absl::StrAppend(&md, absl::Substitute("| **Total** | $0 | $1 | $2 | $3 | $4 | $5$6 |\n", total.requests,
+                                          total.prompt_tokens, total.cached_tokens, total.completion_tokens,
+                                          total.total_tokens, FormatCost(total.cost),
+                                          all_priced || !total.cost ? "" : " (partial)"));
+  }
+  return md;
+}
+
+}  // namespace
+
 /**
- * @brief Displays usage statistics and Gemini user quota.
+ * @brief Displays usage statistics, costs and Gemini user quota.
  *
- * Fetches token usage from the local database grouped by model.
- * If the provider is Gemini and OAuth is active, it also fetches and displays
- * real-time quota information from the Google API.
+ * Token usage comes from the per-day rollups maintained by the database, priced
+ * with the configured model prices:
+ * - `/stats`: the current session by model, plus tool and skill counters and,
+ *   for Gemini with OAuth, real-time quota from the Google API.
+ * - `/stats daily [N]`: all sessions by day and model over the last N days (7).
+ * - `/stats cost`: all sessions by model.
+ * - `/stats price [<pattern> <prompt> <completion>]`: list or set the USD price
+ *   per million tokens for models matching a GLOB pattern.
  *
- * @param args Command arguments providing the session ID.
+ * @param args Command arguments providing the session ID and sub-command.
  */
 CommandHandler::Result CommandHandler::HandleStats(CommandArgs& args) {
-  auto res = db_->Query(
-      "SELECT model, SUM(prompt_tokens) as prompt, SUM(completion_tokens) as completion, "
-      "SUM(prompt_tokens + completion_tokens) as total FROM usage "
-      "WHERE session_id = ? GROUP BY model",
-      {args.session_id});
-  if (res.ok()) {
-    std::string md = "## Usage Stats for Session [" + args.session_id + "]\n\n";
-    auto j = nlohmann::json::parse(*res, nullptr, false);
-    if (!j.is_discarded() && j.is_array() && !j.empty()) {
-      md += "| Model | Prompt | Completion | Total |\n";
-      md += "| :--- | :---: | :---: | :---: |\n";
-      for (const auto& row : j) {
-        md += absl::Substitute("| $0 | $1 | $2 | $3 |\n", row.value("model", "unknown"), row.value("prompt", 0),
-                               row.value("completion", 0), row.value("total", 0));
+  std::vector<std::string> sub_parts = absl::StrSplit(args.args, absl::MaxSplits(' ', 1));
+  std::string sub_cmd = sub_parts[0];
+  std::string sub_args = sub_parts.size() > 1 ? std::string(absl::StripAsciiWhitespace(sub_parts[1])) : "";
+
+  if (sub_cmd == "daily") {
+    int days = 7;
+    if (!sub_args.empty() && (!absl::SimpleAtoi(sub_args, &days) || days < 1)) {
+      std::cerr << "Usage: /stats daily [days]" << std::endl;
+      return Result::HANDLED;
+    }
+    auto rollups = db_->GetUsageByDay("", days);
+    if (!rollups.ok()) {
+      HandleStatus(rollups.status());
+    } else if (rollups->empty()) {
+      std::cout << "No usage in the last " << days << " days." << std::endl;
+    } else {
+      PrintMarkdown(absl::StrCat("## Daily Usage (last ", days, " days, UTC)\n\n", UsageTable(*rollups, true)));
+    }
+    return Result::HANDLED;
+  }
+  if (sub_cmd == "cost") {
+    auto rollups = db_->GetUsageByModel();
+    if (!rollups.ok()) {
+      HandleStatus(rollups.status());
+    } else if (rollups->empty()) {
+      std::cout << "No usage recorded." << std::endl;
+    } else {
+      PrintMarkdown(absl::StrCat("## Cost by Model (all sessions)\n\n", UsageTable(*rollups, false),
+                                 "\nPrices are USD per million tokens; set them with `/stats price`.\n"));
+    }
+    return Result::HANDLED;
+  }
+  if (sub_cmd == "price") {
+    if (!sub_args.empty()) {
+      std::vector<std::string> price_parts = absl::StrSplit(sub_args, ' ', absl::SkipEmpty());
+      Database::ModelPrice price;
+      if (price_parts.size() != 3 || !absl::SimpleAtod(price_parts[1], &price.prompt_per_million) ||
+          !absl::SimpleAtod(price_parts[2], &price.completion_per_million)) {
+        std::cerr << "Usage: /stats price <model_glob> <prompt_usd_per_1M> <completion_usd_per_1M>" << std::endl;
+        return Result::HANDLED;
+      }
+      price.model_pattern = price_parts[0];
+      absl::Status status = db_->SetModelPrice(price);
+      if (!status.ok()) {
+        HandleStatus(status);
+        return Result::HANDLED;
+      }
+    }
+    auto prices = db_->GetModelPrices();
+    if (!prices.ok()) {
+      HandleStatus(prices.status());
+    } else if (prices->empty()) {
+      std::cout << "No model prices set. Usage: /stats price <model_glob> <prompt_usd_per_1M> <completion_usd_per_1M>"
+                << std::endl;
+    } else {
+      std::string md = "## Model Prices (USD per 1M tokens)\n\n| Pattern | Prompt | Completion |\n| :--- | ---: | ---: |\n";
+      for (const auto& p : *prices) {
+        absl::StrAppend(&md, absl::StrFormat("| `%s` | %.4g | %.4g |\n", p.model_pattern, p.prompt_per_million,
+                                             p.completion_per_million));
       }
-      md += "\n";
       PrintMarkdown(md);
+    }
+    return Result::HANDLED;
+  }
+  if (!sub_cmd.empty()) {
+    std::cout << "Unknown stats command: " << sub_cmd << ". Try: daily, cost, price" << std::endl;
+    return Result::HANDLED;
+  }
+
+  auto rollups = db_->GetUsageByModel(args.session_id);
+  if (rollups.ok()) {
+    if (!rollups->empty()) {
+      PrintMarkdown(absl::StrCat("## Usage Stats for Session [", args.session_id, "]\n\n",
+                                 UsageTable(*rollups, false), "\n"));
     } else {
       std::cout << "No usage data for session [" << args.session_id << "]" << std::endl;
     }
@@ -655,6 +793,69 @@ CommandHandler::Result CommandHandler::HandleSchema([[maybe_unused]] CommandArgs
   return Result::HANDLED;
 }
 
+namespace {
+
+std::string FormatBytes(int64_t bytes) {
+  if (bytes >= (int64_t{1} << 20)) return absl::StrFormat("%.1f MiB", static_cast<double>(bytes) / (1 << 20));
+  if (bytes >= (int64_t{1} << 10)) return absl::StrFormat("%.1f KiB", static_cast<double>(bytes) / (1 << 10));
+  return absl::StrCat(bytes, " B");
+}
+
+}  // namespace
+
+/**
+ * @brief Reports on and maintains the SQLite database.
+ *
+ * - `/db stats`: page cache hit rate over all connections, file sizes, free pages
+ *   and how far checkpoints lag behind the WAL.
+ * - `/db optimize`: runs PRAGMA optimize and an incremental vacuum step now.
+ *
+ * @param args Command arguments providing the sub-command.
+ */
+CommandHandler::Result CommandHandler::HandleDb(CommandArgs& args) {
+  std::string sub_cmd = std::string(absl::StripAsciiWhitespace(args.args));
+  if (sub_cmd == "optimize") {
+    absl::Status status = db_->RunMaintenance();
+    if (!status.ok()) {
+      HandleStatus(status);
+    } else {
+      std::cout << "Database optimized." << std::endl;
+    }
+    return Result::HANDLED;
+  }
+  if (!sub_cmd.empty() && sub_cmd != "stats") {
+    std::cout << "Unknown db command: " << sub_cmd << ". Try: stats, optimize" << std::endl;
+    return Result::HANDLED;
+  }
+
+  auto stats = db_->GetStorageStats();
+  if (!stats.ok()) {
+    HandleStatus(stats.status());
+    return Result::HANDLED;
+  }
+  int64_t lookups = stats->cache_hits + stats->cache_misses;
+  std::string hit_rate =
+      lookups > 0 ? absl::StrFormat("%.1f%%", 100.0 * static_cast<double>(stats->cache_hits) / lookups) : "-";
+  std::string md = "## Database Stats\n\n| Metric | Value |\n| :--- | ---: |\n";
+  absl::StrAppend(&md, "| Page cache hit rate | ", hit_rate, " (", stats->cache_hits, " hits, ", stats->cache_misses,
+                  " misses) |\n");
+  absl::StrAppend(&md, "| Page cache memory | ", FormatBytes(stats->cache_bytes_used), " over ", stats->connections,
+                  " connections |\n");
+  absl::StrAppend(&md, "| Database file | ", FormatBytes(stats->db_file_bytes), " (", stats->page_count, " pages of ",
+                  stats->page_size, " B, ", stats->freelist_pages, " free) |\n");
+  absl::StrAppend(&md, "| Journal mode | ", stats->journal_mode, " |\n");
+  if (stats->journal_mode == "wal") {
+    absl::StrAppend(&md, "| WAL file | ", FormatBytes(stats->wal_file_bytes), " |\n");
+    absl::StrAppend(&md, "| Checkpoint lag | ", stats->wal_frames - stats->wal_checkpointed_frames, " of ",
+                    stats->wal_frames, " WAL frames (", stats->checkpoints, " checkpoints this run) |\n");
+  }
+  if (stats->archive_file_bytes > 0) {
+    absl::StrAppend(&md, "| Archive file | ", FormatBytes(stats->archive_file_bytes), " |\n");
+  }
+  PrintMarkdown(md);
+  return Result::HANDLED;
+}
+
 CommandHandler::Result CommandHandler::HandleModel(CommandArgs& args) {
   if (args.args.empty()) {
     std::cout << "Current model: " << orchestrator_->GetModel() << std::endl;
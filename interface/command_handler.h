@@ -75,6 +75,7 @@ class CommandHandler {
   Result HandleModels(CommandArgs& args);
   Result HandleExec(CommandArgs& args);
   Result HandleSchema(CommandArgs& args);
+  Result HandleDb(CommandArgs& args);
   Result HandleModel(CommandArgs& args);
   Result HandleThrottle(CommandArgs& args);
   Result HandleMemo(CommandArgs& args);
@@ -1,6 +1,7 @@
 #include "interface/command_handler.h"
 
 #include "absl/strings/match.h"
+#include "absl/strings/str_cat.h"
 
 #include "core/orchestrator.h"
 
@@ -160,6 +161,30 @@ TEST_F(CommandHandlerTest, HandlesContextWindow) {
   EXPECT_EQ(settings->size, 10);
 }
 
+TEST_F(CommandHandlerTest, ContextBudgetReplacesTheWindow) {
+  auto handler_or = CommandHandler::Create(&db);
+  ASSERT_TRUE(handler_or.ok());
+  auto& handler = **handler_or;
+  std::string sid = "s1";
+  std::vector<std::string> active_skills;
+  std::string input = "/context budget 64000";
+  EXPECT_EQ(handler.Handle(input, sid, active_skills, []() {}, {}), CommandHandler::Result::HANDLED);
+  auto settings = db.GetContextSettings("s1");
+  ASSERT_TRUE(settings.ok());
+  EXPECT_EQ(settings->budget, 64000);
+
+  input = "/context budget lots";
+  EXPECT_EQ(handler.Handle(input, sid, active_skills, []() {}, {}), CommandHandler::Result::HANDLED);
+  EXPECT_EQ(db.GetContextSettings("s1")->budget, 64000);
+
+  input = "/context window 3";
+  EXPECT_EQ(handler.Handle(input, sid, active_skills, []() {}, {}), CommandHandler::Result::HANDLED);
+  settings = db.GetContextSettings("s1");
+  ASSERT_TRUE(settings.ok());
+  EXPECT_EQ(settings->budget, 0);
+  EXPECT_EQ(settings->size, 3);
+}
+
 TEST_F(CommandHandlerTest, ContextWithoutSubcommandShowsUsage) {
   auto handler_or = CommandHandler::Create(&db);
   ASSERT_TRUE(handler_or.ok());
@@ -182,6 +207,44 @@ TEST_F(CommandHandlerTest, ContextShowIsHandled) {
   EXPECT_EQ(res, CommandHandler::Result::HANDLED);
 }
 
+TEST_F(CommandHandlerTest, ContextShowBreaksTokensDownBySection) {
+  auto orchestrator_or = Orchestrator::Builder(&db, &http_client).Build();
+  ASSERT_TRUE(orchestrator_or.ok());
+  auto handler_or = CommandHandler::Create(&db, orchestrator_or->get());
+  ASSERT_TRUE(handler_or.ok());
+  ASSERT_TRUE(db.UpdateScratchpad("s1", "- [ ] count tokens").ok());
+  ASSERT_TRUE(db.AppendMessage("s1", "user", "hello", "", "completed", "g1").ok());
+  std::string input = "/context show";
+  std::string sid = "s1";
+  std::vector<std::string> active_skills;
+
+  testing::internal::CaptureStdout();
+  EXPECT_EQ((*handler_or)->Handle(input, sid, active_skills, []() {}, {}), CommandHandler::Result::HANDLED);
+  std::string output = testing::internal::GetCapturedStdout();
+  for (const char* section : {"System", "Tools", "Skills", "State", "Scratchpad", "Memos", "History", "Total"}) {
+    EXPECT_TRUE(absl::StrContains(output, section)) << section;
+  }
+  Orchestrator::PromptBreakdown breakdown;
+  ASSERT_TRUE((*orchestrator_or)->AssemblePrompt("s1", {}, &breakdown).ok());
+  EXPECT_GT(breakdown.scratchpad, 0);
+  EXPECT_TRUE(absl::StrContains(output, absl::StrCat("| Scratchpad | ", breakdown.scratchpad, " |"))) << output;
+}
+
+TEST_F(CommandHandlerTest, ToolDisableAndEnable) {
+  auto handler_or = CommandHandler::Create(&db);
+  ASSERT_TRUE(handler_or.ok());
+  std::string sid = "s1";
+  std::vector<std::string> active_skills;
+  std::string input = "/tool disable read_file";
+  EXPECT_EQ((*handler_or)->Handle(input, sid, active_skills, []() {}, {}), CommandHandler::Result::HANDLED);
+  EXPECT_FALSE((*db.GetToolManifest())->tool_names.contains("read_file"));
+  input = "/tool enable read_file";
+  EXPECT_EQ((*handler_or)->Handle(input, sid, active_skills, []() {}, {}), CommandHandler::Result::HANDLED);
+  EXPECT_TRUE((*db.GetToolManifest())->tool_names.contains("read_file"));
+  input = "/tool enable no_such_tool";
+  EXPECT_EQ((*handler_or)->Handle(input, sid, active_skills, []() {}, {}), CommandHandler::Result::HANDLED);
+}
+
 TEST_F(CommandHandlerTest, SessionScratchpadEditSaves) {
   TestableCommandHandler handler(&db);
   std::string sid = "test_scratch_session";
@@ -370,6 +433,61 @@ TEST_F(CommandHandlerTest, HandlesUndo) {
   EXPECT_EQ(history->size(), 2);
 }
 
+TEST_F(CommandHandlerTest, UndoOnAForkLeavesTheParentUnchanged) {
+  auto handler_or = CommandHandler::Create(&db);
+  ASSERT_TRUE(handler_or.ok());
+  auto& handler = **handler_or;
+  std::vector<std::string> active_skills;
+
+  ASSERT_TRUE(db.AppendMessage("s1", "user", "msg1", "", "completed", "g1").ok());
+  ASSERT_TRUE(db.AppendMessage("s1", "user", "msg2", "", "completed", "g2").ok());
+  ASSERT_TRUE(db.CloneSession("s1", "fork").ok());
+
+  std::string input = "/undo";
+  std::string sid = "fork";
+  EXPECT_EQ(handler.Handle(input, sid, active_skills, []() {}, {}), CommandHandler::Result::HANDLED);
+
+  auto fork_history = db.GetConversationHistory("fork");
+  ASSERT_TRUE(fork_history.ok());
+  EXPECT_EQ(fork_history->size(), 1);
+  auto parent_history = db.GetConversationHistory("s1");
+  ASSERT_TRUE(parent_history.ok());
+  EXPECT_EQ(parent_history->size(), 2);
+}
+
+TEST_F(CommandHandlerTest, MessageListAndViewFollowTheSessionsHistory) {
+  TestableCommandHandler handler(&db);
+  std::vector<std::string> active_skills;
+
+  ASSERT_TRUE(db.AppendMessage("s1", "user", "first question", "", "completed", "g1").ok());
+  ASSERT_TRUE(db.AppendMessage("s1", "assistant", "first answer", "", "completed", "g1").ok());
+  ASSERT_TRUE(db.AppendMessage("s1", "user", "second question", "", "completed", "g2").ok());
+  ASSERT_TRUE(db.AppendMessage("s1", "assistant", "second answer", "", "completed", "g2").ok());
+  ASSERT_TRUE(db.CloneSession("s1", "fork").ok());
+
+  std::string input = "/undo";
+  std::string sid = "s1";
+  ASSERT_EQ(handler.Handle(input, sid, active_skills, []() {}, {}), CommandHandler::Result::HANDLED);
+
+  auto run = [&](std::string command, std::string session) {
+    testing::internal::CaptureStdout();
+    handler.Handle(command, session, active_skills, []() {}, {});
+    return testing::internal::GetCapturedStdout();
+  };
+  // The fork inherits both groups; the parent removed the second for itself alone.
+  std::string output = run("/message list", "fork");
+  EXPECT_TRUE(absl::StrContains(output, "first question"));
+  EXPECT_TRUE(absl::StrContains(output, "second question"));
+  output = run("/message list", "s1");
+  EXPECT_TRUE(absl::StrContains(output, "first question"));
+  EXPECT_FALSE(absl::StrContains(output, "second question"));
+
+  output = run("/message view g2", "fork");
+  EXPECT_TRUE(absl::StrContains(output, "second answer"));
+  output = run("/message view g2", "s1");
+  EXPECT_FALSE(absl::StrContains(output, "second answer"));
+}
+
 TEST_F(CommandHandlerTest, HandlesSessionRemove) {
   auto handler_or = CommandHandler::Create(&db);
   ASSERT_TRUE(handler_or.ok());
@@ -825,4 +943,47 @@ TEST_F(CommandHandlerTest, ReviewStandardSuggestsMail) {
   }
 }
 
+TEST_F(CommandHandlerTest, StatsCostPricesUsageByModel) {
+  TestableCommandHandler handler(&db);
+  std::string sid = "s1";
+  std::vector<std::string> active_skills;
+  ASSERT_TRUE(db.RecordUsage(sid, "gemini-2.5-pro", 1000000, 1000000, 250000).ok());
+  ASSERT_TRUE(db.RecordUsage("s2", "local-model", 10, 10).ok());
+
+  std::string input = "/stats price gemini-* 1.25 10";
+  handler.Handle(input, sid, active_skills, []() {}, {});
+  auto prices = db.GetModelPrices();
+  ASSERT_TRUE(prices.ok());
+  ASSERT_EQ(prices->size(), 1);
+  EXPECT_EQ((*prices)[0].model_pattern, "gemini-*");
+
+  testing::internal::CaptureStdout();
+  input = "/stats cost";
+  handler.Handle(input, sid, active_skills, []() {}, {});
+  std::string output = testing::internal::GetCapturedStdout();
+  EXPECT_TRUE(absl::StrContains(output, "$11.2500")) << output;
+  EXPECT_TRUE(absl::StrContains(output, "(partial)")) << output;
+  EXPECT_TRUE(absl::StrContains(output, "Cached")) << output;
+  EXPECT_TRUE(absl::StrContains(output, "250000")) << output;
+}
+
+TEST_F(CommandHandlerTest, DbStatsReportsCacheAndFiles) {
+  TestableCommandHandler handler(&db);
+  std::string sid = "s1";
+  std::vector<std::string> active_skills;
+
+  testing::internal::CaptureStdout();
+  std::string input = "/db stats";
+  handler.Handle(input, sid, active_skills, []() {}, {});
+  std::string output = testing::internal::GetCapturedStdout();
+  EXPECT_TRUE(absl::StrContains(output, "Page cache hit rate")) << output;
+  EXPECT_TRUE(absl::StrContains(output, "Journal mode")) << output;
+
+  testing::internal::CaptureStdout();
+  input = "/db optimize";
+  handler.Handle(input, sid, active_skills, []() {}, {});
+  output = testing::internal::GetCapturedStdout();
+  EXPECT_TRUE(absl::StrContains(output, "Database optimized.")) << output;
+}
+
 }  // namespace slop
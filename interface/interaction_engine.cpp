@@ -12,6 +12,7 @@
 #include "core/cancellation.h"
 #include "core/constants.h"
 #include "core/shell_util.h"
+#include "core/status_macros.h"
 #include "interface/color.h"
 #include "interface/ui.h"
 
@@ -55,18 +56,15 @@ bool InteractionEngine::Process(std::string& input, std::string& session_id, std
   (void)db_.AppendMessage(session_id, "user", input, "", "completed", group_id, orchestrator_.GetName());
 
   while (true) {
-    auto prompt_or = orchestrator_.AssemblePrompt(session_id, active_skills);
-    if (!prompt_or.ok()) {
-      slop::HandleStatus(prompt_or.status(), "Prompt Error");
-      break;
-    }
-
     std::vector<std::string> headers = {"Content-Type: application/json"};
     std::string url;
+    // Key for provider-side caches of the prompt; none with OAuth.
+    std::string api_key;
 
     if (orchestrator_.GetProvider() == slop::Orchestrator::Provider::OPENAI) {
       headers.push_back("Authorization: Bearer " + config.openai_api_key);
       url = (!config.openai_base_url.empty() ? config.openai_base_url : slop::kOpenAIBaseUrl) + "/chat/completions";
+      api_key = config.openai_api_key;
     } else if (config.google_oauth && oauth_handler_) {
       auto token_or = oauth_handler_->GetValidToken();
       if (token_or.ok()) headers.push_back("Authorization: Bearer " + *token_or);
@@ -75,10 +73,16 @@ bool InteractionEngine::Process(std::string& input, std::string& session_id, std
       headers.push_back("x-goog-api-key: " + config.google_api_key);
       url = absl::StrCat(slop::kPublicGeminiBaseUrl, "/models/", orchestrator_.GetModel(),
                          ":generateContent?key=", config.google_api_key);
+      api_key = config.google_api_key;
+    }
+
+    auto body_or = orchestrator_.AssembleRequestBody(session_id, active_skills, api_key);
+    if (!body_or.ok()) {
+      slop::HandleStatus(body_or.status(), "Prompt Error");
+      break;
     }
 
-    auto resp_or =
-        http_client_.Post(url, prompt_or->dump(-1, ' ', false, nlohmann::json::error_handler_t::replace), headers);
+    auto resp_or = http_client_.Post(url, *body_or, headers);
     if (!resp_or.ok()) {
       if (resp_or.status().code() == absl::StatusCode::kInvalidArgument) {
         LOG(WARNING) << "HTTP 400 error detected. Attempting to auto-fix history...";
@@ -88,7 +92,7 @@ bool InteractionEngine::Process(std::string& input, std::string& session_id, std
           for (auto it = history_or->rbegin(); it != history_or->rend(); ++it) {
             if (it->status == "tool_call" || it->role == "tool") {
               LOG(INFO) << "Dropping message " << it->id << " to fix 400 error.";
-              (void)db_.UpdateMessageStatus(it->id, "dropped");
+              (void)db_.UpdateMessageStatus(session_id, it->id, "dropped");
               dropped = true;
               break;
             }
@@ -111,8 +115,12 @@ bool InteractionEngine::Process(std::string& input, std::string& session_id, std
       }
     }
 
-    auto history_before_or = db_.GetMessagesByGroups({group_id});
-    size_t start_idx = history_before_or.ok() ? history_before_or->size() : 0;
+    // Only the messages ProcessResponse() appends are printed.
+    auto last_id_or = db_.GetLastMessageId();
+    if (!last_id_or.ok()) {
+      slop::HandleStatus(last_id_or.status(), "Database Error");
+      break;
+    }
 
     auto process_or = orchestrator_.ProcessResponse(session_id, *resp_or, group_id);
     if (!process_or.ok()) {
@@ -121,12 +129,11 @@ bool InteractionEngine::Process(std::string& input, std::string& session_id, std
     }
     (void)*process_or;
 
-    auto history_after_or = db_.GetMessagesByGroups({group_id});
-    if (!history_after_or.ok() || history_after_or->empty()) break;
+    auto new_messages_or = db_.GetMessagesByGroups({group_id}, *last_id_or);
+    if (!new_messages_or.ok() || new_messages_or->empty()) break;
 
     bool has_tool_calls = false;
-    for (size_t i = start_idx; i < history_after_or->size(); ++i) {
-      const auto& msg = (*history_after_or)[i];
+    for (const auto& msg : *new_messages_or) {
       slop::PrintMessage(msg);
 
       if (msg.role == "assistant") {
@@ -161,11 +168,15 @@ bool InteractionEngine::Process(std::string& input, std::string& session_id, std
           t.join();
 
           for (const auto& res : results) {
-            std::string result_content =
-                res.output.ok() ? *res.output : absl::StrCat("Error: ", res.output.status().message());
-            slop::PrintToolResultMessage(res.name, result_content, res.output.ok() ? "completed" : "error", "  ");
-            (void)db_.AppendMessage(session_id, "tool", result_content, res.id, res.output.ok() ? "completed" : "error",
-                                    group_id, msg.parsing_strategy);
+            slop::PrintToolResultMessage(
+                res.name, res.output.ok() ? *res.output : absl::StrCat("Error: ", res.output.status().message()),
+                res.output.ok() ? "completed" : "error", "  ");
+          }
+          absl::Status appended = AppendToolResults(session_id, group_id, msg.parsing_strategy, results);
+          if (!appended.ok()) {
+            // Without its results the turn cannot be sent back to the model.
+            slop::HandleStatus(appended, "Database Error");
+            return true;
           }
           has_tool_calls = true;
         }
@@ -184,4 +195,19 @@ bool InteractionEngine::Process(std::string& input, std::string& session_id, std
   return true;
 }
 
+absl::Status InteractionEngine::AppendToolResults(const std::string& session_id, const std::string& group_id,
+                                                  const std::string& parsing_strategy,
+                                                  const std::vector<ToolDispatcher::Result>& results) {
+  // A transaction of its own, not the one ProcessResponse() appended the calls in: a
+  // batch holds the writer, and the tools, which may write, run in between.
+  ASSIGN_OR_RETURN(auto batch, db_.BeginWriteBatch());
+  for (const auto& res : results) {
+    std::string result_content =
+        res.output.ok() ? *res.output : absl::StrCat("Error: ", res.output.status().message());
+    RETURN_IF_ERROR(db_.AppendMessage(session_id, "tool", result_content, res.id,
+                                      res.output.ok() ? "completed" : "error", group_id, parsing_strategy));
+  }
+  return batch->Commit();
+}
+
 }  // namespace slop
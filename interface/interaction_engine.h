@@ -5,6 +5,8 @@
 #include <string>
 #include <vector>
 
+#include "absl/status/status.h"
+
 #include "core/database.h"
 #include "core/http_client.h"
 #include "core/oauth_handler.h"
@@ -35,6 +37,13 @@ class InteractionEngine {
 
   CommandHandler& GetCommandHandler() { return cmd_handler_; }
 
+ protected:
+  // Appends the results of one turn's tool calls in one transaction. On the first
+  // failure the transaction is rolled back, so none of them is appended.
+  absl::Status AppendToolResults(const std::string& session_id, const std::string& group_id,
+                                 const std::string& parsing_strategy,
+                                 const std::vector<ToolDispatcher::Result>& results);
+
  private:
   Database& db_;
   Orchestrator& orchestrator_;
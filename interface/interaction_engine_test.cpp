@@ -0,0 +1,76 @@
+#include "interface/interaction_engine.h"
+
+#include "core/orchestrator.h"
+
+#include <gtest/gtest.h>
+
+namespace slop {
+
+class TestableInteractionEngine : public InteractionEngine {
+ public:
+  using InteractionEngine::AppendToolResults;
+  using InteractionEngine::InteractionEngine;
+};
+
+class InteractionEngineTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    ASSERT_TRUE(db.Init(":memory:").ok());
+    auto orchestrator_or = Orchestrator::Builder(&db, &http_client).Build();
+    ASSERT_TRUE(orchestrator_or.ok());
+    orchestrator = std::move(*orchestrator_or);
+    auto handler_or = CommandHandler::Create(&db, orchestrator.get());
+    ASSERT_TRUE(handler_or.ok());
+    cmd_handler = std::move(*handler_or);
+    auto executor_or = ToolExecutor::Create(&db);
+    ASSERT_TRUE(executor_or.ok());
+    tool_executor = std::move(*executor_or);
+    engine = std::make_unique<TestableInteractionEngine>(db, *orchestrator, *cmd_handler, dispatcher, *tool_executor,
+                                                         http_client, nullptr);
+  }
+
+  int CountToolResults() {
+    auto res = db.Query("SELECT COUNT(*) AS n FROM messages WHERE role = 'tool'");
+    EXPECT_TRUE(res.ok()) << res.status();
+    return res.ok() ? nlohmann::json::parse(*res)[0]["n"].get<int>() : -1;
+  }
+
+  Database db;
+  HttpClient http_client;
+  std::unique_ptr<Orchestrator> orchestrator;
+  std::unique_ptr<CommandHandler> cmd_handler;
+  std::unique_ptr<ToolExecutor> tool_executor;
+  ToolDispatcher dispatcher{[](const std::string&, const nlohmann::json&, std::shared_ptr<CancellationRequest>) {
+    return absl::StatusOr<std::string>("");
+  }};
+  std::unique_ptr<TestableInteractionEngine> engine;
+  std::vector<ToolDispatcher::Result> results = {{"call_1", "read_file", "first"},
+                                                 {"call_2", "read_file", absl::NotFoundError("no such file")},
+                                                 {"call_3", "read_file", "third"}};
+};
+
+TEST_F(InteractionEngineTest, AppendToolResultsStoresEveryResult) {
+  ASSERT_TRUE(engine->AppendToolResults("s1", "g1", "openai", results).ok());
+  EXPECT_EQ(CountToolResults(), 3);
+  auto error = db.Query("SELECT content, status FROM messages WHERE tool_call_id = 'call_2'");
+  ASSERT_TRUE(error.ok()) << error.status();
+  EXPECT_EQ(nlohmann::json::parse(*error)[0]["content"], "Error: no such file");
+  EXPECT_EQ(nlohmann::json::parse(*error)[0]["status"], "error");
+}
+
+TEST_F(InteractionEngineTest, AppendToolResultsStoresNoneWhenOneFails) {
+  // The second result fails to append after the first was written.
+  ASSERT_TRUE(db.Execute("CREATE TRIGGER fail_second BEFORE INSERT ON stored_messages "
+                         "WHEN new.tool_call_id = 'call_2' BEGIN SELECT RAISE(ABORT, 'disk full'); END")
+                  .ok());
+  absl::Status appended = engine->AppendToolResults("s1", "g1", "openai", results);
+  EXPECT_FALSE(appended.ok());
+  EXPECT_EQ(CountToolResults(), 0);
+
+  // The writer is released and the next turn can append.
+  ASSERT_TRUE(db.Execute("DROP TRIGGER fail_second").ok());
+  ASSERT_TRUE(engine->AppendToolResults("s1", "g2", "openai", results).ok());
+  EXPECT_EQ(CountToolResults(), 3);
+}
+
+}  // namespace slop
@@ -0,0 +1,101 @@
+#include <cstdio>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/strings/str_cat.h"
+
+#include "core/database.h"
+#include "core/http_client.h"
+#include "core/orchestrator.h"
+#include "core/tool_executor.h"
+#include "interface/command_handler.h"
+
+#include <benchmark/benchmark.h>
+
+namespace {
+
+constexpr int kStartupGroups = 50;
+constexpr char kSession[] = "default_session";
+
+void RemoveDatabase(const std::string& path) {
+  for (const char* suffix : {"", "-wal", "-shm"}) {
+    std::remove(absl::StrCat(path, suffix).c_str());
+  }
+}
+
+// A file-backed database, as left by earlier runs: migrated, with defaults
+// registered and a conversation to rebuild the context from. Built once.
+const std::string& GetStartupDatabase() {
+  static const std::string* path = [] {
+    auto* path = new std::string((std::filesystem::temp_directory_path() / "slop_startup_benchmark.db").string());
+    RemoveDatabase(*path);
+    slop::Database db;
+    if (!db.Init(*path).ok()) return path;
+    (void)db.Execute("BEGIN TRANSACTION;");
+    for (int g = 0; g < kStartupGroups; ++g) {
+      std::string group_id = absl::StrCat("g", g);
+      (void)db.AppendMessage(kSession, "user", absl::StrCat("prompt ", g), "", "completed", group_id);
+      (void)db.AppendMessage(kSession, "assistant", absl::StrCat("answer ", g, std::string(400, 'x')), "",
+                             "completed", group_id);
+    }
+    (void)db.Execute("COMMIT;");
+    return path;
+  }();
+  return *path;
+}
+
+// Everything main() does before it shows the first prompt (interactive) or sends
+// the first request (batch mode), minus flag parsing and terminal setup.
+void BM_StartupToFirstPrompt(benchmark::State& state) {
+  const std::string& path = GetStartupDatabase();
+  for (auto _ : state) {
+    slop::Database db;
+    if (!db.Init(path).ok()) {
+      state.SkipWithError("Init failed");
+      break;
+    }
+    slop::HttpClient http_client;
+    slop::Orchestrator::Builder builder(&db, &http_client);
+    builder.WithProvider(slop::Orchestrator::Provider::GEMINI).WithModel("gemini-3-flash-preview");
+    auto orchestrator = builder.Build();
+    auto tool_executor = slop::ToolExecutor::Create(&db);
+    if (!orchestrator.ok() || !tool_executor.ok()) {
+      state.SkipWithError("Setup failed");
+      break;
+    }
+    auto cmd_handler = slop::CommandHandler::Create(&db, orchestrator->get());
+    auto active_skills = db.GetActiveSkills(kSession);
+    std::vector<std::string> skills = active_skills.ok() ? *active_skills : std::vector<std::string>{};
+    (void)(*orchestrator)->RebuildContext(kSession);
+    auto prompt = (*orchestrator)->AssemblePrompt(kSession, skills);
+    benchmark::DoNotOptimize(prompt);
+    benchmark::DoNotOptimize(cmd_handler);
+  }
+}
+BENCHMARK(BM_StartupToFirstPrompt)->Unit(benchmark::kMillisecond);
+
+void BM_InitExistingDatabase(benchmark::State& state) {
+  const std::string& path = GetStartupDatabase();
+  for (auto _ : state) {
+    slop::Database db;
+    benchmark::DoNotOptimize(db.Init(path));
+  }
+}
+BENCHMARK(BM_InitExistingDatabase)->Unit(benchmark::kMillisecond);
+
+void BM_InitNewDatabase(benchmark::State& state) {
+  std::string path = (std::filesystem::temp_directory_path() / "slop_startup_benchmark_new.db").string();
+  for (auto _ : state) {
+    state.PauseTiming();
+    RemoveDatabase(path);
+    state.ResumeTiming();
+    slop::Database db;
+    benchmark::DoNotOptimize(db.Init(path));
+  }
+  RemoveDatabase(path);
+}
+BENCHMARK(BM_InitNewDatabase)->Unit(benchmark::kMillisecond);
+
+}  // namespace
@@ -16,6 +16,7 @@
 #include "absl/log/log.h"
 #include "absl/log/log_sink.h"
 #include "absl/log/log_sink_registry.h"
+#include "absl/strings/ascii.h"
 #include "absl/strings/match.h"
 #include "absl/strings/str_cat.h"
 #include "absl/strings/str_join.h"
@@ -51,9 +52,24 @@ ABSL_FLAG(bool, strip_reasoning, false,
           "Strip reasoning from OpenAI-compatible API responses (Recommended when using newer models via OpenRouter to "
           "improve response speed and focus)");
 
+ABSL_FLAG(int, gemini_cache_minutes, 0,
+          "Minutes an explicit Gemini API context cache of the system prompt and tools lives "
+          "(0: none; the implicit cache still applies)");
 ABSL_FLAG(int, max_parallel_tools, 4, "Maximum number of tools to execute in parallel");
 ABSL_FLAG(std::string, session, "", "Session name (overrides positional session_id)");
 ABSL_FLAG(std::string, prompt, "", "Run a single prompt in batch mode and exit");
+ABSL_FLAG(int, archive_after_days, 0,
+          "Move conversation groups outside the session window that are older than this many days into "
+          "<db>.archive (0: never)");
+ABSL_FLAG(int, archive_max_groups, 0,
+          "Also archive groups beyond the newest N of each session, outside its window (0: no cap)");
+ABSL_FLAG(int, db_mmap_mb, 256, "MiB of the database file each SQLite connection memory-maps (0: no mmap)");
+ABSL_FLAG(int, db_cache_mb, 16, "SQLite page cache per connection, in MiB (0: SQLite's default)");
+ABSL_FLAG(std::string, db_synchronous, "normal",
+          "SQLite synchronous mode under WAL: normal (may lose the last commits on power loss) or full");
+ABSL_FLAG(bool, db_temp_store_memory, true, "Keep SQLite temporary tables and indices in memory");
+ABSL_FLAG(int, db_maintenance_minutes, 60,
+          "Run PRAGMA optimize and an incremental vacuum step this often (0: only on exit)");
 
 // Help text is now in interface/ui.h
 
@@ -99,9 +115,12 @@ void RunInteractiveLoop(slop::InteractionEngine& engine, slop::Database& db, slo
 
     auto settings_or = db.GetContextSettings(session_id);
     int window_size = settings_or.ok() ? settings_or->size : 0;
+    int budget = settings_or.ok() ? settings_or->budget : 0;
     std::string model_name = orchestrator.GetModel();
     std::string persona = active_skills.empty() ? "default" : absl::StrJoin(active_skills, ",");
-    std::string window_str = (window_size == 0) ? "all" : std::to_string(window_size);
+    std::string window_str = budget > 0           ? absl::StrCat(budget, "t")
+                             : (window_size == 0) ? "all"
+                                                  : std::to_string(window_size);
     bool is_mail = engine.GetCommandHandler().IsMailMode();
     std::string color = is_mail ? ansi::Green : ansi::Cyan;
     std::string mode_label = is_mail ? absl::StrCat(icons::Mailbox, " MAIL_MODEL")
@@ -136,11 +155,30 @@ int main(int argc, char* argv[]) {
   bool google_auth = absl::GetFlag(FLAGS_google_oauth);
   std::string manual_project_id = absl::GetFlag(FLAGS_project);
 
+  std::string synchronous = absl::AsciiStrToLower(absl::GetFlag(FLAGS_db_synchronous));
+  if (synchronous != "normal" && synchronous != "full") {
+    std::cerr << "--db_synchronous must be normal or full" << std::endl;
+    return 1;
+  }
+  slop::Database::Tuning tuning;
+  tuning.mmap_bytes = int64_t{std::max(0, absl::GetFlag(FLAGS_db_mmap_mb))} << 20;
+  tuning.cache_bytes = int64_t{std::max(0, absl::GetFlag(FLAGS_db_cache_mb))} << 20;
+  tuning.synchronous_normal = synchronous == "normal";
+  tuning.temp_store_memory = absl::GetFlag(FLAGS_db_temp_store_memory);
+  tuning.maintenance_interval = absl::Minutes(std::max(0, absl::GetFlag(FLAGS_db_maintenance_minutes)));
+
   slop::Database db;
-  if (auto status = db.Init(db_path); !status.ok()) {
+  if (auto status = db.Init(db_path, tuning); !status.ok()) {
     std::cerr << "Failed to initialize database: " << status.message() << std::endl;
     return 1;
   }
+  slop::Database::ArchivePolicy archive_policy;
+  archive_policy.max_age = absl::Hours(24) * absl::GetFlag(FLAGS_archive_after_days);
+  archive_policy.max_groups_per_session = absl::GetFlag(FLAGS_archive_max_groups);
+  if (db_path != ":memory:" && (archive_policy.max_age > absl::ZeroDuration() ||
+                                archive_policy.max_groups_per_session > 0)) {
+    db.StartArchiver(archive_policy, absl::Hours(1));
+  }
 
   slop::HttpClient http_client;
   slop::Orchestrator::Builder builder(&db, &http_client);
@@ -191,7 +229,9 @@ int main(int argc, char* argv[]) {
         .WithBaseUrl(!openai_base_url.empty() ? openai_base_url : slop::kOpenAIBaseUrl);
   } else {  // gemini API key
     builder.WithProvider(slop::Orchestrator::Provider::GEMINI)
-        .WithModel(!model.empty() ? model : "gemini-3-flash-preview");
+        .WithModel(!model.empty() ? model : "gemini-3-flash-preview")
+        .WithBaseUrl(slop::kPublicGeminiBaseUrl)
+        .WithContextCacheTtl(absl::Minutes(std::max(0, absl::GetFlag(FLAGS_gemini_cache_minutes))));
   }
 
   auto orchestrator_or = builder.Build();
@@ -0,0 +1,26 @@
+#!/bin/bash
+# Runs //core:database_benchmark in opt mode and writes its results as JSON to
+# bench_results/<commit>.json, so that runs on different commits can be compared,
+# e.g. with compare.py from Google Benchmark's tools:
+#   compare.py benchmarks bench_results/<old>.json bench_results/<new>.json
+#
+# Usage: scripts/benchmark.sh [benchmark flags...]
+#   scripts/benchmark.sh --benchmark_filter='BM_Ledger/.*/messages:100000$' --benchmark_repetitions=5
+set -e
+
+if [ -n "${BUILD_WORKSPACE_DIRECTORY:-}" ]; then
+  cd "$BUILD_WORKSPACE_DIRECTORY"
+else
+  cd "$(dirname "$0")/.."
+fi
+
+COMMIT=$(git rev-parse --short HEAD)
+if ! git diff --quiet HEAD; then
+  COMMIT="${COMMIT}-dirty"
+fi
+mkdir -p bench_results
+OUT="$PWD/bench_results/${COMMIT}.json"
+
+bazel run -c opt //core:database_benchmark -- \
+  --benchmark_out="$OUT" --benchmark_out_format=json "$@"
+echo "Results written to $OUT"
@@ -0,0 +1,95 @@
+#!/usr/bin/env python3
+"""Trains core/token_vocab.txt, the vocabulary of slop::TokenCounter.
+
+Runs byte-pair encoding over the words of a corpus, split the way TokenCounter
+splits them (runs of ASCII letters, broken at camelCase boundaries, lowercased),
+and writes the single letters followed by the learned pieces, one per line.
+
+Usage: scripts/train_token_vocab.py [--size N] [--min_count N] [corpus files...]
+  With no files, trains on the repository's prose and sources.
+"""
+
+import argparse
+import collections
+import glob
+import os
+import re
+
+WORD = re.compile(r"[A-Z]+(?![a-z])|[A-Z]?[a-z]+")
+MAX_PIECE = 16
+
+
+def words(paths):
+    counts = collections.Counter()
+    for path in paths:
+        with open(path, encoding="utf-8", errors="replace") as f:
+            for match in WORD.finditer(f.read()):
+                counts[match.group().lower()] += 1
+    return counts
+
+
+def train(counts, size, min_count):
+    letters = [chr(c) for c in range(ord("a"), ord("z") + 1)]
+    vocab = list(letters)
+    # Each word as a list of pieces, with how often it occurs.
+    corpus = [(list(w), n) for w, n in counts.items() if len(w) > 1]
+    pairs = collections.Counter()
+    where = collections.defaultdict(set)
+    for i, (pieces, n) in enumerate(corpus):
+        for a, b in zip(pieces, pieces[1:]):
+            pairs[a, b] += n
+            where[a, b].add(i)
+
+    while len(vocab) < size and pairs:
+        (a, b), n = pairs.most_common(1)[0]
+        if n < min_count:
+            break
+        merged = a + b
+        del pairs[a, b]
+        if len(merged) > MAX_PIECE:
+            continue
+        vocab.append(merged)
+        for i in where.pop((a, b), ()):
+            pieces, count = corpus[i]
+            for x, y in zip(pieces, pieces[1:]):
+                pairs[x, y] -= count
+                if pairs[x, y] <= 0:
+                    del pairs[x, y]
+            out = []
+            j = 0
+            while j < len(pieces):
+                if j + 1 < len(pieces) and pieces[j] == a and pieces[j + 1] == b:
+                    out.append(merged)
+                    j += 2
+                else:
+                    out.append(pieces[j])
+                    j += 1
+            corpus[i] = (out, count)
+            for x, y in zip(out, out[1:]):
+                pairs[x, y] += count
+                where[x, y].add(i)
+    return vocab
+
+
+def main():
+    root = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..")
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--size", type=int, default=8000)
+    # Merges seen fewer times than this are not learned.
+    parser.add_argument("--min_count", type=int, default=1)
+    parser.add_argument("--out", default=os.path.join(root, "core", "token_vocab.txt"))
+    parser.add_argument("files", nargs="*")
+    args = parser.parse_args()
+    files = args.files or [
+        path
+        for pattern in ("*.md", "core/*.cpp", "core/*.h", "interface/*.cpp", "interface/*.h", "markdown/*.cpp")
+        for path in sorted(glob.glob(os.path.join(root, pattern)))
+    ]
+    vocab = train(words(files), args.size, args.min_count)
+    with open(args.out, "w") as f:
+        f.write("\n".join(vocab) + "\n")
+    print(f"{len(vocab)} pieces from {len(files)} files -> {args.out}")
+
+
+if __name__ == "__main__":
+    main()